@@ -1,3 +1,3 @@
 #!/bin/sh
 
-REQUIRED_AUTOMAKE_VERSION=1.10 exec gnome-autogen.sh $@
+REQUIRED_AUTOMAKE_VERSION=1.11 exec gnome-autogen.sh $@
@@ -0,0 +1,444 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#ifdef G_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "bench-common.h"
+
+typedef struct
+{
+  FILE *file;
+  BenchPlyFormat format;
+} BenchPlyWriter;
+
+static const char * const
+bench_ply_format_names[] =
+  {
+    "ascii",
+    "binary_little_endian",
+    "binary_big_endian"
+  };
+
+const char *
+bench_ply_format_to_string (BenchPlyFormat format)
+{
+  return bench_ply_format_names[format];
+}
+
+gboolean
+bench_ply_format_from_string (const char *string,
+                              BenchPlyFormat *format)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (bench_ply_format_names); i++)
+    if (!strcmp (string, bench_ply_format_names[i]))
+      {
+        *format = i;
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+static void
+bench_ply_write_uint32 (BenchPlyWriter *writer,
+                        guint32 value)
+{
+  switch (writer->format)
+    {
+    case BENCH_PLY_ASCII:
+      fprintf (writer->file, " %u", value);
+      break;
+
+    case BENCH_PLY_BINARY_LITTLE_ENDIAN:
+      value = GUINT32_TO_LE (value);
+      fwrite (&value, sizeof (value), 1, writer->file);
+      break;
+
+    case BENCH_PLY_BINARY_BIG_ENDIAN:
+      value = GUINT32_TO_BE (value);
+      fwrite (&value, sizeof (value), 1, writer->file);
+      break;
+    }
+}
+
+static void
+bench_ply_write_float (BenchPlyWriter *writer,
+                       float value)
+{
+  if (writer->format == BENCH_PLY_ASCII)
+    {
+      char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+      fputc (' ', writer->file);
+      fputs (g_ascii_formatd (buf, sizeof (buf), "%g", value), writer->file);
+    }
+  else
+    {
+      union
+      {
+        float f;
+        guint32 i;
+      } u;
+
+      u.f = value;
+      bench_ply_write_uint32 (writer, u.i);
+    }
+}
+
+static void
+bench_ply_write_uchar (BenchPlyWriter *writer,
+                       guint8 value)
+{
+  if (writer->format == BENCH_PLY_ASCII)
+    fprintf (writer->file, " %u", value);
+  else
+    fputc (value, writer->file);
+}
+
+static void
+bench_ply_end_element (BenchPlyWriter *writer)
+{
+  if (writer->format == BENCH_PLY_ASCII)
+    fputc ('\n', writer->file);
+}
+
+static void
+bench_ply_write_vertex (BenchPlyWriter *writer,
+                        BenchPlyFlags flags,
+                        float x,
+                        float y)
+{
+  /* A gentle wave over the unit square */
+  const float freq = 4.0f * 2.0f * G_PI;
+  const float amplitude = 0.05f;
+  float z = amplitude * sinf (x * freq) * cosf (y * freq);
+
+  bench_ply_write_float (writer, x);
+  bench_ply_write_float (writer, y);
+  bench_ply_write_float (writer, z);
+
+  if ((flags & BENCH_PLY_NORMALS))
+    {
+      float dzdx = amplitude * freq * cosf (x * freq) * cosf (y * freq);
+      float dzdy = -amplitude * freq * sinf (x * freq) * sinf (y * freq);
+      float length = sqrtf (dzdx * dzdx + dzdy * dzdy + 1.0f);
+
+      bench_ply_write_float (writer, -dzdx / length);
+      bench_ply_write_float (writer, -dzdy / length);
+      bench_ply_write_float (writer, 1.0f / length);
+    }
+
+  if ((flags & BENCH_PLY_TEX_COORDS))
+    {
+      bench_ply_write_float (writer, x);
+      bench_ply_write_float (writer, y);
+    }
+
+  if ((flags & BENCH_PLY_COLORS))
+    {
+      bench_ply_write_uchar (writer, x * 255.0f);
+      bench_ply_write_uchar (writer, y * 255.0f);
+      bench_ply_write_uchar (writer, (z / amplitude + 1.0f) * 127.5f);
+    }
+
+  bench_ply_end_element (writer);
+}
+
+gboolean
+bench_ply_write (const char *filename,
+                 guint n_triangles,
+                 BenchPlyFormat format,
+                 BenchPlyFlags flags,
+                 BenchPlyInfo *info,
+                 GError **error)
+{
+  BenchPlyWriter writer;
+  GStatBuf stat_buf;
+  guint n_quads, width, height;
+  guint x, y;
+  int saved_errno;
+  gboolean ret = TRUE;
+
+  /* Build the triangles out of a grid of quads that is roughly
+     square */
+  n_quads = MAX ((n_triangles + 1) / 2, 1);
+  width = ceil (sqrt (n_quads));
+  height = (n_quads + width - 1) / width;
+
+  info->n_vertices = (width + 1) * (height + 1);
+  info->n_triangles = width * height * 2;
+  info->n_faces = ((flags & BENCH_PLY_QUADS)
+                   ? width * height
+                   : info->n_triangles);
+
+  if ((writer.file = g_fopen (filename, "wb")) == NULL)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to open %s: %s", filename,
+                   g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  writer.format = format;
+
+  fprintf (writer.file,
+           "ply\n"
+           "format %s 1.0\n"
+           "comment Generated by the Mash benchmarks\n"
+           "element vertex %u\n"
+           "property float x\n"
+           "property float y\n"
+           "property float z\n",
+           bench_ply_format_to_string (format),
+           info->n_vertices);
+
+  if ((flags & BENCH_PLY_NORMALS))
+    fputs ("property float nx\n"
+           "property float ny\n"
+           "property float nz\n",
+           writer.file);
+  if ((flags & BENCH_PLY_TEX_COORDS))
+    fputs ("property float s\n"
+           "property float t\n",
+           writer.file);
+  if ((flags & BENCH_PLY_COLORS))
+    fputs ("property uchar red\n"
+           "property uchar green\n"
+           "property uchar blue\n",
+           writer.file);
+
+  fprintf (writer.file,
+           "element face %u\n"
+           "property list uchar uint vertex_indices\n"
+           "end_header\n",
+           info->n_faces);
+
+  for (y = 0; y <= height; y++)
+    for (x = 0; x <= width; x++)
+      bench_ply_write_vertex (&writer, flags,
+                              x / (float) width,
+                              y / (float) height);
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+        guint32 v00 = y * (width + 1) + x;
+        guint32 v10 = v00 + 1;
+        guint32 v01 = v00 + width + 1;
+        guint32 v11 = v01 + 1;
+
+        if ((flags & BENCH_PLY_QUADS))
+          {
+            bench_ply_write_uchar (&writer, 4);
+            bench_ply_write_uint32 (&writer, v00);
+            bench_ply_write_uint32 (&writer, v10);
+            bench_ply_write_uint32 (&writer, v11);
+            bench_ply_write_uint32 (&writer, v01);
+            bench_ply_end_element (&writer);
+          }
+        else
+          {
+            bench_ply_write_uchar (&writer, 3);
+            bench_ply_write_uint32 (&writer, v00);
+            bench_ply_write_uint32 (&writer, v10);
+            bench_ply_write_uint32 (&writer, v11);
+            bench_ply_end_element (&writer);
+
+            bench_ply_write_uchar (&writer, 3);
+            bench_ply_write_uint32 (&writer, v00);
+            bench_ply_write_uint32 (&writer, v11);
+            bench_ply_write_uint32 (&writer, v01);
+            bench_ply_end_element (&writer);
+          }
+      }
+
+  /* Always close the file even if there was an error writing */
+  if (ferror (writer.file) | fclose (writer.file))
+    {
+      saved_errno = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Error writing %s: %s", filename,
+                   g_strerror (saved_errno));
+      ret = FALSE;
+    }
+  else if (g_stat (filename, &stat_buf) == 0)
+    info->file_size = stat_buf.st_size;
+  else
+    info->file_size = 0;
+
+  return ret;
+}
+
+gboolean
+bench_parse_counts (const char *string,
+                    GArray *counts,
+                    GError **error)
+{
+  char **parts = g_strsplit (string, ",", 0);
+  gboolean ret = TRUE;
+  int i;
+
+  for (i = 0; parts[i]; i++)
+    {
+      char *end;
+      guint64 value = g_ascii_strtoull (parts[i], &end, 10);
+
+      if (*end == 'k')
+        {
+          value *= 1000;
+          end++;
+        }
+      else if (*end == 'M')
+        {
+          value *= 1000000;
+          end++;
+        }
+
+      if (end == parts[i] || *end || value == 0 || value > G_MAXUINT)
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Invalid count '%s'", parts[i]);
+          ret = FALSE;
+          break;
+        }
+      else
+        {
+          guint count = value;
+          g_array_append_val (counts, count);
+        }
+    }
+
+  g_strfreev (parts);
+
+  return ret;
+}
+
+gboolean
+bench_reset_peak_rss (void)
+{
+  /* Since Linux 4.0 writing 5 to clear_refs resets the peak RSS */
+  return g_file_set_contents ("/proc/self/clear_refs", "5", 1, NULL);
+}
+
+guint64
+bench_get_peak_rss (void)
+{
+  char *status;
+
+#ifdef G_OS_UNIX
+  struct rusage usage;
+#endif
+
+  if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    {
+      char *line = strstr (status, "\nVmHWM:");
+      guint64 kb = 0;
+
+      if (line)
+        kb = g_ascii_strtoull (line + 7, NULL, 10);
+
+      g_free (status);
+
+      if (kb)
+        return kb * 1024;
+    }
+
+#ifdef G_OS_UNIX
+  /* ru_maxrss is in kilobytes on Linux and the BSDs */
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+    return (guint64) usage.ru_maxrss * 1024;
+#endif
+
+  return 0;
+}
+
+gboolean
+bench_drop_file_cache (const char *filename)
+{
+#if defined (G_OS_UNIX) && defined (POSIX_FADV_DONTNEED)
+  gboolean ret = FALSE;
+  int fd;
+
+  if ((fd = g_open (filename, O_RDONLY, 0)) != -1)
+    {
+      /* Dirty pages can't be dropped so write them out first */
+      fsync (fd);
+      ret = posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+      close (fd);
+    }
+
+  return ret;
+#else
+  return FALSE;
+#endif
+}
+
+void
+bench_json_append_double (GString *json,
+                          double value)
+{
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (isfinite (value))
+    g_string_append (json, g_ascii_formatd (buf, sizeof (buf), "%.9g", value));
+  else
+    g_string_append (json, "null");
+}
+
+void
+bench_json_append_string (GString *json,
+                          const char *value)
+{
+  const char *p;
+
+  g_string_append_c (json, '"');
+
+  for (p = value; *p; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        {
+          g_string_append_c (json, '\\');
+          g_string_append_c (json, *p);
+        }
+      else if ((guchar) *p < 0x20)
+        g_string_append_printf (json, "\\u%04x", (guchar) *p);
+      else
+        g_string_append_c (json, *p);
+    }
+
+  g_string_append_c (json, '"');
+}
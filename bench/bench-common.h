@@ -0,0 +1,95 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_COMMON_H__
+#define __BENCH_COMMON_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Helpers shared by the Mash benchmarks */
+
+typedef enum
+{
+  BENCH_PLY_ASCII,
+  BENCH_PLY_BINARY_LITTLE_ENDIAN,
+  BENCH_PLY_BINARY_BIG_ENDIAN
+} BenchPlyFormat;
+
+typedef enum
+{
+  BENCH_PLY_NORMALS = 1 << 0,
+  BENCH_PLY_TEX_COORDS = 1 << 1,
+  BENCH_PLY_COLORS = 1 << 2,
+  /* Write each pair of triangles as a quad */
+  BENCH_PLY_QUADS = 1 << 3
+} BenchPlyFlags;
+
+typedef struct
+{
+  guint n_vertices;
+  guint n_faces;
+  guint n_triangles;
+  guint64 file_size;
+} BenchPlyInfo;
+
+/* Writes a PLY file containing a grid of at least @n_triangles
+   triangles. The grid is bent into a wave so that the normals and the
+   extents are not trivial */
+gboolean bench_ply_write (const char *filename,
+                          guint n_triangles,
+                          BenchPlyFormat format,
+                          BenchPlyFlags flags,
+                          BenchPlyInfo *info,
+                          GError **error);
+
+const char *bench_ply_format_to_string (BenchPlyFormat format);
+
+gboolean bench_ply_format_from_string (const char *string,
+                                       BenchPlyFormat *format);
+
+/* Parses a comma-separated list of unsigned numbers. The numbers may
+   have a k or M suffix */
+gboolean bench_parse_counts (const char *string,
+                             GArray *counts,
+                             GError **error);
+
+/* Resets the peak resident set size of the process if the system
+   supports it. Returns FALSE if the peak can't be reset in which case
+   bench_get_peak_rss() returns the peak for the whole process */
+gboolean bench_reset_peak_rss (void);
+
+guint64 bench_get_peak_rss (void);
+
+/* Tries to remove the file from the page cache so that the next read
+   comes from the disk. Returns FALSE if this isn't supported */
+gboolean bench_drop_file_cache (const char *filename);
+
+/* Appends a double to a JSON document. Non-finite numbers are written
+   as null */
+void bench_json_append_double (GString *json,
+                               double value);
+
+/* Appends a JSON string literal */
+void bench_json_append_string (GString *json,
+                               const char *value);
+
+G_END_DECLS
+
+#endif /* __BENCH_COMMON_H__ */
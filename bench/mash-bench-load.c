@@ -0,0 +1,486 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures how long mash_data_load() takes for synthetic PLY files of
+   a range of sizes and layouts. The results are written as JSON so
+   that different versions of the loader can be compared.
+
+   Each file is first loaded once after trying to drop it from the
+   page cache to get a cold time and then loaded a number of times
+   with a warm cache. Dropping the cache uses posix_fadvise so it
+   depends on the system whether it really happens. The result
+   records whether it succeeded. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <clutter/clutter.h>
+#include <mash/mash.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-common.h"
+
+typedef struct
+{
+  gdouble seconds;
+  guint64 peak_rss;
+  MashDataLoadStats stats;
+} LoadResult;
+
+static char *option_sizes = "1k,10k,100k,1M";
+static char *option_formats =
+  "ascii,binary_little_endian,binary_big_endian";
+static char *option_attributes = "none,n,t,c,ntc";
+static char *option_faces = "triangles,quads";
+static int option_iterations = 3;
+static char *option_directory = NULL;
+static char *option_output = NULL;
+static gboolean option_keep_files = FALSE;
+static gboolean option_no_cold = FALSE;
+static gboolean option_stream = FALSE;
+
+static GOptionEntry
+options[] =
+  {
+    { "sizes", 's', 0, G_OPTION_ARG_STRING, &option_sizes,
+      "Comma-separated list of triangle counts. A k or M suffix "
+      "multiplies by a thousand or a million, eg 1k,1M,50M", "SIZES" },
+    { "formats", 'f', 0, G_OPTION_ARG_STRING, &option_formats,
+      "Comma-separated list of PLY formats", "FORMATS" },
+    { "attributes", 'a', 0, G_OPTION_ARG_STRING, &option_attributes,
+      "Comma-separated list of vertex layouts. Each layout is 'none' "
+      "or a combination of n (normals), t (texture coordinates) and "
+      "c (colors)", "LAYOUTS" },
+    { "faces", 0, 0, G_OPTION_ARG_STRING, &option_faces,
+      "Comma-separated list of face types (triangles, quads)", "TYPES" },
+    { "iterations", 'i', 0, G_OPTION_ARG_INT, &option_iterations,
+      "Number of warm loads of each file", "N" },
+    { "directory", 'd', 0, G_OPTION_ARG_FILENAME, &option_directory,
+      "Directory to write the generated files to", "DIR" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &option_output,
+      "File to write the JSON results to instead of stdout", "FILE" },
+    { "keep-files", 'k', 0, G_OPTION_ARG_NONE, &option_keep_files,
+      "Don't delete the generated files", NULL },
+    { "no-cold", 0, 0, G_OPTION_ARG_NONE, &option_no_cold,
+      "Skip the load with a cold page cache", NULL },
+    { "stream", 0, 0, G_OPTION_ARG_NONE, &option_stream,
+      "Load the files with MASH_DATA_STREAM", NULL },
+    { NULL }
+  };
+
+static gboolean
+parse_attributes (const char *string,
+                  GArray *layouts,
+                  GError **error)
+{
+  char **parts = g_strsplit (string, ",", 0);
+  gboolean ret = TRUE;
+  int i;
+
+  for (i = 0; parts[i]; i++)
+    {
+      BenchPlyFlags flags = 0;
+      const char *p;
+
+      if (strcmp (parts[i], "none"))
+        for (p = parts[i]; *p; p++)
+          switch (*p)
+            {
+            case 'n':
+              flags |= BENCH_PLY_NORMALS;
+              break;
+            case 't':
+              flags |= BENCH_PLY_TEX_COORDS;
+              break;
+            case 'c':
+              flags |= BENCH_PLY_COLORS;
+              break;
+            default:
+              g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "Invalid vertex layout '%s'", parts[i]);
+              ret = FALSE;
+              goto out;
+            }
+
+      g_array_append_val (layouts, flags);
+    }
+
+ out:
+  g_strfreev (parts);
+
+  return ret;
+}
+
+static gboolean
+parse_formats (const char *string,
+               GArray *formats,
+               GError **error)
+{
+  char **parts = g_strsplit (string, ",", 0);
+  gboolean ret = TRUE;
+  int i;
+
+  for (i = 0; parts[i]; i++)
+    {
+      BenchPlyFormat format;
+
+      if (!bench_ply_format_from_string (parts[i], &format))
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Invalid format '%s'", parts[i]);
+          ret = FALSE;
+          break;
+        }
+
+      g_array_append_val (formats, format);
+    }
+
+  g_strfreev (parts);
+
+  return ret;
+}
+
+static gboolean
+parse_faces (const char *string,
+             GArray *face_flags,
+             GError **error)
+{
+  char **parts = g_strsplit (string, ",", 0);
+  gboolean ret = TRUE;
+  int i;
+
+  for (i = 0; parts[i]; i++)
+    {
+      BenchPlyFlags flags;
+
+      if (!strcmp (parts[i], "triangles"))
+        flags = 0;
+      else if (!strcmp (parts[i], "quads"))
+        flags = BENCH_PLY_QUADS;
+      else
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Invalid face type '%s'", parts[i]);
+          ret = FALSE;
+          break;
+        }
+
+      g_array_append_val (face_flags, flags);
+    }
+
+  g_strfreev (parts);
+
+  return ret;
+}
+
+static gboolean
+load_file (const char *filename,
+           LoadResult *result,
+           gboolean *peak_rss_reset,
+           GError **error)
+{
+  MashData *data = mash_data_new ();
+  gint64 start_time;
+  gboolean ret;
+
+  *peak_rss_reset = bench_reset_peak_rss ();
+
+  start_time = g_get_monotonic_time ();
+  ret = mash_data_load (data,
+                        option_stream ? MASH_DATA_STREAM : MASH_DATA_NONE,
+                        filename,
+                        error);
+  result->seconds = ((g_get_monotonic_time () - start_time)
+                     / (gdouble) G_USEC_PER_SEC);
+
+  /* Make sure the GPU has really got the data */
+  cogl_flush ();
+
+  result->peak_rss = bench_get_peak_rss ();
+  mash_data_get_load_stats (data, &result->stats);
+
+  g_object_unref (data);
+
+  return ret;
+}
+
+static int
+compare_results (const void *a,
+                 const void *b)
+{
+  const LoadResult *result_a = a;
+  const LoadResult *result_b = b;
+
+  return ((result_a->seconds > result_b->seconds)
+          - (result_a->seconds < result_b->seconds));
+}
+
+static void
+append_result (GString *json,
+               const char *format_name,
+               BenchPlyFlags flags,
+               guint requested_triangles,
+               const BenchPlyInfo *info,
+               const char *cache,
+               gboolean cache_dropped,
+               gboolean peak_rss_reset,
+               LoadResult *results,
+               int n_results,
+               const GError *error)
+{
+  const LoadResult *best;
+  const MashDataLoadStats *stats;
+  guint64 peak_rss = 0;
+  int i;
+
+  if (json->str[json->len - 1] == '}')
+    g_string_append (json, ",");
+
+  g_string_append (json, "\n    {\"format\": ");
+  bench_json_append_string (json, format_name);
+  g_string_append_printf (json,
+                          ", \"normals\": %s, \"tex_coords\": %s, "
+                          "\"colors\": %s, \"faces\": \"%s\",\n"
+                          "     \"requested_triangles\": %u, "
+                          "\"triangles\": %u, \"vertices\": %u, "
+                          "\"file_bytes\": %" G_GUINT64_FORMAT ",\n"
+                          "     \"cache\": \"%s\", \"stream\": %s",
+                          (flags & BENCH_PLY_NORMALS) ? "true" : "false",
+                          (flags & BENCH_PLY_TEX_COORDS) ? "true" : "false",
+                          (flags & BENCH_PLY_COLORS) ? "true" : "false",
+                          (flags & BENCH_PLY_QUADS) ? "quads" : "triangles",
+                          requested_triangles,
+                          info->n_triangles,
+                          info->n_vertices,
+                          info->file_size,
+                          cache,
+                          option_stream ? "true" : "false");
+
+  if (!strcmp (cache, "cold"))
+    g_string_append_printf (json, ", \"cache_dropped\": %s",
+                            cache_dropped ? "true" : "false");
+
+  if (error)
+    {
+      g_string_append (json, ", \"error\": ");
+      bench_json_append_string (json, error->message);
+      g_string_append (json, "}");
+      return;
+    }
+
+  for (i = 0; i < n_results; i++)
+    peak_rss = MAX (peak_rss, results[i].peak_rss);
+
+  qsort (results, n_results, sizeof (LoadResult), compare_results);
+  best = results;
+  stats = &best->stats;
+
+  g_string_append_printf (json, ", \"iterations\": %i,\n     \"seconds\": ",
+                          n_results);
+  bench_json_append_double (json, best->seconds);
+  g_string_append (json, ", \"median_seconds\": ");
+  bench_json_append_double (json, results[n_results / 2].seconds);
+  g_string_append (json, ", \"mb_per_second\": ");
+  bench_json_append_double (json,
+                            info->file_size / 1e6 / best->seconds);
+  g_string_append (json, ", \"triangles_per_second\": ");
+  bench_json_append_double (json, info->n_triangles / best->seconds);
+  g_string_append_printf (json,
+                          ",\n     \"peak_rss_bytes\": %" G_GUINT64_FORMAT
+                          ", \"peak_rss_reset\": %s"
+                          ", \"peak_temp_bytes\": %" G_GSIZE_FORMAT,
+                          peak_rss,
+                          peak_rss_reset ? "true" : "false",
+                          stats->peak_temp_bytes);
+
+  g_string_append (json, ",\n     \"stages\": {\"open\": ");
+  bench_json_append_double (json, stats->open_time);
+  g_string_append (json, ", \"header\": ");
+  bench_json_append_double (json, stats->header_time);
+  g_string_append (json, ", \"vertices\": ");
+  bench_json_append_double (json, stats->vertex_time);
+  g_string_append (json, ", \"faces\": ");
+  bench_json_append_double (json, stats->face_time);
+  g_string_append (json, ", \"validate\": ");
+  bench_json_append_double (json, stats->validate_time);
+  g_string_append (json, ", \"extents\": ");
+  bench_json_append_double (json, stats->extents_time);
+  g_string_append (json, ", \"split\": ");
+  bench_json_append_double (json, stats->split_time);
+  g_string_append (json, ", \"coarse\": ");
+  bench_json_append_double (json, stats->coarse_time);
+  g_string_append (json, ", \"upload\": ");
+  bench_json_append_double (json, stats->upload_time);
+  g_string_append (json, "}}");
+}
+
+static void
+run_case (GString *json,
+          guint n_triangles,
+          BenchPlyFormat format,
+          BenchPlyFlags flags)
+{
+  const char *format_name = bench_ply_format_to_string (format);
+  LoadResult *results;
+  BenchPlyInfo info;
+  GError *error = NULL;
+  gboolean peak_rss_reset = FALSE;
+  gboolean cache_dropped;
+  char *basename, *filename;
+  int i;
+
+  basename = g_strdup_printf ("mash-bench-%u-%s%s%s%s-%s.ply",
+                              n_triangles,
+                              format_name,
+                              (flags & BENCH_PLY_NORMALS) ? "-n" : "",
+                              (flags & BENCH_PLY_TEX_COORDS) ? "-t" : "",
+                              (flags & BENCH_PLY_COLORS) ? "-c" : "",
+                              (flags & BENCH_PLY_QUADS) ? "quads" : "tris");
+  filename = g_build_filename (option_directory
+                               ? option_directory
+                               : g_get_tmp_dir (),
+                               basename, NULL);
+  g_free (basename);
+
+  g_printerr ("%s\n", filename);
+
+  if (!bench_ply_write (filename, n_triangles, format, flags, &info, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_clear_error (&error);
+      g_free (filename);
+      return;
+    }
+
+  results = g_new (LoadResult, MAX (option_iterations, 1));
+
+  if (!option_no_cold)
+    {
+      cache_dropped = bench_drop_file_cache (filename);
+
+      load_file (filename, results, &peak_rss_reset, &error);
+      append_result (json, format_name, flags, n_triangles, &info,
+                     "cold", cache_dropped, peak_rss_reset,
+                     results, 1, error);
+    }
+  else
+    /* Make sure the warm loads really are warm */
+    load_file (filename, results, &peak_rss_reset, &error);
+
+  /* If the cold load failed then the error has already been
+     recorded */
+  if (error == NULL || option_no_cold)
+    {
+      for (i = 0; error == NULL && i < option_iterations; i++)
+        load_file (filename, results + i, &peak_rss_reset, &error);
+
+      append_result (json, format_name, flags, n_triangles, &info,
+                     "warm", FALSE, peak_rss_reset,
+                     results, option_iterations, error);
+    }
+
+  g_clear_error (&error);
+  g_free (results);
+
+  if (!option_keep_files)
+    g_unlink (filename);
+
+  g_free (filename);
+}
+
+int
+main (int argc, char **argv)
+{
+  GArray *sizes, *formats, *layouts, *face_flags;
+  GOptionContext *context;
+  ClutterActor *stage;
+  GError *error = NULL;
+  GString *json;
+  int s, f, l, t;
+  int ret = 0;
+
+  context = g_option_context_new ("- benchmark loading PLY files");
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_add_group (context, clutter_get_option_group ());
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+  formats = g_array_new (FALSE, FALSE, sizeof (BenchPlyFormat));
+  layouts = g_array_new (FALSE, FALSE, sizeof (BenchPlyFlags));
+  face_flags = g_array_new (FALSE, FALSE, sizeof (BenchPlyFlags));
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      !bench_parse_counts (option_sizes, sizes, &error) ||
+      !parse_formats (option_formats, formats, &error) ||
+      !parse_attributes (option_attributes, layouts, &error) ||
+      !parse_faces (option_faces, face_flags, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (option_iterations < 1)
+    {
+      g_printerr ("The number of iterations must be at least 1\n");
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  /* A GL context is needed to upload the data */
+  stage = clutter_stage_get_default ();
+  clutter_actor_realize (stage);
+
+  json = g_string_new ("{\"benchmark\": \"mash-bench-load\",\n"
+                       " \"results\": [");
+
+  for (s = 0; s < sizes->len; s++)
+    for (f = 0; f < formats->len; f++)
+      for (l = 0; l < layouts->len; l++)
+        for (t = 0; t < face_flags->len; t++)
+          run_case (json,
+                    g_array_index (sizes, guint, s),
+                    g_array_index (formats, BenchPlyFormat, f),
+                    g_array_index (layouts, BenchPlyFlags, l)
+                    | g_array_index (face_flags, BenchPlyFlags, t));
+
+  g_string_append (json, "\n  ]\n}\n");
+
+  if (option_output)
+    {
+      if (!g_file_set_contents (option_output, json->str, json->len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+          ret = 1;
+        }
+    }
+  else
+    fputs (json->str, stdout);
+
+  g_string_free (json, TRUE);
+  g_array_free (sizes, TRUE);
+  g_array_free (formats, TRUE);
+  g_array_free (layouts, TRUE);
+  g_array_free (face_flags, TRUE);
+
+  return ret;
+}
@@ -0,0 +1,593 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures how long it takes to paint a scene of MashModels lit by a
+   MashLightSet. The lights and the models are animated for a fixed
+   number of frames and the frame times are written as JSON together
+   with the time spent in mash_model_paint() and
+   mash_light_set_begin_paint().
+
+   The scene is painted to a Clutter stage window, not an offscreen
+   buffer, because Clutter 1.x stages always need a window. To run
+   without a display 'make run-bench-render' uses run-headless.sh to
+   start a virtual X server with software rendering, the same as:
+
+   xvfb-run -a -s "-screen 0 1024x768x24" \
+     env LIBGL_ALWAYS_SOFTWARE=1 ./mash-bench-render
+
+   Options can be passed in BENCH_RENDER_FLAGS. 'make
+   run-bench-many-lights' runs it with a thousand animated lights to
+   measure the cost of updating the light data.
+
+   Each frame ends with reading back a pixel so that the frame time
+   includes the time the GPU takes to render it. The animation only
+   depends on the frame number so the results are comparable between
+   runs. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <clutter/clutter.h>
+#include <mash/mash.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bench-common.h"
+
+typedef struct
+{
+  ClutterActor *stage;
+  ClutterActor *scene;
+  MashLightSet *light_set;
+  GPtrArray *models;
+  GPtrArray *lights;
+
+  int frame_num;
+  gint64 frame_start;
+  GArray *frame_times;
+} BenchState;
+
+static int option_models = 16;
+static gboolean option_unique_data = FALSE;
+static int option_point_lights = 2;
+static int option_spot_lights = 2;
+static int option_directional_lights = 1;
+static int option_frames = 300;
+static int option_warmup = 30;
+static char *option_mode = "per-light";
+static int option_max_lights = 0;
+static int option_width = 800;
+static int option_height = 600;
+static char *option_model = NULL;
+static char *option_triangles = "5k";
+static char *option_output = NULL;
+
+static GOptionEntry
+options[] =
+  {
+    { "models", 'n', 0, G_OPTION_ARG_INT, &option_models,
+      "Number of models to paint", "N" },
+    { "unique-data", 'u', 0, G_OPTION_ARG_NONE, &option_unique_data,
+      "Load a separate MashData for each model instead of sharing one",
+      NULL },
+    { "point-lights", 'p', 0, G_OPTION_ARG_INT, &option_point_lights,
+      "Number of point lights", "M" },
+    { "spot-lights", 's', 0, G_OPTION_ARG_INT, &option_spot_lights,
+      "Number of spot lights", "M" },
+    { "directional-lights", 'd', 0, G_OPTION_ARG_INT,
+      &option_directional_lights,
+      "Number of directional lights", "M" },
+    { "frames", 'f', 0, G_OPTION_ARG_INT, &option_frames,
+      "Number of frames to measure", "FRAMES" },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT, &option_warmup,
+      "Number of frames to paint before measuring", "FRAMES" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &option_mode,
+      "Light set mode (per-light, uniform-arrays or clustered)", "MODE" },
+    { "max-lights", 0, 0, G_OPTION_ARG_INT, &option_max_lights,
+      "Maximum number of lights per model in clustered mode", "N" },
+    { "width", 0, 0, G_OPTION_ARG_INT, &option_width,
+      "Width of the stage", "PIXELS" },
+    { "height", 0, 0, G_OPTION_ARG_INT, &option_height,
+      "Height of the stage", "PIXELS" },
+    { "model", 0, 0, G_OPTION_ARG_FILENAME, &option_model,
+      "PLY file to paint instead of a generated grid", "FILE" },
+    { "triangles", 't', 0, G_OPTION_ARG_STRING, &option_triangles,
+      "Number of triangles in the generated grid. A k or M suffix "
+      "multiplies by a thousand or a million", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &option_output,
+      "File to write the JSON results to instead of stdout", "FILE" },
+    { NULL }
+  };
+
+static gboolean
+parse_mode (const char *string,
+            MashLightSetMode *mode,
+            GError **error)
+{
+  GEnumClass *enum_class = g_type_class_ref (MASH_TYPE_LIGHT_SET_MODE);
+  GEnumValue *value = g_enum_get_value_by_nick (enum_class, string);
+
+  if (value)
+    *mode = value->value;
+  else
+    g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                 "Invalid light set mode '%s'", string);
+
+  g_type_class_unref (enum_class);
+
+  return value != NULL;
+}
+
+static MashData *
+load_data (const char *filename)
+{
+  MashData *data = mash_data_new ();
+  GError *error = NULL;
+
+  if (!mash_data_load (data, MASH_DATA_NONE, filename, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  return data;
+}
+
+static void
+create_models (BenchState *state,
+               const char *filename)
+{
+  MashData *shared_data = NULL;
+  int n_columns, n_rows;
+  float cell_width, cell_height;
+  int i;
+
+  n_columns = ceil (sqrt (option_models));
+  n_rows = (option_models + n_columns - 1) / MAX (n_columns, 1);
+  cell_width = option_width / (float) MAX (n_columns, 1);
+  cell_height = option_height / (float) MAX (n_rows, 1);
+
+  if (!option_unique_data)
+    shared_data = load_data (filename);
+
+  for (i = 0; i < option_models; i++)
+    {
+      ClutterActor *model = mash_model_new ();
+      MashData *data = shared_data ? g_object_ref (shared_data)
+        : load_data (filename);
+
+      mash_model_set_data (MASH_MODEL (model), data);
+      g_object_unref (data);
+
+      mash_model_set_light_set (MASH_MODEL (model), state->light_set);
+
+      clutter_actor_set_size (model, cell_width * 0.8f, cell_height * 0.8f);
+      clutter_actor_set_position (model,
+                                  (i % n_columns + 0.1f) * cell_width,
+                                  (i / n_columns + 0.1f) * cell_height);
+
+      clutter_container_add_actor (CLUTTER_CONTAINER (state->scene), model);
+      g_ptr_array_add (state->models, model);
+    }
+
+  if (shared_data)
+    g_object_unref (shared_data);
+}
+
+static void
+add_lights (BenchState *state,
+            ClutterActor *(* light_new) (void),
+            int n_lights)
+{
+  int i;
+
+  for (i = 0; i < n_lights; i++)
+    {
+      ClutterActor *light = light_new ();
+
+      clutter_container_add_actor (CLUTTER_CONTAINER (state->scene), light);
+      mash_light_set_add_light (state->light_set, MASH_LIGHT (light));
+      g_ptr_array_add (state->lights, light);
+    }
+}
+
+/* Moves everything to its position for the given frame. The lights
+   circle around the middle of the stage and the models spin around
+   their vertical axis */
+static void
+animate (BenchState *state,
+         int frame_num)
+{
+  float t = frame_num / 60.0f;
+  float radius = MIN (option_width, option_height) * 0.4f;
+  int i;
+
+  for (i = 0; i < state->lights->len; i++)
+    {
+      ClutterActor *light = g_ptr_array_index (state->lights, i);
+      float angle = t + i * 2.0f * G_PI / state->lights->len;
+
+      clutter_actor_set_position (light,
+                                  option_width / 2.0f
+                                  + radius * cosf (angle),
+                                  option_height / 2.0f
+                                  + radius * sinf (angle));
+      clutter_actor_set_depth (light, 100.0f + 50.0f * sinf (angle * 2.0f));
+
+      if (MASH_IS_DIRECTIONAL_LIGHT (light))
+        clutter_actor_set_rotation (light, CLUTTER_X_AXIS,
+                                    30.0f * sinf (angle) * 180.0f / G_PI,
+                                    0, 0, 0);
+    }
+
+  for (i = 0; i < state->models->len; i++)
+    {
+      ClutterActor *model = g_ptr_array_index (state->models, i);
+      float width, height;
+
+      clutter_actor_get_size (model, &width, &height);
+      clutter_actor_set_rotation (model, CLUTTER_Y_AXIS,
+                                  frame_num * 2.0f + i * 10.0f,
+                                  width / 2.0f, height / 2.0f, 0);
+    }
+}
+
+static gboolean
+next_frame_cb (gpointer user_data)
+{
+  BenchState *state = user_data;
+
+  animate (state, state->frame_num);
+  clutter_actor_queue_redraw (state->stage);
+
+  return FALSE;
+}
+
+static void
+paint_cb (ClutterActor *stage,
+          BenchState *state)
+{
+  state->frame_start = g_get_monotonic_time ();
+}
+
+static void
+paint_after_cb (ClutterActor *stage,
+                BenchState *state)
+{
+  guint8 pixel[4];
+  gdouble frame_time;
+
+  /* Wait for the GPU to finish the frame */
+  cogl_read_pixels (0, 0, 1, 1,
+                    COGL_READ_PIXELS_COLOR_BUFFER,
+                    COGL_PIXEL_FORMAT_RGBA_8888_PRE,
+                    pixel);
+
+  frame_time = ((g_get_monotonic_time () - state->frame_start)
+                / (gdouble) G_USEC_PER_SEC);
+
+  if (state->frame_num >= option_warmup)
+    g_array_append_val (state->frame_times, frame_time);
+
+  state->frame_num++;
+
+  /* Only count the frames that are measured */
+  if (state->frame_num == option_warmup)
+    {
+      mash_render_stats_reset ();
+      mash_light_set_reset_stats (state->light_set);
+    }
+
+  if (state->frame_num >= option_warmup + option_frames)
+    clutter_main_quit ();
+  else
+    g_idle_add (next_frame_cb, state);
+}
+
+static void
+scene_paint_cb (ClutterActor *scene)
+{
+  cogl_set_depth_test_enabled (TRUE);
+}
+
+static void
+scene_paint_after_cb (ClutterActor *scene)
+{
+  cogl_set_depth_test_enabled (FALSE);
+}
+
+static int
+compare_doubles (const void *a,
+                 const void *b)
+{
+  gdouble value_a = *(const gdouble *) a;
+  gdouble value_b = *(const gdouble *) b;
+
+  return (value_a > value_b) - (value_a < value_b);
+}
+
+/* Returns the nearest-rank percentile of the sorted values */
+static gdouble
+get_percentile (const GArray *values,
+                gdouble percentile)
+{
+  int rank = ceil (percentile / 100.0 * values->len) - 1;
+
+  return g_array_index (values, gdouble, CLAMP (rank, 0, values->len - 1));
+}
+
+static void
+append_key_double (GString *json,
+                   const char *key,
+                   gdouble value)
+{
+  g_string_append_printf (json, "\"%s\": ", key);
+  bench_json_append_double (json, value);
+}
+
+static GString *
+create_report (BenchState *state,
+               const char *model_name,
+               guint n_triangles)
+{
+  GArray *frame_times = state->frame_times;
+  int n_frames = frame_times->len;
+  MashRenderStats stats;
+  gdouble total = 0.0;
+  GString *json;
+  int i;
+
+  for (i = 0; i < n_frames; i++)
+    total += g_array_index (frame_times, gdouble, i);
+
+  qsort (frame_times->data, n_frames, sizeof (gdouble), compare_doubles);
+
+  mash_render_stats_get (&stats);
+
+  json = g_string_new ("{\"benchmark\": \"mash-bench-render\",\n"
+                       " \"config\": {\"model\": ");
+  bench_json_append_string (json, model_name);
+  g_string_append_printf (json,
+                          ", \"model_triangles\": %u, \"models\": %i, "
+                          "\"shared_data\": %s,\n"
+                          "            \"point_lights\": %i, "
+                          "\"spot_lights\": %i, "
+                          "\"directional_lights\": %i, \"mode\": ",
+                          n_triangles,
+                          option_models,
+                          option_unique_data ? "false" : "true",
+                          option_point_lights,
+                          option_spot_lights,
+                          option_directional_lights);
+  bench_json_append_string (json, option_mode);
+  g_string_append_printf (json,
+                          ", \"max_lights\": %i,\n"
+                          "            \"width\": %i, \"height\": %i, "
+                          "\"warmup\": %i},\n"
+                          " \"frames\": %i,\n"
+                          " \"frame_seconds\": {",
+                          option_max_lights,
+                          option_width, option_height,
+                          option_warmup,
+                          n_frames);
+
+  append_key_double (json, "mean", total / n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "p50", get_percentile (frame_times, 50));
+  g_string_append (json, ", ");
+  append_key_double (json, "p90", get_percentile (frame_times, 90));
+  g_string_append (json, ", ");
+  append_key_double (json, "p95", get_percentile (frame_times, 95));
+  g_string_append (json, ", ");
+  append_key_double (json, "p99", get_percentile (frame_times, 99));
+  g_string_append (json, ", ");
+  append_key_double (json, "max",
+                     g_array_index (frame_times, gdouble, n_frames - 1));
+
+  g_string_append (json, "},\n \"cpu_seconds\": {");
+  append_key_double (json, "model_paint", stats.paint_time);
+  g_string_append (json, ", ");
+  append_key_double (json, "model_paint_per_frame",
+                     stats.paint_time / n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "begin_paint", stats.begin_paint_time);
+  g_string_append (json, ", ");
+  append_key_double (json, "begin_paint_per_frame",
+                     stats.begin_paint_time / n_frames);
+
+  g_string_append (json, "},\n \"per_frame\": {");
+  append_key_double (json, "draws", stats.n_draws / (gdouble) n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "triangles",
+                     stats.n_triangles / (gdouble) n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "uniform_uploads",
+                     stats.n_uniform_uploads / (gdouble) n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "matrix_inversions",
+                     stats.n_matrix_inversions / (gdouble) n_frames);
+  g_string_append (json, ", ");
+  append_key_double (json, "lights_dropped",
+                     stats.n_lights_dropped / (gdouble) n_frames);
+  g_string_append_printf (json, "},\n \"program_compiles\": %u\n}\n",
+                          stats.n_program_compiles);
+
+  return json;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  MashLightSetMode mode;
+  BenchState state;
+  GArray *counts;
+  char *generated_file = NULL;
+  const char *filename;
+  guint n_triangles = 0;
+  GError *error = NULL;
+  GString *json;
+  int ret = 0;
+
+  /* Don't let the frame rate be limited by the display */
+  g_setenv ("CLUTTER_VBLANK", "none", FALSE);
+
+  context = g_option_context_new ("- benchmark painting models");
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_add_group (context, clutter_get_option_group ());
+
+  counts = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      !parse_mode (option_mode, &mode, &error) ||
+      (option_model == NULL &&
+       !bench_parse_counts (option_triangles, counts, &error)))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  if (option_frames < 1 || option_warmup < 0 || option_models < 0 ||
+      option_point_lights < 0 || option_spot_lights < 0 ||
+      option_directional_lights < 0)
+    {
+      g_printerr ("Invalid count\n");
+      return 1;
+    }
+
+  if (option_model)
+    filename = option_model;
+  else
+    {
+      BenchPlyInfo info;
+
+      if (counts->len != 1)
+        {
+          g_printerr ("Only one triangle count can be given\n");
+          return 1;
+        }
+
+      generated_file = g_build_filename (g_get_tmp_dir (),
+                                         "mash-bench-render.ply",
+                                         NULL);
+
+      if (!bench_ply_write (generated_file,
+                            g_array_index (counts, guint, 0),
+                            BENCH_PLY_BINARY_LITTLE_ENDIAN,
+                            BENCH_PLY_NORMALS,
+                            &info,
+                            &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+
+      filename = generated_file;
+      n_triangles = info.n_triangles;
+    }
+
+  g_array_free (counts, TRUE);
+
+  memset (&state, 0, sizeof (state));
+  state.models = g_ptr_array_new ();
+  state.lights = g_ptr_array_new ();
+  state.frame_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+  state.stage = clutter_stage_get_default ();
+  clutter_actor_set_size (state.stage, option_width, option_height);
+
+  state.light_set = mash_light_set_new ();
+  mash_light_set_set_mode (state.light_set, mode);
+  if (option_max_lights > 0)
+    mash_light_set_set_max_lights (state.light_set, option_max_lights);
+
+  state.scene = clutter_group_new ();
+  clutter_container_add_actor (CLUTTER_CONTAINER (state.stage), state.scene);
+
+  /* Enable depth testing only for the scene */
+  g_signal_connect (state.scene, "paint",
+                    G_CALLBACK (scene_paint_cb), NULL);
+  g_signal_connect_after (state.scene, "paint",
+                          G_CALLBACK (scene_paint_after_cb), NULL);
+
+  add_lights (&state, mash_point_light_new, option_point_lights);
+  add_lights (&state, mash_spot_light_new, option_spot_lights);
+  add_lights (&state, mash_directional_light_new,
+              option_directional_lights);
+
+  create_models (&state, filename);
+
+  if (n_triangles == 0 && state.models->len > 0)
+    {
+      MashDataLoadStats load_stats;
+
+      mash_data_get_load_stats
+        (mash_model_get_data (g_ptr_array_index (state.models, 0)),
+         &load_stats);
+      n_triangles = load_stats.n_triangles;
+    }
+
+  g_signal_connect (state.stage, "paint",
+                    G_CALLBACK (paint_cb), &state);
+  g_signal_connect_after (state.stage, "paint",
+                          G_CALLBACK (paint_after_cb), &state);
+
+  if (option_warmup == 0)
+    mash_render_stats_reset ();
+
+  animate (&state, 0);
+  clutter_actor_show (state.stage);
+
+  clutter_main ();
+
+  json = create_report (&state, option_model ? option_model : "grid",
+                        n_triangles);
+
+  if (option_output)
+    {
+      if (!g_file_set_contents (option_output, json->str, json->len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+          ret = 1;
+        }
+    }
+  else
+    fputs (json->str, stdout);
+
+  g_string_free (json, TRUE);
+
+  if (generated_file)
+    {
+      g_unlink (generated_file);
+      g_free (generated_file);
+    }
+
+  g_ptr_array_free (state.models, TRUE);
+  g_ptr_array_free (state.lights, TRUE);
+  g_array_free (state.frame_times, TRUE);
+  g_object_unref (state.light_set);
+
+  return ret;
+}
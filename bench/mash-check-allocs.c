@@ -0,0 +1,478 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks that painting a MashModel with a MashLightSet doesn't touch
+   the heap once the scene has warmed up. A scene of models and moving
+   lights is painted with each light set mode in turn. The clustered
+   mode is checked a second time with enough positional lights that
+   the light grid is built on the worker threads. After the warm up
+   frames every allocation made on the main thread while a model is
+   being painted is counted and the program fails if there are any.
+
+   The allocations are counted for the whole of the model's paint
+   handler so this includes anything that Cogl, Clutter and the GL
+   driver allocate while drawing, not just Mash. Some drivers, for
+   example Mesa's software rasterizers, may allocate while drawing
+   and make the check fail even though Mash doesn't allocate. If it
+   fails, run it again with --abort in a debugger to get a backtrace
+   of the first allocation and see where it comes from.
+
+   The allocations are counted by replacing malloc and friends in the
+   executable so this only works with glibc, where the real functions
+   are still available as __libc_malloc etc. GMemVTable can't be used
+   because it is ignored by newer versions of GLib. The GSlice
+   allocator is switched to always use malloc so that its allocations
+   are counted as well.
+
+   This runs as 'make check'. The stage needs a display so
+   run-headless.sh runs it under a virtual X server when there isn't
+   one. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <clutter/clutter.h>
+#include <mash/mash.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bench-common.h"
+
+/* The exit status that makes automake skip a test */
+#define SKIP_EXIT_STATUS 77
+
+static gboolean option_abort = FALSE;
+
+#ifdef __GLIBC__
+
+#define CAN_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n_members, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+/* Only the thread painting the models counts its allocations so that
+   threads started by the GL driver don't cause false failures */
+static __thread gboolean counting_allocations = FALSE;
+static guint n_allocations = 0;
+
+static void
+count_allocation (void)
+{
+  n_allocations++;
+
+  /* Stop straight away so that a debugger shows where the allocation
+     came from */
+  if (option_abort)
+    abort ();
+}
+
+void *
+malloc (size_t size)
+{
+  if (counting_allocations)
+    count_allocation ();
+
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members,
+        size_t size)
+{
+  if (counting_allocations)
+    count_allocation ();
+
+  return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+  if (counting_allocations)
+    count_allocation ();
+
+  return __libc_realloc (ptr, size);
+}
+
+void *
+memalign (size_t alignment,
+          size_t size)
+{
+  if (counting_allocations)
+    count_allocation ();
+
+  return __libc_memalign (alignment, size);
+}
+
+#endif /* __GLIBC__ */
+
+typedef struct
+{
+  ClutterActor *stage;
+  ClutterActor *scene;
+  MashLightSet *light_set;
+  GPtrArray *models;
+  GPtrArray *lights;
+
+  /* Index into passes of the pass being checked */
+  int pass_num;
+  int frame_num;
+
+  gboolean failed;
+} CheckState;
+
+typedef struct
+{
+  MashLightSetMode mode;
+  /* The number of lights of each type or 0 to use --lights */
+  int n_lights;
+} CheckPass;
+
+static const CheckPass
+passes[] =
+  {
+    { MASH_LIGHT_SET_MODE_PER_LIGHT, 0 },
+    { MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS, 0 },
+    { MASH_LIGHT_SET_MODE_CLUSTERED, 0 },
+    /* Enough positional lights that the light grid is built on the
+       worker threads */
+    { MASH_LIGHT_SET_MODE_CLUSTERED, 24 }
+  };
+
+static int option_models = 4;
+static int option_lights = 3;
+static int option_frames = 60;
+static int option_warmup = 10;
+
+static GOptionEntry
+options[] =
+  {
+    { "models", 'n', 0, G_OPTION_ARG_INT, &option_models,
+      "Number of models to paint", "N" },
+    { "lights", 'l', 0, G_OPTION_ARG_INT, &option_lights,
+      "Number of lights of each type", "M" },
+    { "frames", 'f', 0, G_OPTION_ARG_INT, &option_frames,
+      "Number of frames to check for each mode", "FRAMES" },
+    { "warmup", 'w', 0, G_OPTION_ARG_INT, &option_warmup,
+      "Number of frames to paint before checking", "FRAMES" },
+    { "abort", 'a', 0, G_OPTION_ARG_NONE, &option_abort,
+      "Abort at the first allocation", NULL },
+    { NULL }
+  };
+
+static const char *
+get_mode_name (MashLightSetMode mode)
+{
+  GEnumClass *enum_class = g_type_class_ref (MASH_TYPE_LIGHT_SET_MODE);
+  const char *name = g_enum_get_value (enum_class, mode)->value_nick;
+
+  g_type_class_unref (enum_class);
+
+  return name;
+}
+
+static void
+model_paint_cb (ClutterActor *model,
+                CheckState *state)
+{
+#ifdef CAN_COUNT_ALLOCATIONS
+  if (state->frame_num >= option_warmup)
+    counting_allocations = TRUE;
+#endif
+}
+
+static void
+model_paint_after_cb (ClutterActor *model,
+                      CheckState *state)
+{
+#ifdef CAN_COUNT_ALLOCATIONS
+  counting_allocations = FALSE;
+#endif
+}
+
+static void
+create_models (CheckState *state,
+               const char *filename)
+{
+  MashData *data = mash_data_new ();
+  GError *error = NULL;
+  int i;
+
+  if (!mash_data_load (data, MASH_DATA_NONE, filename, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  for (i = 0; i < option_models; i++)
+    {
+      ClutterActor *model = mash_model_new ();
+
+      mash_model_set_data (MASH_MODEL (model), data);
+      mash_model_set_light_set (MASH_MODEL (model), state->light_set);
+
+      clutter_actor_set_size (model, 100.0f, 100.0f);
+      clutter_actor_set_position (model, 20.0f + (i % 4) * 150.0f,
+                                  20.0f + (i / 4) * 150.0f);
+
+      g_signal_connect (model, "paint",
+                        G_CALLBACK (model_paint_cb), state);
+      g_signal_connect_after (model, "paint",
+                              G_CALLBACK (model_paint_after_cb), state);
+
+      clutter_container_add_actor (CLUTTER_CONTAINER (state->scene), model);
+      g_ptr_array_add (state->models, model);
+    }
+
+  g_object_unref (data);
+}
+
+static void
+add_lights (CheckState *state,
+            ClutterActor *(* light_new) (void),
+            int n_lights)
+{
+  int i;
+
+  for (i = 0; i < n_lights; i++)
+    {
+      ClutterActor *light = light_new ();
+
+      clutter_container_add_actor (CLUTTER_CONTAINER (state->scene), light);
+      mash_light_set_add_light (state->light_set, MASH_LIGHT (light));
+      g_ptr_array_add (state->lights, light);
+    }
+}
+
+/* Replaces the lights with the ones needed for the current pass */
+static void
+create_lights (CheckState *state)
+{
+  const CheckPass *pass = passes + state->pass_num;
+  int n_lights = pass->n_lights > 0 ? pass->n_lights : option_lights;
+  int i;
+
+  for (i = 0; i < state->lights->len; i++)
+    {
+      ClutterActor *light = g_ptr_array_index (state->lights, i);
+
+      mash_light_set_remove_light (state->light_set, MASH_LIGHT (light));
+      clutter_actor_destroy (light);
+    }
+
+  g_ptr_array_set_size (state->lights, 0);
+
+  add_lights (state, mash_point_light_new, n_lights);
+  add_lights (state, mash_spot_light_new, n_lights);
+  add_lights (state, mash_directional_light_new, n_lights);
+}
+
+/* Moves the lights and spins the models so that every frame has to
+   update the light uniforms and the normal matrices */
+static void
+animate (CheckState *state)
+{
+  float t = state->frame_num / 60.0f;
+  int i;
+
+  for (i = 0; i < state->lights->len; i++)
+    {
+      ClutterActor *light = g_ptr_array_index (state->lights, i);
+      float angle = t + i * 2.0f * G_PI / state->lights->len;
+
+      clutter_actor_set_position (light,
+                                  300.0f + 200.0f * cosf (angle),
+                                  300.0f + 200.0f * sinf (angle));
+    }
+
+  for (i = 0; i < state->models->len; i++)
+    clutter_actor_set_rotation (g_ptr_array_index (state->models, i),
+                                CLUTTER_Y_AXIS,
+                                state->frame_num * 2.0f + i * 10.0f,
+                                50.0f, 50.0f, 0);
+}
+
+static gboolean
+next_frame_cb (gpointer user_data)
+{
+  CheckState *state = user_data;
+
+  animate (state);
+  clutter_actor_queue_redraw (state->stage);
+
+  return FALSE;
+}
+
+static void
+paint_after_cb (ClutterActor *stage,
+                CheckState *state)
+{
+  const CheckPass *pass = passes + state->pass_num;
+
+  state->frame_num++;
+
+  if (state->frame_num < option_warmup + option_frames)
+    {
+      g_idle_add (next_frame_cb, state);
+      return;
+    }
+
+#ifdef CAN_COUNT_ALLOCATIONS
+  if (n_allocations > 0)
+    state->failed = TRUE;
+
+  g_print ("%s with %u lights: %u allocations in %i frames\n",
+           get_mode_name (pass->mode),
+           state->lights->len,
+           n_allocations,
+           option_frames);
+
+  n_allocations = 0;
+#endif
+
+  if (++state->pass_num >= G_N_ELEMENTS (passes))
+    {
+      clutter_main_quit ();
+      return;
+    }
+
+  /* Start again with the next pass. The program has to be rebuilt so
+     it needs to warm up again */
+  mash_light_set_set_mode (state->light_set, passes[state->pass_num].mode);
+  create_lights (state);
+  state->frame_num = 0;
+  g_idle_add (next_frame_cb, state);
+}
+
+static void
+scene_paint_cb (ClutterActor *scene)
+{
+  cogl_set_depth_test_enabled (TRUE);
+}
+
+static void
+scene_paint_after_cb (ClutterActor *scene)
+{
+  cogl_set_depth_test_enabled (FALSE);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  CheckState state;
+  BenchPlyInfo info;
+  char *filename;
+  GError *error = NULL;
+
+#ifndef CAN_COUNT_ALLOCATIONS
+  g_printerr ("Counting allocations is only supported with glibc\n");
+  return SKIP_EXIT_STATUS;
+#endif
+
+  /* Make GSlice use malloc so that its allocations are counted. This
+     has to happen before the first slice is allocated */
+  g_setenv ("G_SLICE", "always-malloc", TRUE);
+  g_setenv ("CLUTTER_VBLANK", "none", FALSE);
+
+  context = g_option_context_new ("- check that painting doesn't allocate");
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_add_group (context, clutter_get_option_group ());
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  if (option_frames < 1 || option_warmup < 1 || option_models < 1 ||
+      option_lights < 0)
+    {
+      g_printerr ("Invalid count\n");
+      return 1;
+    }
+
+  filename = g_build_filename (g_get_tmp_dir (),
+                               "mash-check-allocs.ply",
+                               NULL);
+
+  if (!bench_ply_write (filename,
+                        2000,
+                        BENCH_PLY_BINARY_LITTLE_ENDIAN,
+                        BENCH_PLY_NORMALS,
+                        &info,
+                        &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  memset (&state, 0, sizeof (state));
+  state.models = g_ptr_array_new ();
+  state.lights = g_ptr_array_new ();
+
+  state.stage = clutter_stage_get_default ();
+  clutter_actor_set_size (state.stage, 640, 480);
+
+  state.light_set = mash_light_set_new ();
+  mash_light_set_set_mode (state.light_set, passes[0].mode);
+
+  state.scene = clutter_group_new ();
+  clutter_container_add_actor (CLUTTER_CONTAINER (state.stage), state.scene);
+
+  g_signal_connect (state.scene, "paint",
+                    G_CALLBACK (scene_paint_cb), NULL);
+  g_signal_connect_after (state.scene, "paint",
+                          G_CALLBACK (scene_paint_after_cb), NULL);
+
+  create_lights (&state);
+
+  create_models (&state, filename);
+
+  g_signal_connect_after (state.stage, "paint",
+                          G_CALLBACK (paint_after_cb), &state);
+
+  animate (&state);
+  clutter_actor_show (state.stage);
+
+  clutter_main ();
+
+  g_unlink (filename);
+  g_free (filename);
+
+  g_ptr_array_free (state.models, TRUE);
+  g_ptr_array_free (state.lights, TRUE);
+  g_object_unref (state.light_set);
+
+  if (state.failed)
+    {
+      g_printerr ("Painting allocated memory after warming up\n");
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks that loading with MASH_DATA_STREAM keeps the memory used for
+   the decoded data bounded by the size of a batch. A small and a
+   large model are each loaded with and without the flag and the
+   peak_temp_bytes from the load stats are compared. The peak when
+   streaming must stay about the same for both models while the peak
+   without the flag grows with the model.
+
+   This runs as 'make check'. Creating the buffers needs a Cogl
+   context so run-headless.sh runs it under a virtual X server when
+   there isn't a display. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <clutter/clutter.h>
+#include <mash/mash.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-common.h"
+
+/* The exit status that makes automake skip a test */
+#define SKIP_EXIT_STATUS 77
+
+typedef struct
+{
+  guint n_triangles;
+  MashDataLoadStats stats[2];
+} CheckModel;
+
+/* The small model is two batches and the large one is eight */
+static CheckModel
+models[] =
+  {
+    { 0x80000 },
+    { 0x200000 }
+  };
+
+static const MashDataFlags
+modes[] =
+  {
+    MASH_DATA_NONE,
+    MASH_DATA_STREAM
+  };
+
+static gboolean
+load_model (CheckModel *model,
+            const char *filename)
+{
+  BenchPlyInfo info;
+  GError *error = NULL;
+  int i;
+
+  if (!bench_ply_write (filename,
+                        model->n_triangles,
+                        BENCH_PLY_BINARY_LITTLE_ENDIAN,
+                        BENCH_PLY_NORMALS,
+                        &info,
+                        &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_clear_error (&error);
+      return FALSE;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (modes); i++)
+    {
+      MashData *data = mash_data_new ();
+
+      if (!mash_data_load (data, modes[i], filename, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+          g_object_unref (data);
+          return FALSE;
+        }
+
+      mash_data_get_load_stats (data, model->stats + i);
+      g_object_unref (data);
+
+      g_print ("%u triangles%s: peak_temp_bytes %" G_GSIZE_FORMAT "\n",
+               model->stats[i].n_triangles,
+               modes[i] == MASH_DATA_STREAM ? " streamed" : "",
+               model->stats[i].peak_temp_bytes);
+    }
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  const CheckModel *small = models, *large = models + 1;
+  char *filename;
+  gboolean failed = FALSE;
+  int i;
+
+  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+    {
+      g_printerr ("Failed to initialize Clutter\n");
+      return SKIP_EXIT_STATUS;
+    }
+
+  filename = g_build_filename (g_get_tmp_dir (),
+                               "mash-check-stream.ply",
+                               NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (models); i++)
+    if (!load_model (models + i, filename))
+      {
+        failed = TRUE;
+        break;
+      }
+
+  g_unlink (filename);
+  g_free (filename);
+
+  if (failed)
+    return 1;
+
+  for (i = 0; i < G_N_ELEMENTS (models); i++)
+    if (models[i].stats[0].n_triangles != models[i].stats[1].n_triangles)
+      {
+        g_printerr ("Streaming loaded %u triangles instead of %u\n",
+                    models[i].stats[1].n_triangles,
+                    models[i].stats[0].n_triangles);
+        failed = TRUE;
+      }
+
+  /* Four times as many triangles shouldn't need noticeably more
+     memory when streaming */
+  if (large->stats[1].peak_temp_bytes
+      > small->stats[1].peak_temp_bytes + small->stats[1].peak_temp_bytes / 4)
+    {
+      g_printerr ("Streaming used more memory for the larger model\n");
+      failed = TRUE;
+    }
+
+  if (large->stats[1].peak_temp_bytes * 2 > large->stats[0].peak_temp_bytes)
+    {
+      g_printerr ("Streaming didn't save memory for the larger model\n");
+      failed = TRUE;
+    }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# Runs a program that needs a Clutter stage. If there is no display
+# then the program is run under a virtual X server with software
+# rendering. If that isn't available either then the program is not
+# run and the exit status is 77 so that automake skips the test.
+
+if test -n "$DISPLAY"; then
+    exec "$@"
+fi
+
+if command -v xvfb-run > /dev/null 2>&1; then
+    exec xvfb-run -a -s "-screen 0 1024x768x24" \
+        env LIBGL_ALWAYS_SOFTWARE=1 "$@"
+fi
+
+echo "No display and xvfb-run is not available, skipping $1" >&2
+exit 77
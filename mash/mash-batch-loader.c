@@ -0,0 +1,1290 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:mash-batch-loader
+ * @short_description: An object for loading many models in the
+ *   background.
+ *
+ * #MashBatchLoader loads #MashData from many files without blocking
+ * the main loop. Each file is added as a request with
+ * mash_batch_loader_add(). The files are parsed by a bounded pool of
+ * worker threads and then handed back to the main thread where the
+ * buffers are created. The buffers are created just before each
+ * frame is painted until the time set with
+ * mash_batch_loader_set_frame_budget() has been used up so that
+ * loading doesn't cause the stage to stutter. A model is uploaded in
+ * one go unless mash_batch_loader_set_max_part_vertices() is used to
+ * split large models into parts that can be uploaded in different
+ * frames. When all of the parts
+ * of a request have been uploaded its callback is called with the
+ * complete data so a #MashModel never shows a partly uploaded model.
+ *
+ * If mash_batch_loader_set_coarse_triangles() is used then a coarse
+ * version of each large model is made at the end of parsing it. The
+ * coarse version is uploaded first and the callback is called with it
+ * straight away so that it can be shown while the rest of the model
+ * is uploaded. When the upload finishes the full model replaces the
+ * coarse one in the same #MashData and the #MashData::changed signal
+ * is emitted. The coarse version is made from the fully decoded model
+ * so it only shortens the wait for the upload. Nothing can be shown
+ * until the whole file has been read and decoded. This is not
+ * progressive streaming.
+ *
+ * Each request has a priority. Requests with a lower priority value
+ * are parsed and uploaded first, in the same way as the priorities
+ * of #GSource. For example, models that are visible could be added
+ * with %G_PRIORITY_HIGH and the rest with %G_PRIORITY_DEFAULT. The
+ * priority can be changed with mash_batch_loader_set_priority() and
+ * requests that are no longer needed can be cancelled with
+ * mash_batch_loader_cancel().
+ *
+ * Like mash_model_new_from_file(), the loader shares data through
+ * the cache used by mash_data_cache_lookup_or_load() so a file that
+ * is already loaded with the same flags isn't loaded again.
+ *
+ * The loader must be used from the thread that runs the Clutter main
+ * loop.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib-object.h>
+#include <string.h>
+#include <clutter/clutter.h>
+
+#include "mash-batch-loader.h"
+#include "mash-data-private.h"
+#include "mash-debug.h"
+#include "mash-trace.h"
+
+static void mash_batch_loader_dispose (GObject *object);
+static void mash_batch_loader_finalize (GObject *object);
+
+static void mash_batch_loader_get_property (GObject *object,
+                                            guint prop_id,
+                                            GValue *value,
+                                            GParamSpec *pspec);
+static void mash_batch_loader_set_property (GObject *object,
+                                            guint prop_id,
+                                            const GValue *value,
+                                            GParamSpec *pspec);
+
+G_DEFINE_TYPE (MashBatchLoader, mash_batch_loader, G_TYPE_OBJECT);
+
+#define MASH_BATCH_LOADER_GET_PRIVATE(obj)                      \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((obj), MASH_TYPE_BATCH_LOADER,  \
+                                MashBatchLoaderPrivate))
+
+typedef enum
+{
+  /* Waiting in the pending queue for a worker */
+  MASH_BATCH_LOADER_PENDING,
+  /* Being parsed by a worker */
+  MASH_BATCH_LOADER_PARSING,
+  /* Waiting in the parsed queue to be uploaded */
+  MASH_BATCH_LOADER_PARSED,
+  /* Some of its parts have been uploaded */
+  MASH_BATCH_LOADER_UPLOADING,
+  /* Cancelled while a worker was parsing it. The worker frees it */
+  MASH_BATCH_LOADER_CANCELLED
+} MashBatchLoaderState;
+
+typedef struct
+{
+  guint id;
+  gint priority;
+  MashDataFlags flags;
+  gchar *filename;
+
+  MashBatchLoaderState state;
+
+  /* The loader that parses the file. This is NULL if the data was
+     found in the cache or the format is unknown */
+  MashDataLoader *loader;
+  /* Data found in the cache */
+  MashData *data;
+  /* Data holding the coarse version while the full data is uploaded.
+     The callback has already been called with it */
+  MashData *coarse_data;
+  GError *error;
+
+  gdouble parse_time;
+  gdouble upload_time;
+
+  MashBatchLoaderCallback callback;
+  gpointer user_data;
+  GDestroyNotify notify;
+} MashBatchLoaderRequest;
+
+struct _MashBatchLoaderPrivate
+{
+  guint n_workers;
+  /* Created when the first request is added */
+  GThreadPool *pool;
+
+  /* Map from id to request for every unfinished request that hasn't
+     been cancelled. This is only used from the main thread */
+  GHashTable *requests;
+  guint next_id;
+
+  /* Protects the fields below and the state of the requests */
+  GMutex mutex;
+  /* Both queues are sorted by priority and then by id. The pool gets
+     one task for each request added to the pending queue and each
+     task takes the first request in the queue so that the order can
+     still be changed after the task is pushed */
+  GQueue pending;
+  GQueue parsed;
+  /* The idle source that starts uploading the parsed requests or 0 */
+  guint upload_source;
+
+  /* The fields below are only used from the main thread */
+
+  /* The repaint func that uploads parts before each frame or 0 */
+  guint repaint_func;
+  /* The request whose parts are being uploaded or NULL */
+  MashBatchLoaderRequest *uploading;
+  /* The maximum number of milliseconds to spend uploading per frame */
+  gdouble frame_budget;
+  /* The size of the coarse versions or 0 to not make them */
+  guint coarse_triangles;
+  /* The size of the parts that models are split into or 0 to not
+     split them */
+  guint max_part_vertices;
+
+  /* The batch statistics. These are only used from the main thread */
+  MashBatchLoaderStats stats;
+  guint n_unfinished;
+  gint64 batch_start;
+};
+
+enum
+  {
+    FINISHED,
+
+    LAST_SIGNAL
+  };
+
+static guint batch_loader_signals[LAST_SIGNAL];
+
+enum
+  {
+    PROP_0,
+
+    PROP_N_WORKERS,
+    PROP_FRAME_BUDGET,
+    PROP_COARSE_TRIANGLES,
+    PROP_MAX_PART_VERTICES
+  };
+
+#define MASH_BATCH_LOADER_DEFAULT_FRAME_BUDGET 4.0
+
+static void
+mash_batch_loader_class_init (MashBatchLoaderClass *klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *) klass;
+  GParamSpec *pspec;
+
+  _mash_trace_init ();
+
+  gobject_class->dispose = mash_batch_loader_dispose;
+  gobject_class->finalize = mash_batch_loader_finalize;
+  gobject_class->get_property = mash_batch_loader_get_property;
+  gobject_class->set_property = mash_batch_loader_set_property;
+
+  pspec = g_param_spec_uint ("n-workers",
+                             "Number of workers",
+                             "The maximum number of threads used to "
+                             "parse files. Zero means one per processor",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READABLE | G_PARAM_WRITABLE
+                             | G_PARAM_CONSTRUCT_ONLY
+                             | G_PARAM_STATIC_NAME
+                             | G_PARAM_STATIC_NICK
+                             | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class, PROP_N_WORKERS, pspec);
+
+  pspec = g_param_spec_double ("frame-budget",
+                               "Frame budget",
+                               "The maximum number of milliseconds to "
+                               "spend uploading before each frame",
+                               0.0, G_MAXDOUBLE,
+                               MASH_BATCH_LOADER_DEFAULT_FRAME_BUDGET,
+                               G_PARAM_READABLE | G_PARAM_WRITABLE
+                               | G_PARAM_STATIC_NAME
+                               | G_PARAM_STATIC_NICK
+                               | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class, PROP_FRAME_BUDGET, pspec);
+
+  pspec = g_param_spec_uint ("coarse-triangles",
+                             "Coarse triangles",
+                             "The rough number of triangles in the coarse "
+                             "version shown while a model is uploaded. "
+                             "Zero means no coarse version",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READABLE | G_PARAM_WRITABLE
+                             | G_PARAM_STATIC_NAME
+                             | G_PARAM_STATIC_NICK
+                             | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class,
+                                   PROP_COARSE_TRIANGLES,
+                                   pspec);
+
+  pspec = g_param_spec_uint ("max-part-vertices",
+                             "Max part vertices",
+                             "The maximum number of vertices in each "
+                             "part that a model is uploaded in. "
+                             "Zero means one part",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READABLE | G_PARAM_WRITABLE
+                             | G_PARAM_STATIC_NAME
+                             | G_PARAM_STATIC_NICK
+                             | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class,
+                                   PROP_MAX_PART_VERTICES,
+                                   pspec);
+
+  /**
+   * MashBatchLoader::finished:
+   * @loader: The #MashBatchLoader
+   *
+   * Emitted when the last unfinished request of a batch has finished
+   * or been cancelled. The statistics for the batch can be retrieved
+   * with mash_batch_loader_get_stats().
+   */
+  batch_loader_signals[FINISHED] =
+    g_signal_new ("finished",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, /* class offset */
+                  NULL, NULL, /* accumulator */
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
+  g_type_class_add_private (klass, sizeof (MashBatchLoaderPrivate));
+}
+
+static void
+mash_batch_loader_init (MashBatchLoader *self)
+{
+  MashBatchLoaderPrivate *priv;
+
+  priv = self->priv = MASH_BATCH_LOADER_GET_PRIVATE (self);
+
+  priv->n_workers = g_get_num_processors ();
+  priv->frame_budget = MASH_BATCH_LOADER_DEFAULT_FRAME_BUDGET;
+  priv->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  g_mutex_init (&priv->mutex);
+  g_queue_init (&priv->pending);
+  g_queue_init (&priv->parsed);
+}
+
+static void
+mash_batch_loader_request_free (MashBatchLoaderRequest *request)
+{
+  if (request->loader)
+    g_object_unref (request->loader);
+  if (request->data)
+    g_object_unref (request->data);
+  if (request->coarse_data)
+    g_object_unref (request->coarse_data);
+  if (request->error)
+    g_error_free (request->error);
+  if (request->notify)
+    request->notify (request->user_data);
+
+  g_free (request->filename);
+
+  g_slice_free (MashBatchLoaderRequest, request);
+}
+
+static void
+mash_batch_loader_dispose (GObject *object)
+{
+  MashBatchLoader *self = (MashBatchLoader *) object;
+  MashBatchLoaderPrivate *priv = self->priv;
+
+  mash_batch_loader_cancel_all (self);
+
+  /* Wait for the workers to finish the requests they are parsing.
+     They free the requests because they have been cancelled */
+  if (priv->pool)
+    {
+      g_thread_pool_free (priv->pool, TRUE, TRUE);
+      priv->pool = NULL;
+    }
+
+  if (priv->upload_source)
+    {
+      g_source_remove (priv->upload_source);
+      priv->upload_source = 0;
+    }
+
+  if (priv->repaint_func)
+    {
+      clutter_threads_remove_repaint_func (priv->repaint_func);
+      priv->repaint_func = 0;
+    }
+
+  G_OBJECT_CLASS (mash_batch_loader_parent_class)->dispose (object);
+}
+
+static void
+mash_batch_loader_finalize (GObject *object)
+{
+  MashBatchLoader *self = (MashBatchLoader *) object;
+  MashBatchLoaderPrivate *priv = self->priv;
+
+  g_hash_table_destroy (priv->requests);
+  g_mutex_clear (&priv->mutex);
+
+  G_OBJECT_CLASS (mash_batch_loader_parent_class)->finalize (object);
+}
+
+/**
+ * mash_batch_loader_new:
+ * @n_workers: The maximum number of threads used to parse files, or
+ *   0 to use one thread per processor
+ *
+ * Constructs a new #MashBatchLoader.
+ *
+ * Return value: a new #MashBatchLoader.
+ */
+MashBatchLoader *
+mash_batch_loader_new (guint n_workers)
+{
+  return g_object_new (MASH_TYPE_BATCH_LOADER,
+                       "n-workers", n_workers,
+                       NULL);
+}
+
+/**
+ * mash_batch_loader_get_n_workers:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Return value: the maximum number of threads that @loader uses to
+ *   parse files.
+ */
+guint
+mash_batch_loader_get_n_workers (MashBatchLoader *loader)
+{
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0);
+
+  return loader->priv->n_workers;
+}
+
+/**
+ * mash_batch_loader_set_frame_budget:
+ * @loader: A #MashBatchLoader instance
+ * @budget: The budget in milliseconds
+ *
+ * Sets the maximum number of milliseconds that @loader spends
+ * uploading parts of models to the GPU before each frame. At least
+ * one part is always uploaded per frame so a budget of 0 uploads a
+ * single part per frame. The default is 4 milliseconds.
+ */
+void
+mash_batch_loader_set_frame_budget (MashBatchLoader *loader,
+                                    gdouble budget)
+{
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+  g_return_if_fail (budget >= 0.0);
+
+  if (loader->priv->frame_budget != budget)
+    {
+      loader->priv->frame_budget = budget;
+      g_object_notify (G_OBJECT (loader), "frame-budget");
+    }
+}
+
+/**
+ * mash_batch_loader_get_frame_budget:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Return value: the maximum number of milliseconds that @loader
+ *   spends uploading before each frame.
+ */
+gdouble
+mash_batch_loader_get_frame_budget (MashBatchLoader *loader)
+{
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0.0);
+
+  return loader->priv->frame_budget;
+}
+
+/**
+ * mash_batch_loader_set_coarse_triangles:
+ * @loader: A #MashBatchLoader instance
+ * @n_triangles: The rough number of triangles, or 0 to not make
+ *   coarse versions
+ *
+ * Sets the rough number of triangles in the coarse version of each
+ * model that is shown while the rest of the model is uploaded. Only
+ * models with more triangles than this get a coarse version. The
+ * coarse version is only available once the whole file has been
+ * parsed. This
+ * only affects requests added afterwards. The default is 0 which
+ * means the callback is only called once the whole model has been
+ * uploaded.
+ */
+void
+mash_batch_loader_set_coarse_triangles (MashBatchLoader *loader,
+                                        guint n_triangles)
+{
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+
+  if (loader->priv->coarse_triangles != n_triangles)
+    {
+      loader->priv->coarse_triangles = n_triangles;
+      g_object_notify (G_OBJECT (loader), "coarse-triangles");
+    }
+}
+
+/**
+ * mash_batch_loader_get_coarse_triangles:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Return value: the rough number of triangles in the coarse versions
+ *   of the models, or 0 if they aren't made.
+ */
+guint
+mash_batch_loader_get_coarse_triangles (MashBatchLoader *loader)
+{
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0);
+
+  return loader->priv->coarse_triangles;
+}
+
+/**
+ * mash_batch_loader_set_max_part_vertices:
+ * @loader: A #MashBatchLoader instance
+ * @max_part_vertices: The maximum number of vertices in each part,
+ *   or 0 to upload each model in one part
+ *
+ * Sets the number of vertices that large models are split into parts
+ * of. The parts are uploaded separately so the upload of a large
+ * model can be spread over several frames instead of taking longer
+ * than the frame budget in one go. Each part is drawn with a separate
+ * call. See mash_data_loader_set_max_part_vertices(). This only
+ * affects requests added afterwards. The default is 0.
+ */
+void
+mash_batch_loader_set_max_part_vertices (MashBatchLoader *loader,
+                                         guint max_part_vertices)
+{
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+  g_return_if_fail (max_part_vertices == 0 || max_part_vertices >= 3);
+
+  if (loader->priv->max_part_vertices != max_part_vertices)
+    {
+      loader->priv->max_part_vertices = max_part_vertices;
+      g_object_notify (G_OBJECT (loader), "max-part-vertices");
+    }
+}
+
+/**
+ * mash_batch_loader_get_max_part_vertices:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Return value: the maximum number of vertices in each part of a
+ *   model, or 0 if models aren't split.
+ */
+guint
+mash_batch_loader_get_max_part_vertices (MashBatchLoader *loader)
+{
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0);
+
+  return loader->priv->max_part_vertices;
+}
+
+static gint
+mash_batch_loader_compare_requests (gconstpointer a_ptr,
+                                    gconstpointer b_ptr,
+                                    gpointer user_data)
+{
+  const MashBatchLoaderRequest *a = a_ptr;
+  const MashBatchLoaderRequest *b = b_ptr;
+
+  if (a->priority != b->priority)
+    return a->priority < b->priority ? -1 : 1;
+
+  return a->id < b->id ? -1 : a->id > b->id ? 1 : 0;
+}
+
+static gboolean mash_batch_loader_upload_cb (gpointer user_data);
+
+/* Moves @request to the parsed queue and makes sure the main thread
+   will upload it. This must be called with the mutex held */
+static void
+mash_batch_loader_queue_parsed (MashBatchLoader *self,
+                                MashBatchLoaderRequest *request)
+{
+  MashBatchLoaderPrivate *priv = self->priv;
+
+  request->state = MASH_BATCH_LOADER_PARSED;
+  g_queue_insert_sorted (&priv->parsed, request,
+                         mash_batch_loader_compare_requests,
+                         NULL);
+
+  /* The Clutter lock needs to be held while uploading so the idle
+     is added through Clutter */
+  if (priv->upload_source == 0)
+    priv->upload_source =
+      clutter_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                                     mash_batch_loader_upload_cb,
+                                     self,
+                                     NULL);
+}
+
+static void
+mash_batch_loader_worker (gpointer task,
+                          gpointer user_data)
+{
+  MashBatchLoader *self = user_data;
+  MashBatchLoaderPrivate *priv = self->priv;
+  MashBatchLoaderRequest *request;
+  gint64 start_time;
+
+  g_mutex_lock (&priv->mutex);
+  request = g_queue_pop_head (&priv->pending);
+  if (request)
+    request->state = MASH_BATCH_LOADER_PARSING;
+  g_mutex_unlock (&priv->mutex);
+
+  /* The request that this task was pushed for may have been
+     cancelled */
+  if (request == NULL)
+    return;
+
+  MASH_TRACE_BEGIN ("mash_batch_loader_parse");
+
+  start_time = g_get_monotonic_time ();
+
+  mash_data_loader_parse (request->loader,
+                          request->flags,
+                          request->filename,
+                          &request->error);
+
+  request->parse_time = ((g_get_monotonic_time () - start_time)
+                         / (gdouble) G_USEC_PER_SEC);
+
+  MASH_TRACE_END ();
+
+  g_mutex_lock (&priv->mutex);
+  if (request->state == MASH_BATCH_LOADER_CANCELLED)
+    {
+      g_mutex_unlock (&priv->mutex);
+      /* The notify has already been called from the main thread */
+      mash_batch_loader_request_free (request);
+    }
+  else
+    {
+      mash_batch_loader_queue_parsed (self, request);
+      g_mutex_unlock (&priv->mutex);
+    }
+}
+
+static void
+mash_batch_loader_finish_batch (MashBatchLoader *self)
+{
+  MashBatchLoaderPrivate *priv = self->priv;
+  MashBatchLoaderStats *stats = &priv->stats;
+
+  stats->elapsed_time = ((g_get_monotonic_time () - priv->batch_start)
+                         / (gdouble) G_USEC_PER_SEC);
+
+  if (MASH_DEBUG_ENABLED (LOAD))
+    g_message ("Finished a batch of %u requests in %.3fs: "
+               "%u loaded (%u from the cache), %u failed, %u cancelled, "
+               "%.1f files/s, %.2f MB/s, "
+               "%.3fs parsing, %.3fs uploading",
+               stats->n_requests,
+               stats->elapsed_time,
+               stats->n_loaded,
+               stats->n_cache_hits,
+               stats->n_failed,
+               stats->n_cancelled,
+               stats->elapsed_time > 0.0
+               ? stats->n_loaded / stats->elapsed_time : 0.0,
+               stats->elapsed_time > 0.0
+               ? stats->file_bytes / 1e6 / stats->elapsed_time : 0.0,
+               stats->parse_time,
+               stats->upload_time);
+
+  g_signal_emit (self, batch_loader_signals[FINISHED], 0);
+}
+
+/* Called when a request finishes or is cancelled */
+static void
+mash_batch_loader_request_done (MashBatchLoader *self)
+{
+  MashBatchLoaderPrivate *priv = self->priv;
+
+  if (--priv->n_unfinished == 0)
+    mash_batch_loader_finish_batch (self);
+}
+
+/* Creates the data for a request whose parts have all been uploaded
+   and calls its callback */
+static void
+mash_batch_loader_finish_request (MashBatchLoader *self,
+                                  MashBatchLoaderRequest *request)
+{
+  MashBatchLoaderPrivate *priv = self->priv;
+  MashBatchLoaderStats *stats = &priv->stats;
+  MashData *data = request->data;
+
+  stats->parse_time += request->parse_time;
+  stats->upload_time += request->upload_time;
+
+  if (data)
+    stats->n_cache_hits++;
+  else if (request->error == NULL)
+    {
+      MashDataLoadStats load_stats;
+
+      /* The loader has kept all of the parts so they are swapped
+         into the data in one go, replacing the coarse version if
+         there is one */
+      if (request->coarse_data)
+        data = g_object_ref (request->coarse_data);
+      else
+        data = mash_data_new ();
+      _mash_data_set_loaded (data, request->loader,
+                             request->filename,
+                             request->parse_time + request->upload_time);
+      _mash_data_cache_insert (data, request->flags,
+                               request->filename);
+
+      mash_data_get_load_stats (data, &load_stats);
+      stats->file_bytes += load_stats.file_size;
+      stats->n_triangles += load_stats.n_triangles;
+    }
+
+  if (data)
+    stats->n_loaded++;
+  else
+    stats->n_failed++;
+
+  /* The callback was already called with the coarse version so the
+     data is left coarse if the rest of the upload failed */
+  if (request->coarse_data)
+    {
+      if (request->error)
+        {
+          gchar *display_name = g_filename_display_name (request->filename);
+          g_warning ("Only the coarse version of %s could be loaded: %s",
+                     display_name, request->error->message);
+          g_free (display_name);
+        }
+    }
+  else if (request->callback)
+    request->callback (self,
+                       request->id,
+                       data,
+                       request->error,
+                       request->user_data);
+
+  if (data && data != request->data)
+    g_object_unref (data);
+}
+
+/* Uploads the next part of @request. Returns TRUE if there are no
+   parts left to upload */
+static gboolean
+mash_batch_loader_upload_part (MashBatchLoader *self,
+                               MashBatchLoaderRequest *request)
+{
+  gboolean done = TRUE;
+
+  if (request->data || request->error)
+    return TRUE;
+
+  /* Another request for the same file may have been uploaded since
+     this one was parsed */
+  if (request->state == MASH_BATCH_LOADER_PARSED &&
+      (request->data = _mash_data_cache_lookup (request->flags,
+                                                request->filename)))
+    return TRUE;
+
+  {
+    gint64 start_time = g_get_monotonic_time ();
+
+    /* The coarse version takes the first step by itself so that it
+       can be shown as soon as possible */
+    if (request->state == MASH_BATCH_LOADER_PARSED &&
+        mash_data_loader_get_coarse_triangles (request->loader) > 0)
+      {
+        MashData *coarse_data = mash_data_new ();
+
+        if (_mash_data_set_coarse (coarse_data, request->loader))
+          request->coarse_data = coarse_data;
+        else
+          g_object_unref (coarse_data);
+      }
+
+    if (request->coarse_data && request->state == MASH_BATCH_LOADER_PARSED)
+      done = FALSE;
+    else if (!mash_data_loader_upload_part (request->loader,
+                                            &done,
+                                            &request->error))
+      done = TRUE;
+
+    request->upload_time += ((g_get_monotonic_time () - start_time)
+                             / (gdouble) G_USEC_PER_SEC);
+  }
+
+  if (request->state == MASH_BATCH_LOADER_PARSED)
+    {
+      request->state = MASH_BATCH_LOADER_UPLOADING;
+
+      /* The callback may cancel the request so it must not be used
+         after this */
+      if (request->coarse_data && request->callback)
+        request->callback (self,
+                           request->id,
+                           request->coarse_data,
+                           NULL,
+                           request->user_data);
+    }
+
+  return done;
+}
+
+/* Uploads parts of the parsed requests until the frame budget has
+   been used up. At least one part is always uploaded. Returns TRUE if
+   there is anything left to upload */
+static gboolean
+mash_batch_loader_upload_parts (MashBatchLoader *self)
+{
+  MashBatchLoaderPrivate *priv = self->priv;
+  MashBatchLoaderRequest *request;
+  gint64 end_time;
+  gboolean more;
+
+  end_time = (g_get_monotonic_time ()
+              + (gint64) (priv->frame_budget * 1000.0));
+
+  /* Keep the loader alive in case a callback drops the last
+     reference */
+  g_object_ref (self);
+
+  MASH_TRACE_BEGIN ("mash_batch_loader_upload");
+
+  do
+    {
+      if ((request = priv->uploading) == NULL)
+        {
+          g_mutex_lock (&priv->mutex);
+          request = g_queue_pop_head (&priv->parsed);
+          g_mutex_unlock (&priv->mutex);
+
+          if (request == NULL)
+            break;
+
+          priv->uploading = request;
+        }
+
+      if (mash_batch_loader_upload_part (self, request))
+        {
+          /* Stop the request from being cancelled from the
+             callback */
+          priv->uploading = NULL;
+          g_hash_table_remove (priv->requests,
+                               GUINT_TO_POINTER (request->id));
+
+          mash_batch_loader_finish_request (self, request);
+          mash_batch_loader_request_free (request);
+          mash_batch_loader_request_done (self);
+        }
+    }
+  while (g_get_monotonic_time () < end_time);
+
+  MASH_TRACE_END ();
+
+  g_mutex_lock (&priv->mutex);
+  more = priv->uploading || !g_queue_is_empty (&priv->parsed);
+  g_mutex_unlock (&priv->mutex);
+
+  g_object_unref (self);
+
+  return more;
+}
+
+/* Queues a redraw of every mapped stage so that the repaint func
+   gets called. Returns FALSE if there are no mapped stages */
+static gboolean
+mash_batch_loader_queue_redraws (void)
+{
+  ClutterStageManager *stage_manager = clutter_stage_manager_get_default ();
+  GSList *stages, *l;
+  gboolean ret = FALSE;
+
+  stages = clutter_stage_manager_list_stages (stage_manager);
+
+  for (l = stages; l; l = l->next)
+    if (CLUTTER_ACTOR_IS_MAPPED (l->data))
+      {
+        clutter_actor_queue_redraw (l->data);
+        ret = TRUE;
+      }
+
+  g_slist_free (stages);
+
+  return ret;
+}
+
+static gboolean
+mash_batch_loader_repaint_cb (gpointer user_data)
+{
+  MashBatchLoader *self = user_data;
+  MashBatchLoaderPrivate *priv = self->priv;
+
+  /* Keep the frames coming until everything is uploaded. If the
+     stages have been hidden then the idle takes over */
+  if (mash_batch_loader_upload_parts (self)
+      && mash_batch_loader_queue_redraws ())
+    return TRUE;
+
+  priv->repaint_func = 0;
+
+  g_mutex_lock (&priv->mutex);
+  if ((priv->uploading || !g_queue_is_empty (&priv->parsed))
+      && priv->upload_source == 0)
+    priv->upload_source =
+      clutter_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                                     mash_batch_loader_upload_cb,
+                                     self,
+                                     NULL);
+  g_mutex_unlock (&priv->mutex);
+
+  return FALSE;
+}
+
+static gboolean
+mash_batch_loader_upload_cb (gpointer user_data)
+{
+  MashBatchLoader *self = user_data;
+  MashBatchLoaderPrivate *priv = self->priv;
+  gboolean more;
+
+  if (priv->repaint_func)
+    more = FALSE;
+  else if (mash_batch_loader_queue_redraws ())
+    {
+      /* Upload from a repaint func so that the budget is spent just
+         before a frame is painted */
+      priv->repaint_func =
+        clutter_threads_add_repaint_func (mash_batch_loader_repaint_cb,
+                                          self,
+                                          NULL);
+      more = FALSE;
+    }
+  else
+    /* Nothing is being painted so there are no frames to drive the
+       upload. Upload from the idle instead */
+    more = mash_batch_loader_upload_parts (self);
+
+  g_mutex_lock (&priv->mutex);
+  if (!more)
+    priv->upload_source = 0;
+  g_mutex_unlock (&priv->mutex);
+
+  return more;
+}
+
+/**
+ * mash_batch_loader_add:
+ * @loader: A #MashBatchLoader instance
+ * @flags: Flags used to specify load-time modifications to the data
+ * @filename: The name of a file to load
+ * @priority: The priority of the request. Requests with a lower value
+ *   are loaded first.
+ * @callback: (allow-none): A function to call when the request finishes
+ * @user_data: Data to pass to @callback
+ * @notify: (allow-none): A function to call to destroy @user_data when
+ *   the request finishes or is cancelled
+ *
+ * Adds a request to load the file called @filename. @callback is
+ * always called from the main loop, even if the data is already
+ * loaded or the format of the file isn't known. It is not called for
+ * requests that are cancelled.
+ *
+ * Return value: an id for the request that can be passed to
+ *   mash_batch_loader_cancel() and mash_batch_loader_set_priority().
+ *   The id is never 0.
+ */
+guint
+mash_batch_loader_add (MashBatchLoader *loader,
+                       MashDataFlags flags,
+                       const gchar *filename,
+                       gint priority,
+                       MashBatchLoaderCallback callback,
+                       gpointer user_data,
+                       GDestroyNotify notify)
+{
+  MashBatchLoaderPrivate *priv;
+  MashBatchLoaderRequest *request;
+
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0);
+  g_return_val_if_fail (filename != NULL, 0);
+
+  priv = loader->priv;
+
+  request = g_slice_new0 (MashBatchLoaderRequest);
+
+  if (++priv->next_id == 0)
+    priv->next_id = 1;
+
+  request->id = priv->next_id;
+  request->priority = priority;
+  request->flags = flags;
+  request->filename = g_strdup (filename);
+  request->callback = callback;
+  request->user_data = user_data;
+  request->notify = notify;
+
+  if (priv->n_unfinished++ == 0)
+    {
+      memset (&priv->stats, 0, sizeof (priv->stats));
+      priv->batch_start = g_get_monotonic_time ();
+    }
+
+  priv->stats.n_requests++;
+
+  g_hash_table_insert (priv->requests,
+                       GUINT_TO_POINTER (request->id),
+                       request);
+
+  /* Requests that don't need parsing go straight to the parsed queue
+     so that the callback is still called from the main loop */
+  if ((request->data = _mash_data_cache_lookup (flags, filename)) ||
+      !(request->loader = _mash_data_create_loader (filename,
+                                                    &request->error)))
+    {
+      g_mutex_lock (&priv->mutex);
+      mash_batch_loader_queue_parsed (loader, request);
+      g_mutex_unlock (&priv->mutex);
+    }
+  else
+    {
+      mash_data_loader_set_coarse_triangles (request->loader,
+                                             priv->coarse_triangles);
+      mash_data_loader_set_max_part_vertices (request->loader,
+                                              priv->max_part_vertices);
+
+      if (priv->pool == NULL)
+        priv->pool = g_thread_pool_new (mash_batch_loader_worker,
+                                        loader,
+                                        MAX (priv->n_workers, 1),
+                                        FALSE,
+                                        NULL);
+
+      g_mutex_lock (&priv->mutex);
+      request->state = MASH_BATCH_LOADER_PENDING;
+      g_queue_insert_sorted (&priv->pending, request,
+                             mash_batch_loader_compare_requests,
+                             NULL);
+      g_mutex_unlock (&priv->mutex);
+
+      g_thread_pool_push (priv->pool, request, NULL);
+    }
+
+  return request->id;
+}
+
+/**
+ * mash_batch_loader_set_priority:
+ * @loader: A #MashBatchLoader instance
+ * @request_id: The id of a request returned by mash_batch_loader_add()
+ * @priority: The new priority
+ *
+ * Changes the priority of a request. This has no effect if the
+ * request is already being parsed or uploaded. Nothing happens if the request has
+ * already finished.
+ */
+void
+mash_batch_loader_set_priority (MashBatchLoader *loader,
+                                guint request_id,
+                                gint priority)
+{
+  MashBatchLoaderPrivate *priv;
+  MashBatchLoaderRequest *request;
+  GQueue *queue;
+
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+
+  priv = loader->priv;
+
+  request = g_hash_table_lookup (priv->requests,
+                                 GUINT_TO_POINTER (request_id));
+
+  if (request == NULL)
+    return;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (request->state == MASH_BATCH_LOADER_PENDING)
+    queue = &priv->pending;
+  else if (request->state == MASH_BATCH_LOADER_PARSED
+           && request != priv->uploading)
+    queue = &priv->parsed;
+  else
+    queue = NULL;
+
+  if (queue)
+    g_queue_remove (queue, request);
+
+  request->priority = priority;
+
+  if (queue)
+    g_queue_insert_sorted (queue, request,
+                           mash_batch_loader_compare_requests,
+                           NULL);
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * mash_batch_loader_cancel:
+ * @loader: A #MashBatchLoader instance
+ * @request_id: The id of a request returned by mash_batch_loader_add()
+ *
+ * Cancels a request. The callback for the request won't be called
+ * but the notify function passed to mash_batch_loader_add() is called
+ * immediately. If a worker is currently parsing the file then it
+ * finishes parsing it in the background and throws away the result.
+ * If the callback has already been called with a coarse version of
+ * the model then the data is left with the coarse version.
+ *
+ * Return value: %TRUE if the request was cancelled or %FALSE if it
+ *   has already finished.
+ */
+gboolean
+mash_batch_loader_cancel (MashBatchLoader *loader,
+                          guint request_id)
+{
+  MashBatchLoaderPrivate *priv;
+  MashBatchLoaderRequest *request;
+  gboolean parsing;
+
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), FALSE);
+
+  priv = loader->priv;
+
+  request = g_hash_table_lookup (priv->requests,
+                                 GUINT_TO_POINTER (request_id));
+
+  if (request == NULL)
+    return FALSE;
+
+  g_hash_table_remove (priv->requests, GUINT_TO_POINTER (request_id));
+
+  g_mutex_lock (&priv->mutex);
+  switch (request->state)
+    {
+    case MASH_BATCH_LOADER_PENDING:
+      g_queue_remove (&priv->pending, request);
+      parsing = FALSE;
+      break;
+
+    case MASH_BATCH_LOADER_PARSED:
+      /* The request may have been taken from the queue to be
+         uploaded */
+      if (request == priv->uploading)
+        priv->uploading = NULL;
+      else
+        g_queue_remove (&priv->parsed, request);
+      parsing = FALSE;
+      break;
+
+    case MASH_BATCH_LOADER_UPLOADING:
+      /* Freeing the loader frees the parts uploaded so far */
+      priv->uploading = NULL;
+      parsing = FALSE;
+      break;
+
+    default:
+      request->state = MASH_BATCH_LOADER_CANCELLED;
+      parsing = TRUE;
+      break;
+    }
+  g_mutex_unlock (&priv->mutex);
+
+  if (parsing)
+    {
+      /* The worker frees the request when it finishes so only the
+         user data is destroyed here */
+      if (request->notify)
+        {
+          request->notify (request->user_data);
+          request->notify = NULL;
+        }
+    }
+  else
+    mash_batch_loader_request_free (request);
+
+  priv->stats.n_cancelled++;
+  mash_batch_loader_request_done (loader);
+
+  return TRUE;
+}
+
+/**
+ * mash_batch_loader_cancel_all:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Cancels all of the unfinished requests as if
+ * mash_batch_loader_cancel() was called for each of them.
+ */
+void
+mash_batch_loader_cancel_all (MashBatchLoader *loader)
+{
+  GList *ids, *l;
+
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+
+  ids = g_hash_table_get_keys (loader->priv->requests);
+
+  for (l = ids; l; l = l->next)
+    mash_batch_loader_cancel (loader, GPOINTER_TO_UINT (l->data));
+
+  g_list_free (ids);
+}
+
+/**
+ * mash_batch_loader_get_n_pending:
+ * @loader: A #MashBatchLoader instance
+ *
+ * Return value: the number of requests that haven't finished or been
+ *   cancelled yet.
+ */
+guint
+mash_batch_loader_get_n_pending (MashBatchLoader *loader)
+{
+  g_return_val_if_fail (MASH_IS_BATCH_LOADER (loader), 0);
+
+  return loader->priv->n_unfinished;
+}
+
+/**
+ * mash_batch_loader_get_stats:
+ * @loader: A #MashBatchLoader instance
+ * @stats: (out): A location to return the statistics
+ *
+ * Retrieves the statistics for the current batch of requests or for
+ * the last batch if all of the requests have finished. The
+ * statistics are also logged when a batch finishes if the MASH_DEBUG
+ * environment variable contains "load".
+ */
+void
+mash_batch_loader_get_stats (MashBatchLoader *loader,
+                             MashBatchLoaderStats *stats)
+{
+  MashBatchLoaderPrivate *priv;
+
+  g_return_if_fail (MASH_IS_BATCH_LOADER (loader));
+  g_return_if_fail (stats != NULL);
+
+  priv = loader->priv;
+
+  *stats = priv->stats;
+
+  if (priv->n_unfinished > 0)
+    stats->elapsed_time = ((g_get_monotonic_time () - priv->batch_start)
+                           / (gdouble) G_USEC_PER_SEC);
+
+  if (stats->elapsed_time > 0.0)
+    {
+      stats->files_per_second = stats->n_loaded / stats->elapsed_time;
+      stats->bytes_per_second = stats->file_bytes / stats->elapsed_time;
+    }
+}
+
+static void
+mash_batch_loader_get_property (GObject *object,
+                                guint prop_id,
+                                GValue *value,
+                                GParamSpec *pspec)
+{
+  MashBatchLoader *loader = MASH_BATCH_LOADER (object);
+
+  switch (prop_id)
+    {
+    case PROP_N_WORKERS:
+      g_value_set_uint (value, mash_batch_loader_get_n_workers (loader));
+      break;
+
+    case PROP_FRAME_BUDGET:
+      g_value_set_double (value, mash_batch_loader_get_frame_budget (loader));
+      break;
+
+    case PROP_COARSE_TRIANGLES:
+      g_value_set_uint (value,
+                        mash_batch_loader_get_coarse_triangles (loader));
+      break;
+
+    case PROP_MAX_PART_VERTICES:
+      g_value_set_uint (value,
+                        mash_batch_loader_get_max_part_vertices (loader));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+mash_batch_loader_set_property (GObject *object,
+                                guint prop_id,
+                                const GValue *value,
+                                GParamSpec *pspec)
+{
+  MashBatchLoader *loader = MASH_BATCH_LOADER (object);
+
+  switch (prop_id)
+    {
+    case PROP_N_WORKERS:
+      if (g_value_get_uint (value) > 0)
+        loader->priv->n_workers = g_value_get_uint (value);
+      break;
+
+    case PROP_FRAME_BUDGET:
+      mash_batch_loader_set_frame_budget (loader, g_value_get_double (value));
+      break;
+
+    case PROP_COARSE_TRIANGLES:
+      mash_batch_loader_set_coarse_triangles (loader,
+                                              g_value_get_uint (value));
+      break;
+
+    case PROP_MAX_PART_VERTICES:
+      mash_batch_loader_set_max_part_vertices (loader,
+                                               g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
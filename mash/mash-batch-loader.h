@@ -0,0 +1,191 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(__MASH_H_INSIDE__) && !defined(MASH_COMPILATION)
+#error "Only <mash/mash.h> can be included directly."
+#endif
+
+#ifndef __MASH_BATCH_LOADER_H__
+#define __MASH_BATCH_LOADER_H__
+
+#include <glib-object.h>
+#include <mash/mash-data.h>
+
+G_BEGIN_DECLS
+
+#define MASH_TYPE_BATCH_LOADER                  \
+  (mash_batch_loader_get_type())
+#define MASH_BATCH_LOADER(obj)                          \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj),                   \
+                               MASH_TYPE_BATCH_LOADER,  \
+                               MashBatchLoader))
+#define MASH_BATCH_LOADER_CLASS(klass)                  \
+  (G_TYPE_CHECK_CLASS_CAST ((klass),                    \
+                            MASH_TYPE_BATCH_LOADER,     \
+                            MashBatchLoaderClass))
+#define MASH_IS_BATCH_LOADER(obj)                       \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj),                   \
+                               MASH_TYPE_BATCH_LOADER))
+#define MASH_IS_BATCH_LOADER_CLASS(klass)               \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass),                    \
+                            MASH_TYPE_BATCH_LOADER))
+#define MASH_BATCH_LOADER_GET_CLASS(obj)                \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj),                    \
+                              MASH_TYPE_BATCH_LOADER,   \
+                              MashBatchLoaderClass))
+
+typedef struct _MashBatchLoader        MashBatchLoader;
+typedef struct _MashBatchLoaderClass   MashBatchLoaderClass;
+typedef struct _MashBatchLoaderPrivate MashBatchLoaderPrivate;
+typedef struct _MashBatchLoaderStats   MashBatchLoaderStats;
+
+/**
+ * MashBatchLoaderClass:
+ *
+ * The #MashBatchLoaderClass structure contains only private data.
+ */
+struct _MashBatchLoaderClass
+{
+  /*< private >*/
+  GObjectClass parent_class;
+};
+
+/**
+ * MashBatchLoader:
+ *
+ * The #MashBatchLoader structure contains only private data.
+ */
+struct _MashBatchLoader
+{
+  /*< private >*/
+  GObject parent;
+
+  MashBatchLoaderPrivate *priv;
+};
+
+/**
+ * MashBatchLoaderCallback:
+ * @loader: The #MashBatchLoader
+ * @request_id: The id returned by mash_batch_loader_add()
+ * @data: (allow-none): The loaded data or %NULL if the load failed
+ * @error: (allow-none): The reason the load failed or %NULL
+ * @user_data: The data passed to mash_batch_loader_add()
+ *
+ * The type of the function called when a request added with
+ * mash_batch_loader_add() finishes. @data is only guaranteed to be
+ * alive while the callback is running so a reference should be taken
+ * to keep it. If the loader makes coarse versions of the models then
+ * the callback may instead be called as soon as the coarse version
+ * of @data is ready. In that case it is not called again and @data is
+ * refined in place later.
+ */
+typedef void (* MashBatchLoaderCallback) (MashBatchLoader *loader,
+                                          guint request_id,
+                                          MashData *data,
+                                          const GError *error,
+                                          gpointer user_data);
+
+/**
+ * MashBatchLoaderStats:
+ * @n_requests: The number of requests added during the batch
+ * @n_loaded: The number of requests that were loaded successfully,
+ *   including the ones found in the cache
+ * @n_failed: The number of requests that failed
+ * @n_cancelled: The number of requests that were cancelled
+ * @n_cache_hits: The number of requests that reused data that was
+ *   already loaded instead of loading the file again
+ * @file_bytes: The total size of the files that were loaded
+ * @n_triangles: The total number of triangles that were loaded
+ * @elapsed_time: The number of seconds from the first request being
+ *   added to the last one finishing, or to now if the batch hasn't
+ *   finished yet
+ * @parse_time: The number of seconds spent parsing files, summed over
+ *   all of the worker threads
+ * @upload_time: The number of seconds spent creating buffers on the
+ *   main thread, summed over all of the frames that the uploads were
+ *   spread across
+ * @files_per_second: @n_loaded divided by @elapsed_time
+ * @bytes_per_second: @file_bytes divided by @elapsed_time
+ *
+ * Statistics about a batch of requests to a #MashBatchLoader. A batch
+ * starts when a request is added to a loader that has no unfinished
+ * requests and ends when there are none left. They can be retrieved
+ * with mash_batch_loader_get_stats().
+ */
+struct _MashBatchLoaderStats
+{
+  guint n_requests;
+  guint n_loaded;
+  guint n_failed;
+  guint n_cancelled;
+  guint n_cache_hits;
+
+  guint64 file_bytes;
+  guint64 n_triangles;
+
+  gdouble elapsed_time;
+  gdouble parse_time;
+  gdouble upload_time;
+
+  gdouble files_per_second;
+  gdouble bytes_per_second;
+};
+
+GType mash_batch_loader_get_type (void) G_GNUC_CONST;
+
+MashBatchLoader *mash_batch_loader_new (guint n_workers);
+
+guint mash_batch_loader_get_n_workers (MashBatchLoader *loader);
+
+void mash_batch_loader_set_frame_budget (MashBatchLoader *loader,
+                                         gdouble budget);
+gdouble mash_batch_loader_get_frame_budget (MashBatchLoader *loader);
+
+void mash_batch_loader_set_coarse_triangles (MashBatchLoader *loader,
+                                             guint n_triangles);
+guint mash_batch_loader_get_coarse_triangles (MashBatchLoader *loader);
+
+void mash_batch_loader_set_max_part_vertices (MashBatchLoader *loader,
+                                              guint max_part_vertices);
+guint mash_batch_loader_get_max_part_vertices (MashBatchLoader *loader);
+
+guint mash_batch_loader_add (MashBatchLoader *loader,
+                             MashDataFlags flags,
+                             const gchar *filename,
+                             gint priority,
+                             MashBatchLoaderCallback callback,
+                             gpointer user_data,
+                             GDestroyNotify notify);
+
+void mash_batch_loader_set_priority (MashBatchLoader *loader,
+                                     guint request_id,
+                                     gint priority);
+
+gboolean mash_batch_loader_cancel (MashBatchLoader *loader,
+                                   guint request_id);
+
+void mash_batch_loader_cancel_all (MashBatchLoader *loader);
+
+guint mash_batch_loader_get_n_pending (MashBatchLoader *loader);
+
+void mash_batch_loader_get_stats (MashBatchLoader *loader,
+                                  MashBatchLoaderStats *stats);
+
+G_END_DECLS
+
+#endif /* __MASH_BATCH_LOADER_H__ */
@@ -39,20 +39,68 @@ G_DEFINE_ABSTRACT_TYPE (MashDataLoader, mash_data_loader, G_TYPE_OBJECT);
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), MASH_TYPE_DATA_LOADER,  \
                                 MashDataLoaderPrivate))
 
-/* reserved for future use */
+/* The data is only split if it is asked for or if the driver needs
+   it */
+#define MASH_DATA_LOADER_DEFAULT_MAX_PART_VERTICES 0
+
 struct _MashDataLoaderPrivate
 {
+  /* The maximum number of vertices in each part of the data or 0 to
+     not split the data */
+  guint max_part_vertices;
+  /* The number of triangles to aim for in the coarse version of the
+     data or 0 to not make one */
+  guint coarse_triangles;
 };
 
+static gboolean
+mash_data_loader_real_load (MashDataLoader *data_loader,
+                            MashDataFlags flags,
+                            const gchar *filename,
+                            GError **error)
+{
+  return (mash_data_loader_parse (data_loader, flags, filename, error) &&
+          mash_data_loader_upload (data_loader, error));
+}
+
+static gboolean
+mash_data_loader_real_upload (MashDataLoader *data_loader,
+                              GError **error)
+{
+  gboolean done = FALSE;
+
+  while (!done)
+    if (!mash_data_loader_upload_part (data_loader, &done, error))
+      return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+mash_data_loader_real_upload_coarse (MashDataLoader *data_loader,
+                                     MashDataLoaderData *loader_data)
+{
+  return FALSE;
+}
+
 static void
 mash_data_loader_class_init (MashDataLoaderClass *klass)
 {
   GObjectClass *gobject_class = (GObjectClass *) klass;
+
+  klass->load = mash_data_loader_real_load;
+  klass->upload = mash_data_loader_real_upload;
+  klass->upload_coarse = mash_data_loader_real_upload_coarse;
+
+  g_type_class_add_private (klass, sizeof (MashDataLoaderPrivate));
 }
 
 static void
 mash_data_loader_init (MashDataLoader *self)
 {
+  self->priv = MASH_DATA_LOADER_GET_PRIVATE (self);
+
+  self->priv->max_part_vertices = MASH_DATA_LOADER_DEFAULT_MAX_PART_VERTICES;
 }
 
 /**
@@ -96,3 +144,200 @@ mash_data_loader_get_data (MashDataLoader *data_loader,
 
   MASH_DATA_LOADER_GET_CLASS (data_loader)->get_data (data_loader, loader_data);
 }
+
+/**
+ * mash_data_loader_parse:
+ * @data_loader: The #MashDataLoader instance
+ * @flags: Flags used to specify load-time modifications to the data
+ * @filename: The name of a file to load
+ * @error: Return location for an error or %NULL
+ *
+ * Decodes the file called @filename into system memory without
+ * creating any buffers. This doesn't use Cogl so it can be called
+ * from a worker thread as long as nothing else uses @data_loader at
+ * the same time. mash_data_loader_upload() must then be called to
+ * finish the load. This function is not usually called by
+ * applications.
+ *
+ * Return value: %TRUE if the file was decoded or %FALSE otherwise.
+ */
+gboolean
+mash_data_loader_parse (MashDataLoader *data_loader,
+                        MashDataFlags flags,
+                        const gchar *filename,
+                        GError **error)
+{
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), FALSE);
+
+  return MASH_DATA_LOADER_GET_CLASS (data_loader)->parse (data_loader,
+                                                          flags,
+                                                          filename,
+                                                          error);
+}
+
+/**
+ * mash_data_loader_upload:
+ * @data_loader: The #MashDataLoader instance
+ * @error: Return location for an error or %NULL
+ *
+ * Creates the buffers for the data decoded by the last successful
+ * call to mash_data_loader_parse() and frees the decoded data. This
+ * must be called from the thread that uses Cogl. The data can then
+ * be retrieved with mash_data_loader_get_data(). This function is not
+ * usually called by applications.
+ *
+ * Return value: %TRUE if the buffers were created or %FALSE otherwise.
+ */
+gboolean
+mash_data_loader_upload (MashDataLoader *data_loader,
+                         GError **error)
+{
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), FALSE);
+
+  return MASH_DATA_LOADER_GET_CLASS (data_loader)->upload (data_loader,
+                                                           error);
+}
+
+/**
+ * mash_data_loader_upload_part:
+ * @data_loader: The #MashDataLoader instance
+ * @done: Return location for whether the last part was uploaded
+ * @error: Return location for an error or %NULL
+ *
+ * Creates the buffers for the next part of the data decoded by
+ * mash_data_loader_parse(). This can be used instead of
+ * mash_data_loader_upload() to spread the upload over several calls.
+ * Once @done is set to %TRUE the data can be retrieved with
+ * mash_data_loader_get_data(). This function is not usually called by
+ * applications.
+ *
+ * Return value: %TRUE if the part was uploaded or %FALSE otherwise.
+ */
+gboolean
+mash_data_loader_upload_part (MashDataLoader *data_loader,
+                              gboolean *done,
+                              GError **error)
+{
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), FALSE);
+  g_return_val_if_fail (done != NULL, FALSE);
+
+  return MASH_DATA_LOADER_GET_CLASS (data_loader)->upload_part (data_loader,
+                                                                done,
+                                                                error);
+}
+
+/**
+ * mash_data_loader_set_max_part_vertices:
+ * @data_loader: The #MashDataLoader instance
+ * @max_part_vertices: The maximum number of vertices in each part, or
+ *   0 to keep the data in one part
+ *
+ * Sets the number of vertices that the data is split into parts of
+ * by the next call to mash_data_loader_parse(). Each part has its own
+ * buffers so they can be uploaded separately with
+ * mash_data_loader_upload_part() and each part is drawn separately.
+ * The triangles are grouped spatially so that each part covers a
+ * compact region of the model. Vertices shared by triangles in
+ * different parts are duplicated.
+ *
+ * The default is 0 so that the data is drawn with a single call. If
+ * the data needs 32-bit indices but the driver doesn't support them
+ * then it is split into parts of 65536 vertices when it is uploaded
+ * regardless of this setting. Setting it to 65536 makes every part
+ * use 16-bit indices, which halves the size of the index buffers of
+ * large models at the cost of more draw calls and duplicated
+ * vertices. It also lets #MashBatchLoader spread the upload of a
+ * large model over several frames. This function is not usually
+ * called by applications.
+ */
+void
+mash_data_loader_set_max_part_vertices (MashDataLoader *data_loader,
+                                        guint max_part_vertices)
+{
+  g_return_if_fail (MASH_IS_DATA_LOADER (data_loader));
+  g_return_if_fail (max_part_vertices == 0 || max_part_vertices >= 3);
+
+  data_loader->priv->max_part_vertices = max_part_vertices;
+}
+
+/**
+ * mash_data_loader_get_max_part_vertices:
+ * @data_loader: The #MashDataLoader instance
+ *
+ * Return value: the maximum number of vertices in each part set with
+ *   mash_data_loader_set_max_part_vertices().
+ */
+guint
+mash_data_loader_get_max_part_vertices (MashDataLoader *data_loader)
+{
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), 0);
+
+  return data_loader->priv->max_part_vertices;
+}
+
+/**
+ * mash_data_loader_upload_coarse:
+ * @data_loader: The #MashDataLoader instance
+ * @loader_data: Return location for the coarse data
+ *
+ * Creates the buffers for a coarse version of the data decoded by
+ * mash_data_loader_parse() and stores them in @loader_data. The coarse
+ * version is simplified from the whole decoded data so it can be
+ * shown while the rest of the data is uploaded, but not while the file
+ * is still being parsed. It is
+ * only made if mash_data_loader_set_coarse_triangles() was called
+ * before parsing and the data has more triangles than were asked for.
+ * The caller owns the buffers in @loader_data. This function is not
+ * usually called by applications.
+ *
+ * Return value: %TRUE if there is a coarse version or %FALSE
+ *   otherwise.
+ */
+gboolean
+mash_data_loader_upload_coarse (MashDataLoader *data_loader,
+                                MashDataLoaderData *loader_data)
+{
+  MashDataLoaderClass *klass;
+
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), FALSE);
+  g_return_val_if_fail (loader_data != NULL, FALSE);
+
+  klass = MASH_DATA_LOADER_GET_CLASS (data_loader);
+
+  return klass->upload_coarse (data_loader, loader_data);
+}
+
+/**
+ * mash_data_loader_set_coarse_triangles:
+ * @data_loader: The #MashDataLoader instance
+ * @n_triangles: The number of triangles to aim for, or 0 to not make
+ *   a coarse version
+ *
+ * Sets the rough number of triangles in the coarse version of the
+ * data made by the next call to mash_data_loader_parse(). The coarse
+ * version can be retrieved with mash_data_loader_upload_coarse().
+ * This function is not usually called by applications.
+ */
+void
+mash_data_loader_set_coarse_triangles (MashDataLoader *data_loader,
+                                       guint n_triangles)
+{
+  g_return_if_fail (MASH_IS_DATA_LOADER (data_loader));
+
+  data_loader->priv->coarse_triangles = n_triangles;
+}
+
+/**
+ * mash_data_loader_get_coarse_triangles:
+ * @data_loader: The #MashDataLoader instance
+ *
+ * Return value: the number of triangles set with
+ *   mash_data_loader_set_coarse_triangles().
+ */
+guint
+mash_data_loader_get_coarse_triangles (MashDataLoader *data_loader)
+{
+  g_return_val_if_fail (MASH_IS_DATA_LOADER (data_loader), 0);
+
+  return data_loader->priv->coarse_triangles;
+}
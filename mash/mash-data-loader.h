@@ -55,11 +55,25 @@ typedef struct _MashDataLoader        MashDataLoader;
 typedef struct _MashDataLoaderClass   MashDataLoaderClass;
 typedef struct _MashDataLoaderPrivate MashDataLoaderPrivate;
 typedef struct _MashDataLoaderData    MashDataLoaderData;
+typedef struct _MashDataLoaderPart    MashDataLoaderPart;
 
 /**
  * MashDataLoaderClass:
- * @load: Virtual used for loading the model from the file
+ * @load: Virtual used for loading the model from the file. The
+ *   default implementation calls @parse and then @upload.
  * @get_data: Virtual used to get the loaded data
+ * @parse: Virtual used to decode the file into system memory. This
+ *   must not use Cogl so that it can be run in a worker thread.
+ * @upload: Virtual used to create the buffers from the data decoded
+ *   by @parse. This is called from the thread that uses Cogl. The
+ *   default implementation calls @upload_part until it is done.
+ * @upload_part: Virtual used to create the buffers for the next part
+ *   of the data decoded by @parse. @done should be set to %TRUE once
+ *   the last part has been uploaded.
+ * @upload_coarse: Virtual used to create the buffers for a coarse
+ *   version of the data decoded by @parse. It should return %FALSE if
+ *   there is no coarse version. The default implementation always
+ *   returns %FALSE.
  */
 struct _MashDataLoaderClass
 {
@@ -73,6 +87,18 @@ struct _MashDataLoaderClass
                      GError **error);
   void (* get_data) (MashDataLoader *data_loader,
                      MashDataLoaderData *loader_data);
+
+  gboolean (* parse) (MashDataLoader *data_loader,
+                      MashDataFlags flags,
+                      const gchar *filename,
+                      GError **error);
+  gboolean (* upload) (MashDataLoader *data_loader,
+                       GError **error);
+  gboolean (* upload_part) (MashDataLoader *data_loader,
+                            gboolean *done,
+                            GError **error);
+  gboolean (* upload_coarse) (MashDataLoader *data_loader,
+                              MashDataLoaderData *loader_data);
 };
 
 /**
@@ -89,19 +115,43 @@ struct _MashDataLoader
 };
 
 /**
- * MashDataLoaderData:
+ * MashDataLoaderPart:
  *
- * The #MashDataLoaderData structure contains the loaded data.
+ * A piece of the loaded data with its own buffers. Large models can
+ * be split into parts so that they can be uploaded a part at a time.
+ * Each part is drawn with a separate call.
  */
-struct _MashDataLoaderData
+struct _MashDataLoaderPart
 {
   CoglHandle vertices_vbo;
   CoglHandle indices;
   guint min_index, max_index;
   guint n_triangles;
+};
+
+/**
+ * MashDataLoaderData:
+ *
+ * The #MashDataLoaderData structure contains the loaded data.
+ */
+struct _MashDataLoaderData
+{
+  /* An array of n_parts parts. The data owns a reference to each of
+     the buffers */
+  MashDataLoaderPart *parts;
+  guint n_parts;
+  /* The total number of triangles in all of the parts */
+  guint n_triangles;
 
   /* Bounding cuboid of the data */
   ClutterVertex min_vertex, max_vertex;
+
+  /* Statistics about the load. The loader doesn't fill in the total
+     time */
+  MashDataLoadStats stats;
+
+  /* The memory used by the buffers */
+  MashDataMemoryUsage memory;
 };
 
 GType mash_data_loader_get_type (void) G_GNUC_CONST;
@@ -114,6 +164,31 @@ gboolean mash_data_loader_load (MashDataLoader *self,
 void mash_data_loader_get_data (MashDataLoader *self,
                                 MashDataLoaderData *loader_data);
 
+gboolean mash_data_loader_parse (MashDataLoader *self,
+                                 MashDataFlags flags,
+                                 const gchar *filename,
+                                 GError **error);
+
+gboolean mash_data_loader_upload (MashDataLoader *self,
+                                  GError **error);
+
+gboolean mash_data_loader_upload_part (MashDataLoader *self,
+                                       gboolean *done,
+                                       GError **error);
+
+void mash_data_loader_set_max_part_vertices (MashDataLoader *self,
+                                             guint max_part_vertices);
+
+guint mash_data_loader_get_max_part_vertices (MashDataLoader *self);
+
+gboolean mash_data_loader_upload_coarse (MashDataLoader *self,
+                                         MashDataLoaderData *loader_data);
+
+void mash_data_loader_set_coarse_triangles (MashDataLoader *self,
+                                            guint n_triangles);
+
+guint mash_data_loader_get_coarse_triangles (MashDataLoader *self);
+
 G_END_DECLS
 
 #endif /* __MASH_DATA_LOADER_H__ */
@@ -0,0 +1,63 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_DATA_PRIVATE_H__
+#define __MASH_DATA_PRIVATE_H__
+
+#include "mash-data.h"
+#include "mash-data-loader.h"
+
+G_BEGIN_DECLS
+
+/* These let the loading be split up so that the file can be parsed
+   in another thread. A load is done by creating a loader for the
+   file with _mash_data_create_loader(), calling
+   mash_data_loader_parse() and mash_data_loader_upload() and then
+   giving the loader to _mash_data_set_loaded() */
+
+MashDataLoader *_mash_data_create_loader (const gchar *filename,
+                                          GError **error);
+
+void _mash_data_set_loaded (MashData *self,
+                            MashDataLoader *loader,
+                            const gchar *filename,
+                            gdouble total_time);
+
+/* Replaces the data in @self with the coarse version of the data
+   parsed by @loader so that it can be shown until the full data is
+   given to _mash_data_set_loaded(). Returns FALSE and leaves @self
+   alone if there is no coarse version */
+gboolean _mash_data_set_coarse (MashData *self,
+                                MashDataLoader *loader);
+
+/* Access to the cache used by mash_data_cache_lookup_or_load().
+   _mash_data_cache_lookup() returns a new reference */
+MashData *_mash_data_cache_lookup (MashDataFlags flags,
+                                   const gchar *filename);
+
+void _mash_data_cache_insert (MashData *self,
+                              MashDataFlags flags,
+                              const gchar *filename);
+
+G_END_DECLS
+
+#endif /* __MASH_DATA_PRIVATE_H__ */
@@ -37,37 +37,146 @@
 #endif
 
 #include <glib-object.h>
+#include <glib/gstdio.h>
 #include <string.h>
 #include <cogl/cogl.h>
 #include <clutter/clutter.h>
 
 #include "mash-data.h"
+#include "mash-data-private.h"
 #include "mash-data-loader.h"
 #include "mash-data-loaders.h"
+#include "mash-debug.h"
+#include "mash-render-stats-private.h"
+#include "mash-trace.h"
 
 static void mash_data_finalize (GObject *object);
 
 G_DEFINE_TYPE (MashData, mash_data, G_TYPE_OBJECT);
 
+enum
+  {
+    MEMORY_BUDGET_EXCEEDED,
+    CHANGED,
+
+    LAST_SIGNAL
+  };
+
+static guint data_signals[LAST_SIGNAL];
+
+/* The memory used by all of the MashData instances and the budget
+   set with mash_data_set_memory_budget(). These are only modified
+   from the thread that uploads the data */
+static MashDataMemoryUsage mash_data_total_memory;
+static guint64 mash_data_memory_budget = 0;
+
 #define MASH_DATA_GET_PRIVATE(obj)                      \
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), MASH_TYPE_DATA,  \
                                 MashDataPrivate))
 
+/* Identifies a file and the flags it was loaded with in the cache
+   used by mash_data_cache_lookup_or_load() */
+typedef struct
+{
+  guint64 device;
+  guint64 inode;
+  gint64 mtime;
+  /* The sub-second part of the modification time or 0 if the system
+     doesn't report it */
+  glong mtime_nsec;
+  guint64 size;
+  MashDataFlags flags;
+  /* The absolute filename. This is only used if the file system
+     doesn't have inode numbers */
+  gchar *path;
+} MashDataCacheKey;
+
 struct _MashDataPrivate
 {
   MashDataLoaderData loaded_data;
+
+  /* The key of this data in the cache or NULL if it isn't in the
+     cache. The key is owned by the hash table */
+  MashDataCacheKey *cache_key;
 };
 
+/* A weak reference to every MashData loaded by
+   mash_data_cache_lookup_or_load(). Like the rest of MashData this is
+   only used from the thread that renders */
+static GHashTable *mash_data_cache = NULL;
+
 static void
 mash_data_class_init (MashDataClass *klass)
 {
   GObjectClass *gobject_class = (GObjectClass *) klass;
 
+  _mash_trace_init ();
+
   gobject_class->finalize = mash_data_finalize;
 
+  /**
+   * MashData::memory-budget-exceeded:
+   * @data: The #MashData that was loaded
+   *
+   * Emitted when loading data into @data makes the total size of
+   * the buffers of all #MashData instances go over the budget set
+   * with mash_data_set_memory_budget(). It is only emitted when the
+   * total goes from within the budget to over it so it won't be
+   * emitted again until enough data has been freed.
+   */
+  data_signals[MEMORY_BUDGET_EXCEEDED] =
+    g_signal_new ("memory-budget-exceeded",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, /* class offset */
+                  NULL, NULL, /* accumulator */
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
+  /**
+   * MashData::changed:
+   * @data: The #MashData that changed
+   *
+   * Emitted whenever new data is loaded into @data. This includes
+   * when the upload of data loaded in the background by a
+   * #MashBatchLoader finishes so that any #MashModel using @data can
+   * update its size.
+   */
+  data_signals[CHANGED] =
+    g_signal_new ("changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, /* class offset */
+                  NULL, NULL, /* accumulator */
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
   g_type_class_add_private (klass, sizeof (MashDataPrivate));
 }
 
+static void
+mash_data_add_memory_usage (MashDataMemoryUsage *total,
+                            const MashDataMemoryUsage *usage,
+                            int sign)
+{
+  total->position_bytes += sign * usage->position_bytes;
+  total->normal_bytes += sign * usage->normal_bytes;
+  total->tex_coord_bytes += sign * usage->tex_coord_bytes;
+  total->color_bytes += sign * usage->color_bytes;
+  total->padding_bytes += sign * usage->padding_bytes;
+  total->vertex_bytes += sign * usage->vertex_bytes;
+  total->index_bytes += sign * usage->index_bytes;
+  total->gpu_bytes += sign * usage->gpu_bytes;
+  total->cpu_bytes += sign * usage->cpu_bytes;
+}
+
+/* The size that is compared against the memory budget */
+static guint64
+mash_data_get_budgeted_bytes (const MashDataMemoryUsage *usage)
+{
+  return (guint64) usage->gpu_bytes + usage->cpu_bytes;
+}
+
 static void
 mash_data_init (MashData *self)
 {
@@ -78,18 +187,22 @@ static void
 mash_data_free_vbos (MashData *self)
 {
   MashDataPrivate *priv = self->priv;
+  int i;
 
-  if (priv->loaded_data.vertices_vbo)
+  for (i = 0; i < priv->loaded_data.n_parts; i++)
     {
-      cogl_handle_unref (priv->loaded_data.vertices_vbo);
-      priv->loaded_data.vertices_vbo = NULL;
+      cogl_handle_unref (priv->loaded_data.parts[i].vertices_vbo);
+      cogl_handle_unref (priv->loaded_data.parts[i].indices);
     }
 
-  if (priv->loaded_data.indices)
-    {
-      cogl_handle_unref (priv->loaded_data.indices);
-      priv->loaded_data.indices = NULL;
-    }
+  g_free (priv->loaded_data.parts);
+  priv->loaded_data.parts = NULL;
+  priv->loaded_data.n_parts = 0;
+
+  mash_data_add_memory_usage (&mash_data_total_memory,
+                              &priv->loaded_data.memory,
+                              -1);
+  memset (&priv->loaded_data.memory, 0, sizeof (MashDataMemoryUsage));
 }
 
 static void
@@ -119,6 +232,298 @@ mash_data_new (void)
   return self;
 }
 
+static guint
+mash_data_cache_key_hash (gconstpointer key_ptr)
+{
+  const MashDataCacheKey *key = key_ptr;
+  guint hash;
+
+  hash = (guint) key->inode ^ (guint) (key->inode >> 32);
+  hash = hash * 31 + (guint) key->device;
+  hash = hash * 31 + (guint) key->mtime;
+  hash = hash * 31 + (guint) key->mtime_nsec;
+  hash = hash * 31 + (guint) key->size;
+  hash = hash * 31 + key->flags;
+
+  if (key->path)
+    hash = hash * 31 + g_str_hash (key->path);
+
+  return hash;
+}
+
+static gboolean
+mash_data_cache_key_equal (gconstpointer a_ptr,
+                           gconstpointer b_ptr)
+{
+  const MashDataCacheKey *a = a_ptr;
+  const MashDataCacheKey *b = b_ptr;
+
+  return (a->device == b->device &&
+          a->inode == b->inode &&
+          a->mtime == b->mtime &&
+          a->mtime_nsec == b->mtime_nsec &&
+          a->size == b->size &&
+          a->flags == b->flags &&
+          g_strcmp0 (a->path, b->path) == 0);
+}
+
+static void
+mash_data_cache_key_free (gpointer key_ptr)
+{
+  MashDataCacheKey *key = key_ptr;
+
+  g_free (key->path);
+  g_slice_free (MashDataCacheKey, key);
+}
+
+/* Fills in the key for @filename. Returns FALSE if the file can't be
+   stat'd in which case it isn't cached and mash_data_load() reports
+   the error */
+static gboolean
+mash_data_cache_init_key (MashDataCacheKey *key,
+                          MashDataFlags flags,
+                          const gchar *filename)
+{
+  GStatBuf buf;
+
+  if (g_stat (filename, &buf) == -1)
+    return FALSE;
+
+  key->device = buf.st_dev;
+  key->inode = buf.st_ino;
+  key->mtime = buf.st_mtime;
+  /* st_mtime only has a resolution of a second so a file rewritten
+     straight after being loaded would otherwise still match */
+#if defined (HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC) && !defined (G_OS_WIN32)
+  key->mtime_nsec = buf.st_mtim.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC) && !defined (G_OS_WIN32)
+  key->mtime_nsec = buf.st_mtimespec.tv_nsec;
+#else
+  key->mtime_nsec = 0;
+#endif
+  key->size = buf.st_size;
+  /* Streaming only changes how the data is loaded, not the result */
+  key->flags = flags & ~MASH_DATA_STREAM;
+
+  /* The device and inode identify the file regardless of how it was
+     named, but some file systems on Windows always report an inode
+     of 0 so the name has to be used instead */
+  if (key->inode == 0)
+    {
+      if (g_path_is_absolute (filename))
+        key->path = g_strdup (filename);
+      else
+        {
+          gchar *cwd = g_get_current_dir ();
+          key->path = g_build_filename (cwd, filename, NULL);
+          g_free (cwd);
+        }
+    }
+  else
+    key->path = NULL;
+
+  return TRUE;
+}
+
+static void
+mash_data_cache_weak_notify (gpointer user_data,
+                             GObject *where_the_object_was)
+{
+  MashData *self = (MashData *) where_the_object_was;
+  MashDataCacheKey *key = user_data;
+
+  self->priv->cache_key = NULL;
+  g_hash_table_remove (mash_data_cache, key);
+}
+
+/* Removes @self from the cache. This is done when new data is loaded
+   into it because it then no longer matches its key */
+static void
+mash_data_cache_remove (MashData *self)
+{
+  MashDataPrivate *priv = self->priv;
+
+  if (priv->cache_key)
+    {
+      g_object_weak_unref (G_OBJECT (self),
+                           mash_data_cache_weak_notify,
+                           priv->cache_key);
+      g_hash_table_remove (mash_data_cache, priv->cache_key);
+      priv->cache_key = NULL;
+    }
+}
+
+/* Returns a new reference to the data in the cache for @filename
+   and @flags or NULL if there isn't any */
+MashData *
+_mash_data_cache_lookup (MashDataFlags flags,
+                         const gchar *filename)
+{
+  MashDataCacheKey key;
+  MashData *self;
+
+  if (mash_data_cache == NULL ||
+      !mash_data_cache_init_key (&key, flags, filename))
+    return NULL;
+
+  self = g_hash_table_lookup (mash_data_cache, &key);
+
+  g_free (key.path);
+
+  if (self == NULL)
+    return NULL;
+
+  if (MASH_DEBUG_ENABLED (LOAD))
+    {
+      gchar *display_name = g_filename_display_name (filename);
+      g_message ("Using cached data for %s", display_name);
+      g_free (display_name);
+    }
+
+  return g_object_ref (self);
+}
+
+/* Adds @self to the cache as the data for @filename and @flags.
+   Nothing happens if the file can't be stat'd or if there is already
+   data for the file in the cache */
+void
+_mash_data_cache_insert (MashData *self,
+                         MashDataFlags flags,
+                         const gchar *filename)
+{
+  MashDataCacheKey key, *cache_key;
+
+  g_return_if_fail (self->priv->cache_key == NULL);
+
+  if (!mash_data_cache_init_key (&key, flags, filename))
+    return;
+
+  if (mash_data_cache == NULL)
+    mash_data_cache = g_hash_table_new_full (mash_data_cache_key_hash,
+                                             mash_data_cache_key_equal,
+                                             mash_data_cache_key_free,
+                                             NULL);
+  else if (g_hash_table_lookup (mash_data_cache, &key))
+    {
+      g_free (key.path);
+      return;
+    }
+
+  cache_key = g_slice_dup (MashDataCacheKey, &key);
+  self->priv->cache_key = cache_key;
+  g_hash_table_insert (mash_data_cache, cache_key, self);
+  g_object_weak_ref (G_OBJECT (self),
+                     mash_data_cache_weak_notify,
+                     cache_key);
+}
+
+/**
+ * mash_data_cache_lookup_or_load:
+ * @flags: Flags used to specify load-time modifications to the data
+ * @filename: The name of a file to load
+ * @error: Return location for an error or %NULL
+ *
+ * Returns a #MashData containing the data from @filename. If a
+ * #MashData that was returned by an earlier call for the same file
+ * and @flags still exists then a new reference to it is returned
+ * instead of loading the file again. Otherwise a new #MashData is
+ * created and loaded with mash_data_load().
+ *
+ * The file is identified by its device, inode number, modification
+ * time and size so different names for the same file share the data
+ * and a file that has been modified since it was cached is loaded
+ * again. The cache only holds weak references so the data is freed
+ * as normal when the last reference to it is dropped.
+ *
+ * The returned data is shared so it should not be reloaded with
+ * mash_data_load(). If that is done anyway the data is removed from
+ * the cache. mash_model_new_from_file() uses this function so to get
+ * a model with its own copy of the data create a #MashData with
+ * mash_data_new() instead.
+ *
+ * Return value: (transfer full): a #MashData or %NULL if the load
+ *   failed.
+ */
+MashData *
+mash_data_cache_lookup_or_load (MashDataFlags flags,
+                                const gchar *filename,
+                                GError **error)
+{
+  MashData *self;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  if ((self = _mash_data_cache_lookup (flags, filename)))
+    return self;
+
+  self = mash_data_new ();
+
+  if (!mash_data_load (self, flags, filename, error))
+    {
+      g_object_unref (self);
+      return NULL;
+    }
+
+  _mash_data_cache_insert (self, flags, filename);
+
+  return self;
+}
+
+/* Adds the memory used by the newly loaded data to the total and
+   emits the budget signal if it has just been exceeded */
+static void
+mash_data_account_memory (MashData *self)
+{
+  guint64 old_total, new_total;
+
+  old_total = mash_data_get_budgeted_bytes (&mash_data_total_memory);
+
+  mash_data_add_memory_usage (&mash_data_total_memory,
+                              &self->priv->loaded_data.memory,
+                              1);
+
+  new_total = mash_data_get_budgeted_bytes (&mash_data_total_memory);
+
+  if (mash_data_memory_budget > 0 &&
+      old_total <= mash_data_memory_budget &&
+      new_total > mash_data_memory_budget)
+    g_signal_emit (self, data_signals[MEMORY_BUDGET_EXCEEDED], 0);
+}
+
+static void
+mash_data_log_load_stats (const gchar *display_name,
+                          const MashDataLoadStats *stats)
+{
+  g_message ("Loaded %s in %.3fms\n"
+             "  open %.3fms, header %.3fms, vertices %.3fms, "
+             "faces %.3fms,\n"
+             "  validate %.3fms, extents %.3fms, split %.3fms, coarse %.3fms,\n"
+             "  upload %.3fms\n"
+             "  %" G_GUINT64_FORMAT " bytes in file, "
+             "%u vertices, %u faces, %u triangles\n"
+             "  %" G_GSIZE_FORMAT " vertex bytes, "
+             "%" G_GSIZE_FORMAT " index bytes, "
+             "%" G_GSIZE_FORMAT " peak temporary bytes",
+             display_name,
+             stats->total_time * 1000.0,
+             stats->open_time * 1000.0,
+             stats->header_time * 1000.0,
+             stats->vertex_time * 1000.0,
+             stats->face_time * 1000.0,
+             stats->validate_time * 1000.0,
+             stats->extents_time * 1000.0,
+             stats->split_time * 1000.0,
+             stats->coarse_time * 1000.0,
+             stats->upload_time * 1000.0,
+             stats->file_size,
+             stats->n_vertices,
+             stats->n_faces,
+             stats->n_triangles,
+             stats->vertex_bytes,
+             stats->index_bytes,
+             stats->peak_temp_bytes);
+}
+
 /**
  * mash_data_load:
  * @self: The #MashData instance
@@ -131,6 +536,10 @@ mash_data_new (void)
  * there is an error loading the file it will return %FALSE and @error
  * will be set to a GError instance.
  *
+ * Statistics about how long each stage of loading took can be
+ * retrieved afterwards with mash_data_get_load_stats(). They are also
+ * logged if the MASH_DEBUG environment variable contains "load".
+ *
  * Return value: %TRUE if the load succeeded or %FALSE otherwise.
  */
 gboolean
@@ -139,50 +548,116 @@ mash_data_load (MashData *self,
                 const gchar *filename,
                 GError **error)
 {
-  MashDataPrivate *priv;
   MashDataLoader *loader;
-  gchar *display_name;
   gboolean ret;
+  gint64 start_time;
 
   g_return_val_if_fail (MASH_IS_DATA (self), FALSE);
 
-  priv = self->priv;
+  MASH_TRACE_BEGIN ("mash_data_load");
 
-  loader = NULL;
-  display_name = g_filename_display_name (filename);
+  start_time = g_get_monotonic_time ();
 
-  if (g_str_has_suffix (filename, ".ply"))
-    loader = g_object_new (MASH_TYPE_PLY_LOADER, NULL);
+  loader = _mash_data_create_loader (filename, error);
 
-  if (loader != NULL)
+  if (loader == NULL)
+    ret = FALSE;
+  else
     {
       if (!mash_data_loader_load (loader, flags, filename, error))
         ret = FALSE;
       else
         {
-          /* Get rid of the old VBOs (if any) */
-          mash_data_free_vbos (self);
-
-          mash_data_loader_get_data (loader, &priv->loaded_data);
+          _mash_data_set_loaded (self, loader, filename,
+                                 (g_get_monotonic_time () - start_time)
+                                 / (gdouble) G_USEC_PER_SEC);
           ret = TRUE;
         }
+
+      g_object_unref (loader);
     }
+
+  MASH_TRACE_END ();
+
+  return ret;
+}
+
+/* Creates a loader for the format of @filename or sets @error if the
+   format isn't known */
+MashDataLoader *
+_mash_data_create_loader (const gchar *filename,
+                          GError **error)
+{
+  if (g_str_has_suffix (filename, ".ply"))
+    return g_object_new (MASH_TYPE_PLY_LOADER, NULL);
   else
     {
-      /* Unknown file format */
+      gchar *display_name = g_filename_display_name (filename);
 
+      /* Unknown file format */
       g_set_error (error, MASH_DATA_ERROR,
                    MASH_DATA_ERROR_UNKNOWN_FORMAT,
                    "Unknown format for file %s",
                    display_name);
-      ret = FALSE;
+      g_free (display_name);
+
+      return NULL;
     }
+}
 
-  g_free (display_name);
-  if (loader)
-    g_object_unref (loader);
+/* Replaces the data in @self with the data from @loader which must
+   have finished loading @filename. @total_time is the time the load
+   took for the stats */
+void
+_mash_data_set_loaded (MashData *self,
+                       MashDataLoader *loader,
+                       const gchar *filename,
+                       gdouble total_time)
+{
+  MashDataPrivate *priv = self->priv;
 
-  return ret;
+  /* Get rid of the old VBOs (if any) */
+  mash_data_free_vbos (self);
+
+  /* The data no longer matches what it was cached as */
+  mash_data_cache_remove (self);
+
+  mash_data_loader_get_data (loader, &priv->loaded_data);
+
+  mash_data_account_memory (self);
+
+  priv->loaded_data.stats.total_time = total_time;
+
+  if (MASH_DEBUG_ENABLED (LOAD))
+    {
+      gchar *display_name = g_filename_display_name (filename);
+      mash_data_log_load_stats (display_name, &priv->loaded_data.stats);
+      g_free (display_name);
+    }
+
+  g_signal_emit (self, data_signals[CHANGED], 0);
+}
+
+gboolean
+_mash_data_set_coarse (MashData *self,
+                       MashDataLoader *loader)
+{
+  MashDataPrivate *priv = self->priv;
+  MashDataLoaderData coarse;
+
+  if (!mash_data_loader_upload_coarse (loader, &coarse))
+    return FALSE;
+
+  mash_data_free_vbos (self);
+  mash_data_cache_remove (self);
+
+  priv->loaded_data = coarse;
+
+  mash_data_account_memory (self);
+
+  g_signal_emit (self, data_signals[CHANGED], 0);
+
+  return TRUE;
 }
 
 /**
@@ -200,21 +675,29 @@ void
 mash_data_render (MashData *self)
 {
   MashDataPrivate *priv;
+  int i;
 
   g_return_if_fail (MASH_IS_DATA (self));
 
   priv = self->priv;
 
-  /* Silently fail if we didn't load any data */
-  if (priv->loaded_data.vertices_vbo == NULL || priv->loaded_data.indices == NULL)
-    return;
+  /* Each part has its own buffers so it needs a separate draw. If we
+     didn't load any data then there are no parts and this silently
+     does nothing */
+  for (i = 0; i < priv->loaded_data.n_parts; i++)
+    {
+      const MashDataLoaderPart *part = priv->loaded_data.parts + i;
 
-  cogl_vertex_buffer_draw_elements (priv->loaded_data.vertices_vbo,
-                                    COGL_VERTICES_MODE_TRIANGLES,
-                                    priv->loaded_data.indices,
-                                    priv->loaded_data.min_index,
-                                    priv->loaded_data.max_index,
-                                    0, priv->loaded_data.n_triangles * 3);
+      cogl_vertex_buffer_draw_elements (part->vertices_vbo,
+                                        COGL_VERTICES_MODE_TRIANGLES,
+                                        part->indices,
+                                        part->min_index,
+                                        part->max_index,
+                                        0, part->n_triangles * 3);
+
+      _mash_render_stats_count_draw (part->n_triangles,
+                                     part->max_index - part->min_index + 1);
+    }
 }
 
 /**
@@ -241,6 +724,91 @@ mash_data_get_extents (MashData *self,
   *max_vertex = priv->loaded_data.max_vertex;
 }
 
+/**
+ * mash_data_get_load_stats:
+ * @self: A #MashData instance
+ * @stats: (out): A location to return the statistics
+ *
+ * Gets statistics about the last successful call to mash_data_load()
+ * on @self. These can be used to find out which stage of loading a
+ * file is slow. If no data has been loaded then all of the
+ * statistics will be zero.
+ */
+void
+mash_data_get_load_stats (MashData *self,
+                          MashDataLoadStats *stats)
+{
+  g_return_if_fail (MASH_IS_DATA (self));
+  g_return_if_fail (stats != NULL);
+
+  *stats = self->priv->loaded_data.stats;
+}
+
+/**
+ * mash_data_get_memory_usage:
+ * @self: A #MashData instance
+ * @usage: (out): A location to return the memory usage
+ *
+ * Gets the sizes of the vertex and index buffers used by @self. If no
+ * data has been loaded then all of the sizes will be zero.
+ */
+void
+mash_data_get_memory_usage (MashData *self,
+                            MashDataMemoryUsage *usage)
+{
+  g_return_if_fail (MASH_IS_DATA (self));
+  g_return_if_fail (usage != NULL);
+
+  *usage = self->priv->loaded_data.memory;
+}
+
+/**
+ * mash_data_get_total_memory_usage:
+ * @usage: (out): A location to return the memory usage
+ *
+ * Gets the sum of the memory used by the buffers of every #MashData
+ * instance in the process.
+ */
+void
+mash_data_get_total_memory_usage (MashDataMemoryUsage *usage)
+{
+  g_return_if_fail (usage != NULL);
+
+  *usage = mash_data_total_memory;
+}
+
+/**
+ * mash_data_set_memory_budget:
+ * @budget: The budget in bytes or 0 for no budget
+ *
+ * Sets a budget for the total memory used by the buffers of every
+ * #MashData instance in the process. The total includes both the
+ * memory on the GPU and any buffers kept in system memory. Whenever
+ * loading some data takes the total over the budget the
+ * #MashData::memory-budget-exceeded signal is emitted on the
+ * #MashData that was loaded. The budget doesn't prevent the data from
+ * being loaded. Setting a budget that is already exceeded doesn't
+ * emit the signal.
+ */
+void
+mash_data_set_memory_budget (guint64 budget)
+{
+  mash_data_memory_budget = budget;
+}
+
+/**
+ * mash_data_get_memory_budget:
+ *
+ * Gets the budget set with mash_data_set_memory_budget().
+ *
+ * Return value: the budget in bytes or 0 if there is no budget.
+ */
+guint64
+mash_data_get_memory_budget (void)
+{
+  return mash_data_memory_budget;
+}
+
 GQuark
 mash_data_error_quark (void)
 {
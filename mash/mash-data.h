@@ -58,6 +58,8 @@ G_BEGIN_DECLS
 typedef struct _MashData        MashData;
 typedef struct _MashDataClass   MashDataClass;
 typedef struct _MashDataPrivate MashDataPrivate;
+typedef struct _MashDataLoadStats MashDataLoadStats;
+typedef struct _MashDataMemoryUsage MashDataMemoryUsage;
 
 /**
  * MashDataClass:
@@ -92,9 +94,10 @@ struct _MashData
  *  will happen if the file does not contain the x, y and z properties.
  * @MASH_DATA_ERROR_INVALID: The file is not valid.
  * @MASH_DATA_ERROR_UNSUPPORTED: The file is not supported
- *  by your GL driver. This will happen if your driver can't support
- *  GL_UNSIGNED_INT indices but the model has more than 65,536
- *  vertices.
+ *  by your GL driver. A model with more than 65,536 vertices doesn't
+ *  cause this error if your driver can't support GL_UNSIGNED_INT
+ *  indices because it is split into parts that use 16-bit indices
+ *  instead.
  *
  * Error enumeration for #MashData
  */
@@ -113,6 +116,17 @@ typedef enum
  * @MASH_DATA_NEGATE_X: Negate the X axis
  * @MASH_DATA_NEGATE_Y: Negate the Y axis
  * @MASH_DATA_NEGATE_Z: Negate the Z axis
+ * @MASH_DATA_STREAM: Write the decoded vertices and faces to
+ *   temporary files while the file is being read instead of keeping
+ *   them in memory. The files are mapped once the file has been read
+ *   and the faces are uploaded in batches of 262144 triangles. Each
+ *   batch is sorted spatially and cut into windows of at most 65536
+ *   vertices so the model is drawn with several calls that each cover
+ *   a compact region. The memory used then depends on the size of a
+ *   batch rather than the size of the model, but the temporary files
+ *   need as much disk space as the decoded data. There is no
+ *   coarse version of the data when streaming. This doesn't need
+ *   Cogl while reading the file so it works with #MashBatchLoader.
  *
  * Flags used for modifying the data as it is loaded. These can be
  * passed to mash_data_load().
@@ -139,9 +153,98 @@ typedef enum
     MASH_DATA_NONE = 0,
     MASH_DATA_NEGATE_X = 1,
     MASH_DATA_NEGATE_Y = 2,
-    MASH_DATA_NEGATE_Z = 4
+    MASH_DATA_NEGATE_Z = 4,
+    MASH_DATA_STREAM = 8
   } MashDataFlags;
 
+/**
+ * MashDataLoadStats:
+ * @open_time: Seconds spent opening the file
+ * @header_time: Seconds spent parsing the header of the file
+ * @vertex_time: Seconds spent decoding the vertices
+ * @face_time: Seconds spent decoding the faces
+ * @validate_time: Seconds spent checking that the data is valid
+ * @extents_time: Seconds spent calculating the bounding cuboid
+ * @split_time: Seconds spent splitting the data into parts for
+ *   uploading. See mash_data_loader_set_max_part_vertices().
+ * @coarse_time: Seconds spent building the coarse version of the
+ *   data. See mash_data_loader_set_coarse_triangles().
+ * @upload_time: Seconds spent creating the buffers on the GPU
+ * @total_time: Seconds spent in mash_data_load() altogether
+ * @file_size: The size of the file in bytes
+ * @n_vertices: The number of vertices
+ * @n_faces: The number of faces in the file
+ * @n_triangles: The number of triangles that the faces were split into
+ * @vertex_bytes: The number of bytes of vertex data given to the GPU
+ * @index_bytes: The number of bytes of index data given to the GPU
+ * @peak_temp_bytes: The largest amount of memory used to hold the
+ *   decoded data before it is given to the GPU. This doesn't include
+ *   any spare space left when the temporary arrays were grown or the
+ *   temporary files mapped with %MASH_DATA_STREAM.
+ *
+ * Statistics about the last successful call to mash_data_load(). They
+ * can be retrieved with mash_data_get_load_stats(). The times are
+ * measured with the monotonic clock.
+ */
+struct _MashDataLoadStats
+{
+  gdouble open_time;
+  gdouble header_time;
+  gdouble vertex_time;
+  gdouble face_time;
+  gdouble validate_time;
+  gdouble extents_time;
+  gdouble split_time;
+  gdouble coarse_time;
+  gdouble upload_time;
+  gdouble total_time;
+
+  guint64 file_size;
+  guint n_vertices;
+  guint n_faces;
+  guint n_triangles;
+  gsize vertex_bytes;
+  gsize index_bytes;
+  gsize peak_temp_bytes;
+};
+
+/**
+ * MashDataMemoryUsage:
+ * @position_bytes: Bytes of the vertex buffer used for the positions
+ * @normal_bytes: Bytes of the vertex buffer used for the normals
+ * @tex_coord_bytes: Bytes of the vertex buffer used for the texture
+ *   coordinates
+ * @color_bytes: Bytes of the vertex buffer used for the colors
+ * @padding_bytes: Bytes of the vertex buffer used to align the
+ *   vertices or to store properties from the file that aren't used
+ * @vertex_bytes: The total size of the vertex buffer
+ * @index_bytes: The size of the index buffer
+ * @gpu_bytes: The number of bytes of the buffers that are stored in
+ *   buffer objects on the GPU
+ * @cpu_bytes: The number of bytes of the buffers that are kept in
+ *   system memory. This happens when the GL driver doesn't support
+ *   buffer objects.
+ *
+ * The memory used by the buffers of a #MashData. This can be
+ * retrieved for a single #MashData with mash_data_get_memory_usage()
+ * or for all of them with mash_data_get_total_memory_usage(). The
+ * sizes are the sizes of the data given to Cogl so the driver may
+ * use a little more memory than this.
+ */
+struct _MashDataMemoryUsage
+{
+  gsize position_bytes;
+  gsize normal_bytes;
+  gsize tex_coord_bytes;
+  gsize color_bytes;
+  gsize padding_bytes;
+  gsize vertex_bytes;
+  gsize index_bytes;
+
+  gsize gpu_bytes;
+  gsize cpu_bytes;
+};
+
 GType mash_data_get_type (void) G_GNUC_CONST;
 
 MashData *mash_data_new (void);
@@ -159,6 +262,22 @@ void mash_data_get_extents (MashData *self,
                             ClutterVertex *min_vertex,
                             ClutterVertex *max_vertex);
 
+void mash_data_get_load_stats (MashData *self,
+                               MashDataLoadStats *stats);
+
+void mash_data_get_memory_usage (MashData *self,
+                                 MashDataMemoryUsage *usage);
+
+void mash_data_get_total_memory_usage (MashDataMemoryUsage *usage);
+
+void mash_data_set_memory_budget (guint64 budget);
+
+guint64 mash_data_get_memory_budget (void);
+
+MashData *mash_data_cache_lookup_or_load (MashDataFlags flags,
+                                          const gchar *filename,
+                                          GError **error);
+
 G_END_DECLS
 
 #endif /* __MASH_DATA_H__ */
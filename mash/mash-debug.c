@@ -0,0 +1,51 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "mash-debug.h"
+
+static const GDebugKey mash_debug_keys[] =
+  {
+    { "load", MASH_DEBUG_LOAD },
+    { "stats", MASH_DEBUG_STATS }
+  };
+
+guint
+_mash_debug_get_flags (void)
+{
+  /* The flags are stored with an extra bit set so that zero can mean
+     that the environment variable hasn't been read yet. This can be
+     called from any thread */
+  static gsize flags = 0;
+
+  if (g_once_init_enter (&flags))
+    {
+      guint value = g_parse_debug_string (g_getenv ("MASH_DEBUG"),
+                                          mash_debug_keys,
+                                          G_N_ELEMENTS (mash_debug_keys));
+
+      g_once_init_leave (&flags, (gsize) value | ((gsize) 1 << 31));
+    }
+
+  return flags & ~((gsize) 1 << 31);
+}
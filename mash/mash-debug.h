@@ -0,0 +1,49 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_DEBUG_H__
+#define __MASH_DEBUG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Debugging output is enabled by setting the MASH_DEBUG environment
+   variable to a comma-separated list of these names, eg
+   MASH_DEBUG=load. The variable is read the first time any of the
+   flags are checked */
+typedef enum
+{
+  /* Log the statistics for each file loaded by mash_data_load() */
+  MASH_DEBUG_LOAD = 1 << 0,
+  /* Log a summary of the render statistics once a second */
+  MASH_DEBUG_STATS = 1 << 1
+} MashDebugFlags;
+
+guint _mash_debug_get_flags (void);
+
+#define MASH_DEBUG_ENABLED(flag) \
+  ((_mash_debug_get_flags () & MASH_DEBUG_ ## flag) != 0)
+
+G_END_DECLS
+
+#endif /* __MASH_DEBUG_H__ */
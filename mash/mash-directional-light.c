@@ -44,6 +44,7 @@
 
 #include "mash-light.h"
 #include "mash-directional-light.h"
+#include "mash-light-private.h"
 
 static void mash_directional_light_generate_shader (MashLight *light,
                                                     GString *uniform_source,
@@ -53,19 +54,6 @@ static void mash_directional_light_update_uniforms (MashLight *light,
 
 G_DEFINE_TYPE (MashDirectionalLight, mash_directional_light, MASH_TYPE_LIGHT);
 
-#define MASH_DIRECTIONAL_LIGHT_GET_PRIVATE(obj) \
-  (G_TYPE_INSTANCE_GET_PRIVATE ((obj), MASH_TYPE_DIRECTIONAL_LIGHT, \
-                                MashDirectionalLightPrivate))
-
-struct _MashDirectionalLightPrivate
-{
-  int light_direction_uniform_location;
-
-  /* TRUE if the shader has changed since we last called
-     cogl_program_get_uniform_location for the uniforms */
-  gboolean uniform_locations_dirty;
-};
-
 static const char
 mash_directional_light_shader[] =
   /* Add the ambient light term */
@@ -95,6 +83,52 @@ mash_directional_light_shader[] =
   "  cogl_color_out.xyz += lit_color$;\n"
   ;
 
+/* This is used instead of the snippet above when the light set is
+   using uniform arrays. See _mash_directional_light_get_block() for
+   the layout of the array */
+static const char
+mash_directional_light_array_uniforms[] =
+  "uniform int mash_n_directional_lights;\n"
+  "uniform vec4 mash_directional_lights[mash_max_directional_lights * 4];\n"
+  ;
+
+static const char
+mash_directional_light_array_shader[] =
+  "  for (int i = 0; i < mash_max_directional_lights; i++)\n"
+  "    {\n"
+  "      if (i >= mash_n_directional_lights)\n"
+  "        break;\n"
+  "      int base = i * 4;\n"
+  "      vec3 light_direction = mash_directional_lights[base + 3].xyz;\n"
+  /* Add the ambient light term */
+  "      vec3 lit_color = (mash_material.ambient.rgb\n"
+  "                        * mash_directional_lights[base].rgb);\n"
+  /* Calculate the diffuse factor based on the angle between the
+     vertex normal and light direction */
+  "      float diffuse_factor = max (0.0, dot (light_direction, normal));\n"
+  /* Skip the specular and diffuse terms if the vertex is not facing
+     the light */
+  "      if (diffuse_factor > 0.0)\n"
+  "        {\n"
+  /* Add the diffuse term */
+  "          lit_color += (diffuse_factor * mash_material.diffuse.rgb\n"
+  "                        * mash_directional_lights[base + 1].rgb);\n"
+  /* Add the specular term using the half vector as in the snippet
+     for a single light */
+  "          vec3 half_vector = normalize (light_direction\n"
+  "                                        + vec3 (0.0, 0.0, 1.0));\n"
+  "          float spec_factor = max (0.0, dot (half_vector, normal));\n"
+  "          float spec_power = pow (spec_factor,\n"
+  "                                  mash_material.shininess);\n"
+  "          lit_color += (mash_material.specular.rgb\n"
+  "                        * mash_directional_lights[base + 2].rgb\n"
+  "                        * spec_power);\n"
+  "        }\n"
+  /* Add it to the total computed color value */
+  "      cogl_color_out.xyz += lit_color;\n"
+  "    }\n"
+  ;
+
 static void
 mash_directional_light_class_init (MashDirectionalLightClass *klass)
 {
@@ -102,18 +136,14 @@ mash_directional_light_class_init (MashDirectionalLightClass *klass)
 
   light_class->generate_shader = mash_directional_light_generate_shader;
   light_class->update_uniforms = mash_directional_light_update_uniforms;
-
-  g_type_class_add_private (klass, sizeof (MashDirectionalLightPrivate));
 }
 
 static void
 mash_directional_light_init (MashDirectionalLight *self)
 {
-  MashDirectionalLightPrivate *priv;
-
-  priv = self->priv = MASH_DIRECTIONAL_LIGHT_GET_PRIVATE (self);
-
-  priv->uniform_locations_dirty = TRUE;
+  /* The directional light has no private data. The uniform locations
+     of the light in each program are kept by MashLight */
+  self->priv = NULL;
 }
 
 /**
@@ -136,19 +166,28 @@ mash_directional_light_generate_shader (MashLight *light,
                                         GString *uniform_source,
                                         GString *main_source)
 {
-  MashDirectionalLight *plight = MASH_DIRECTIONAL_LIGHT (light);
-  MashDirectionalLightPrivate *priv = plight->priv;
-
   MASH_LIGHT_CLASS (mash_directional_light_parent_class)
     ->generate_shader (light, uniform_source, main_source);
 
-  /* If the shader is being generated then the uniform locations also
-     need updating */
-  priv->uniform_locations_dirty = TRUE;
-
   mash_light_append_shader (light, uniform_source,
                             "uniform vec3 light_direction$;\n");
 
+  if (mash_light_get_static_parameters (light))
+    {
+      float ambient[3];
+
+      /* Leave out any terms that can't contribute. The ambient term
+         is summed with the other static lights by the light set */
+      _mash_light_append_static_terms (light, main_source,
+                                       "light_direction$",
+                                       !_mash_light_get_folded_ambient
+                                       (light, ambient));
+      mash_light_append_shader (light, main_source,
+                                "  cogl_color_out.xyz += lit_color$;\n");
+
+      return;
+    }
+
   mash_light_append_shader (light, main_source, mash_directional_light_shader);
 }
 
@@ -156,30 +195,49 @@ static void
 mash_directional_light_update_uniforms (MashLight *light,
                                         CoglHandle program)
 {
-  MashDirectionalLight *dlight = MASH_DIRECTIONAL_LIGHT (light);
-  MashDirectionalLightPrivate *priv = dlight->priv;
   /* The light is assumed to always be pointing directly down. This
      can be modified by rotating the actor */
   static const float light_direction[4] = { 0.0f, -1.0f, 0.0f, 0.0f };
+  MashLightProgramState *state = _mash_light_get_program_state (light);
 
   MASH_LIGHT_CLASS (mash_directional_light_parent_class)
     ->update_uniforms (light, program);
 
-  if (priv->uniform_locations_dirty)
-    {
-      priv->light_direction_uniform_location
-        = mash_light_get_uniform_location (light, program, "light_direction");
-      priv->uniform_locations_dirty = FALSE;
-    }
+  if (!state->initialized)
+    state->locations[MASH_LIGHT_UNIFORM_LIGHT_DIRECTION]
+      = mash_light_get_uniform_location (light, program, "light_direction");
+
+  /* The direction only changes with the transformation of the
+     light */
+  if (_mash_light_transform_changed (light))
+    mash_light_set_direction_uniform (light,
+                                      program,
+                                      state->locations
+                                      [MASH_LIGHT_UNIFORM_LIGHT_DIRECTION],
+                                      light_direction);
+}
+
+void
+_mash_directional_light_generate_array_shader (int capacity,
+                                               GString *uniform_source,
+                                               GString *main_source)
+{
+  g_string_append_printf (uniform_source,
+                          "const int mash_max_directional_lights = %i;\n",
+                          capacity);
+  g_string_append (uniform_source, mash_directional_light_array_uniforms);
+  g_string_append (main_source, mash_directional_light_array_shader);
+}
+
+void
+_mash_directional_light_get_block (MashDirectionalLight *light,
+                                   float *block)
+{
+  float *direction = block + MASH_LIGHT_COLOR_BLOCK_SIZE * 4;
 
-  /* I can't think of a good way to recognise when the transformation
-     of the actor may have changed so this just always updates the
-     light direction. Any transformations in the parent hierarchy
-     could cause the transformation to change without affecting the
-     allocation */
+  _mash_light_get_color_block (MASH_LIGHT (light), block);
 
-  mash_light_set_direction_uniform (light,
-                                    program,
-                                    priv->light_direction_uniform_location,
-                                    light_direction);
+  /* The xyz of the direction is filled in by the light set. The light
+     points along the negative y axis */
+  direction[3] = 0.0f;
 }
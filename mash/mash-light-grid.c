@@ -0,0 +1,530 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mash-light-grid.h"
+
+#define MASH_LIGHT_GRID_TILES_X 16
+#define MASH_LIGHT_GRID_TILES_Y 8
+#define MASH_LIGHT_GRID_SLICES 24
+#define MASH_LIGHT_GRID_SLICE_SIZE \
+  (MASH_LIGHT_GRID_TILES_X * MASH_LIGHT_GRID_TILES_Y)
+#define MASH_LIGHT_GRID_N_CLUSTERS \
+  (MASH_LIGHT_GRID_SLICE_SIZE * MASH_LIGHT_GRID_SLICES)
+
+/* The number of lights that can be listed for each cluster. If more
+   lights touch a cluster then the cluster is marked as overflowed and
+   a gather touching it returns every light instead. The count for
+   each cluster is stored in a guint8 so this can't be more than 254 */
+#define MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER 32
+#define MASH_LIGHT_GRID_OVERFLOWED (MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER + 1)
+
+/* The grid is built by the calling thread plus up to this many
+   worker threads shared by all of the grids */
+#define MASH_LIGHT_GRID_MAX_WORKERS 3
+
+/* With fewer lights than this it isn't worth waking up the workers */
+#define MASH_LIGHT_GRID_MIN_THREADED_LIGHTS 32
+
+/* The worker threads are started the first time a grid is built with
+   enough lights and then live for the rest of the process. Handing
+   them a build only touches this preallocated state so that
+   rebuilding the grid while painting never allocates */
+typedef struct
+{
+  /* Serializes builds from different threads because there is only
+     one set of workers */
+  GMutex build_mutex;
+
+  /* Protects the rest of the fields */
+  GMutex mutex;
+  /* Signalled when a build is handed to the workers */
+  GCond start_cond;
+  /* Signalled when the last worker finishes its share of a build */
+  GCond done_cond;
+  /* Incremented for every build so that a worker can tell a new build
+     from a spurious wakeup */
+  guint generation;
+  /* The grid being built */
+  MashLightGrid *grid;
+  int n_threads;
+  int n_done;
+} MashLightGridWorkers;
+
+struct _MashLightGrid
+{
+  /* The terms of the projection matrix needed to map eye space to
+     normalized device coordinates */
+  float xx, xz, yy, yz;
+  gboolean perspective;
+  float near, far;
+  /* Multiplier to convert log (depth / near) into a slice number */
+  float slice_scale;
+  float slice_depths[MASH_LIGHT_GRID_SLICES + 1];
+
+  /* The number of lights and the spheres passed to the last
+     _mash_light_grid_build(). The spheres are only valid during the
+     build */
+  int n_lights;
+  const float *spheres;
+  int stride;
+
+  /* A fixed-size list of light indices for each cluster */
+  guint16 *cluster_lights;
+  guint8 *cluster_counts;
+
+  /* Lights with an unbounded range. These are returned from every
+     gather */
+  int *global_lights;
+  int n_global_lights;
+
+  /* Used to avoid returning a light twice from a gather. A light has
+     already been added if its stamp matches the current stamp */
+  guint *light_stamps;
+  guint stamp;
+
+  /* The allocated size of global_lights and light_stamps. These only
+     grow so that rebuilding the grid doesn't normally allocate */
+  int lights_size;
+};
+
+static MashLightGridWorkers mash_light_grid_workers;
+
+static int
+mash_light_grid_get_slice (MashLightGrid *grid,
+                           float depth)
+{
+  int slice;
+
+  if (depth <= grid->near)
+    return 0;
+
+  slice = (int) (logf (depth / grid->near) * grid->slice_scale);
+
+  return CLAMP (slice, 0, MASH_LIGHT_GRID_SLICES - 1);
+}
+
+static int
+mash_light_grid_get_tile (float ndc,
+                          int n_tiles)
+{
+  int tile = (int) floorf ((ndc + 1.0f) * 0.5f * n_tiles);
+
+  return CLAMP (tile, 0, n_tiles - 1);
+}
+
+/* Calculates the range of tiles touched by the given box. The depths
+   must be positive. Returns FALSE if the box is entirely off screen */
+static gboolean
+mash_light_grid_get_tile_range (MashLightGrid *grid,
+                                float x_min, float x_max,
+                                float y_min, float y_max,
+                                float depth_min, float depth_max,
+                                int *tile_x1, int *tile_x2,
+                                int *tile_y1, int *tile_y2)
+{
+  float u_min, u_max, v_min, v_max;
+  float ndc_a, ndc_b, ndc_min, ndc_max;
+
+  /* Dividing by the depth is monotonic in both the coordinate and the
+     depth so the extremes are always at the corners */
+  u_min = MIN (x_min / depth_min, x_min / depth_max);
+  u_max = MAX (x_max / depth_min, x_max / depth_max);
+  v_min = MIN (y_min / depth_min, y_min / depth_max);
+  v_max = MAX (y_max / depth_min, y_max / depth_max);
+
+  ndc_a = grid->xx * u_min - grid->xz;
+  ndc_b = grid->xx * u_max - grid->xz;
+  ndc_min = MIN (ndc_a, ndc_b);
+  ndc_max = MAX (ndc_a, ndc_b);
+
+  if (ndc_max < -1.0f || ndc_min > 1.0f)
+    return FALSE;
+
+  *tile_x1 = mash_light_grid_get_tile (ndc_min, MASH_LIGHT_GRID_TILES_X);
+  *tile_x2 = mash_light_grid_get_tile (ndc_max, MASH_LIGHT_GRID_TILES_X);
+
+  /* The y axis may be flipped if rendering to an offscreen buffer */
+  ndc_a = grid->yy * v_min - grid->yz;
+  ndc_b = grid->yy * v_max - grid->yz;
+  ndc_min = MIN (ndc_a, ndc_b);
+  ndc_max = MAX (ndc_a, ndc_b);
+
+  if (ndc_max < -1.0f || ndc_min > 1.0f)
+    return FALSE;
+
+  *tile_y1 = mash_light_grid_get_tile (ndc_min, MASH_LIGHT_GRID_TILES_Y);
+  *tile_y2 = mash_light_grid_get_tile (ndc_max, MASH_LIGHT_GRID_TILES_Y);
+
+  return TRUE;
+}
+
+/* Bins all of the lights into every step'th slice starting from
+   first_slice. Each slice is only ever written by one thread so this
+   doesn't need any locking */
+static void
+mash_light_grid_bin_slices (MashLightGrid *grid,
+                            int first_slice,
+                            int step)
+{
+  int slice, i;
+
+  for (slice = first_slice; slice < MASH_LIGHT_GRID_SLICES; slice += step)
+    {
+      float slice_near = grid->slice_depths[slice];
+      float slice_far = grid->slice_depths[slice + 1];
+      guint8 *counts =
+        grid->cluster_counts + slice * MASH_LIGHT_GRID_SLICE_SIZE;
+      guint16 *lights =
+        grid->cluster_lights + (slice * MASH_LIGHT_GRID_SLICE_SIZE
+                                * MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER);
+
+      memset (counts, 0, MASH_LIGHT_GRID_SLICE_SIZE);
+
+      for (i = 0; i < grid->n_lights; i++)
+        {
+          const float *sphere = grid->spheres + i * grid->stride;
+          float radius = sphere[3];
+          float depth = -sphere[2];
+          float depth_min, depth_max;
+          int x1, x2, y1, y2, x, y;
+
+          if (radius < 0.0f)
+            continue;
+
+          /* Clip the depth range of the sphere to the slice so that
+             the tile range is as tight as possible */
+          depth_min = MAX (depth - radius, slice_near);
+          depth_max = MIN (depth + radius, slice_far);
+
+          if (depth_min > depth_max)
+            continue;
+
+          if (!mash_light_grid_get_tile_range (grid,
+                                               sphere[0] - radius,
+                                               sphere[0] + radius,
+                                               sphere[1] - radius,
+                                               sphere[1] + radius,
+                                               depth_min, depth_max,
+                                               &x1, &x2, &y1, &y2))
+            continue;
+
+          for (y = y1; y <= y2; y++)
+            for (x = x1; x <= x2; x++)
+              {
+                int cluster = y * MASH_LIGHT_GRID_TILES_X + x;
+
+                if (counts[cluster] < MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER)
+                  lights[cluster * MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER
+                         + counts[cluster]++] = i;
+                else
+                  /* Dropping the light would silently lose it for
+                     every actor in the cluster */
+                  counts[cluster] = MASH_LIGHT_GRID_OVERFLOWED;
+              }
+        }
+    }
+}
+
+static gpointer
+mash_light_grid_worker_thread (gpointer user_data)
+{
+  MashLightGridWorkers *workers = &mash_light_grid_workers;
+  int index = GPOINTER_TO_INT (user_data);
+  guint generation = 0;
+
+  while (TRUE)
+    {
+      MashLightGrid *grid;
+
+      g_mutex_lock (&workers->mutex);
+      while (workers->generation == generation)
+        g_cond_wait (&workers->start_cond, &workers->mutex);
+      generation = workers->generation;
+      grid = workers->grid;
+      g_mutex_unlock (&workers->mutex);
+
+      /* The calling thread takes the first share of the slices */
+      mash_light_grid_bin_slices (grid,
+                                  index + 1,
+                                  workers->n_threads + 1);
+
+      g_mutex_lock (&workers->mutex);
+      if (++workers->n_done == workers->n_threads)
+        g_cond_signal (&workers->done_cond);
+      g_mutex_unlock (&workers->mutex);
+    }
+
+  return NULL;
+}
+
+/* Starts the worker threads the first time it is called. Returns the
+   number of workers, which is 0 if the grids should be built on the
+   calling thread only */
+static int
+mash_light_grid_get_workers (void)
+{
+  static gsize initialized = 0;
+  MashLightGridWorkers *workers = &mash_light_grid_workers;
+
+  if (g_once_init_enter (&initialized))
+    {
+      int n_threads = CLAMP ((int) g_get_num_processors () - 1,
+                             0, MASH_LIGHT_GRID_MAX_WORKERS);
+      int i;
+
+      for (i = 0; i < n_threads; i++)
+        {
+          GThread *thread = g_thread_try_new ("mash-light-grid",
+                                              mash_light_grid_worker_thread,
+                                              GINT_TO_POINTER (i),
+                                              NULL);
+
+          /* The threads are never joined */
+          if (thread == NULL)
+            break;
+          g_thread_unref (thread);
+        }
+
+      workers->n_threads = i;
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return workers->n_threads;
+}
+
+/* Bins the lights on the calling thread and the worker threads and
+   waits for them to finish */
+static void
+mash_light_grid_bin_threaded (MashLightGrid *grid)
+{
+  MashLightGridWorkers *workers = &mash_light_grid_workers;
+
+  g_mutex_lock (&workers->build_mutex);
+
+  g_mutex_lock (&workers->mutex);
+  workers->grid = grid;
+  workers->n_done = 0;
+  workers->generation++;
+  g_cond_broadcast (&workers->start_cond);
+  g_mutex_unlock (&workers->mutex);
+
+  mash_light_grid_bin_slices (grid, 0, workers->n_threads + 1);
+
+  g_mutex_lock (&workers->mutex);
+  while (workers->n_done < workers->n_threads)
+    g_cond_wait (&workers->done_cond, &workers->mutex);
+  workers->grid = NULL;
+  g_mutex_unlock (&workers->mutex);
+
+  g_mutex_unlock (&workers->build_mutex);
+}
+
+MashLightGrid *
+_mash_light_grid_new (void)
+{
+  MashLightGrid *grid = g_slice_new0 (MashLightGrid);
+
+  grid->cluster_lights = g_new (guint16,
+                                MASH_LIGHT_GRID_N_CLUSTERS
+                                * MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER);
+  grid->cluster_counts = g_new0 (guint8, MASH_LIGHT_GRID_N_CLUSTERS);
+
+  return grid;
+}
+
+void
+_mash_light_grid_free (MashLightGrid *grid)
+{
+  /* _mash_light_grid_build() waits for the workers so none of them
+     can still be using the grid */
+  g_free (grid->cluster_lights);
+  g_free (grid->cluster_counts);
+  g_free (grid->global_lights);
+  g_free (grid->light_stamps);
+
+  g_slice_free (MashLightGrid, grid);
+}
+
+static void
+mash_light_grid_set_projection (MashLightGrid *grid,
+                                const CoglMatrix *projection)
+{
+  int i;
+
+  grid->xx = projection->xx;
+  grid->xz = projection->xz;
+  grid->yy = projection->yy;
+  grid->yz = projection->yz;
+
+  /* Only a perspective projection with w = -z is supported */
+  grid->perspective = (fabsf (projection->wz + 1.0f) < 1e-5f &&
+                       projection->ww == 0.0f &&
+                       projection->zz != 1.0f &&
+                       projection->zz != -1.0f);
+
+  if (!grid->perspective)
+    return;
+
+  grid->near = projection->zw / (projection->zz - 1.0f);
+  grid->far = projection->zw / (projection->zz + 1.0f);
+
+  if (grid->near <= 0.0f || grid->far <= grid->near)
+    {
+      grid->perspective = FALSE;
+      return;
+    }
+
+  grid->slice_scale = MASH_LIGHT_GRID_SLICES / logf (grid->far / grid->near);
+
+  for (i = 0; i <= MASH_LIGHT_GRID_SLICES; i++)
+    grid->slice_depths[i] =
+      grid->near * powf (grid->far / grid->near,
+                         i / (float) MASH_LIGHT_GRID_SLICES);
+}
+
+void
+_mash_light_grid_build (MashLightGrid *grid,
+                        const CoglMatrix *projection,
+                        int n_lights,
+                        const float *spheres,
+                        int stride)
+{
+  int i;
+
+  /* The cluster lists store the light indices in 16 bits */
+  n_lights = MIN (n_lights, G_MAXUINT16 + 1);
+
+  if (n_lights > grid->lights_size)
+    {
+      grid->lights_size = MAX (grid->lights_size * 2, n_lights);
+      grid->global_lights = g_renew (int,
+                                     grid->global_lights,
+                                     grid->lights_size);
+      g_free (grid->light_stamps);
+      grid->light_stamps = g_new0 (guint, grid->lights_size);
+      grid->stamp = 0;
+    }
+
+  mash_light_grid_set_projection (grid, projection);
+
+  grid->n_lights = n_lights;
+  grid->spheres = spheres;
+  grid->stride = stride;
+
+  grid->n_global_lights = 0;
+  for (i = 0; i < n_lights; i++)
+    if (!grid->perspective || spheres[i * stride + 3] < 0.0f)
+      grid->global_lights[grid->n_global_lights++] = i;
+
+  if (!grid->perspective)
+    memset (grid->cluster_counts, 0, MASH_LIGHT_GRID_N_CLUSTERS);
+  else if (n_lights >= MASH_LIGHT_GRID_MIN_THREADED_LIGHTS
+           && mash_light_grid_get_workers () > 0)
+    mash_light_grid_bin_threaded (grid);
+  else
+    mash_light_grid_bin_slices (grid, 0, 1);
+
+  grid->spheres = NULL;
+}
+
+int
+_mash_light_grid_gather (MashLightGrid *grid,
+                         const float *eye_min,
+                         const float *eye_max,
+                         int *lights_out,
+                         int max_lights)
+{
+  float depth_min, depth_max;
+  int n_out = 0;
+  int x1, x2, y1, y2, z1, z2, x, y, z, i;
+
+  /* Start a new set of stamps. If the counter wraps then all of the
+     old stamps need to be cleared */
+  if (++grid->stamp == 0)
+    {
+      memset (grid->light_stamps, 0, sizeof (guint) * grid->lights_size);
+      grid->stamp = 1;
+    }
+
+  for (i = 0; i < grid->n_global_lights && n_out < max_lights; i++)
+    lights_out[n_out++] = grid->global_lights[i];
+
+  if (!grid->perspective)
+    return n_out;
+
+  depth_min = MAX (-eye_max[2], grid->near);
+  depth_max = MIN (-eye_min[2], grid->far);
+
+  if (depth_min > depth_max ||
+      !mash_light_grid_get_tile_range (grid,
+                                       eye_min[0], eye_max[0],
+                                       eye_min[1], eye_max[1],
+                                       depth_min, depth_max,
+                                       &x1, &x2, &y1, &y2))
+    return n_out;
+
+  z1 = mash_light_grid_get_slice (grid, depth_min);
+  z2 = mash_light_grid_get_slice (grid, depth_max);
+
+  for (z = z1; z <= z2; z++)
+    for (y = y1; y <= y2; y++)
+      for (x = x1; x <= x2; x++)
+        {
+          int cluster = ((z * MASH_LIGHT_GRID_TILES_Y + y)
+                         * MASH_LIGHT_GRID_TILES_X + x);
+          const guint16 *lights =
+            grid->cluster_lights
+            + cluster * MASH_LIGHT_GRID_MAX_LIGHTS_PER_CLUSTER;
+          int count = grid->cluster_counts[cluster];
+
+          /* The lights in an overflowed cluster aren't known so
+             every light has to be returned */
+          if (count == MASH_LIGHT_GRID_OVERFLOWED)
+            {
+              for (i = 0; i < grid->n_lights && i < max_lights; i++)
+                lights_out[i] = i;
+
+              return i;
+            }
+
+          for (i = 0; i < count; i++)
+            {
+              int light = lights[i];
+
+              if (grid->light_stamps[light] == grid->stamp)
+                continue;
+
+              if (n_out >= max_lights)
+                return n_out;
+
+              grid->light_stamps[light] = grid->stamp;
+              lights_out[n_out++] = light;
+            }
+        }
+
+  return n_out;
+}
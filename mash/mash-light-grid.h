@@ -0,0 +1,68 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_LIGHT_GRID_H__
+#define __MASH_LIGHT_GRID_H__
+
+#include <cogl/cogl.h>
+
+G_BEGIN_DECLS
+
+/* MashLightGrid is used by MashLightSet in
+   MASH_LIGHT_SET_MODE_CLUSTERED mode. It divides the view frustum
+   into a grid of clusters. The clusters are tiles in screen space and
+   exponentially sized slices in depth. Each light is binned into the
+   clusters touched by the sphere bounding its range so that the
+   lights affecting a region of eye space can be found without
+   looking at every light. */
+
+typedef struct _MashLightGrid MashLightGrid;
+
+MashLightGrid *_mash_light_grid_new (void);
+
+void _mash_light_grid_free (MashLightGrid *grid);
+
+/* Rebuilds the grid. @spheres starts with four floats for each light
+   giving the eye space position and the radius. Consecutive lights
+   are @stride floats apart. A negative radius means that the light
+   affects everything. The projection must be a perspective
+   projection, otherwise every light will be treated as affecting
+   everything. */
+void _mash_light_grid_build (MashLightGrid *grid,
+                             const CoglMatrix *projection,
+                             int n_lights,
+                             const float *spheres,
+                             int stride);
+
+/* Fills @lights_out with the indices of the lights whose spheres may
+   intersect the given eye space bounding box, without duplicates. At
+   most @max_lights are stored. Returns the number of lights
+   stored. */
+int _mash_light_grid_gather (MashLightGrid *grid,
+                             const float *eye_min,
+                             const float *eye_max,
+                             int *lights_out,
+                             int max_lights);
+
+G_END_DECLS
+
+#endif /* __MASH_LIGHT_GRID_H__ */
@@ -0,0 +1,264 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_LIGHT_PRIVATE_H__
+#define __MASH_LIGHT_PRIVATE_H__
+
+#include "mash-light.h"
+#include "mash-point-light.h"
+#include "mash-spot-light.h"
+#include "mash-directional-light.h"
+#include "mash-light-set.h"
+#include "mash-render-stats-private.h"
+
+/* SSE intrinsics are used for some of the per-light maths if the
+   compiler is targeting a processor that has them */
+#if defined (HAVE_XMMINTRIN_H) && defined (__SSE__)
+#define MASH_USE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+G_BEGIN_DECLS
+
+/* These are used by MashLightSet when it is in
+   MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS mode. In that mode the built-in
+   light types don't generate a snippet for each light. Instead the
+   light set generates a single loop for each light type which reads
+   the light parameters from an array of vec4s. Each light is packed
+   into a block of the given number of vec4s */
+
+/* The _mash_*_light_get_block() functions fill in everything in the
+   block except for the eye space position and direction of the
+   light. The light set calculates those for all of the lights of a
+   type at once using _mash_light_get_eye_transform() */
+
+/* The number of vec4s used by _mash_light_get_color_block(). These
+   are always stored at the start of a light's block */
+#define MASH_LIGHT_COLOR_BLOCK_SIZE 3
+
+/* ambient, diffuse, specular, position, attenuation */
+#define MASH_POINT_LIGHT_BLOCK_SIZE (MASH_LIGHT_COLOR_BLOCK_SIZE + 2)
+/* ambient, diffuse, specular, position + cos cutoff, attenuation,
+   direction + exponent */
+#define MASH_SPOT_LIGHT_BLOCK_SIZE (MASH_POINT_LIGHT_BLOCK_SIZE + 1)
+/* ambient, diffuse, specular, direction */
+#define MASH_DIRECTIONAL_LIGHT_BLOCK_SIZE (MASH_LIGHT_COLOR_BLOCK_SIZE + 1)
+
+void _mash_light_get_color_block (MashLight *light,
+                                  float *block);
+
+void _mash_light_get_eye_direction (MashLight *light,
+                                    const float *direction_in,
+                                    float *direction_out);
+
+/* Stores the translation column of the light's modelview matrix in
+   @translation and returns its normal matrix. The eye space position
+   of the light is the translation divided by its w component and the
+   eye space direction of a vector is the normal matrix multiplied by
+   the vector and normalized. Both matrices are only recalculated when
+   the transformation changes */
+const float *_mash_light_get_eye_transform (MashLight *light,
+                                            float *translation);
+
+/* Recalculates the cached matrices of any of @lights whose
+   transformation has changed. Walking up to the stage is shared
+   between consecutive lights with the same parent so that animating
+   many lights in one container only walks the hierarchy once */
+void _mash_light_ensure_eye_transforms (MashLight * const *lights,
+                                        int n_lights);
+
+/* Lights tell each light set they have been added to whenever
+   anything that affects the lighting changes. This includes the
+   light's properties, its visibility and the transformation of the
+   light or any of its ancestors. Changes to the properties are
+   picked up from the notify signal so a subclass only needs to call
+   g_object_notify() when one of its own parameters changes */
+typedef enum
+{
+  /* The transformation changed so only the uniforms need updating */
+  MASH_LIGHT_CHANGE_STATE,
+  /* The light was shown or hidden. Lights in the arrays only need
+     repacking but any other light adds or removes its snippet */
+  MASH_LIGHT_CHANGE_VISIBILITY,
+  /* One of the parameters of the light changed. If the light has
+     static parameters then the shader needs regenerating */
+  MASH_LIGHT_CHANGE_PARAMETERS,
+  /* The shader always needs regenerating */
+  MASH_LIGHT_CHANGE_SHADER
+} MashLightChange;
+
+void _mash_light_add_light_set (MashLight *light,
+                                MashLightSet *light_set);
+void _mash_light_remove_light_set (MashLight *light,
+                                   MashLightSet *light_set);
+
+void _mash_light_set_light_changed (MashLightSet *light_set,
+                                    MashLight *light,
+                                    MashLightChange change);
+
+/* Returns a number that changes whenever the modelview matrix of the
+   light may have changed */
+guint _mash_light_get_transform_serial (MashLight *light);
+
+/* Indices into the locations of MashLightProgramState. Each built-in
+   light type uses the indices after the ones of its parent type */
+enum
+{
+  /* The ambient, diffuse and specular colors of every light */
+  MASH_LIGHT_UNIFORM_AMBIENT,
+  MASH_LIGHT_UNIFORM_DIFFUSE,
+  MASH_LIGHT_UNIFORM_SPECULAR,
+
+  /* MashDirectionalLight */
+  MASH_LIGHT_UNIFORM_LIGHT_DIRECTION = MASH_LIGHT_UNIFORM_SPECULAR + 1,
+
+  /* MashPointLight */
+  MASH_LIGHT_UNIFORM_ATTENUATION = MASH_LIGHT_UNIFORM_SPECULAR + 1,
+  MASH_LIGHT_UNIFORM_LIGHT_EYE_COORD,
+
+  /* MashSpotLight */
+  MASH_LIGHT_UNIFORM_SPOT_COS_CUTOFF,
+  MASH_LIGHT_UNIFORM_SPOT_EXPONENT,
+  MASH_LIGHT_UNIFORM_SPOT_DIRECTION,
+
+  MASH_LIGHT_N_UNIFORMS
+};
+
+/* The uniform locations of a light in one program and the serials of
+   the light when its values were last uploaded to them. The light set
+   keeps one of these for each light in each of its programs so that
+   switching to another cached program doesn't need to query the
+   locations again or upload values that haven't changed */
+typedef struct
+{
+  /* FALSE until the uniforms of the program have been updated once.
+     Until then the locations haven't been queried and all of the
+     values need uploading */
+  gboolean initialized;
+  int locations[MASH_LIGHT_N_UNIFORMS];
+  guint parameters_serial;
+  guint transform_serial;
+} MashLightProgramState;
+
+/* Calls the update_uniforms virtual with @state as the state of the
+   light in @program and then records that @state is up to date */
+void _mash_light_update_program_uniforms (MashLight *light,
+                                          CoglHandle program,
+                                          MashLightProgramState *state);
+
+/* These can be used within the update_uniforms virtual of the
+   built-in light types. They return the state of the light in the
+   program being updated and whether the parameters or the
+   transformation of the light have changed since they were last
+   uploaded to it. Both are TRUE the first time the program is
+   updated */
+MashLightProgramState *_mash_light_get_program_state (MashLight *light);
+gboolean _mash_light_parameters_changed (MashLight *light);
+gboolean _mash_light_transform_changed (MashLight *light);
+
+/* Appends a GLSL literal for a float or a vec3 to @string */
+void _mash_append_glsl_float (GString *string,
+                              float value);
+void _mash_append_glsl_vec3 (GString *string,
+                             const float *value);
+
+/* These are used when a light has static parameters. The colors are
+   then declared as constants instead of uniforms.
+   _mash_light_append_static_terms() appends the part of the snippet
+   that declares lit_color$ and adds the ambient, diffuse and specular
+   terms for the given light vector, leaving out any terms whose color
+   is black. If @include_ambient is FALSE the ambient term is left out
+   because the light set has added it to the sum returned by
+   _mash_light_get_folded_ambient() */
+void _mash_light_append_static_terms (MashLight *light,
+                                      GString *main_source,
+                                      const char *light_vector,
+                                      gboolean include_ambient);
+gboolean _mash_light_get_folded_ambient (MashLight *light,
+                                         float *ambient);
+
+/* Calculates a matrix suitable for transforming directions from the
+   upper 3x3 of a modelview matrix. Both matrices are in column-major
+   order. The result is only correct up to a scale so the transformed
+   directions need to be normalized. Returns TRUE if the general case
+   was needed and the matrix was inverted or FALSE if the matrix was a
+   rotation with a uniform scale that could be used directly. Only the
+   inversions are counted in n_matrix_inversions of the render
+   stats */
+gboolean _mash_calculate_normal_matrix (const float *m,
+                                        float *normal_matrix);
+
+void _mash_point_light_generate_array_shader (int capacity,
+                                              GString *uniform_source,
+                                              GString *main_source);
+void _mash_point_light_get_block (MashPointLight *light,
+                                  float *block);
+
+/* Returns TRUE if the attenuation is not the default of 1, 0, 0 */
+gboolean _mash_point_light_is_attenuated (MashPointLight *light);
+
+void _mash_spot_light_generate_array_shader (int capacity,
+                                             GString *uniform_source,
+                                             GString *main_source);
+void _mash_spot_light_get_block (MashSpotLight *light,
+                                 float *block);
+
+void _mash_directional_light_generate_array_shader (int capacity,
+                                                    GString *uniform_source,
+                                                    GString *main_source);
+void _mash_directional_light_get_block (MashDirectionalLight *light,
+                                        float *block);
+
+/* The normal matrix calculated from the upper 3x3 of a modelview
+   matrix. An actor can keep one of these and pass it to
+   _mash_light_set_set_normal_matrix_cache() so that the normal matrix
+   is only recalculated when the actor's transformation changes. The
+   cache should be zero-initialized */
+typedef struct
+{
+  float modelview[3 * 3];
+  float normal_matrix[3 * 3];
+  gboolean valid;
+} MashNormalMatrixCache;
+
+void _mash_light_set_set_normal_matrix_cache (MashLightSet *light_set,
+                                              MashNormalMatrixCache *cache);
+
+/* This can be called before mash_light_set_begin_paint() to give the
+   bounding box of the vertices that are about to be painted in the
+   current modelview coordinates. It only affects the next call to
+   mash_light_set_begin_paint(). In MASH_LIGHT_SET_MODE_CLUSTERED mode
+   it is used to pick the lights that can affect the actor */
+void _mash_light_set_set_paint_bounds (MashLightSet *light_set,
+                                       const ClutterVertex *min_vertex,
+                                       const ClutterVertex *max_vertex);
+
+/* Adds the draws, triangles, vertices, pick passes and paint time
+   counted in _mash_render_stats since it had the values in @before to
+   the render stats of @light_set. MashModel uses this to count the
+   work done for the models that use the light set */
+void _mash_light_set_count_draws (MashLightSet *light_set,
+                                  const MashRenderStats *before);
+
+G_END_DECLS
+
+#endif /* __MASH_LIGHT_PRIVATE_H__ */
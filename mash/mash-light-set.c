@@ -63,14 +63,29 @@
 #define COGL_ENABLE_EXPERIMENTAL_API
 
 #include <clutter/clutter.h>
+#include <string.h>
+#include <math.h>
 
 #include "mash-light-set.h"
 #include "mash-light.h"
+#include "mash-light-private.h"
+#include "mash-light-grid.h"
+#include "mash-render-stats-private.h"
+#include "mash-trace.h"
+#include "mash-enum-types.h"
 
 static void mash_light_set_dispose (GObject *object);
 static void mash_light_set_finalize (GObject *object);
 
-static gboolean mash_light_set_repaint_func (gpointer data);
+static void mash_light_set_get_property (GObject *object,
+                                         guint prop_id,
+                                         GValue *value,
+                                         GParamSpec *pspec);
+static void mash_light_set_set_property (GObject *object,
+                                         guint prop_id,
+                                         const GValue *value,
+                                         GParamSpec *pspec);
+
 
 static float mash_light_set_get_shininess_wrapper (CoglMaterial *material);
 
@@ -126,36 +141,331 @@ mash_light_set_material_properties[] =
     }
   };
 
-struct _MashLightSetPrivate
+typedef void (* ArrayShaderFunc) (int capacity,
+                                  GString *uniform_source,
+                                  GString *main_source);
+
+typedef void (* ArrayBlockFunc) (MashLight *light,
+                                 float *block);
+
+/* The light types that are evaluated from uniform arrays when the
+   light set is in MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS or
+   MASH_LIGHT_SET_MODE_CLUSTERED mode. The positional light types must
+   come first because only those can be culled */
+static struct
 {
-  CoglHandle program;
+  GType (* get_type) (void);
+  /* Number of vec4s used for each light */
+  int block_size;
+  const char *count_uniform_name;
+  const char *array_uniform_name;
+  ArrayShaderFunc generate_shader;
+  ArrayBlockFunc get_block;
+  /* The vec4 in the block that holds the eye space position or -1 if
+     the light has no position */
+  int position_offset;
+  /* The vec4 in the block that holds the eye space direction or -1 if
+     the light has no direction. The light points along the y axis in
+     the direction given by the sign */
+  int direction_offset;
+  float direction_sign;
+}
+mash_light_set_array_types[] =
+  {
+    {
+      mash_point_light_get_type,
+      MASH_POINT_LIGHT_BLOCK_SIZE,
+      "mash_n_point_lights",
+      "mash_point_lights",
+      _mash_point_light_generate_array_shader,
+      (ArrayBlockFunc) _mash_point_light_get_block,
+      MASH_LIGHT_COLOR_BLOCK_SIZE,
+      -1, 0.0f
+    },
+    {
+      mash_spot_light_get_type,
+      MASH_SPOT_LIGHT_BLOCK_SIZE,
+      "mash_n_spot_lights",
+      "mash_spot_lights",
+      _mash_spot_light_generate_array_shader,
+      (ArrayBlockFunc) _mash_spot_light_get_block,
+      MASH_LIGHT_COLOR_BLOCK_SIZE,
+      MASH_POINT_LIGHT_BLOCK_SIZE, 1.0f
+    },
+    {
+      mash_directional_light_get_type,
+      MASH_DIRECTIONAL_LIGHT_BLOCK_SIZE,
+      "mash_n_directional_lights",
+      "mash_directional_lights",
+      _mash_directional_light_generate_array_shader,
+      (ArrayBlockFunc) _mash_directional_light_get_block,
+      -1,
+      MASH_LIGHT_COLOR_BLOCK_SIZE, -1.0f
+    }
+  };
+
+#define MASH_LIGHT_SET_N_ARRAY_TYPES G_N_ELEMENTS (mash_light_set_array_types)
 
-  /* This is the layer indices that the pipeline contained the last
-   * time the program was generated. If these change then we need to
-   * regenerate the program */
+/* The number of array types that have a position and a range */
+#define MASH_LIGHT_SET_N_POSITIONAL_TYPES 2
+
+/* Indices of the positional types in the table above */
+#define MASH_LIGHT_SET_POINT_TYPE 0
+#define MASH_LIGHT_SET_SPOT_TYPE  1
+
+/* The number of floats stored for each light when the eye space
+   positions and directions are calculated. These are x, y, z and w
+   of the translation followed by x, y and z of the direction */
+#define MASH_LIGHT_SET_N_EYE_COMPONENTS 7
+
+/* The fixed capacity of the arrays in MASH_LIGHT_SET_MODE_CLUSTERED
+   mode. This is the maximum number of lights of each type that can
+   affect a single actor. It is kept small so that the arrays for all
+   of the types fit in the minimum number of uniforms that GLES2
+   guarantees for a vertex shader */
+#define MASH_LIGHT_SET_CLUSTER_CAPACITY 8
+
+/* The range of a light is the distance at which its attenuation
+   reaches this value. Beyond that the light can't make a visible
+   difference to an 8-bit color */
+#define MASH_LIGHT_SET_ATTENUATION_CUTOFF 256.0f
+
+typedef struct
+{
+  /* The eye-space position and range of the light. The range is
+     negative if the light is never attenuated */
+  float sphere[4];
+  /* The eye-space direction and cosine of the cutoff angle of a spot
+     light. The cosine is negative if the cone can't be used for
+     culling */
+  float cone[4];
+} MashLightSetLightBounds;
+
+/* The smallest capacity of the uniform arrays. The arrays are always
+   generated for all of the light types so that the first light of a
+   type can be added without regenerating the program */
+#define MASH_LIGHT_SET_MIN_ARRAY_CAPACITY 4
+
+/* The default number of programs that will be kept in the cache of
+   programs for different layer layouts. If more layouts than this are
+   used then the least recently used program will be thrown away.
+   When the number of lights per actor is limited each layout may need
+   a program for each variant so this leaves room for that.
+   mash_light_set_prepare() grows the cache if it prepares more
+   programs than this */
+#define MASH_LIGHT_SET_MAX_PROGRAMS 16
+
+/* The largest value for the max-lights property. The programs are
+   generated with room for 1, 2, 4 or 8 positional lights so that
+   actors affected by only a few lights use a shorter shader */
+#define MASH_LIGHT_SET_MAX_TOP_LIGHTS 8
+
+/* When lights are folded into the ambient term their diffuse color is
+   scaled by this. It is the average of the diffuse factor over all
+   possible normal directions */
+#define MASH_LIGHT_SET_FOLDED_DIFFUSE_SCALE 0.25f
+
+typedef struct
+{
+  /* The layer indices that the pipeline contained when this program
+     was generated */
   GArray *layer_indices;
 
-  GSList *lights;
+  /* The capacity of the positional light arrays when the number of
+     lights per actor is limited or 0 otherwise */
+  int variant;
 
-  guint repaint_func_id;
+  CoglHandle program;
 
   int normal_matrix_uniform;
 
   int material_uniforms[G_N_ELEMENTS (mash_light_set_material_properties)];
 
-  /* Set to TRUE at the beginning of every paint so that we know we
-     need to update the uniforms on the program before painting any
+  /* The material values that were last uploaded to the program. Bit
+     n of material_values_valid is set if material_values[n] has been
+     uploaded */
+  float material_values[G_N_ELEMENTS (mash_light_set_material_properties)][4];
+  guint material_values_valid;
+
+  int array_count_uniforms[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  int array_uniforms[MASH_LIGHT_SET_N_ARRAY_TYPES];
+
+  /* The location of the mash_light_enabled array used to skip culled
+     lights in MASH_LIGHT_SET_MODE_PER_LIGHT mode */
+  int light_enabled_uniform;
+
+  /* The lights that were last picked for an actor painted with this
+     program so that consecutive actors affected by the same lights
+     don't need to reupload. This is not valid if the light data has
+     changed since */
+  GArray *draw_lights;
+  gboolean draw_lights_valid;
+
+  /* The locations and last uploaded values of the uniforms for the
+     lights that didn't make it into the arrays when the number of
+     lights is limited. The first is multiplied by the ambient color
+     of the material and the second by the diffuse color */
+  int folded_uniforms[2];
+  float folded_values[2][3];
+  gboolean folded_values_valid;
+
+  /* The normal matrix that was last uploaded to this program so that
+     it doesn't need to be uploaded again if it hasn't changed */
+  float normal_matrix[3 * 3];
+  gboolean normal_matrix_valid;
+
+  /* A MashLightProgramState for each light that adds its own snippet
+     to the program, in the order of the light list. This remembers
+     the uniform locations of each light in this program and which of
+     its values have been uploaded so that switching between cached
+     programs doesn't need to query the locations again. The set of
+     lights with a snippet can't change without regenerating all of
+     the programs so the indices stay valid */
+  GArray *light_states;
+
+  /* Set to TRUE whenever one of the lights changes so that we know
+     we need to update the uniforms on the program before painting any
      actor */
   gboolean uniforms_dirty;
+} MashLightSetProgram;
+
+struct _MashLightSetPrivate
+{
+  /* A cache of programs for each combination of layer indices that
+     the light set has been used with. The most recently used program
+     is at the front of the list */
+  GSList *programs;
+  /* The number of programs to keep in the cache */
+  guint max_programs;
+
+  /* This is used to collect the layer indices of the material that
+     is about to be painted. It is kept around so that we don't need
+     to allocate it on every paint */
+  GArray *layer_indices;
+
+  GSList *lights;
+
+  MashLightSetMode mode;
+
+  /* The maximum number of positional lights used for each actor or 0
+     if there is no limit */
+  int max_lights;
+
+  /* The number of lights of each type that the uniform arrays in the
+     program can hold. This only ever grows so that lights can come
+     and go without regenerating the program */
+  int array_capacities[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  /* The packed light parameters for each type and the number of
+     lights packed into each array */
+  GArray *array_data[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  int array_counts[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  /* Set to TRUE whenever the lights may have changed so that the
+     arrays and the light bounds need to be recalculated */
+  gboolean light_data_dirty;
+
+  /* The bounds of every light that can be culled. In the array modes
+     there is one for each packed positional light in the order they
+     are packed. In MASH_LIGHT_SET_MODE_PER_LIGHT mode there is one for
+     each point or spot light in the order of the list of lights */
+  GArray *light_bounds;
+
+  /* Scratch space used to pack the lights of one type. The eye space
+     data has a separate array for each component */
+  GPtrArray *pack_lights;
+  GArray *eye_data;
+
+  /* The cluster grid used in MASH_LIGHT_SET_MODE_CLUSTERED mode. This
+     is created the first time it is needed */
+  MashLightGrid *grid;
+
+  /* Scratch space for the lights picked for an actor and the data
+     that will be uploaded for them */
+  GArray *draw_lights;
+  GArray *draw_data[MASH_LIGHT_SET_N_POSITIONAL_TYPES];
+  GArray *draw_mask;
+
+  /* The eye space bounds of the actor about to be painted, which are
+     only valid if has_eye_bounds is TRUE */
+  gboolean has_eye_bounds;
+  float eye_bounds_min[3];
+  float eye_bounds_max[3];
+
+  /* The estimated contribution of each picked light and the light
+     that is folded into the ambient term when the number of lights is
+     limited */
+  GArray *draw_scores;
+  float folded_light[2][3];
+
+  /* Counters for mash_light_set_get_cull_stats() and
+     mash_light_set_get_n_uniform_uploads() */
+  guint n_lights_tested;
+  guint n_lights_culled;
+  guint n_uniform_uploads;
+
+  /* Counters for mash_light_set_get_compile_stats() */
+  guint n_compiles;
+  gdouble compile_time_total;
+  gdouble compile_time_max;
+
+  /* Counters for mash_light_set_get_render_stats(). The compiles and
+     uniform uploads are taken from the counters above instead */
+  MashRenderStats render_stats;
+
+  /* The cache given by _mash_light_set_set_normal_matrix_cache() for
+     the next paint or NULL to use the light set's own cache */
+  MashNormalMatrixCache *paint_normal_matrix_cache;
+  MashNormalMatrixCache normal_matrix_cache;
+
+  /* The bounds given by _mash_light_set_set_paint_bounds() */
+  gboolean has_paint_bounds;
+  float paint_bounds_min[3];
+  float paint_bounds_max[3];
 };
 
+enum
+  {
+    PROP_0,
+
+    PROP_MODE,
+    PROP_MAX_LIGHTS
+  };
+
 static void
 mash_light_set_class_init (MashLightSetClass *klass)
 {
   GObjectClass *gobject_class = (GObjectClass *) klass;
 
+  GParamSpec *pspec;
+
+  _mash_trace_init ();
+
   gobject_class->dispose = mash_light_set_dispose;
   gobject_class->finalize = mash_light_set_finalize;
+  gobject_class->get_property = mash_light_set_get_property;
+  gobject_class->set_property = mash_light_set_set_property;
+
+  pspec = g_param_spec_enum ("mode",
+                             "Mode",
+                             "How the program for the lights is generated",
+                             MASH_TYPE_LIGHT_SET_MODE,
+                             MASH_LIGHT_SET_MODE_PER_LIGHT,
+                             G_PARAM_READABLE | G_PARAM_WRITABLE
+                             | G_PARAM_STATIC_NAME
+                             | G_PARAM_STATIC_NICK
+                             | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class, PROP_MODE, pspec);
+
+  pspec = g_param_spec_uint ("max-lights",
+                             "Max lights",
+                             "The maximum number of point and spot lights "
+                             "used for each actor or 0 for no limit",
+                             0, MASH_LIGHT_SET_MAX_TOP_LIGHTS,
+                             0,
+                             G_PARAM_READABLE | G_PARAM_WRITABLE
+                             | G_PARAM_STATIC_NAME
+                             | G_PARAM_STATIC_NICK
+                             | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class, PROP_MAX_LIGHTS, pspec);
 
   g_type_class_add_private (klass, sizeof (MashLightSetPrivate));
 }
@@ -164,13 +474,34 @@ static void
 mash_light_set_init (MashLightSet *self)
 {
   MashLightSetPrivate *priv;
+  int i;
 
   priv = self->priv = MASH_LIGHT_SET_GET_PRIVATE (self);
 
-  priv->repaint_func_id =
-    clutter_threads_add_repaint_func (mash_light_set_repaint_func, self, NULL);
-
   priv->layer_indices = g_array_new (FALSE, FALSE, sizeof (int));
+  priv->max_programs = MASH_LIGHT_SET_MAX_PROGRAMS;
+
+  priv->mode = MASH_LIGHT_SET_MODE_PER_LIGHT;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    {
+      priv->array_capacities[i] = MASH_LIGHT_SET_MIN_ARRAY_CAPACITY;
+      priv->array_data[i] = g_array_new (FALSE, FALSE, sizeof (float));
+    }
+
+  priv->light_data_dirty = TRUE;
+
+  priv->light_bounds = g_array_new (FALSE, FALSE,
+                                    sizeof (MashLightSetLightBounds));
+
+  priv->pack_lights = g_ptr_array_new ();
+  priv->eye_data = g_array_new (FALSE, FALSE, sizeof (float));
+
+  priv->draw_lights = g_array_new (FALSE, FALSE, sizeof (int));
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    priv->draw_data[i] = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->draw_mask = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->draw_scores = g_array_new (FALSE, FALSE, sizeof (float));
 }
 
 static void
@@ -179,30 +510,62 @@ mash_light_set_dispose (GObject *object)
   MashLightSet *self = (MashLightSet *) object;
   MashLightSetPrivate *priv = self->priv;
 
-  g_slist_foreach (priv->lights, (GFunc) g_object_unref, NULL);
-  g_slist_free (priv->lights);
-  priv->lights = NULL;
+  GSList *l;
 
-  if (priv->repaint_func_id)
+  for (l = priv->lights; l; l = l->next)
     {
-      clutter_threads_remove_repaint_func (priv->repaint_func_id);
-      priv->repaint_func_id = 0;
+      _mash_light_remove_light_set (l->data, self);
+      g_object_unref (l->data);
     }
+  g_slist_free (priv->lights);
+  priv->lights = NULL;
 
   G_OBJECT_CLASS (mash_light_set_parent_class)->dispose (object);
 }
 
+static void
+mash_light_set_free_program (MashLightSetProgram *program)
+{
+  if (program->program)
+    cogl_handle_unref (program->program);
+
+  g_array_free (program->layer_indices, TRUE);
+  g_array_free (program->draw_lights, TRUE);
+  g_array_free (program->light_states, TRUE);
+
+  g_slice_free (MashLightSetProgram, program);
+}
+
 static void
 mash_light_set_finalize (GObject *object)
 {
   MashLightSet *self = (MashLightSet *) object;
   MashLightSetPrivate *priv = self->priv;
 
-  if (priv->program)
-    cogl_handle_unref (priv->program);
+  int i;
+
+  g_slist_foreach (priv->programs, (GFunc) mash_light_set_free_program, NULL);
+  g_slist_free (priv->programs);
 
   g_array_free (priv->layer_indices, TRUE);
 
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    g_array_free (priv->array_data[i], TRUE);
+
+  g_array_free (priv->light_bounds, TRUE);
+
+  g_ptr_array_free (priv->pack_lights, TRUE);
+  g_array_free (priv->eye_data, TRUE);
+
+  g_array_free (priv->draw_lights, TRUE);
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    g_array_free (priv->draw_data[i], TRUE);
+  g_array_free (priv->draw_mask, TRUE);
+  g_array_free (priv->draw_scores, TRUE);
+
+  if (priv->grid)
+    _mash_light_grid_free (priv->grid);
+
   G_OBJECT_CLASS (mash_light_set_parent_class)->finalize (object);
 }
 
@@ -220,380 +583,2151 @@ mash_light_set_new (void)
 }
 
 static void
-add_layer_indices (MashLightSet *light_set,
-                   GString *string)
+mash_light_set_get_property (GObject *object,
+                             guint prop_id,
+                             GValue *value,
+                             GParamSpec *pspec)
 {
-  MashLightSetPrivate *priv = light_set->priv;
-  int i;
+  MashLightSet *light_set = MASH_LIGHT_SET (object);
 
-  for (i = 0; i < priv->layer_indices->len; i++)
+  switch (prop_id)
     {
-      int layer_index = g_array_index (priv->layer_indices, int, i);
+    case PROP_MODE:
+      g_value_set_enum (value, mash_light_set_get_mode (light_set));
+      break;
 
-      g_string_append_printf (string,
-                              "  cogl_tex_coord%i_out = cogl_tex_coord%i_in;\n",
-                              layer_index, layer_index);
+    case PROP_MAX_LIGHTS:
+      g_value_set_uint (value, mash_light_set_get_max_lights (light_set));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
     }
 }
 
-static CoglHandle
-mash_light_set_get_program (MashLightSet *light_set)
+static void
+mash_light_set_set_property (GObject *object,
+                             guint prop_id,
+                             const GValue *value,
+                             GParamSpec *pspec)
 {
-  MashLightSetPrivate *priv = light_set->priv;
+  MashLightSet *light_set = MASH_LIGHT_SET (object);
 
-  if (priv->program == COGL_INVALID_HANDLE)
+  switch (prop_id)
     {
-      GString *uniform_source, *main_source;
-      char *full_source;
-      CoglHandle shader;
-      char *info_log;
-      GSList *l;
-      int i;
+    case PROP_MODE:
+      mash_light_set_set_mode (light_set, g_value_get_enum (value));
+      break;
 
-      uniform_source = g_string_new (NULL);
-      main_source = g_string_new (NULL);
+    case PROP_MAX_LIGHTS:
+      mash_light_set_set_max_lights (light_set, g_value_get_uint (value));
+      break;
 
-      /* Give all of the lights in the scene a chance to modify the
-         shader source */
-      for (l = priv->lights; l; l = l->next)
-        mash_light_generate_shader (l->data,
-                                    uniform_source,
-                                    main_source);
-
-      /* Append the shader boiler plate */
-      g_string_append (uniform_source,
-                       "\n"
-                       "uniform mat3 mash_normal_matrix;\n"
-                       "\n"
-                       "struct MashMaterialParameters {\n"
-                       "  vec4 emission;\n"
-                       "  vec4 ambient;\n"
-                       "  vec4 diffuse;\n"
-                       "  vec4 specular;\n"
-                       "  float shininess;\n"
-                       "};\n"
-                       "\n"
-                       "uniform MashMaterialParameters mash_material;\n"
-                       "\n"
-                       "void\n"
-                       "main ()\n"
-                       "{\n"
-                       /* Start with just the light emitted by the
-                          object itself. The lights should add to this
-                          color */
-                       "  cogl_color_out = mash_material.emission;\n"
-                       /* Calculate a transformed and normalized
-                          vertex normal */
-                       "  vec3 normal = normalize (mash_normal_matrix\n"
-                       "                           * cogl_normal_in);\n"
-                       /* Calculate the vertex position in eye coordinates */
-                       "  vec4 homogenous_eye_coord\n"
-                       "    = cogl_modelview_matrix * cogl_position_in;\n"
-                       "  vec3 eye_coord = homogenous_eye_coord.xyz\n"
-                       "    / homogenous_eye_coord.w;\n");
-      /* Append the main source to the uniform source to get the full
-         source for the shader */
-      g_string_append_len (uniform_source,
-                           main_source->str,
-                           main_source->len);
-      /* Perform the standard vertex transformation and copy the
-         texture coordinates. FIXME: Ideally this could should be
-         updated to use CoglSnippets so that it doesn't have to do
-         this. */
-      g_string_append (uniform_source,
-                       "  cogl_position_out =\n"
-                       "    cogl_modelview_projection_matrix *\n"
-                       "    cogl_position_in;\n");
-
-      add_layer_indices (light_set, uniform_source);
-
-      g_string_append (uniform_source,
-                       "}\n");
-
-      full_source = g_string_free (uniform_source, FALSE);
-      g_string_free (main_source, TRUE);
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
 
-      priv->program = cogl_create_program ();
+static int
+mash_light_set_get_array_type (MashLightSet *light_set,
+                               MashLight *light)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  GType type;
+  int i;
 
-      shader = cogl_create_shader (COGL_SHADER_TYPE_VERTEX);
-      cogl_shader_source (shader, full_source);
-      g_free (full_source);
-      cogl_shader_compile (shader);
+  if (priv->mode == MASH_LIGHT_SET_MODE_PER_LIGHT)
+    return -1;
 
-      if (!cogl_shader_is_compiled (shader))
-        g_warning ("Error compiling light box shader");
+  /* Only the exact built-in types can be put in the arrays because a
+     subclass may have overridden the shader generation */
+  type = G_OBJECT_TYPE (light);
 
-      info_log = cogl_shader_get_info_log (shader);
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    if (type == mash_light_set_array_types[i].get_type ())
+      return i;
 
-      if (info_log)
-        {
-          if (*info_log)
-            g_warning ("The light box shader has an info log:\n%s", info_log);
+  return -1;
+}
 
-          g_free (info_log);
-        }
+/* Returns whether the light adds its own snippet to the program.
+   Hidden lights are left out of the program in the same way that they
+   are left out of the arrays */
+static gboolean
+mash_light_set_light_has_snippet (MashLightSet *light_set,
+                                  MashLight *light)
+{
+  return (mash_light_set_get_array_type (light_set, light) == -1 &&
+          CLUTTER_ACTOR_IS_VISIBLE (light));
+}
 
-      cogl_program_attach_shader (priv->program, shader);
-      cogl_program_link (priv->program);
+static int
+mash_light_set_count_lights_of_type (MashLightSet *light_set,
+                                     int array_type)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int count = 0;
+  GSList *l;
 
-      priv->normal_matrix_uniform =
-        cogl_program_get_uniform_location (priv->program, "mash_normal_matrix");
+  for (l = priv->lights; l; l = l->next)
+    if (mash_light_set_get_array_type (light_set, l->data) == array_type)
+      count++;
 
-      for (i = 0; i < G_N_ELEMENTS (mash_light_set_material_properties); i++)
-        {
-          const char *uniform_name =
-            mash_light_set_material_properties[i].uniform_name;
+  return count;
+}
 
-          priv->material_uniforms[i] =
-            cogl_program_get_uniform_location (priv->program, uniform_name);
-        }
-    }
+/* Returns the number of lights of the given type that the arrays in
+   a program generated for @variant can hold */
+static int
+mash_light_set_get_capacity (MashLightSet *light_set,
+                             int array_type,
+                             int variant)
+{
+  MashLightSetPrivate *priv = light_set->priv;
 
-  return priv->program;
+  if (variant > 0 && array_type < MASH_LIGHT_SET_N_POSITIONAL_TYPES)
+    return variant;
+  else if (priv->mode == MASH_LIGHT_SET_MODE_CLUSTERED)
+    return MASH_LIGHT_SET_CLUSTER_CAPACITY;
+  else
+    return priv->array_capacities[array_type];
 }
 
 static void
-mash_light_set_dirty_program (MashLightSet *light_set)
+add_layer_indices (GArray *layer_indices,
+                   GString *string)
 {
-  MashLightSetPrivate *priv = light_set->priv;
+  int i;
 
-  /* If we've added or removed a light then we need to regenerate the
-     shader */
-  if (priv->program != COGL_INVALID_HANDLE)
+  for (i = 0; i < layer_indices->len; i++)
     {
-      cogl_handle_unref (priv->program);
-      priv->program = COGL_INVALID_HANDLE;
+      int layer_index = g_array_index (layer_indices, int, i);
+
+      g_string_append_printf (string,
+                              "  cogl_tex_coord%i_out = cogl_tex_coord%i_in;\n",
+                              layer_index, layer_index);
     }
 }
 
-typedef struct
+static CoglHandle
+mash_light_set_generate_program (MashLightSet *light_set,
+                                 GArray *layer_indices,
+                                 int variant)
 {
-  MashLightSet *light_set;
-  CoglPipeline *pipeline;
-  gboolean is_matching;
-  int index_num;
-} UpdateLayerIndicesData;
+  MashLightSetPrivate *priv = light_set->priv;
+  GString *uniform_source, *main_source;
+  char *full_source;
+  CoglHandle program, shader;
+  char *info_log;
+  GSList *l;
+  int n_cullable_lights = 0;
+  float folded_ambient[3] = { 0.0f, 0.0f, 0.0f };
+  gboolean has_folded_ambient = FALSE;
+  int i;
 
-static CoglBool
-update_layer_indices_cb (CoglPipeline *pipeline,
-                         int layer_index,
-                         void *user_data)
-{
-  UpdateLayerIndicesData *data = user_data;
-  MashLightSetPrivate *priv = data->light_set->priv;
+  MASH_TRACE_BEGIN ("generate light set program");
+
+  uniform_source = g_string_new (NULL);
+  main_source = g_string_new (NULL);
 
-  if (data->is_matching)
+  /* Lights with static parameters that aren't attenuated leave their
+     ambient term out of their snippet so that we can add them all
+     together here instead */
+  for (l = priv->lights; l; l = l->next)
     {
-      if (data->index_num >= priv->layer_indices->len ||
-          g_array_index (priv->layer_indices,
-                         int,
-                         data->index_num) != layer_index)
+      float ambient[3];
+
+      if (mash_light_set_light_has_snippet (light_set, l->data) &&
+          _mash_light_get_folded_ambient (l->data, ambient))
         {
-          g_array_set_size (priv->layer_indices, data->index_num);
-          data->is_matching = FALSE;
+          for (i = 0; i < 3; i++)
+            folded_ambient[i] += ambient[i];
+          has_folded_ambient = TRUE;
         }
     }
 
-  if (!data->is_matching)
-    g_array_append_val (priv->layer_indices, layer_index);
-
-  data->index_num++;
+  if (has_folded_ambient)
+    {
+      g_string_append (main_source,
+                       "  cogl_color_out.xyz += (mash_material.ambient.rgb\n"
+                       "                         * ");
+      _mash_append_glsl_vec3 (main_source, folded_ambient);
+      g_string_append (main_source, ");\n");
+    }
 
-  return TRUE;
-}
+  /* Give all of the lights in the scene a chance to modify the
+     shader source */
+  for (l = priv->lights; l; l = l->next)
+    if (!mash_light_set_light_has_snippet (light_set, l->data))
+      continue;
+    else if (priv->mode == MASH_LIGHT_SET_MODE_PER_LIGHT
+             && MASH_IS_POINT_LIGHT (l->data))
+      {
+        /* Point and spot lights have a range so they are wrapped in
+           a condition that lets them be skipped for actors out of
+           range */
+        gsize snippet_start = main_source->len;
+        char *condition;
 
-static void
-update_layer_indices (MashLightSet *light_set,
-                      CoglHandle material)
-{
-  MashLightSetPrivate *priv = light_set->priv;
-  UpdateLayerIndicesData data;
+        mash_light_generate_shader (l->data,
+                                    uniform_source,
+                                    main_source);
 
-  data.light_set = light_set;
-  data.pipeline = COGL_PIPELINE (material);
-  data.is_matching = TRUE;
-  data.index_num = 0;
+        condition = g_strdup_printf ("  if (mash_light_enabled[%i] > 0.0)\n"
+                                     "  {\n",
+                                     n_cullable_lights++);
+        g_string_insert (main_source, snippet_start, condition);
+        g_free (condition);
 
-  cogl_pipeline_foreach_layer (data.pipeline,
-                               update_layer_indices_cb,
-                               &data);
+        g_string_append (main_source, "  }\n");
+      }
+    else
+      mash_light_generate_shader (l->data,
+                                  uniform_source,
+                                  main_source);
+
+  if (n_cullable_lights > 0)
+    g_string_append_printf (uniform_source,
+                            "uniform float mash_light_enabled[%i];\n",
+                            n_cullable_lights);
+
+  if (priv->mode != MASH_LIGHT_SET_MODE_PER_LIGHT)
+    for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+      mash_light_set_array_types[i].generate_shader
+        (mash_light_set_get_capacity (light_set, i, variant),
+         uniform_source, main_source);
+
+  /* The lights that didn't fit in the arrays are approximated by an
+     extra ambient term */
+  if (variant > 0)
+    {
+      g_string_append (uniform_source,
+                       "uniform vec3 mash_folded_ambient;\n"
+                       "uniform vec3 mash_folded_diffuse;\n");
+      g_string_append (main_source,
+                       "  cogl_color_out.xyz +=\n"
+                       "    (mash_material.ambient.rgb * mash_folded_ambient\n"
+                       "     + mash_material.diffuse.rgb * mash_folded_diffuse);\n");
+    }
 
-  /* If the layer indices have changed then we need to regenerate the
-   * program */
-  if (!data.is_matching ||
-      data.index_num != priv->layer_indices->len)
+  /* Append the shader boiler plate */
+  g_string_append (uniform_source,
+                   "\n"
+                   "uniform mat3 mash_normal_matrix;\n"
+                   "\n"
+                   "struct MashMaterialParameters {\n"
+                   "  vec4 emission;\n"
+                   "  vec4 ambient;\n"
+                   "  vec4 diffuse;\n"
+                   "  vec4 specular;\n"
+                   "  float shininess;\n"
+                   "};\n"
+                   "\n"
+                   "uniform MashMaterialParameters mash_material;\n"
+                   "\n"
+                   "void\n"
+                   "main ()\n"
+                   "{\n"
+                   /* Start with just the light emitted by the
+                      object itself. The lights should add to this
+                      color */
+                   "  cogl_color_out = mash_material.emission;\n"
+                   /* Calculate a transformed and normalized
+                      vertex normal */
+                   "  vec3 normal = normalize (mash_normal_matrix\n"
+                   "                           * cogl_normal_in);\n"
+                   /* Calculate the vertex position in eye coordinates */
+                   "  vec4 homogenous_eye_coord\n"
+                   "    = cogl_modelview_matrix * cogl_position_in;\n"
+                   "  vec3 eye_coord = homogenous_eye_coord.xyz\n"
+                   "    / homogenous_eye_coord.w;\n");
+  /* Append the main source to the uniform source to get the full
+     source for the shader */
+  g_string_append_len (uniform_source,
+                       main_source->str,
+                       main_source->len);
+  /* Perform the standard vertex transformation and copy the
+     texture coordinates. FIXME: Ideally this could should be
+     updated to use CoglSnippets so that it doesn't have to do
+     this. */
+  g_string_append (uniform_source,
+                   "  cogl_position_out =\n"
+                   "    cogl_modelview_projection_matrix *\n"
+                   "    cogl_position_in;\n");
+
+  add_layer_indices (layer_indices, uniform_source);
+
+  g_string_append (uniform_source,
+                   "}\n");
+
+  full_source = g_string_free (uniform_source, FALSE);
+  g_string_free (main_source, TRUE);
+
+  MASH_TRACE_BEGIN ("compile light set program");
+
+  program = cogl_create_program ();
+
+  shader = cogl_create_shader (COGL_SHADER_TYPE_VERTEX);
+  cogl_shader_source (shader, full_source);
+  g_free (full_source);
+  cogl_shader_compile (shader);
+
+  if (!cogl_shader_is_compiled (shader))
+    g_warning ("Error compiling light box shader");
+
+  info_log = cogl_shader_get_info_log (shader);
+
+  if (info_log)
     {
-      g_array_set_size (priv->layer_indices, data.index_num);
-      mash_light_set_dirty_program (light_set);
+      if (*info_log)
+        g_warning ("The light box shader has an info log:\n%s", info_log);
+
+      g_free (info_log);
     }
+
+  cogl_program_attach_shader (program, shader);
+  cogl_handle_unref (shader);
+  cogl_program_link (program);
+
+  MASH_TRACE_END ();
+  MASH_TRACE_END ();
+
+  return program;
 }
 
-/**
- * mash_light_set_begin_paint:
- * @light_set: A #MashLightSet instance
- * @material: The material that will be used to paint
- *
- * This function should only be needed by custom actors that wish to
- * use the lighting model of Mash. The function should be called every
- * time the actor is painted. The @material parameter is used to
- * specify the lighting material properties. The material is not
- * otherwise read or modified. The material properties that are used
- * are: the emission color, the ambient color, the diffuse color, the
- * specular color and the shininess.
- *
- * The return value is a CoglProgram that should be used to paint the
- * actor. The actor should attach this to its material using
- * cogl_material_set_user_program().
- *
- * #MashModel<!-- -->s are already designed to use this function when
- * a light set is passed to mash_model_set_light_set().
- *
- * Return value: a CoglProgram to use for rendering.
- *
- * Since: 0.2
- */
-CoglHandle
-mash_light_set_begin_paint (MashLightSet *light_set,
-                            CoglHandle material)
+static MashLightSetProgram *
+mash_light_set_create_program (MashLightSet *light_set,
+                               GArray *layer_indices,
+                               int variant)
 {
-  MashLightSetPrivate *priv = light_set->priv;
-  CoglHandle program;
+  MashLightSetProgram *program = g_slice_new (MashLightSetProgram);
+  int n_snippet_lights = 0;
+  GSList *l;
   int i;
 
-  update_layer_indices (light_set, material);
-
-  program = mash_light_set_get_program (light_set);
+  program->layer_indices = g_array_sized_new (FALSE, FALSE, sizeof (int),
+                                              layer_indices->len);
+  g_array_append_vals (program->layer_indices,
+                       layer_indices->data,
+                       layer_indices->len);
 
-  if (priv->uniforms_dirty)
-    {
-      GSList *l;
+  program->variant = variant;
 
-      /* Give all of the lights a chance to update the uniforms before we
-         paint the first actor using the light set */
-      for (l = priv->lights; l; l = l->next)
-        mash_light_update_uniforms (l->data, program);
+  program->program = mash_light_set_generate_program (light_set,
+                                                      layer_indices,
+                                                      variant);
 
-      priv->uniforms_dirty = FALSE;
-    }
+  program->normal_matrix_uniform =
+    cogl_program_get_uniform_location (program->program,
+                                       "mash_normal_matrix");
 
-  /* Calculate the normal matrix from the modelview matrix */
-  if (priv->normal_matrix_uniform != -1)
+  for (i = 0; i < G_N_ELEMENTS (mash_light_set_material_properties); i++)
     {
-      CoglMatrix modelview_matrix;
-      CoglMatrix inverse_matrix;
-      float transpose_matrix[3 * 3];
+      const char *uniform_name =
+        mash_light_set_material_properties[i].uniform_name;
 
-      /* Invert the matrix */
-      cogl_get_modelview_matrix (&modelview_matrix);
-      cogl_matrix_get_inverse (&modelview_matrix, &inverse_matrix);
+      program->material_uniforms[i] =
+        cogl_program_get_uniform_location (program->program, uniform_name);
+    }
 
-      /* Transpose it while converting it to 3x3 */
-      transpose_matrix[0] = inverse_matrix.xx;
-      transpose_matrix[1] = inverse_matrix.xy;
-      transpose_matrix[2] = inverse_matrix.xz;
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    if (light_set->priv->mode != MASH_LIGHT_SET_MODE_PER_LIGHT)
+      {
+        program->array_count_uniforms[i] =
+          cogl_program_get_uniform_location
+          (program->program, mash_light_set_array_types[i].count_uniform_name);
+        program->array_uniforms[i] =
+          cogl_program_get_uniform_location
+          (program->program, mash_light_set_array_types[i].array_uniform_name);
+      }
+    else
+      {
+        program->array_count_uniforms[i] = -1;
+        program->array_uniforms[i] = -1;
+      }
 
-      transpose_matrix[3] = inverse_matrix.yx;
-      transpose_matrix[4] = inverse_matrix.yy;
-      transpose_matrix[5] = inverse_matrix.yz;
+  program->light_enabled_uniform =
+    cogl_program_get_uniform_location (program->program,
+                                       "mash_light_enabled");
 
-      transpose_matrix[6] = inverse_matrix.zx;
-      transpose_matrix[7] = inverse_matrix.zy;
-      transpose_matrix[8] = inverse_matrix.zz;
+  program->draw_lights = g_array_new (FALSE, FALSE, sizeof (int));
+  program->draw_lights_valid = FALSE;
 
-      cogl_program_set_uniform_matrix (program,
-                                       priv->normal_matrix_uniform,
-                                       3, /* dimensions */
-                                       1, /* count */
-                                       FALSE, /* transpose */
-                                       transpose_matrix);
-    }
+  program->folded_uniforms[0] =
+    cogl_program_get_uniform_location (program->program,
+                                       "mash_folded_ambient");
+  program->folded_uniforms[1] =
+    cogl_program_get_uniform_location (program->program,
+                                       "mash_folded_diffuse");
+  program->folded_values_valid = FALSE;
 
-  for (i = 0; i < G_N_ELEMENTS (mash_light_set_material_properties); i++)
-    if (priv->material_uniforms[i] != -1)
-      switch (mash_light_set_material_properties[i].type)
-        {
-        case MATERIAL_PROP_TYPE_COLOR:
-          {
-            CoglColor color;
-            MaterialColorGetFunc get_func =
-              mash_light_set_material_properties[i].get_func;
-            float vec[4];
+  program->normal_matrix_valid = FALSE;
 
-            get_func (material, &color);
+  program->material_values_valid = 0;
 
-            vec[0] = cogl_color_get_red_float (&color);
-            vec[1] = cogl_color_get_green_float (&color);
-            vec[2] = cogl_color_get_blue_float (&color);
-            vec[3] = cogl_color_get_alpha_float (&color);
+  /* The states are cleared so each light queries its locations the
+     first time the program is used */
+  for (l = light_set->priv->lights; l; l = l->next)
+    if (mash_light_set_light_has_snippet (light_set, l->data))
+      n_snippet_lights++;
+  program->light_states = g_array_new (FALSE, TRUE,
+                                       sizeof (MashLightProgramState));
+  g_array_set_size (program->light_states, n_snippet_lights);
 
-            cogl_program_set_uniform_float (program,
-                                            priv->material_uniforms[i],
-                                            4, /* n_components */
-                                            1, /* count */
-                                            vec);
-          }
-          break;
+  /* The lights have never seen this program so they will need to
+     update all of their uniforms before it is used */
+  program->uniforms_dirty = TRUE;
 
-        case MATERIAL_PROP_TYPE_FLOAT:
-          {
-            MaterialFloatGetFunc get_func =
-              mash_light_set_material_properties[i].get_func;
-            float value;
+  return program;
+}
 
-            value = get_func (material);
+static void
+mash_light_set_dirty_program (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
 
-            cogl_program_set_uniform_1f (program,
-                                         priv->material_uniforms[i],
-                                         value);
-          }
-          break;
-        }
+  /* If we've added or removed a light then we need to regenerate all
+     of the shaders */
+  g_slist_foreach (priv->programs, (GFunc) mash_light_set_free_program, NULL);
+  g_slist_free (priv->programs);
+  priv->programs = NULL;
 
-  return program;
+  /* The light bounds need to match the lights in the new program */
+  priv->light_data_dirty = TRUE;
 }
 
-static gboolean
-mash_light_set_repaint_func (gpointer data)
+static void
+mash_light_set_dirty_uniforms (MashLightSet *light_set)
 {
-  MashLightSet *light_set = MASH_LIGHT_SET (data);
   MashLightSetPrivate *priv = light_set->priv;
+  GSList *l;
 
-  /* Mark that we need to update the uniforms the next time an actor
-     is painted. We can't just update the uniforms immediately because
-     the repaint function is called before the allocation is run so
-     the lights may not have the correct position yet */
+  for (l = priv->programs; l; l = l->next)
+    ((MashLightSetProgram *) l->data)->uniforms_dirty = TRUE;
 
-  priv->uniforms_dirty = TRUE;
+  priv->light_data_dirty = TRUE;
+}
 
-  return TRUE;
+static float
+mash_light_set_get_range (const float *attenuation)
+{
+  float constant = attenuation[0];
+  float linear = attenuation[1];
+  float quadratic = attenuation[2];
+  float cutoff = MASH_LIGHT_SET_ATTENUATION_CUTOFF;
+
+  if (constant >= cutoff)
+    return 0.0f;
+
+  /* Solve constant + linear * d + quadratic * d * d = cutoff for d */
+  if (quadratic > 0.0f)
+    return ((sqrtf (linear * linear - 4.0f * quadratic * (constant - cutoff))
+             - linear)
+            / (2.0f * quadratic));
+  else if (linear > 0.0f)
+    return (cutoff - constant) / linear;
+  else
+    /* The light is never attenuated so it has an unlimited range */
+    return -1.0f;
 }
 
-/**
- * mash_light_set_add_light:
- * @light_set: A #MashLightSet instance
- * @light: A #MashLight
- *
- * This adds a light to the set. Lights need to be added to the light
- * set as well as to a container somewhere in the Clutter actor
- * hierarchy in order to be useful.
- */
-void
-mash_light_set_add_light (MashLightSet *light_set,
-                          MashLight *light)
+static void
+mash_light_set_get_block_bounds (const float *block,
+                                 gboolean is_spot,
+                                 MashLightSetLightBounds *bounds)
 {
-  MashLightSetPrivate *priv;
+  /* Both positional types store the eye-space position and then the
+     attenuation straight after the colors */
+  const float *position = block + MASH_LIGHT_COLOR_BLOCK_SIZE * 4;
+  const float *attenuation = block + (MASH_LIGHT_COLOR_BLOCK_SIZE + 1) * 4;
 
-  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
-  g_return_if_fail (MASH_IS_LIGHT (light));
+  memcpy (bounds->sphere, position, sizeof (float) * 3);
+  bounds->sphere[3] = mash_light_set_get_range (attenuation);
 
-  priv = light_set->priv;
+  /* The cone is only used if the cutoff angle is no more than 90 degrees */
+  if (is_spot && position[3] >= 0.0f)
+    {
+      memcpy (bounds->cone,
+              block + MASH_POINT_LIGHT_BLOCK_SIZE * 4,
+              sizeof (float) * 3);
+      bounds->cone[3] = position[3];
+    }
+  else
+    bounds->cone[3] = -1.0f;
+}
 
-  priv->lights = g_slist_prepend (priv->lights, g_object_ref_sink (light));
+/* Converts the translations and directions of @n_lights lights to
+   eye space positions and normalized directions. Each component is in
+   a separate array so that four lights can be converted at once with
+   SSE. The compiler won't vectorize the scalar loops by itself
+   because sqrtf may set errno. The SSE division and square root are
+   correctly rounded like the scalar ones so the results match */
+static void
+mash_light_set_transform_eye_data (int n_lights,
+                                   float *x,
+                                   float *y,
+                                   float *z,
+                                   const float *w,
+                                   float *dx,
+                                   float *dy,
+                                   float *dz,
+                                   float direction_sign)
+{
+  int i = 0;
 
-  mash_light_set_dirty_program (light_set);
-}
+#ifdef MASH_USE_SSE
+  for (; i + 4 <= n_lights; i += 4)
+    {
+      __m128 inv_w = _mm_div_ps (_mm_set1_ps (1.0f), _mm_loadu_ps (w + i));
 
-/**
+      _mm_storeu_ps (x + i, _mm_mul_ps (_mm_loadu_ps (x + i), inv_w));
+      _mm_storeu_ps (y + i, _mm_mul_ps (_mm_loadu_ps (y + i), inv_w));
+      _mm_storeu_ps (z + i, _mm_mul_ps (_mm_loadu_ps (z + i), inv_w));
+    }
+#endif /* MASH_USE_SSE */
+
+  for (; i < n_lights; i++)
+    {
+      float inv_w = 1.0f / w[i];
+
+      x[i] *= inv_w;
+      y[i] *= inv_w;
+      z[i] *= inv_w;
+    }
+
+  if (direction_sign == 0.0f)
+    return;
+
+  i = 0;
+
+#ifdef MASH_USE_SSE
+  for (; i + 4 <= n_lights; i += 4)
+    {
+      __m128 vx = _mm_loadu_ps (dx + i);
+      __m128 vy = _mm_loadu_ps (dy + i);
+      __m128 vz = _mm_loadu_ps (dz + i);
+      __m128 length_2 = _mm_add_ps (_mm_add_ps (_mm_mul_ps (vx, vx),
+                                                _mm_mul_ps (vy, vy)),
+                                    _mm_mul_ps (vz, vz));
+      __m128 scale = _mm_div_ps (_mm_set1_ps (direction_sign),
+                                 _mm_sqrt_ps (length_2));
+
+      _mm_storeu_ps (dx + i, _mm_mul_ps (vx, scale));
+      _mm_storeu_ps (dy + i, _mm_mul_ps (vy, scale));
+      _mm_storeu_ps (dz + i, _mm_mul_ps (vz, scale));
+    }
+#endif /* MASH_USE_SSE */
+
+  for (; i < n_lights; i++)
+    {
+      float scale = direction_sign / sqrtf (dx[i] * dx[i]
+                                            + dy[i] * dy[i]
+                                            + dz[i] * dz[i]);
+
+      dx[i] *= scale;
+      dy[i] *= scale;
+      dz[i] *= scale;
+    }
+}
+
+/* Fills in the blocks for @n_lights lights of the given array type
+   starting at @data. The lights don't need to be of exactly the
+   built-in type as long as their blocks have the same layout */
+static void
+mash_light_set_pack_lights (MashLightSet *light_set,
+                            int array_type,
+                            MashLight * const *lights,
+                            int n_lights,
+                            float *data)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int block_floats = mash_light_set_array_types[array_type].block_size * 4;
+  int position_offset = mash_light_set_array_types[array_type].position_offset;
+  int direction_offset
+    = mash_light_set_array_types[array_type].direction_offset;
+  float direction_sign
+    = mash_light_set_array_types[array_type].direction_sign;
+  float *x, *y, *z, *w, *dx, *dy, *dz;
+  int i;
+
+  /* This only allocates when the number of lights grows */
+  if (priv->eye_data->len < n_lights * MASH_LIGHT_SET_N_EYE_COMPONENTS)
+    g_array_set_size (priv->eye_data,
+                      n_lights * MASH_LIGHT_SET_N_EYE_COMPONENTS);
+
+  x = (float *) priv->eye_data->data;
+  y = x + n_lights;
+  z = y + n_lights;
+  w = z + n_lights;
+  dx = w + n_lights;
+  dy = dx + n_lights;
+  dz = dy + n_lights;
+
+  /* Bring the cached transformations up to date first so that lights
+     sharing a parent only walk up the hierarchy once */
+  _mash_light_ensure_eye_transforms (lights, n_lights);
+
+  /* Gather the parameters and the cached transformations of each
+     light */
+  for (i = 0; i < n_lights; i++)
+    {
+      const float *normal_matrix;
+      float translation[4];
+
+      mash_light_set_array_types[array_type].get_block (lights[i],
+                                                        data
+                                                        + i * block_floats);
+
+      normal_matrix = _mash_light_get_eye_transform (lights[i], translation);
+
+      x[i] = translation[0];
+      y[i] = translation[1];
+      z[i] = translation[2];
+      w[i] = translation[3];
+
+      /* The lights point along the y axis so the untransformed
+         direction is the second column of the normal matrix */
+      dx[i] = normal_matrix[3];
+      dy[i] = normal_matrix[4];
+      dz[i] = normal_matrix[5];
+    }
+
+  mash_light_set_transform_eye_data (n_lights,
+                                     x, y, z, w,
+                                     dx, dy, dz,
+                                     direction_offset == -1
+                                     ? 0.0f : direction_sign);
+
+  /* Scatter the results back into the blocks */
+  for (i = 0; i < n_lights; i++)
+    {
+      float *block = data + i * block_floats;
+
+      if (position_offset != -1)
+        {
+          float *position = block + position_offset * 4;
+
+          position[0] = x[i];
+          position[1] = y[i];
+          position[2] = z[i];
+        }
+
+      if (direction_offset != -1)
+        {
+          float *direction = block + direction_offset * 4;
+
+          direction[0] = dx[i];
+          direction[1] = dy[i];
+          direction[2] = dz[i];
+        }
+    }
+}
+
+static void
+mash_light_set_update_array_bounds (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int n_lights = 0;
+  int i, j;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    n_lights += priv->array_counts[i];
+
+  /* This only allocates when the number of lights grows */
+  g_array_set_size (priv->light_bounds, n_lights);
+
+  n_lights = 0;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    {
+      int block_floats = mash_light_set_array_types[i].block_size * 4;
+      const float *block = (const float *) priv->array_data[i]->data;
+      gboolean is_spot =
+        mash_light_set_array_types[i].get_type () == MASH_TYPE_SPOT_LIGHT;
+
+      for (j = 0; j < priv->array_counts[i]; j++)
+        {
+          mash_light_set_get_block_bounds
+            (block,
+             is_spot,
+             &g_array_index (priv->light_bounds,
+                             MashLightSetLightBounds,
+                             n_lights++));
+
+          block += block_floats;
+        }
+    }
+}
+
+static void
+mash_light_set_update_per_light_bounds (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  float block[MASH_SPOT_LIGHT_BLOCK_SIZE * 4];
+  int n_lights = 0;
+  GSList *l;
+
+  g_array_set_size (priv->light_bounds, 0);
+
+  /* This must visit the lights in the same order as
+     mash_light_set_generate_program() */
+  for (l = priv->lights; l; l = l->next)
+    if (MASH_IS_POINT_LIGHT (l->data) &&
+        CLUTTER_ACTOR_IS_VISIBLE (l->data))
+      {
+        MashLight *light = l->data;
+        gboolean is_spot = MASH_IS_SPOT_LIGHT (light);
+
+        g_array_set_size (priv->light_bounds, n_lights + 1);
+
+        mash_light_set_pack_lights (light_set,
+                                    is_spot
+                                    ? MASH_LIGHT_SET_SPOT_TYPE
+                                    : MASH_LIGHT_SET_POINT_TYPE,
+                                    &light, 1,
+                                    block);
+
+        mash_light_set_get_block_bounds (block,
+                                         is_spot,
+                                         &g_array_index (priv->light_bounds,
+                                                         MashLightSetLightBounds,
+                                                         n_lights++));
+      }
+}
+
+static void
+mash_light_set_build_grid (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  CoglMatrix projection;
+
+  if (priv->grid == NULL)
+    priv->grid = _mash_light_grid_new ();
+
+  cogl_get_projection_matrix (&projection);
+
+  _mash_light_grid_build (priv->grid,
+                          &projection,
+                          priv->light_bounds->len,
+                          (const float *) priv->light_bounds->data,
+                          sizeof (MashLightSetLightBounds) / sizeof (float));
+}
+
+/* Returns the sum of the ambient and diffuse colors of a packed
+   light */
+static float
+mash_light_set_get_block_intensity (const float *block)
+{
+  float intensity = 0.0f;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    intensity += block[i] + block[4 + i];
+
+  return intensity;
+}
+
+/* The lights without a range affect every actor so in
+   MASH_LIGHT_SET_MODE_CLUSTERED mode the first
+   MASH_LIGHT_SET_CLUSTER_CAPACITY of them are always used. If there
+   are more than that then the brightest ones are moved to the front
+   of the packed array */
+static void
+mash_light_set_sort_global_lights (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  float tmp[MASH_SPOT_LIGHT_BLOCK_SIZE * 4];
+  int type, i, j;
+
+  for (type = MASH_LIGHT_SET_N_POSITIONAL_TYPES;
+       type < MASH_LIGHT_SET_N_ARRAY_TYPES;
+       type++)
+    {
+      int block_floats = mash_light_set_array_types[type].block_size * 4;
+      float *data = (float *) priv->array_data[type]->data;
+      int n_lights = priv->array_counts[type];
+
+      if (n_lights <= MASH_LIGHT_SET_CLUSTER_CAPACITY)
+        continue;
+
+      for (i = 0; i < MASH_LIGHT_SET_CLUSTER_CAPACITY; i++)
+        {
+          float *block = data + i * block_floats;
+          float best_intensity = mash_light_set_get_block_intensity (block);
+          int best = i;
+
+          for (j = i + 1; j < n_lights; j++)
+            {
+              float intensity =
+                mash_light_set_get_block_intensity (data + j * block_floats);
+
+              if (intensity > best_intensity)
+                {
+                  best = j;
+                  best_intensity = intensity;
+                }
+            }
+
+          if (best != i)
+            {
+              float *best_block = data + best * block_floats;
+
+              memcpy (tmp, block, block_floats * sizeof (float));
+              memcpy (block, best_block, block_floats * sizeof (float));
+              memcpy (best_block, tmp, block_floats * sizeof (float));
+            }
+        }
+    }
+}
+
+/* Makes sure the arrays in the generated programs are big enough for
+   all of the lights. This has to happen before the lights are packed
+   because the packing stops at the capacity */
+static void
+mash_light_set_grow_capacities (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  gboolean grown = FALSE;
+  int i;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    {
+      int count;
+
+      /* The positional arrays are sized by the variant instead when
+         there is a maximum number of lights */
+      if (priv->max_lights > 0 && i < MASH_LIGHT_SET_N_POSITIONAL_TYPES)
+        continue;
+
+      count = mash_light_set_count_lights_of_type (light_set, i);
+
+      /* Grow the capacity in powers of two so that adding lights one
+         at a time doesn't regenerate the program every time */
+      while (priv->array_capacities[i] < count)
+        {
+          priv->array_capacities[i] *= 2;
+          grown = TRUE;
+        }
+    }
+
+  if (grown)
+    mash_light_set_dirty_program (light_set);
+}
+
+static void
+mash_light_set_update_light_data (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int i;
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_PER_LIGHT)
+    {
+      mash_light_set_update_per_light_bounds (light_set);
+      priv->light_data_dirty = FALSE;
+      return;
+    }
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS)
+    mash_light_set_grow_capacities (light_set);
+
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    {
+      int block_floats = mash_light_set_array_types[i].block_size * 4;
+      GArray *data = priv->array_data[i];
+      GSList *l;
+
+      g_ptr_array_set_size (priv->pack_lights, 0);
+
+      for (l = priv->lights; l; l = l->next)
+        {
+          MashLight *light = l->data;
+
+          /* Hidden lights are simply left out of the array */
+          if (mash_light_set_get_array_type (light_set, light) != i ||
+              !CLUTTER_ACTOR_IS_VISIBLE (light) ||
+              (priv->mode == MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS &&
+               (priv->max_lights == 0 ||
+                i >= MASH_LIGHT_SET_N_POSITIONAL_TYPES) &&
+               priv->pack_lights->len >= priv->array_capacities[i]))
+            continue;
+
+          g_ptr_array_add (priv->pack_lights, light);
+        }
+
+      /* The array is never shrunk so this will only allocate when the
+         number of lights grows */
+      if (data->len < priv->pack_lights->len * block_floats)
+        g_array_set_size (data, priv->pack_lights->len * block_floats);
+
+      /* All of the lights of the type are transformed to eye space
+         together */
+      mash_light_set_pack_lights (light_set,
+                                  i,
+                                  (MashLight * const *)
+                                  priv->pack_lights->pdata,
+                                  priv->pack_lights->len,
+                                  (float *) data->data);
+
+      priv->array_counts[i] = priv->pack_lights->len;
+    }
+
+  mash_light_set_update_array_bounds (light_set);
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_CLUSTERED)
+    {
+      mash_light_set_sort_global_lights (light_set);
+      mash_light_set_build_grid (light_set);
+    }
+
+  priv->light_data_dirty = FALSE;
+}
+
+static void
+mash_light_set_count_uniform_upload (MashLightSet *light_set)
+{
+  light_set->priv->n_uniform_uploads++;
+  _mash_render_stats.n_uniform_uploads++;
+}
+
+static void
+mash_light_set_upload_arrays (MashLightSet *light_set,
+                              MashLightSetProgram *program,
+                              const int *counts,
+                              const float * const *data)
+{
+  int i;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_ARRAY_TYPES; i++)
+    {
+      if (program->array_count_uniforms[i] != -1)
+        {
+          cogl_program_set_uniform_1i (program->program,
+                                       program->array_count_uniforms[i],
+                                       counts[i]);
+          mash_light_set_count_uniform_upload (light_set);
+        }
+
+      /* All of the parameters for a light type are uploaded in a
+         single call */
+      if (program->array_uniforms[i] != -1 && counts[i] > 0)
+        {
+          cogl_program_set_uniform_float (program->program,
+                                          program->array_uniforms[i],
+                                          4, /* n_components */
+                                          counts[i]
+                                          * mash_light_set_array_types[i]
+                                          .block_size,
+                                          data[i]);
+          mash_light_set_count_uniform_upload (light_set);
+        }
+    }
+}
+
+static gboolean
+mash_light_set_get_eye_bounds (MashLightSet *light_set,
+                               const CoglMatrix *modelview,
+                               float *eye_min,
+                               float *eye_max)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int i, j;
+
+  if (!priv->has_paint_bounds)
+    return FALSE;
+
+  /* Transform the corners of the bounding box into eye space */
+
+  for (j = 0; j < 3; j++)
+    {
+      eye_min[j] = G_MAXFLOAT;
+      eye_max[j] = -G_MAXFLOAT;
+    }
+
+  for (i = 0; i < 8; i++)
+    {
+      float v[4];
+
+      v[0] = (i & 1) ? priv->paint_bounds_max[0] : priv->paint_bounds_min[0];
+      v[1] = (i & 2) ? priv->paint_bounds_max[1] : priv->paint_bounds_min[1];
+      v[2] = (i & 4) ? priv->paint_bounds_max[2] : priv->paint_bounds_min[2];
+      v[3] = 1.0f;
+
+      cogl_matrix_transform_point (modelview, v + 0, v + 1, v + 2, v + 3);
+
+      for (j = 0; j < 3; j++)
+        {
+          float coord = v[j] / v[3];
+
+          if (coord < eye_min[j])
+            eye_min[j] = coord;
+          if (coord > eye_max[j])
+            eye_max[j] = coord;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+mash_light_set_light_affects_box (const MashLightSetLightBounds *bounds,
+                                  const float *box_min,
+                                  const float *box_max)
+{
+  float center[3], to_center[3];
+  float box_radius_sq = 0.0f, distance_sq = 0.0f, axis_distance;
+  float cone_cos, cone_sin, box_radius, closest;
+  int i;
+
+  /* Test the range sphere against the box */
+  if (bounds->sphere[3] >= 0.0f)
+    {
+      for (i = 0; i < 3; i++)
+        {
+          float p = bounds->sphere[i];
+
+          if (p < box_min[i])
+            distance_sq += (box_min[i] - p) * (box_min[i] - p);
+          else if (p > box_max[i])
+            distance_sq += (p - box_max[i]) * (p - box_max[i]);
+        }
+
+      if (distance_sq > bounds->sphere[3] * bounds->sphere[3])
+        return FALSE;
+    }
+
+  if (bounds->cone[3] < 0.0f)
+    return TRUE;
+
+  /* Test the cone against the bounding sphere of the box */
+  distance_sq = 0.0f;
+  axis_distance = 0.0f;
+
+  for (i = 0; i < 3; i++)
+    {
+      float half_size = (box_max[i] - box_min[i]) * 0.5f;
+
+      center[i] = (box_max[i] + box_min[i]) * 0.5f;
+      box_radius_sq += half_size * half_size;
+      to_center[i] = center[i] - bounds->sphere[i];
+      distance_sq += to_center[i] * to_center[i];
+      axis_distance += to_center[i] * bounds->cone[i];
+    }
+
+  /* The light is inside the box */
+  if (distance_sq <= box_radius_sq)
+    return TRUE;
+
+  box_radius = sqrtf (box_radius_sq);
+
+  /* The box is entirely behind the light */
+  if (axis_distance < -box_radius)
+    return FALSE;
+
+  cone_cos = bounds->cone[3];
+  cone_sin = sqrtf (MAX (0.0f, 1.0f - cone_cos * cone_cos));
+
+  /* Distance from the center of the box to the nearest point on the
+     surface of the cone */
+  closest = (cone_cos * sqrtf (MAX (0.0f, (distance_sq
+                                           - axis_distance * axis_distance)))
+             - axis_distance * cone_sin);
+
+  return closest <= box_radius;
+}
+
+/* Fills in draw_lights with the indices into light_bounds of the
+   lights that affect the actor about to be painted */
+static int
+mash_light_set_pick_lights (MashLightSet *light_set,
+                            const CoglMatrix *modelview)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int n_bounds = priv->light_bounds->len;
+  float *eye_min = priv->eye_bounds_min;
+  float *eye_max = priv->eye_bounds_max;
+  int *lights;
+  int n_lights, i;
+
+  /* This only allocates when the number of lights grows */
+  g_array_set_size (priv->draw_lights, n_bounds);
+  lights = (int *) priv->draw_lights->data;
+
+  priv->has_eye_bounds = mash_light_set_get_eye_bounds (light_set,
+                                                        modelview,
+                                                        eye_min, eye_max);
+
+  if (!priv->has_eye_bounds)
+    {
+      /* We don't know where the actor is so use all of the lights */
+      for (i = 0; i < n_bounds; i++)
+        lights[i] = i;
+
+      return n_bounds;
+    }
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_CLUSTERED)
+    {
+      /* The grid only gives the lights in the touched clusters so
+         they still need to be tested individually */
+      int n_candidates = _mash_light_grid_gather (priv->grid,
+                                                  eye_min, eye_max,
+                                                  lights,
+                                                  n_bounds);
+
+      for (i = 0, n_lights = 0; i < n_candidates; i++)
+        if (mash_light_set_light_affects_box
+            (&g_array_index (priv->light_bounds,
+                             MashLightSetLightBounds,
+                             lights[i]),
+             eye_min, eye_max))
+          lights[n_lights++] = lights[i];
+    }
+  else
+    {
+      for (i = 0, n_lights = 0; i < n_bounds; i++)
+        if (mash_light_set_light_affects_box
+            (&g_array_index (priv->light_bounds,
+                             MashLightSetLightBounds,
+                             i),
+             eye_min, eye_max))
+          lights[n_lights++] = i;
+    }
+
+  priv->n_lights_tested += n_bounds;
+  priv->n_lights_culled += n_bounds - n_lights;
+
+  return n_lights;
+}
+
+/* Returns the packed block for a light given its index into
+   light_bounds. The light indices count through each positional type
+   in turn */
+static const float *
+mash_light_set_get_light_block (MashLightSet *light_set,
+                                int light,
+                                int *type_out)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int type;
+
+  for (type = 0; light >= priv->array_counts[type]; type++)
+    light -= priv->array_counts[type];
+
+  *type_out = type;
+
+  return &g_array_index (priv->array_data[type], float,
+                         light * mash_light_set_array_types[type].block_size
+                         * 4);
+}
+
+/* Estimates how much of a light reaches the actor about to be painted
+   by calculating the attenuation at the nearest point of its bounds
+   and the falloff of a spot light towards the center */
+static float
+mash_light_set_get_light_factor (MashLightSet *light_set,
+                                 const float *block,
+                                 int type)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  const float *position = block + MASH_LIGHT_COLOR_BLOCK_SIZE * 4;
+  const float *attenuation = position + 4;
+  float distance_sq = 0.0f, distance, factor;
+  int i;
+
+  if (priv->has_eye_bounds)
+    for (i = 0; i < 3; i++)
+      {
+        float nearest = CLAMP (position[i],
+                               priv->eye_bounds_min[i],
+                               priv->eye_bounds_max[i]);
+
+        distance_sq += (nearest - position[i]) * (nearest - position[i]);
+      }
+
+  distance = sqrtf (distance_sq);
+
+  factor = 1.0f / MAX (attenuation[0]
+                       + attenuation[1] * distance
+                       + attenuation[2] * distance_sq,
+                       1e-4f);
+
+  if (type == MASH_LIGHT_SET_SPOT_TYPE && priv->has_eye_bounds)
+    {
+      const float *direction = block + MASH_POINT_LIGHT_BLOCK_SIZE * 4;
+      float to_center[3], length_sq = 0.0f, spot_cos = 0.0f;
+
+      for (i = 0; i < 3; i++)
+        {
+          to_center[i] = ((priv->eye_bounds_min[i] + priv->eye_bounds_max[i])
+                          * 0.5f - position[i]);
+          length_sq += to_center[i] * to_center[i];
+          spot_cos += to_center[i] * direction[i];
+        }
+
+      /* The actor has already been found to touch the cone so at
+         worst it is on the edge */
+      if (length_sq > 0.0f)
+        {
+          spot_cos = MAX (spot_cos / sqrtf (length_sq), position[3]);
+          factor *= powf (MAX (spot_cos, 0.0f), direction[3]);
+        }
+    }
+
+  return factor;
+}
+
+/* Fills draw_scores with the estimated contribution of each light in
+   draw_lights to the actor about to be painted */
+static float *
+mash_light_set_score_lights (MashLightSet *light_set,
+                             int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  const int *lights = (const int *) priv->draw_lights->data;
+  float *scores;
+  int i, type;
+
+  /* This only allocates when the number of lights grows */
+  g_array_set_size (priv->draw_scores, n_lights);
+  scores = (float *) priv->draw_scores->data;
+
+  for (i = 0; i < n_lights; i++)
+    {
+      const float *block = mash_light_set_get_light_block (light_set,
+                                                           lights[i],
+                                                           &type);
+
+      scores[i] = (mash_light_set_get_block_intensity (block)
+                   * mash_light_set_get_light_factor (light_set,
+                                                      block,
+                                                      type));
+    }
+
+  return scores;
+}
+
+static void
+mash_light_set_count_dropped_lights (MashLightSet *light_set,
+                                     int n_dropped)
+{
+  light_set->priv->render_stats.n_lights_dropped += n_dropped;
+  _mash_render_stats.n_lights_dropped += n_dropped;
+}
+
+/* In MASH_LIGHT_SET_MODE_CLUSTERED mode the arrays can only hold
+   MASH_LIGHT_SET_CLUSTER_CAPACITY lights of each type. If more lights
+   touch the actor then the ones estimated to contribute the least are
+   removed from draw_lights. The remaining lights are kept in index
+   order. The lights without a range have already been sorted by
+   mash_light_set_sort_global_lights() so those are only counted.
+   Returns the new number of lights */
+static int
+mash_light_set_limit_cluster_lights (MashLightSet *light_set,
+                                     int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int *lights = (int *) priv->draw_lights->data;
+  int counts[MASH_LIGHT_SET_N_POSITIONAL_TYPES];
+  gboolean overflowed = FALSE;
+  float *scores;
+  int i, type, n_dropped = 0;
+
+  for (type = MASH_LIGHT_SET_N_POSITIONAL_TYPES;
+       type < MASH_LIGHT_SET_N_ARRAY_TYPES;
+       type++)
+    if (priv->array_counts[type] > MASH_LIGHT_SET_CLUSTER_CAPACITY)
+      n_dropped += (priv->array_counts[type]
+                    - MASH_LIGHT_SET_CLUSTER_CAPACITY);
+
+  memset (counts, 0, sizeof (counts));
+
+  for (i = 0; i < n_lights; i++)
+    {
+      mash_light_set_get_light_block (light_set, lights[i], &type);
+      if (++counts[type] > MASH_LIGHT_SET_CLUSTER_CAPACITY)
+        overflowed = TRUE;
+    }
+
+  if (!overflowed)
+    {
+      if (n_dropped > 0)
+        mash_light_set_count_dropped_lights (light_set, n_dropped);
+
+      return n_lights;
+    }
+
+  scores = mash_light_set_score_lights (light_set, n_lights);
+
+  for (type = 0; type < MASH_LIGHT_SET_N_POSITIONAL_TYPES; type++)
+    while (counts[type] > MASH_LIGHT_SET_CLUSTER_CAPACITY)
+      {
+        int weakest = -1;
+
+        for (i = 0; i < n_lights; i++)
+          {
+            int light_type;
+
+            mash_light_set_get_light_block (light_set, lights[i],
+                                            &light_type);
+
+            if (light_type == type &&
+                (weakest == -1 || scores[i] < scores[weakest]))
+              weakest = i;
+          }
+
+        n_lights--;
+        memmove (lights + weakest, lights + weakest + 1,
+                 (n_lights - weakest) * sizeof (int));
+        memmove (scores + weakest, scores + weakest + 1,
+                 (n_lights - weakest) * sizeof (float));
+
+        counts[type]--;
+        n_dropped++;
+      }
+
+  mash_light_set_count_dropped_lights (light_set, n_dropped);
+
+  return n_lights;
+}
+
+/* Keeps only the max_lights lights in draw_lights that are estimated
+   to contribute the most to the actor. The rest are folded into
+   folded_light. Returns the new number of lights */
+static int
+mash_light_set_select_lights (MashLightSet *light_set,
+                              int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int *lights = (int *) priv->draw_lights->data;
+  float *scores;
+  int i, j, type;
+
+  memset (priv->folded_light, 0, sizeof (priv->folded_light));
+
+  if (n_lights <= priv->max_lights)
+    return n_lights;
+
+  scores = mash_light_set_score_lights (light_set, n_lights);
+
+  /* Move the strongest lights to the front. There are at most
+     MASH_LIGHT_SET_MAX_TOP_LIGHTS of them so a partial selection sort
+     is good enough */
+  for (i = 0; i < priv->max_lights; i++)
+    {
+      int best = i;
+
+      for (j = i + 1; j < n_lights; j++)
+        if (scores[j] > scores[best])
+          best = j;
+
+      if (best != i)
+        {
+          int light = lights[i];
+          float score = scores[i];
+
+          lights[i] = lights[best];
+          scores[i] = scores[best];
+          lights[best] = light;
+          scores[best] = score;
+        }
+    }
+
+  /* Fold the remaining lights into the ambient term */
+  for (i = priv->max_lights; i < n_lights; i++)
+    {
+      const float *block = mash_light_set_get_light_block (light_set,
+                                                           lights[i],
+                                                           &type);
+      float factor = mash_light_set_get_light_factor (light_set,
+                                                      block,
+                                                      type);
+
+      for (j = 0; j < 3; j++)
+        {
+          priv->folded_light[0][j] += block[j] * factor;
+          priv->folded_light[1][j] += (block[4 + j] * factor
+                                       * MASH_LIGHT_SET_FOLDED_DIFFUSE_SCALE);
+        }
+    }
+
+  /* Keep the selected lights in index order so that
+     mash_light_set_upload_draw_lights() can recognise when the same
+     lights are used again */
+  for (i = 1; i < priv->max_lights; i++)
+    {
+      int light = lights[i];
+
+      for (j = i; j > 0 && lights[j - 1] > light; j--)
+        lights[j] = lights[j - 1];
+
+      lights[j] = light;
+    }
+
+  return priv->max_lights;
+}
+
+static void
+mash_light_set_upload_folded_light (MashLightSet *light_set,
+                                    MashLightSetProgram *program)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      if (program->folded_uniforms[i] == -1 ||
+          (program->folded_values_valid &&
+           !memcmp (program->folded_values[i],
+                    priv->folded_light[i],
+                    sizeof (float) * 3)))
+        continue;
+
+      cogl_program_set_uniform_float (program->program,
+                                      program->folded_uniforms[i],
+                                      3, 1,
+                                      priv->folded_light[i]);
+      mash_light_set_count_uniform_upload (light_set);
+    }
+
+  memcpy (program->folded_values, priv->folded_light,
+          sizeof (program->folded_values));
+  program->folded_values_valid = TRUE;
+}
+
+static void
+mash_light_set_upload_light_mask (MashLightSet *light_set,
+                                  MashLightSetProgram *program,
+                                  int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  const int *lights = (const int *) priv->draw_lights->data;
+  float *mask;
+  int i;
+
+  g_array_set_size (priv->draw_mask, priv->light_bounds->len);
+  mask = (float *) priv->draw_mask->data;
+
+  memset (mask, 0, sizeof (float) * priv->light_bounds->len);
+  for (i = 0; i < n_lights; i++)
+    mask[lights[i]] = 1.0f;
+
+  cogl_program_set_uniform_float (program->program,
+                                  program->light_enabled_uniform,
+                                  1, /* n_components */
+                                  priv->light_bounds->len,
+                                  mask);
+  mash_light_set_count_uniform_upload (light_set);
+}
+
+static void
+mash_light_set_upload_light_arrays (MashLightSet *light_set,
+                                    MashLightSetProgram *program,
+                                    int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  const int *lights = (const int *) priv->draw_lights->data;
+  int counts[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  const float *data[MASH_LIGHT_SET_N_ARRAY_TYPES];
+  int i;
+
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    {
+      int capacity = mash_light_set_get_capacity (light_set,
+                                                  i,
+                                                  program->variant);
+
+      /* This only allocates when the capacity grows */
+      g_array_set_size (priv->draw_data[i],
+                        capacity * mash_light_set_array_types[i].block_size
+                        * 4);
+      counts[i] = 0;
+    }
+
+  for (i = 0; i < n_lights; i++)
+    {
+      const float *block;
+      int type, block_floats;
+
+      block = mash_light_set_get_light_block (light_set, lights[i], &type);
+      block_floats = mash_light_set_array_types[type].block_size * 4;
+
+      if ((counts[type] + 1) * block_floats > priv->draw_data[type]->len)
+        continue;
+
+      memcpy (&g_array_index (priv->draw_data[type], float,
+                              counts[type] * block_floats),
+              block,
+              block_floats * sizeof (float));
+
+      counts[type]++;
+    }
+
+  for (i = 0; i < MASH_LIGHT_SET_N_POSITIONAL_TYPES; i++)
+    data[i] = (const float *) priv->draw_data[i]->data;
+
+  /* The remaining types don't have a range so they affect every
+     actor */
+  for (i = MASH_LIGHT_SET_N_POSITIONAL_TYPES;
+       i < MASH_LIGHT_SET_N_ARRAY_TYPES;
+       i++)
+    {
+      counts[i] = MIN (priv->array_counts[i],
+                       mash_light_set_get_capacity (light_set,
+                                                    i,
+                                                    program->variant));
+      data[i] = (const float *) priv->array_data[i]->data;
+    }
+
+  mash_light_set_upload_arrays (light_set, program, counts, data);
+}
+
+static void
+mash_light_set_upload_draw_lights (MashLightSet *light_set,
+                                   MashLightSetProgram *program,
+                                   int n_lights)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+
+  /* Avoid reuploading if the previous actor painted with this
+     program used the same lights */
+  if (program->draw_lights_valid &&
+      n_lights == program->draw_lights->len &&
+      !memcmp (program->draw_lights->data,
+               priv->draw_lights->data,
+               n_lights * sizeof (int)))
+    return;
+
+  g_array_set_size (program->draw_lights, n_lights);
+  memcpy (program->draw_lights->data,
+          priv->draw_lights->data,
+          n_lights * sizeof (int));
+  program->draw_lights_valid = TRUE;
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_PER_LIGHT)
+    mash_light_set_upload_light_mask (light_set, program, n_lights);
+  else
+    mash_light_set_upload_light_arrays (light_set, program, n_lights);
+}
+
+static void
+mash_light_set_upload_normal_matrix (MashLightSet *light_set,
+                                     MashLightSetProgram *program,
+                                     const CoglMatrix *modelview)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  MashNormalMatrixCache *cache;
+  float m[3 * 3];
+
+  cache = (priv->paint_normal_matrix_cache
+           ? priv->paint_normal_matrix_cache
+           : &priv->normal_matrix_cache);
+
+  m[0] = modelview->xx;
+  m[1] = modelview->yx;
+  m[2] = modelview->zx;
+  m[3] = modelview->xy;
+  m[4] = modelview->yy;
+  m[5] = modelview->zy;
+  m[6] = modelview->xz;
+  m[7] = modelview->yz;
+  m[8] = modelview->zz;
+
+  /* The normal matrix only depends on the upper 3x3 of the modelview
+     so a change in translation doesn't require recalculating it */
+  if (!cache->valid || memcmp (cache->modelview, m, sizeof (m)))
+    {
+      memcpy (cache->modelview, m, sizeof (m));
+      if (_mash_calculate_normal_matrix (m, cache->normal_matrix))
+        priv->render_stats.n_matrix_inversions++;
+      cache->valid = TRUE;
+    }
+
+  /* The program keeps the value of the uniform so it only needs
+     uploading when it changes */
+  if (program->normal_matrix_valid &&
+      !memcmp (program->normal_matrix,
+               cache->normal_matrix,
+               sizeof (program->normal_matrix)))
+    return;
+
+  memcpy (program->normal_matrix,
+          cache->normal_matrix,
+          sizeof (program->normal_matrix));
+  program->normal_matrix_valid = TRUE;
+
+  cogl_program_set_uniform_matrix (program->program,
+                                   program->normal_matrix_uniform,
+                                   3, /* dimensions */
+                                   1, /* count */
+                                   FALSE, /* transpose */
+                                   program->normal_matrix);
+  mash_light_set_count_uniform_upload (light_set);
+}
+
+static void
+mash_light_set_upload_material (MashLightSet *light_set,
+                                MashLightSetProgram *program,
+                                CoglHandle material)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (mash_light_set_material_properties); i++)
+    {
+      float *last_value = program->material_values[i];
+      float vec[4];
+
+      if (program->material_uniforms[i] == -1)
+        continue;
+
+      switch (mash_light_set_material_properties[i].type)
+        {
+        case MATERIAL_PROP_TYPE_COLOR:
+          {
+            CoglColor color;
+            MaterialColorGetFunc get_func =
+              mash_light_set_material_properties[i].get_func;
+
+            get_func (material, &color);
+
+            vec[0] = cogl_color_get_red_float (&color);
+            vec[1] = cogl_color_get_green_float (&color);
+            vec[2] = cogl_color_get_blue_float (&color);
+            vec[3] = cogl_color_get_alpha_float (&color);
+          }
+          break;
+
+        case MATERIAL_PROP_TYPE_FLOAT:
+          {
+            MaterialFloatGetFunc get_func =
+              mash_light_set_material_properties[i].get_func;
+
+            vec[0] = get_func (material);
+            vec[1] = vec[2] = vec[3] = 0.0f;
+          }
+          break;
+        }
+
+      /* The program keeps the uniform values so consecutive actors
+         with the same material properties don't need to upload
+         anything. Comparing the values catches both different
+         materials with the same properties and a material that has
+         been modified since the last paint */
+      if ((program->material_values_valid & (1 << i)) &&
+          !memcmp (last_value, vec, sizeof (vec)))
+        continue;
+
+      memcpy (last_value, vec, sizeof (vec));
+      program->material_values_valid |= 1 << i;
+
+      switch (mash_light_set_material_properties[i].type)
+        {
+        case MATERIAL_PROP_TYPE_COLOR:
+          cogl_program_set_uniform_float (program->program,
+                                          program->material_uniforms[i],
+                                          4, /* n_components */
+                                          1, /* count */
+                                          vec);
+          break;
+
+        case MATERIAL_PROP_TYPE_FLOAT:
+          cogl_program_set_uniform_1f (program->program,
+                                       program->material_uniforms[i],
+                                       vec[0]);
+          break;
+        }
+
+      mash_light_set_count_uniform_upload (light_set);
+    }
+}
+
+static CoglBool
+get_layer_indices_cb (CoglPipeline *pipeline,
+                      int layer_index,
+                      void *user_data)
+{
+  GArray *layer_indices = user_data;
+
+  g_array_append_val (layer_indices, layer_index);
+
+  return TRUE;
+}
+
+static gboolean
+layer_indices_equal (GArray *a,
+                     GArray *b)
+{
+  return (a->len == b->len &&
+          !memcmp (a->data, b->data, a->len * sizeof (int)));
+}
+
+/* Draws with the program without changing the framebuffer so that
+   Cogl and the driver compile and link it straight away instead of
+   on the first real paint */
+static void
+mash_light_set_prewarm_program (MashLightSetProgram *program,
+                                CoglHandle material)
+{
+  CoglFramebuffer *framebuffer = cogl_get_draw_framebuffer ();
+  CoglColorMask old_color_mask;
+  CoglHandle copy;
+
+  MASH_TRACE_BEGIN ("prewarm light set program");
+
+  copy = cogl_material_copy (material);
+
+  cogl_material_set_user_program (copy, program->program);
+  cogl_material_set_depth_writing_enabled (copy, FALSE);
+
+  /* A zero-sized rectangle may be discarded before it reaches the
+     driver so a single pixel is drawn with all of the color channels
+     masked out instead */
+  old_color_mask = cogl_framebuffer_get_color_mask (framebuffer);
+  cogl_framebuffer_set_color_mask (framebuffer, COGL_COLOR_MASK_NONE);
+
+  cogl_push_source (copy);
+  cogl_rectangle (0.0f, 0.0f, 1.0f, 1.0f);
+  cogl_pop_source ();
+  cogl_flush ();
+
+  cogl_framebuffer_set_color_mask (framebuffer, old_color_mask);
+
+  cogl_handle_unref (copy);
+
+  MASH_TRACE_END ();
+}
+
+/* Throws away the least recently used programs until the cache is no
+   bigger than max_programs */
+static void
+mash_light_set_trim_programs (MashLightSet *light_set)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  GSList *last, *l;
+
+  last = g_slist_nth (priv->programs, priv->max_programs - 1);
+
+  if (last == NULL)
+    return;
+
+  for (l = last->next; l; l = l->next)
+    mash_light_set_free_program (l->data);
+
+  g_slist_free (last->next);
+  last->next = NULL;
+}
+
+/* Returns the program to use for @material and @variant, creating it
+   if it isn't in the cache. If @compile_time is not NULL then it is
+   set to the time in seconds taken to create the program or to a
+   negative value if it was already in the cache. If @prewarm is TRUE
+   then a new program is also linked by the driver before
+   returning */
+static MashLightSetProgram *
+mash_light_set_get_program (MashLightSet *light_set,
+                            CoglHandle material,
+                            int variant,
+                            gboolean prewarm,
+                            gdouble *compile_time)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  MashLightSetProgram *program;
+  GSList *l, *prev = NULL, *last_prev = NULL;
+  int n_programs = 0;
+  gint64 start_time;
+  gdouble elapsed;
+
+  if (compile_time)
+    *compile_time = -1.0;
+
+  /* Collect the layer indices used by the material. The array is
+     only ever truncated so after the first few paints this won't
+     need to allocate */
+  g_array_set_size (priv->layer_indices, 0);
+  cogl_pipeline_foreach_layer (COGL_PIPELINE (material),
+                               get_layer_indices_cb,
+                               priv->layer_indices);
+
+  for (l = priv->programs; l; l = l->next)
+    {
+      program = l->data;
+
+      if (program->variant == variant &&
+          layer_indices_equal (program->layer_indices, priv->layer_indices))
+        {
+          /* Move the program to the front of the list so that the
+             least recently used program will end up at the end */
+          if (prev)
+            {
+              prev->next = l->next;
+              l->next = priv->programs;
+              priv->programs = l;
+            }
+
+          return program;
+        }
+
+      last_prev = prev;
+      prev = l;
+      n_programs++;
+    }
+
+  /* If the cache is full then throw away the least recently used
+     program */
+  if (n_programs >= priv->max_programs)
+    {
+      mash_light_set_free_program (prev->data);
+      g_slist_free_1 (prev);
+      if (last_prev)
+        last_prev->next = NULL;
+      else
+        priv->programs = NULL;
+    }
+
+  start_time = g_get_monotonic_time ();
+
+  program = mash_light_set_create_program (light_set,
+                                           priv->layer_indices,
+                                           variant);
+
+  if (prewarm)
+    mash_light_set_prewarm_program (program, material);
+
+  elapsed = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+
+  priv->n_compiles++;
+  _mash_render_stats.n_program_compiles++;
+  priv->compile_time_total += elapsed;
+  priv->compile_time_max = MAX (priv->compile_time_max, elapsed);
+
+  if (compile_time)
+    *compile_time = elapsed;
+
+  priv->programs = g_slist_prepend (priv->programs, program);
+
+  return program;
+}
+
+/**
+ * mash_light_set_prepare:
+ * @light_set: A #MashLightSet instance
+ * @materials: (array length=n_materials): The materials that actors
+ *   using the light set will be painted with
+ * @n_materials: The number of materials in @materials
+ * @compile_times: (element-type gdouble) (allow-none): An array to
+ *   append the time of each compile to or %NULL
+ *
+ * Builds the programs that mash_light_set_begin_paint() would need to
+ * paint actors with each of @materials so that the first frame that
+ * shows them doesn't stall while the shaders are compiled. This is
+ * intended to be called during a loading screen after all of the
+ * lights have been added and the mode and the number of lights per
+ * actor have been chosen. Changing any of those or adding or removing
+ * a light afterwards may throw the programs away again.
+ *
+ * A program is needed for each layout of layers in the materials so
+ * materials with the same layout share a program. When the number of
+ * lights per actor is limited with mash_light_set_set_max_lights()
+ * all of the variants for each layout are built. The cache of programs
+ * is made big enough to keep all of the programs for @materials so
+ * painting with them won't throw any of them away.
+ *
+ * Only the current configuration of lights is prepared. The programs
+ * depend on which lights are in the set and on which of them are
+ * visible or have static parameters, so programs can't be built ahead
+ * of time for a configuration that the light set will only be in
+ * later. If the application switches between a few known
+ * configurations, for example by showing and hiding lights, then
+ * those changes regenerate the programs and this should be called
+ * again after each of them, for example behind a fade or a loading
+ * screen.
+ *
+ * The programs are drawn with once so that the driver compiles and
+ * links them straight away. This needs a current framebuffer, for
+ * example the one for a realized stage. The time in seconds taken to
+ * build each program is appended to @compile_times if it is not %NULL.
+ * The times are also included in the counters returned by
+ * mash_light_set_get_compile_stats().
+ *
+ * Return value: the number of programs that were built. Programs that
+ * were already built are not counted.
+ */
+guint
+mash_light_set_prepare (MashLightSet *light_set,
+                        CoglHandle *materials,
+                        guint n_materials,
+                        GArray *compile_times)
+{
+  MashLightSetPrivate *priv;
+  GHashTable *prepared;
+  guint old_max_programs;
+  guint n_built = 0;
+  guint i;
+
+  g_return_val_if_fail (MASH_IS_LIGHT_SET (light_set), 0);
+  g_return_val_if_fail (n_materials == 0 || materials != NULL, 0);
+
+  priv = light_set->priv;
+
+  for (i = 0; i < n_materials; i++)
+    g_return_val_if_fail (cogl_is_material (materials[i]), 0);
+
+  if (priv->light_data_dirty)
+    mash_light_set_update_light_data (light_set);
+
+  /* Nothing is thrown out of the cache while preparing so that a
+     program can't be replaced by one built later in the same call.
+     The cache is then sized to hold every program that was asked
+     for */
+  prepared = g_hash_table_new (g_direct_hash, g_direct_equal);
+  old_max_programs = priv->max_programs;
+  priv->max_programs = G_MAXUINT;
+
+  for (i = 0; i < n_materials; i++)
+    {
+      int variant = 0;
+
+      if (priv->mode != MASH_LIGHT_SET_MODE_PER_LIGHT &&
+          priv->max_lights > 0)
+        variant = 1;
+
+      /* Build every variant that mash_light_set_begin_paint() could
+         pick for this layout */
+      do
+        {
+          MashLightSetProgram *program;
+          gdouble compile_time;
+
+          program = mash_light_set_get_program (light_set,
+                                                materials[i],
+                                                variant,
+                                                TRUE, /* prewarm */
+                                                &compile_time);
+          g_hash_table_add (prepared, program);
+
+          if (compile_time >= 0.0)
+            {
+              n_built++;
+
+              if (compile_times)
+                g_array_append_val (compile_times, compile_time);
+            }
+
+          variant *= 2;
+        }
+      while (variant > 0 && variant / 2 < priv->max_lights);
+    }
+
+  priv->max_programs = MAX (old_max_programs,
+                            g_hash_table_size (prepared));
+  g_hash_table_destroy (prepared);
+
+  /* The prepared programs were all moved to the front of the list so
+     only older programs are thrown away here */
+  mash_light_set_trim_programs (light_set);
+
+  return n_built;
+}
+
+/**
+ * mash_light_set_begin_paint:
+ * @light_set: A #MashLightSet instance
+ * @material: The material that will be used to paint
+ *
+ * This function should only be needed by custom actors that wish to
+ * use the lighting model of Mash. The function should be called every
+ * time the actor is painted. The @material parameter is used to
+ * specify the lighting material properties. The material is not
+ * otherwise read or modified. The material properties that are used
+ * are: the emission color, the ambient color, the diffuse color, the
+ * specular color and the shininess.
+ *
+ * The return value is a CoglProgram that should be used to paint the
+ * actor. The actor should attach this to its material using
+ * cogl_material_set_user_program().
+ *
+ * #MashModel<!-- -->s are already designed to use this function when
+ * a light set is passed to mash_model_set_light_set().
+ *
+ * Return value: a CoglProgram to use for rendering.
+ *
+ * Since: 0.2
+ */
+CoglHandle
+mash_light_set_begin_paint (MashLightSet *light_set,
+                            CoglHandle material)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+  MashLightSetProgram *light_set_program;
+  CoglMatrix modelview_matrix;
+  CoglHandle program;
+  int n_lights = 0;
+  int variant = 0;
+  gint64 start_time;
+  gdouble elapsed;
+
+  MASH_TRACE_BEGIN ("mash_light_set_begin_paint");
+
+  start_time = g_get_monotonic_time ();
+
+  if (priv->light_data_dirty)
+    mash_light_set_update_light_data (light_set);
+
+  cogl_get_modelview_matrix (&modelview_matrix);
+
+  /* In the array modes the lights are picked before the program
+     because the number of lights may decide which variant is used */
+  if (priv->mode != MASH_LIGHT_SET_MODE_PER_LIGHT)
+    {
+      n_lights = mash_light_set_pick_lights (light_set, &modelview_matrix);
+
+      if (priv->max_lights > 0)
+        {
+          n_lights = mash_light_set_select_lights (light_set, n_lights);
+
+          /* Round up to the next program variant */
+          variant = 1;
+          while (variant < n_lights)
+            variant *= 2;
+        }
+
+      if (priv->mode == MASH_LIGHT_SET_MODE_CLUSTERED)
+        n_lights = mash_light_set_limit_cluster_lights (light_set, n_lights);
+    }
+
+  light_set_program = mash_light_set_get_program (light_set,
+                                                  material,
+                                                  variant,
+                                                  FALSE, /* prewarm */
+                                                  NULL);
+  program = light_set_program->program;
+
+  if (light_set_program->uniforms_dirty)
+    {
+      GSList *l;
+      int light_num = 0;
+
+      MASH_TRACE_BEGIN ("update light uniforms");
+
+      /* Give all of the lights a chance to update the uniforms before we
+         paint the first actor using this program. Each light only
+         uploads the values that changed since it last updated this
+         program */
+      for (l = priv->lights; l; l = l->next)
+        if (mash_light_set_light_has_snippet (light_set, l->data))
+          _mash_light_update_program_uniforms
+            (l->data, program,
+             &g_array_index (light_set_program->light_states,
+                             MashLightProgramState,
+                             light_num++));
+
+      /* The light data may have changed so the lights for the actor
+         will need to be uploaded even if they are the same lights */
+      light_set_program->draw_lights_valid = FALSE;
+
+      light_set_program->uniforms_dirty = FALSE;
+
+      MASH_TRACE_END ();
+    }
+
+  if (priv->mode == MASH_LIGHT_SET_MODE_PER_LIGHT &&
+      light_set_program->light_enabled_uniform != -1)
+    n_lights = mash_light_set_pick_lights (light_set, &modelview_matrix);
+
+  MASH_TRACE_BEGIN ("upload light set uniforms");
+
+  if (priv->mode != MASH_LIGHT_SET_MODE_PER_LIGHT ||
+      light_set_program->light_enabled_uniform != -1)
+    mash_light_set_upload_draw_lights (light_set,
+                                       light_set_program,
+                                       n_lights);
+
+  if (variant > 0)
+    mash_light_set_upload_folded_light (light_set, light_set_program);
+
+  if (light_set_program->normal_matrix_uniform != -1)
+    mash_light_set_upload_normal_matrix (light_set,
+                                         light_set_program,
+                                         &modelview_matrix);
+
+  mash_light_set_upload_material (light_set, light_set_program, material);
+
+  MASH_TRACE_END ();
+
+  priv->has_paint_bounds = FALSE;
+  priv->paint_normal_matrix_cache = NULL;
+
+  elapsed = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+  _mash_render_stats.begin_paint_time += elapsed;
+  priv->render_stats.begin_paint_time += elapsed;
+
+  MASH_TRACE_END ();
+
+  return program;
+}
+
+void
+_mash_light_set_light_changed (MashLightSet *light_set,
+                               MashLight *light,
+                               MashLightChange change)
+{
+  /* Lights in the arrays never generate their own snippet so they
+     can always be updated with uniforms. The other lights are left
+     out of the shader while they are hidden and their parameters are
+     baked into the shader if they are static */
+  if (mash_light_set_get_array_type (light_set, light) == -1 &&
+      (change == MASH_LIGHT_CHANGE_SHADER ||
+       change == MASH_LIGHT_CHANGE_VISIBILITY ||
+       (change == MASH_LIGHT_CHANGE_PARAMETERS &&
+        mash_light_get_static_parameters (light))))
+    mash_light_set_dirty_program (light_set);
+  else
+    /* Mark that we need to update the uniforms the next time an actor
+       is painted with each program. We can't just update the uniforms
+       immediately because this may be called during the allocation so
+       the rest of the lights may not have the correct position yet.
+       If nothing changes then the uniforms are left alone so a static
+       scene doesn't cost anything per frame */
+    mash_light_set_dirty_uniforms (light_set);
+}
+
+/**
+ * mash_light_set_add_light:
+ * @light_set: A #MashLightSet instance
+ * @light: A #MashLight
+ *
+ * This adds a light to the set. Lights need to be added to the light
+ * set as well as to a container somewhere in the Clutter actor
+ * hierarchy in order to be useful.
+ */
+void
+mash_light_set_add_light (MashLightSet *light_set,
+                          MashLight *light)
+{
+  MashLightSetPrivate *priv;
+  int array_type;
+
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+  g_return_if_fail (MASH_IS_LIGHT (light));
+
+  priv = light_set->priv;
+
+  priv->lights = g_slist_prepend (priv->lights, g_object_ref_sink (light));
+  _mash_light_add_light_set (light, light_set);
+
+  array_type = mash_light_set_get_array_type (light_set, light);
+
+  /* If the light goes in the uniform arrays then we only need to
+     update the uniforms. The arrays are grown before the lights are
+     packed if the light doesn't fit */
+  if (array_type != -1)
+    mash_light_set_dirty_uniforms (light_set);
+  else
+    mash_light_set_dirty_program (light_set);
+}
+
+/**
  * mash_light_set_remove_light:
  * @light_set: A #MashLightSet instance
  * @light: A #MashLight
@@ -615,6 +2749,14 @@ mash_light_set_remove_light (MashLightSet *light_set,
   for (l = priv->lights; l; l = l->next)
     if (l->data == light)
       {
+        /* Lights in the uniform arrays can be removed without
+           regenerating the program */
+        if (mash_light_set_get_array_type (light_set, light) != -1)
+          mash_light_set_dirty_uniforms (light_set);
+        else
+          mash_light_set_dirty_program (light_set);
+
+        _mash_light_remove_light_set (light, light_set);
         g_object_unref (light);
         if (prev)
           prev->next = l->next;
@@ -622,14 +2764,260 @@ mash_light_set_remove_light (MashLightSet *light_set,
           priv->lights = l->next;
         g_slist_free_1 (l);
 
-        mash_light_set_dirty_program (light_set);
-
         break;
       }
     else
       prev = l;
 }
 
+/**
+ * mash_light_set_set_mode:
+ * @light_set: A #MashLightSet instance
+ * @mode: The new mode
+ *
+ * Sets how the program for the lights in @light_set is generated. See
+ * #MashLightSetMode for a description of the modes. The default is
+ * %MASH_LIGHT_SET_MODE_PER_LIGHT.
+ *
+ * %MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS is useful when lights are
+ * frequently added, removed, shown or hidden because none of those
+ * cause the program to be recompiled. %MASH_LIGHT_SET_MODE_CLUSTERED
+ * is useful when there are many lights that each only affect a small
+ * part of the scene.
+ */
+void
+mash_light_set_set_mode (MashLightSet *light_set,
+                         MashLightSetMode mode)
+{
+  MashLightSetPrivate *priv;
+
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+
+  priv = light_set->priv;
+
+  if (priv->mode != mode)
+    {
+      priv->mode = mode;
+      mash_light_set_dirty_program (light_set);
+      priv->light_data_dirty = TRUE;
+      g_object_notify (G_OBJECT (light_set), "mode");
+    }
+}
+
+/**
+ * mash_light_set_get_mode:
+ * @light_set: A #MashLightSet instance
+ *
+ * Return value: the mode previously set with
+ * mash_light_set_set_mode().
+ */
+MashLightSetMode
+mash_light_set_get_mode (MashLightSet *light_set)
+{
+  g_return_val_if_fail (MASH_IS_LIGHT_SET (light_set),
+                        MASH_LIGHT_SET_MODE_PER_LIGHT);
+
+  return light_set->priv->mode;
+}
+
+/**
+ * mash_light_set_set_max_lights:
+ * @light_set: A #MashLightSet instance
+ * @max_lights: The maximum number of lights or 0
+ *
+ * Limits the number of point and spot lights that are evaluated for
+ * each actor to @max_lights, which can be at most 8. The lights that
+ * are estimated to contribute the most at the bounds of the actor are
+ * used and the rest are approximated by adding their color to the
+ * ambient term. A separate program is generated with room for 1, 2,
+ * 4 or 8 lights so the cost of the shader for an actor only depends
+ * on the number of lights that actually affect it, regardless of
+ * how many lights are in the scene.
+ *
+ * This only has an effect in %MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS and
+ * %MASH_LIGHT_SET_MODE_CLUSTERED modes. Directional lights always
+ * affect every actor. The default is 0 which means there is no
+ * limit.
+ */
+void
+mash_light_set_set_max_lights (MashLightSet *light_set,
+                               guint max_lights)
+{
+  MashLightSetPrivate *priv;
+
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+  g_return_if_fail (max_lights <= MASH_LIGHT_SET_MAX_TOP_LIGHTS);
+
+  priv = light_set->priv;
+
+  if (priv->max_lights != max_lights)
+    {
+      priv->max_lights = max_lights;
+      mash_light_set_dirty_program (light_set);
+      g_object_notify (G_OBJECT (light_set), "max-lights");
+    }
+}
+
+/**
+ * mash_light_set_get_max_lights:
+ * @light_set: A #MashLightSet instance
+ *
+ * Return value: the limit previously set with
+ * mash_light_set_set_max_lights().
+ */
+guint
+mash_light_set_get_max_lights (MashLightSet *light_set)
+{
+  g_return_val_if_fail (MASH_IS_LIGHT_SET (light_set), 0);
+
+  return light_set->priv->max_lights;
+}
+
+/**
+ * mash_light_set_get_cull_stats:
+ * @light_set: A #MashLightSet instance
+ * @n_tested: (out) (allow-none): return location for the number of
+ *   light evaluations that were tested
+ * @n_culled: (out) (allow-none): return location for the number of
+ *   light evaluations that were skipped
+ *
+ * Retrieves counters that can be used to see how effective the light
+ * culling is. Every time an actor with known bounds is painted, each
+ * point and spot light in @light_set is tested against the bounds.
+ * The light is culled for that actor if it is too far away to make a
+ * visible difference or if the actor is outside of the cone of a spot
+ * light. @n_tested is the number of tests performed and @n_culled is
+ * the number of those that resulted in the light being skipped. The
+ * counters accumulate until mash_light_set_reset_stats() is called.
+ */
+void
+mash_light_set_get_cull_stats (MashLightSet *light_set,
+                               guint *n_tested,
+                               guint *n_culled)
+{
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+
+  if (n_tested)
+    *n_tested = light_set->priv->n_lights_tested;
+  if (n_culled)
+    *n_culled = light_set->priv->n_lights_culled;
+}
+
+/**
+ * mash_light_set_get_n_uniform_uploads:
+ * @light_set: A #MashLightSet instance
+ *
+ * Retrieves the number of uniform values that @light_set has uploaded
+ * to its programs. Uniforms are only uploaded when their value
+ * differs from the value that the program already has so this can be
+ * used to check how much state is changing between actors. Uniforms
+ * uploaded by the lights themselves in
+ * %MASH_LIGHT_SET_MODE_PER_LIGHT mode are not included. The counter
+ * accumulates until mash_light_set_reset_stats() is called.
+ *
+ * Return value: the number of uniform uploads.
+ */
+guint
+mash_light_set_get_n_uniform_uploads (MashLightSet *light_set)
+{
+  g_return_val_if_fail (MASH_IS_LIGHT_SET (light_set), 0);
+
+  return light_set->priv->n_uniform_uploads;
+}
+
+/**
+ * mash_light_set_get_compile_stats:
+ * @light_set: A #MashLightSet instance
+ * @n_compiles: (out) (allow-none): return location for the number of
+ *   programs built
+ * @total_time: (out) (allow-none): return location for the total
+ *   time spent building them in seconds
+ * @max_time: (out) (allow-none): return location for the longest
+ *   time spent building a single program in seconds
+ *
+ * Retrieves counters for the programs that @light_set has built,
+ * either in mash_light_set_prepare() or lazily when an actor is
+ * painted. The times of programs built lazily only include the time
+ * taken by Cogl to create the program because the driver may defer
+ * the real work until the actor is drawn. The counters accumulate
+ * until mash_light_set_reset_stats() is called.
+ */
+void
+mash_light_set_get_compile_stats (MashLightSet *light_set,
+                                  guint *n_compiles,
+                                  gdouble *total_time,
+                                  gdouble *max_time)
+{
+  MashLightSetPrivate *priv;
+
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+
+  priv = light_set->priv;
+
+  if (n_compiles)
+    *n_compiles = priv->n_compiles;
+  if (total_time)
+    *total_time = priv->compile_time_total;
+  if (max_time)
+    *max_time = priv->compile_time_max;
+}
+
+/**
+ * mash_light_set_get_render_stats:
+ * @light_set: A #MashLightSet instance
+ * @stats: (out): A location to return the counters
+ *
+ * Retrieves the counters for the rendering work done for the models
+ * that use @light_set. The draws, triangles, vertices, pick passes
+ * and paint time are counted by each #MashModel that has @light_set
+ * as its light set. The program compiles and uniform uploads are the
+ * same as the counters returned by mash_light_set_get_compile_stats()
+ * and mash_light_set_get_n_uniform_uploads(). The matrix inversions only
+ * include the normal matrices calculated by @light_set and not those
+ * calculated by the lights. The counters accumulate until
+ * mash_light_set_reset_stats() is called. Use mash_render_stats_get()
+ * to get the counters for the whole library.
+ */
+void
+mash_light_set_get_render_stats (MashLightSet *light_set,
+                                 MashRenderStats *stats)
+{
+  MashLightSetPrivate *priv;
+
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+  g_return_if_fail (stats != NULL);
+
+  priv = light_set->priv;
+
+  *stats = priv->render_stats;
+  stats->n_program_compiles = priv->n_compiles;
+  stats->n_uniform_uploads = priv->n_uniform_uploads;
+}
+
+/**
+ * mash_light_set_reset_stats:
+ * @light_set: A #MashLightSet instance
+ *
+ * Resets the counters returned by mash_light_set_get_cull_stats(),
+ * mash_light_set_get_n_uniform_uploads(),
+ * mash_light_set_get_compile_stats() and
+ * mash_light_set_get_render_stats() to zero.
+ */
+void
+mash_light_set_reset_stats (MashLightSet *light_set)
+{
+  g_return_if_fail (MASH_IS_LIGHT_SET (light_set));
+
+  light_set->priv->n_lights_tested = 0;
+  light_set->priv->n_lights_culled = 0;
+  light_set->priv->n_uniform_uploads = 0;
+  light_set->priv->n_compiles = 0;
+  light_set->priv->compile_time_total = 0.0;
+  light_set->priv->compile_time_max = 0.0;
+  memset (&light_set->priv->render_stats, 0,
+          sizeof (light_set->priv->render_stats));
+}
+
 static float
 mash_light_set_get_shininess_wrapper (CoglMaterial *material)
 {
@@ -650,3 +3038,43 @@ mash_light_set_get_shininess_wrapper (CoglMaterial *material)
 
   return MAX (0.0001, shininess);
 }
+
+void
+_mash_light_set_set_paint_bounds (MashLightSet *light_set,
+                                  const ClutterVertex *min_vertex,
+                                  const ClutterVertex *max_vertex)
+{
+  MashLightSetPrivate *priv = light_set->priv;
+
+  priv->paint_bounds_min[0] = min_vertex->x;
+  priv->paint_bounds_min[1] = min_vertex->y;
+  priv->paint_bounds_min[2] = min_vertex->z;
+  priv->paint_bounds_max[0] = max_vertex->x;
+  priv->paint_bounds_max[1] = max_vertex->y;
+  priv->paint_bounds_max[2] = max_vertex->z;
+
+  priv->has_paint_bounds = TRUE;
+}
+
+void
+_mash_light_set_set_normal_matrix_cache (MashLightSet *light_set,
+                                         MashNormalMatrixCache *cache)
+{
+  light_set->priv->paint_normal_matrix_cache = cache;
+}
+
+void
+_mash_light_set_count_draws (MashLightSet *light_set,
+                             const MashRenderStats *before)
+{
+  MashRenderStats *stats = &light_set->priv->render_stats;
+  MashRenderStats delta;
+
+  _mash_render_stats_subtract (&delta, &_mash_render_stats, before);
+
+  stats->n_draws += delta.n_draws;
+  stats->n_triangles += delta.n_triangles;
+  stats->n_vertices += delta.n_vertices;
+  stats->n_pick_passes += delta.n_pick_passes;
+  stats->paint_time += delta.paint_time;
+}
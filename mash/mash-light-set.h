@@ -25,6 +25,7 @@
 
 #include <clutter/clutter.h>
 #include <mash/mash-light.h>
+#include <mash/mash-render-stats.h>
 
 G_BEGIN_DECLS
 
@@ -49,6 +50,46 @@ G_BEGIN_DECLS
                               MASH_LIGHT_SET,                           \
                               MashLightSetClass))
 
+/**
+ * MashLightSetMode:
+ * @MASH_LIGHT_SET_MODE_PER_LIGHT: Every light generates its own
+ *   snippet of GLSL with uniforms that are unique to the light. This
+ *   is the default. Adding, removing, showing or hiding a light
+ *   causes the program to be regenerated.
+ * @MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS: The built-in light types are
+ *   evaluated by one loop per light type which reads the light
+ *   parameters from a uniform array. The arrays have a fixed capacity
+ *   so adding, removing, showing or hiding a built-in light only
+ *   requires updating the uniforms. The program is only regenerated
+ *   if the number of lights of a type exceeds the capacity.
+ *   Subclasses of the built-in light types are still given their own
+ *   snippets.
+ * @MASH_LIGHT_SET_MODE_CLUSTERED: Like
+ *   %MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS except that the point and
+ *   spot lights are binned into a view-space grid of clusters using
+ *   the range given by their attenuation. Each time an actor is
+ *   painted only the lights in the clusters touched by the actor are
+ *   uploaded so the cost of lighting depends on the number of nearby
+ *   lights rather than the total number of lights. This is intended
+ *   for scenes with hundreds of small lights. Lights without a linear
+ *   or quadratic attenuation have an unlimited range and affect
+ *   every actor. Only a limited number of lights of each type can
+ *   affect a single actor. If more lights touch an actor then the
+ *   ones estimated to contribute the least are left out and counted
+ *   in the n_lights_dropped member of #MashRenderStats.
+ *
+ * Specifies how the program for a #MashLightSet is generated. This
+ * can be set with mash_light_set_set_mode(). In every mode a light
+ * that is hidden is left out of the program and doesn't light
+ * anything.
+ */
+typedef enum
+  {
+    MASH_LIGHT_SET_MODE_PER_LIGHT,
+    MASH_LIGHT_SET_MODE_UNIFORM_ARRAYS,
+    MASH_LIGHT_SET_MODE_CLUSTERED
+  } MashLightSetMode;
+
 typedef struct _MashLightSet        MashLightSet;
 typedef struct _MashLightSetClass   MashLightSetClass;
 typedef struct _MashLightSetPrivate MashLightSetPrivate;
@@ -87,6 +128,33 @@ void mash_light_set_add_light (MashLightSet *light_set,
 void mash_light_set_remove_light (MashLightSet *light_set,
                                   MashLight *light);
 
+void mash_light_set_set_mode (MashLightSet *light_set,
+                              MashLightSetMode mode);
+
+MashLightSetMode mash_light_set_get_mode (MashLightSet *light_set);
+
+void mash_light_set_set_max_lights (MashLightSet *light_set,
+                                    guint max_lights);
+
+guint mash_light_set_get_max_lights (MashLightSet *light_set);
+
+void mash_light_set_get_cull_stats (MashLightSet *light_set,
+                                    guint *n_tested,
+                                    guint *n_culled);
+guint mash_light_set_get_n_uniform_uploads (MashLightSet *light_set);
+void mash_light_set_get_compile_stats (MashLightSet *light_set,
+                                       guint *n_compiles,
+                                       gdouble *total_time,
+                                       gdouble *max_time);
+void mash_light_set_get_render_stats (MashLightSet *light_set,
+                                      MashRenderStats *stats);
+void mash_light_set_reset_stats (MashLightSet *light_set);
+
+guint mash_light_set_prepare (MashLightSet *light_set,
+                              CoglHandle *materials,
+                              guint n_materials,
+                              GArray *compile_times);
+
 CoglHandle mash_light_set_begin_paint (MashLightSet *light_set,
                                        CoglHandle material);
 
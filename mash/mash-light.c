@@ -50,6 +50,7 @@
 
 #include "mash-light.h"
 #include "mash-light-set.h"
+#include "mash-light-private.h"
 
 static void mash_light_get_property (GObject *object,
                                      guint prop_id,
@@ -60,6 +61,14 @@ static void mash_light_set_property (GObject *object,
                                      const GValue *value,
                                      GParamSpec *pspec);
 
+static void mash_light_dispose (GObject *object);
+static void mash_light_finalize (GObject *object);
+static void mash_light_notify (GObject *object,
+                               GParamSpec *pspec);
+
+static void mash_light_watch_ancestors (MashLight *light);
+static void mash_light_unwatch_ancestors (MashLight *light);
+
 static void mash_light_real_generate_shader (MashLight *light,
                                              GString *uniform_source,
                                              GString *main_source);
@@ -70,6 +79,10 @@ static void mash_light_real_update_uniforms (MashLight *light,
    unique string that we append to uniform symbols */
 #define MASH_LIGHT_UNIQUE_SYMBOL_SIZE (1 + 8)
 
+/* Size of the buffer used to build the unique uniform names without
+   allocating. Longer names fall back to the heap */
+#define MASH_LIGHT_UNIFORM_NAME_BUF_SIZE 64
+
 static const ClutterColor
 mash_light_default_color = { 0xff, 0xff, 0xff, 0xff };
 
@@ -102,24 +115,52 @@ struct _MashLightPrivate
      by all light types */
   ClutterColor light_colors[MASH_LIGHT_COLOR_COUNT];
 
-  int uniform_locations[MASH_LIGHT_COLOR_COUNT];
+  /* This is incremented whenever one of the parameters of the light
+     changes. The serial that the values in each program were
+     uploaded with is kept in its MashLightProgramState */
+  guint parameters_serial;
 
-  /* TRUE if the shader has changed since we last called
-     cogl_program_get_uniform_location for the color uniforms */
-  gboolean uniform_locations_dirty;
+  /* The state of the light in the program whose uniforms are being
+     updated. This is only set during
+     _mash_light_update_program_uniforms() */
+  MashLightProgramState *program_state;
 
-  /* Contains a bit for each light color. The bit is set if the color
-     value has changed since we last copied the values to the
-     uniforms */
-  guint dirty_uniforms;
+  /* The state used when mash_light_update_uniforms() is called
+     directly instead of by a light set. It only remembers the last
+     program it was used with */
+  MashLightProgramState own_program_state;
+  CoglHandle own_program;
+
+  /* If TRUE then the parameters of the light are baked into the
+     generated shader instead of being passed as uniforms */
+  gboolean static_parameters;
 
   /* This contains the modelview matrix for the light including all of
      its parent's transformations. It is probably expensive to
-     calculate and the matrix is used to update the uniforms for both
-     spot lights and point lights so it is cached to avoid calculating
-     it twice */
+     calculate so it is cached until the transformation or allocation
+     of the light or one of its ancestors changes. The normal matrix
+     is the inverse transpose of the upper 3x3 which is used to
+     transform directions */
   gboolean modelview_matrix_dirty;
   CoglMatrix modelview_matrix;
+  float normal_matrix[3 * 3];
+
+  /* This is incremented whenever the transformation may have
+     changed. Lights compare it with the value from their last upload
+     so that they only update the eye space uniforms when needed */
+  guint transform_serial;
+
+  /* The light and all of its ancestors. We have signal handlers
+     connected to each of these so that we know when the modelview
+     matrix becomes invalid */
+  GPtrArray *watched_actors;
+
+  /* The light sets that this light has been added to. These aren't
+     referenced because the light set removes itself when the light is
+     removed or the light set is disposed. The light sets are told
+     whenever anything about the light changes so that they don't
+     have to check the lights on every frame */
+  GSList *light_sets;
 };
 
 enum
@@ -128,7 +169,8 @@ enum
 
     PROP_AMBIENT,
     PROP_DIFFUSE,
-    PROP_SPECULAR
+    PROP_SPECULAR,
+    PROP_STATIC_PARAMETERS
   };
 
 static void
@@ -139,6 +181,9 @@ mash_light_class_init (MashLightClass *klass)
 
   gobject_class->get_property = mash_light_get_property;
   gobject_class->set_property = mash_light_set_property;
+  gobject_class->dispose = mash_light_dispose;
+  gobject_class->finalize = mash_light_finalize;
+  gobject_class->notify = mash_light_notify;
 
   klass->generate_shader = mash_light_real_generate_shader;
   klass->update_uniforms = mash_light_real_update_uniforms;
@@ -173,6 +218,19 @@ mash_light_class_init (MashLightClass *klass)
                                     | G_PARAM_STATIC_BLURB);
   g_object_class_install_property (gobject_class, PROP_SPECULAR, pspec);
 
+  pspec = g_param_spec_boolean ("static-parameters",
+                                "Static parameters",
+                                "Whether the parameters of the light are "
+                                "baked into the shader",
+                                FALSE,
+                                G_PARAM_READABLE | G_PARAM_WRITABLE
+                                | G_PARAM_STATIC_NAME
+                                | G_PARAM_STATIC_NICK
+                                | G_PARAM_STATIC_BLURB);
+  g_object_class_install_property (gobject_class,
+                                   PROP_STATIC_PARAMETERS,
+                                   pspec);
+
   g_type_class_add_private (klass, sizeof (MashLightPrivate));
 }
 
@@ -194,10 +252,185 @@ mash_light_init (MashLight *self)
   for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
     priv->light_colors[i] = mash_light_default_color;
 
-  priv->uniform_locations_dirty = TRUE;
-  priv->dirty_uniforms = (1 << MASH_LIGHT_COLOR_COUNT) - 1;
+  priv->own_program = COGL_INVALID_HANDLE;
 
   priv->modelview_matrix_dirty = TRUE;
+
+  priv->watched_actors = g_ptr_array_new ();
+  mash_light_watch_ancestors (self);
+}
+
+static void
+mash_light_dispose (GObject *object)
+{
+  MashLight *light = MASH_LIGHT (object);
+
+  mash_light_unwatch_ancestors (light);
+
+  G_OBJECT_CLASS (mash_light_parent_class)->dispose (object);
+}
+
+static void
+mash_light_finalize (GObject *object)
+{
+  MashLight *light = MASH_LIGHT (object);
+
+  g_ptr_array_free (light->priv->watched_actors, TRUE);
+  g_slist_free (light->priv->light_sets);
+
+  G_OBJECT_CLASS (mash_light_parent_class)->finalize (object);
+}
+
+static void
+mash_light_notify_light_sets (MashLight *light,
+                              MashLightChange change)
+{
+  GSList *l;
+
+  for (l = light->priv->light_sets; l; l = l->next)
+    _mash_light_set_light_changed (l->data, light, change);
+}
+
+static void
+mash_light_transform_changed (MashLight *light)
+{
+  MashLightPrivate *priv = light->priv;
+
+  priv->modelview_matrix_dirty = TRUE;
+  priv->transform_serial++;
+
+  mash_light_notify_light_sets (light, MASH_LIGHT_CHANGE_STATE);
+}
+
+static void
+mash_light_allocation_changed_cb (ClutterActor *actor,
+                                  const ClutterActorBox *box,
+                                  ClutterAllocationFlags flags,
+                                  MashLight *light)
+{
+  mash_light_transform_changed (light);
+}
+
+/* The properties of an actor that affect its transformation. The
+   position and size are caught by the allocation handler instead.
+   Some of these only exist in newer versions of Clutter but
+   connecting to the notify signal for a property that doesn't exist
+   is harmless */
+static const char * const
+mash_light_transform_signals[] =
+  {
+    "notify::scale-x", "notify::scale-y", "notify::scale-z",
+    "notify::scale-center-x", "notify::scale-center-y",
+    "notify::scale-gravity",
+    "notify::rotation-angle-x", "notify::rotation-angle-y",
+    "notify::rotation-angle-z",
+    "notify::rotation-center-x", "notify::rotation-center-y",
+    "notify::rotation-center-z", "notify::rotation-center-z-gravity",
+    "notify::anchor-x", "notify::anchor-y", "notify::anchor-gravity",
+    "notify::depth", "notify::z-position",
+    "notify::translation-x", "notify::translation-y",
+    "notify::translation-z",
+    "notify::pivot-point", "notify::pivot-point-z",
+    "notify::transform", "notify::child-transform",
+    "notify::perspective"
+  };
+
+static void
+mash_light_transform_notify_cb (ClutterActor *actor,
+                                GParamSpec *pspec,
+                                MashLight *light)
+{
+  mash_light_transform_changed (light);
+}
+
+static void
+mash_light_notify (GObject *object,
+                   GParamSpec *pspec)
+{
+  MashLight *light = MASH_LIGHT (object);
+
+  /* This is the only place that tells the light sets about changes to
+     the light's own properties so the setters only need to notify
+     them. Any properties installed by MashLight or a subclass are
+     parameters of the light. Hidden lights are skipped by the light
+     set */
+  if (g_type_is_a (pspec->owner_type, MASH_TYPE_LIGHT))
+    {
+      light->priv->parameters_serial++;
+      mash_light_notify_light_sets (light,
+                                    !strcmp (pspec->name, "static-parameters")
+                                    ? MASH_LIGHT_CHANGE_SHADER
+                                    : MASH_LIGHT_CHANGE_PARAMETERS);
+    }
+  else if (!strcmp (pspec->name, "visible"))
+    mash_light_notify_light_sets (light, MASH_LIGHT_CHANGE_VISIBILITY);
+
+  if (G_OBJECT_CLASS (mash_light_parent_class)->notify)
+    G_OBJECT_CLASS (mash_light_parent_class)->notify (object, pspec);
+}
+
+static void
+mash_light_parent_set_cb (ClutterActor *actor,
+                          ClutterActor *old_parent,
+                          MashLight *light)
+{
+  /* The chain of ancestors has changed so we need to start watching
+     the new ones */
+  mash_light_watch_ancestors (light);
+  mash_light_transform_changed (light);
+}
+
+static void
+mash_light_unwatch_ancestors (MashLight *light)
+{
+  MashLightPrivate *priv = light->priv;
+  int i;
+
+  for (i = 0; i < priv->watched_actors->len; i++)
+    {
+      ClutterActor *actor = g_ptr_array_index (priv->watched_actors, i);
+
+      g_signal_handlers_disconnect_by_func (actor,
+                                            mash_light_allocation_changed_cb,
+                                            light);
+      g_signal_handlers_disconnect_by_func (actor,
+                                            mash_light_transform_notify_cb,
+                                            light);
+      g_signal_handlers_disconnect_by_func (actor,
+                                            mash_light_parent_set_cb,
+                                            light);
+    }
+
+  g_ptr_array_set_size (priv->watched_actors, 0);
+}
+
+static void
+mash_light_watch_ancestors (MashLight *light)
+{
+  MashLightPrivate *priv = light->priv;
+  ClutterActor *actor;
+
+  mash_light_unwatch_ancestors (light);
+
+  for (actor = CLUTTER_ACTOR (light);
+       actor;
+       actor = clutter_actor_get_parent (actor))
+    {
+      int i;
+
+      g_signal_connect (actor, "allocation-changed",
+                        G_CALLBACK (mash_light_allocation_changed_cb),
+                        light);
+      for (i = 0; i < G_N_ELEMENTS (mash_light_transform_signals); i++)
+        g_signal_connect (actor, mash_light_transform_signals[i],
+                          G_CALLBACK (mash_light_transform_notify_cb),
+                          light);
+      g_signal_connect (actor, "parent-set",
+                        G_CALLBACK (mash_light_parent_set_cb),
+                        light);
+
+      g_ptr_array_add (priv->watched_actors, actor);
+    }
 }
 
 static void
@@ -234,6 +467,10 @@ mash_light_get_property (GObject *object,
       }
       break;
 
+    case PROP_STATIC_PARAMETERS:
+      g_value_set_boolean (value, mash_light_get_static_parameters (light));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -262,6 +499,10 @@ mash_light_set_property (GObject *object,
       mash_light_set_specular (light, clutter_value_get_color (value));
       break;
 
+    case PROP_STATIC_PARAMETERS:
+      mash_light_set_static_parameters (light, g_value_get_boolean (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -292,10 +533,9 @@ mash_light_set_ambient (MashLight *light, const ClutterColor *ambient)
   priv = light->priv;
 
   if (!clutter_color_equal (ambient,
-                            &priv->light_colors + MASH_LIGHT_COLOR_AMBIENT))
+                            priv->light_colors + MASH_LIGHT_COLOR_AMBIENT))
     {
       priv->light_colors[MASH_LIGHT_COLOR_AMBIENT] = *ambient;
-      priv->dirty_uniforms |= 1 << MASH_LIGHT_COLOR_AMBIENT;
       g_object_notify (G_OBJECT (light), "ambient");
     }
 }
@@ -336,10 +576,9 @@ mash_light_set_diffuse (MashLight *light, const ClutterColor *diffuse)
   priv = light->priv;
 
   if (!clutter_color_equal (diffuse,
-                            &priv->light_colors + MASH_LIGHT_COLOR_DIFFUSE))
+                            priv->light_colors + MASH_LIGHT_COLOR_DIFFUSE))
     {
       priv->light_colors[MASH_LIGHT_COLOR_DIFFUSE] = *diffuse;
-      priv->dirty_uniforms |= 1 << MASH_LIGHT_COLOR_DIFFUSE;
       g_object_notify (G_OBJECT (light), "diffuse");
     }
 }
@@ -382,10 +621,9 @@ mash_light_set_specular (MashLight *light, const ClutterColor *specular)
   priv = light->priv;
 
   if (!clutter_color_equal (specular,
-                            &priv->light_colors + MASH_LIGHT_COLOR_SPECULAR))
+                            priv->light_colors + MASH_LIGHT_COLOR_SPECULAR))
     {
       priv->light_colors[MASH_LIGHT_COLOR_SPECULAR] = *specular;
-      priv->dirty_uniforms |= 1 << MASH_LIGHT_COLOR_SPECULAR;
       g_object_notify (G_OBJECT (light), "specular");
     }
 }
@@ -405,6 +643,62 @@ mash_light_get_specular (MashLight *light, ClutterColor *specular)
   *specular = light->priv->light_colors[MASH_LIGHT_COLOR_SPECULAR];
 }
 
+/**
+ * mash_light_set_static_parameters:
+ * @light: The #MashLight to modify
+ * @static_parameters: Whether the parameters are static
+ *
+ * Declares whether the parameters of the light such as its colors
+ * and attenuation are expected to stay the same. Static parameters
+ * are baked into the shader generated by #MashLightSet as constants
+ * instead of being passed as uniforms. This lets the shader skip the
+ * terms that can't contribute anything, for example the specular
+ * term of a light whose specular color is black. The ambient
+ * contribution of static lights that are not attenuated is summed
+ * into a single constant.
+ *
+ * The parameters can still be changed but each change will cause the
+ * shader to be regenerated so it should not be done often. The
+ * position and direction of the light are always passed as uniforms
+ * so the light can still be moved freely.
+ *
+ * This only affects lights that generate their own shader snippet,
+ * which is all lights in %MASH_LIGHT_SET_MODE_PER_LIGHT mode.
+ */
+void
+mash_light_set_static_parameters (MashLight *light,
+                                  gboolean static_parameters)
+{
+  MashLightPrivate *priv;
+
+  g_return_if_fail (MASH_IS_LIGHT (light));
+
+  priv = light->priv;
+
+  static_parameters = !!static_parameters;
+
+  if (priv->static_parameters != static_parameters)
+    {
+      priv->static_parameters = static_parameters;
+      g_object_notify (G_OBJECT (light), "static-parameters");
+    }
+}
+
+/**
+ * mash_light_get_static_parameters:
+ * @light: The #MashLight to query
+ *
+ * Return value: whether the parameters of the light have been
+ * declared static with mash_light_set_static_parameters().
+ */
+gboolean
+mash_light_get_static_parameters (MashLight *light)
+{
+  g_return_val_if_fail (MASH_IS_LIGHT (light), FALSE);
+
+  return light->priv->static_parameters;
+}
+
 /**
  * mash_light_generate_shader:
  * @light: A #MashLight
@@ -506,7 +800,19 @@ mash_light_generate_shader (MashLight *light,
  * the paint sequence of #MashLightSet on every light before any other
  * actors are painted. This gives the light implementation a chance to
  * update any uniforms it may have declared in the override of
- * mash_light_generate_shader().
+ * mash_light_generate_shader(). It is only called after something
+ * that may affect the lighting has changed, such as a property of one
+ * of the lights or the transformation of a light or one of its
+ * ancestors. Subclasses that have their own parameters should emit
+ * #GObject::notify for a property when one changes so that the light
+ * set notices.
+ *
+ * The light set keeps a separate program for each layout of material
+ * layers that it is painted with so this may be called with several
+ * different programs. The uniform values are stored separately in
+ * each program so if @program is not the same as the one passed in
+ * the last call then the implementation should query the uniform
+ * locations again and update all of its uniforms.
  *
  * The program is always made current with cogl_program_use() before
  * this method is called so it is safe to directly call
@@ -520,9 +826,68 @@ mash_light_generate_shader (MashLight *light,
 void
 mash_light_update_uniforms (MashLight *light, CoglHandle program)
 {
+  MashLightPrivate *priv;
+
   g_return_if_fail (MASH_IS_LIGHT (light));
 
+  priv = light->priv;
+
+  /* Without a light set to keep the state for each program only the
+     last program is remembered */
+  if (priv->own_program != program)
+    {
+      priv->own_program_state.initialized = FALSE;
+      priv->own_program = program;
+    }
+
+  _mash_light_update_program_uniforms (light, program,
+                                       &priv->own_program_state);
+}
+
+void
+_mash_light_update_program_uniforms (MashLight *light,
+                                     CoglHandle program,
+                                     MashLightProgramState *state)
+{
+  MashLightPrivate *priv = light->priv;
+
+  priv->program_state = state;
+
   MASH_LIGHT_GET_CLASS (light)->update_uniforms (light, program);
+
+  priv->program_state = NULL;
+
+  state->initialized = TRUE;
+  state->parameters_serial = priv->parameters_serial;
+  state->transform_serial = priv->transform_serial;
+}
+
+MashLightProgramState *
+_mash_light_get_program_state (MashLight *light)
+{
+  MashLightPrivate *priv = light->priv;
+
+  /* A subclass may run the virtual without going through
+     mash_light_update_uniforms() */
+  return priv->program_state ? priv->program_state : &priv->own_program_state;
+}
+
+gboolean
+_mash_light_parameters_changed (MashLight *light)
+{
+  MashLightProgramState *state = _mash_light_get_program_state (light);
+
+  return (!state->initialized ||
+          state->parameters_serial != light->priv->parameters_serial);
+}
+
+gboolean
+_mash_light_transform_changed (MashLight *light)
+{
+  MashLightProgramState *state = _mash_light_get_program_state (light);
+
+  return (!state->initialized ||
+          state->transform_serial != light->priv->transform_serial);
 }
 
 /**
@@ -599,37 +964,147 @@ mash_light_get_uniform_location (MashLight *light,
                                  const char *uniform_name)
 {
   MashLightPrivate *priv;
+  char buf[MASH_LIGHT_UNIFORM_NAME_BUF_SIZE];
   char *unique_name;
+  size_t name_len;
   int location;
 
   g_return_val_if_fail (MASH_IS_LIGHT (light), -1);
 
   priv = light->priv;
 
-  /* Append this light's unique identifier to the uniform name */
-  unique_name = g_strconcat (uniform_name, priv->unique_str, NULL);
+  /* Append this light's unique identifier to the uniform name. This
+     can be called during a paint whenever the light set switches
+     programs so the name is built on the stack unless it is too
+     long */
+  name_len = strlen (uniform_name);
+
+  if (name_len + MASH_LIGHT_UNIQUE_SYMBOL_SIZE < sizeof (buf))
+    {
+      memcpy (buf, uniform_name, name_len);
+      memcpy (buf + name_len, priv->unique_str,
+              MASH_LIGHT_UNIQUE_SYMBOL_SIZE + 1);
+      unique_name = buf;
+    }
+  else
+    unique_name = g_strconcat (uniform_name, priv->unique_str, NULL);
 
   location = cogl_program_get_uniform_location (program, unique_name);
 
-  g_free (unique_name);
+  if (unique_name != buf)
+    g_free (unique_name);
 
   return location;
 }
 
+/* Gets the complete modelview matrix for @actor by walking up the
+   hierarchy and applying each parent's transformation before the
+   transformations accumulated so far. @actor can be NULL to get the
+   identity matrix */
+static void
+mash_light_get_actor_modelview (ClutterActor *actor,
+                                CoglMatrix *matrix)
+{
+  CoglMatrix matrices[2];
+  int current = 0;
+
+  cogl_matrix_init_identity (&matrices[current]);
+
+  for (; actor; actor = clutter_actor_get_parent (actor))
+    {
+      CoglMatrix actor_matrix;
+
+      cogl_matrix_init_identity (&actor_matrix);
+      clutter_actor_get_transformation_matrix (actor, &actor_matrix);
+
+      cogl_matrix_multiply (&matrices[!current],
+                            &actor_matrix,
+                            &matrices[current]);
+      current = !current;
+    }
+
+  *matrix = matrices[current];
+}
+
+/* Recalculates the cached modelview and normal matrices from the
+   complete modelview matrix of the light's parent */
+static void
+mash_light_update_modelview_matrix (MashLight *light,
+                                    const CoglMatrix *parent_matrix)
+{
+  MashLightPrivate *priv = light->priv;
+  CoglMatrix actor_matrix;
+  float m[3 * 3];
+
+  cogl_matrix_init_identity (&actor_matrix);
+  clutter_actor_get_transformation_matrix (CLUTTER_ACTOR (light),
+                                           &actor_matrix);
+
+  cogl_matrix_multiply (&priv->modelview_matrix,
+                        parent_matrix,
+                        &actor_matrix);
+
+  m[0] = priv->modelview_matrix.xx;
+  m[1] = priv->modelview_matrix.yx;
+  m[2] = priv->modelview_matrix.zx;
+  m[3] = priv->modelview_matrix.xy;
+  m[4] = priv->modelview_matrix.yy;
+  m[5] = priv->modelview_matrix.zy;
+  m[6] = priv->modelview_matrix.xz;
+  m[7] = priv->modelview_matrix.yz;
+  m[8] = priv->modelview_matrix.zz;
+
+  _mash_calculate_normal_matrix (m, priv->normal_matrix);
+
+  priv->modelview_matrix_dirty = FALSE;
+}
+
+/* Recalculates the cached modelview and normal matrices if the
+   transformation has changed since they were last calculated */
 static void
-transpose_matrix (const CoglMatrix *matrix,
-                  CoglMatrix *transpose)
+mash_light_ensure_modelview_matrix (MashLight *light)
+{
+  if (light->priv->modelview_matrix_dirty)
+    {
+      CoglMatrix parent_matrix;
+
+      mash_light_get_actor_modelview
+        (clutter_actor_get_parent (CLUTTER_ACTOR (light)), &parent_matrix);
+
+      mash_light_update_modelview_matrix (light, &parent_matrix);
+    }
+}
+
+void
+_mash_light_ensure_eye_transforms (MashLight * const *lights,
+                                   int n_lights)
 {
-  const float *matrix_p = cogl_matrix_get_array (matrix);
-  float matrix_array[16];
-  int i, j;
+  ClutterActor *last_parent = NULL;
+  gboolean have_parent_matrix = FALSE;
+  CoglMatrix parent_matrix;
+  int i;
+
+  for (i = 0; i < n_lights; i++)
+    {
+      ClutterActor *parent;
+
+      if (!lights[i]->priv->modelview_matrix_dirty)
+        continue;
 
-  /* This should probably be in Cogl */
-  for (j = 0; j < 4; j++)
-    for (i = 0; i < 4; i++)
-      matrix_array[i * 4 + j] = matrix_p[j * 4 + i];
+      /* Lights are usually added to the same container one after
+         another so the parent's matrix is only recalculated when the
+         parent differs from the previous dirty light's */
+      parent = clutter_actor_get_parent (CLUTTER_ACTOR (lights[i]));
 
-  cogl_matrix_init_from_array (transpose, matrix_array);
+      if (!have_parent_matrix || parent != last_parent)
+        {
+          mash_light_get_actor_modelview (parent, &parent_matrix);
+          last_parent = parent;
+          have_parent_matrix = TRUE;
+        }
+
+      mash_light_update_modelview_matrix (lights[i], &parent_matrix);
+    }
 }
 
 /**
@@ -646,41 +1121,9 @@ void
 mash_light_get_modelview_matrix (MashLight *light,
                                  CoglMatrix *matrix)
 {
-  MashLightPrivate *priv = light->priv;
+  mash_light_ensure_modelview_matrix (light);
 
-  if (priv->modelview_matrix_dirty)
-    {
-      ClutterActor *actor;
-      GSList *parents = NULL, *l;
-
-      cogl_matrix_init_identity (&priv->modelview_matrix);
-
-      /* Get the complete modelview matrix for light by applying all of
-         its parent transformations as well as its own in reverse */
-      for (actor = CLUTTER_ACTOR (light);
-           actor;
-           actor = clutter_actor_get_parent (actor))
-        parents = g_slist_prepend (parents, actor);
-
-      for (l = parents; l; l = l->next)
-        {
-          CoglMatrix actor_matrix;
-
-          cogl_matrix_init_identity (&actor_matrix);
-          clutter_actor_get_transformation_matrix (CLUTTER_ACTOR (l->data),
-                                                   &actor_matrix);
-
-          cogl_matrix_multiply (&priv->modelview_matrix,
-                                &priv->modelview_matrix,
-                                &actor_matrix);
-        }
-
-      g_slist_free (parents);
-
-      priv->modelview_matrix_dirty = FALSE;
-    }
-
-  *matrix = priv->modelview_matrix;
+  *matrix = light->priv->modelview_matrix;
 }
 
 /**
@@ -706,38 +1149,364 @@ mash_light_set_direction_uniform (MashLight *light,
                                   int uniform_location,
                                   const float *direction_in)
 {
-  float light_direction[4];
-  CoglMatrix matrix, inverse_matrix;
-  float magnitude;
+  float light_direction[3];
 
-  memcpy (light_direction, direction_in, sizeof (light_direction));
+  _mash_light_get_eye_direction (light, direction_in, light_direction);
 
-  mash_light_get_modelview_matrix (light, &matrix);
+  cogl_program_set_uniform_float (program,
+                                  uniform_location,
+                                  3, 1,
+                                  light_direction);
+}
 
-  /* To safely transform the direction when the matrix might not be
-     orthogonal we need the transposed inverse matrix */
+void
+_mash_light_get_eye_direction (MashLight *light,
+                               const float *direction_in,
+                               float *direction_out)
+{
+  MashLightPrivate *priv = light->priv;
+  const float *n = priv->normal_matrix;
+  float light_direction[3];
+  float magnitude;
+  int i;
 
-  cogl_matrix_get_inverse (&matrix, &inverse_matrix);
-  transpose_matrix (&inverse_matrix, &matrix);
+  mash_light_ensure_modelview_matrix (light);
 
-  cogl_matrix_transform_point (&matrix,
-                               light_direction + 0,
-                               light_direction + 1,
-                               light_direction + 2,
-                               light_direction + 3);
+  /* To safely transform the direction when the matrix might not be
+     orthogonal we need the transposed inverse matrix. This is stored
+     in column-major order */
+  for (i = 0; i < 3; i++)
+    light_direction[i] = (n[i] * direction_in[0] +
+                          n[i + 3] * direction_in[1] +
+                          n[i + 6] * direction_in[2]);
 
   /* Normalize the light direction */
   magnitude = sqrtf ((light_direction[0] * light_direction[0])
                      + (light_direction[1] * light_direction[1])
                      + (light_direction[2] * light_direction[2]));
-  light_direction[0] /= magnitude;
-  light_direction[1] /= magnitude;
-  light_direction[2] /= magnitude;
+  direction_out[0] = light_direction[0] / magnitude;
+  direction_out[1] = light_direction[1] / magnitude;
+  direction_out[2] = light_direction[2] / magnitude;
+}
 
-  cogl_program_set_uniform_float (program,
-                                  uniform_location,
-                                  3, 1,
-                                  light_direction);
+const float *
+_mash_light_get_eye_transform (MashLight *light,
+                               float *translation)
+{
+  MashLightPrivate *priv = light->priv;
+
+  mash_light_ensure_modelview_matrix (light);
+
+  translation[0] = priv->modelview_matrix.xw;
+  translation[1] = priv->modelview_matrix.yw;
+  translation[2] = priv->modelview_matrix.zw;
+  translation[3] = priv->modelview_matrix.ww;
+
+  return priv->normal_matrix;
+}
+
+#ifdef MASH_USE_SSE
+
+/* Rotates the first three components of a vector to y, z, x or z, x,
+   y */
+#define MASH_LIGHT_YZX(v) _mm_shuffle_ps ((v), (v), _MM_SHUFFLE (3, 0, 2, 1))
+#define MASH_LIGHT_ZXY(v) _mm_shuffle_ps ((v), (v), _MM_SHUFFLE (3, 1, 0, 2))
+
+static inline __m128
+mash_light_cross_sse (__m128 a,
+                      __m128 b)
+{
+  return _mm_sub_ps (_mm_mul_ps (MASH_LIGHT_YZX (a), MASH_LIGHT_ZXY (b)),
+                     _mm_mul_ps (MASH_LIGHT_ZXY (a), MASH_LIGHT_YZX (b)));
+}
+
+/* The same as the scalar version below with each column in a
+   register. The last column is loaded and stored one float early so
+   that nothing outside of the two 3x3 matrices is touched. This takes
+   less than half of the time of the scalar version */
+static void
+mash_light_invert_transpose (const float *m,
+                             float *normal_matrix)
+{
+  __m128 c0 = _mm_loadu_ps (m);
+  __m128 c1 = _mm_loadu_ps (m + 3);
+  __m128 c2 = _mm_loadu_ps (m + 5);
+  __m128 n0, n1, n2, det, last;
+
+  c2 = _mm_shuffle_ps (c2, c2, _MM_SHUFFLE (3, 3, 2, 1));
+
+  n0 = mash_light_cross_sse (c1, c2);
+  n1 = mash_light_cross_sse (c2, c0);
+  n2 = mash_light_cross_sse (c0, c1);
+
+  det = _mm_mul_ps (c0, n0);
+  det = _mm_add_ss (_mm_add_ss (det, _mm_shuffle_ps (det, det, 1)),
+                    _mm_shuffle_ps (det, det, 2));
+
+  if (_mm_comilt_ss (det, _mm_setzero_ps ()))
+    {
+      __m128 sign = _mm_set1_ps (-0.0f);
+
+      n0 = _mm_xor_ps (n0, sign);
+      n1 = _mm_xor_ps (n1, sign);
+      n2 = _mm_xor_ps (n2, sign);
+    }
+
+  /* Put the last element of the second column in front of the third
+     column */
+  last = _mm_shuffle_ps (n1, n2, _MM_SHUFFLE (0, 0, 2, 2));
+  last = _mm_shuffle_ps (last, n2, _MM_SHUFFLE (2, 1, 2, 0));
+
+  _mm_storeu_ps (normal_matrix, n0);
+  _mm_storeu_ps (normal_matrix + 3, n1);
+  _mm_storeu_ps (normal_matrix + 5, last);
+}
+
+#else /* MASH_USE_SSE */
+
+/* The columns of the inverse transpose are the cross products of the
+   other two columns divided by the determinant. Only the sign of the
+   determinant matters because of the normalization */
+static void
+mash_light_invert_transpose (const float *m,
+                             float *normal_matrix)
+{
+  float det;
+  int i;
+
+  normal_matrix[0] = m[4] * m[8] - m[5] * m[7];
+  normal_matrix[1] = m[5] * m[6] - m[3] * m[8];
+  normal_matrix[2] = m[3] * m[7] - m[4] * m[6];
+
+  normal_matrix[3] = m[7] * m[2] - m[8] * m[1];
+  normal_matrix[4] = m[8] * m[0] - m[6] * m[2];
+  normal_matrix[5] = m[6] * m[1] - m[7] * m[0];
+
+  normal_matrix[6] = m[1] * m[5] - m[2] * m[4];
+  normal_matrix[7] = m[2] * m[3] - m[0] * m[5];
+  normal_matrix[8] = m[0] * m[4] - m[1] * m[3];
+
+  det = (m[0] * normal_matrix[0] +
+         m[1] * normal_matrix[1] +
+         m[2] * normal_matrix[2]);
+
+  if (det < 0.0f)
+    for (i = 0; i < 3 * 3; i++)
+      normal_matrix[i] = -normal_matrix[i];
+}
+
+#endif /* MASH_USE_SSE */
+
+gboolean
+_mash_calculate_normal_matrix (const float *m,
+                               float *normal_matrix)
+{
+  float dot_01, dot_02, dot_12;
+  float len_0, len_1, len_2;
+
+  len_0 = m[0] * m[0] + m[1] * m[1] + m[2] * m[2];
+  len_1 = m[3] * m[3] + m[4] * m[4] + m[5] * m[5];
+  len_2 = m[6] * m[6] + m[7] * m[7] + m[8] * m[8];
+  dot_01 = m[0] * m[3] + m[1] * m[4] + m[2] * m[5];
+  dot_02 = m[0] * m[6] + m[1] * m[7] + m[2] * m[8];
+  dot_12 = m[3] * m[6] + m[4] * m[7] + m[5] * m[8];
+
+  /* If the columns are orthogonal and all the same length then the
+     matrix is a rotation with a uniform scale. The inverse transpose
+     is then the same matrix divided by the square of the scale. The
+     results are always normalized so the matrix can be used
+     directly */
+  if (fabsf (len_0 - len_1) <= 1e-4f * len_0 &&
+      fabsf (len_0 - len_2) <= 1e-4f * len_0 &&
+      fabsf (dot_01) <= 1e-4f * len_0 &&
+      fabsf (dot_02) <= 1e-4f * len_0 &&
+      fabsf (dot_12) <= 1e-4f * len_0)
+    {
+      memcpy (normal_matrix, m, sizeof (float) * 3 * 3);
+      return FALSE;
+    }
+
+  mash_light_invert_transpose (m, normal_matrix);
+
+  _mash_render_stats.n_matrix_inversions++;
+
+  return TRUE;
+}
+
+guint
+_mash_light_get_transform_serial (MashLight *light)
+{
+  return light->priv->transform_serial;
+}
+
+void
+_mash_light_add_light_set (MashLight *light,
+                           MashLightSet *light_set)
+{
+  MashLightPrivate *priv = light->priv;
+
+  priv->light_sets = g_slist_prepend (priv->light_sets, light_set);
+}
+
+void
+_mash_light_remove_light_set (MashLight *light,
+                              MashLightSet *light_set)
+{
+  MashLightPrivate *priv = light->priv;
+
+  priv->light_sets = g_slist_remove (priv->light_sets, light_set);
+}
+
+void
+_mash_append_glsl_float (GString *string,
+                         float value)
+{
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  /* This always includes a decimal point and an exponent so that GLSL
+     parses it as a float regardless of the locale */
+  g_string_append (string, g_ascii_formatd (buf, sizeof (buf), "%.8e", value));
+}
+
+void
+_mash_append_glsl_vec3 (GString *string,
+                        const float *value)
+{
+  int i;
+
+  g_string_append (string, "vec3 (");
+
+  for (i = 0; i < 3; i++)
+    {
+      if (i > 0)
+        g_string_append (string, ", ");
+      _mash_append_glsl_float (string, value[i]);
+    }
+
+  g_string_append_c (string, ')');
+}
+
+static gboolean
+mash_light_color_is_black (const ClutterColor *color)
+{
+  return color->red == 0 && color->green == 0 && color->blue == 0;
+}
+
+void
+_mash_light_append_static_terms (MashLight *light,
+                                 GString *main_source,
+                                 const char *light_vector,
+                                 gboolean include_ambient)
+{
+  MashLightPrivate *priv = light->priv;
+  gboolean has_diffuse, has_specular;
+  char *snippet;
+
+  has_diffuse =
+    !mash_light_color_is_black (priv->light_colors + MASH_LIGHT_COLOR_DIFFUSE);
+  has_specular =
+    !mash_light_color_is_black (priv->light_colors
+                                + MASH_LIGHT_COLOR_SPECULAR);
+
+  if (include_ambient &&
+      !mash_light_color_is_black (priv->light_colors
+                                  + MASH_LIGHT_COLOR_AMBIENT))
+    mash_light_append_shader (light, main_source,
+                              "  vec3 lit_color$ = (mash_material.ambient.rgb\n"
+                              "                     * ambient_light$);\n");
+  else
+    mash_light_append_shader (light, main_source,
+                              "  vec3 lit_color$ = vec3 (0.0);\n");
+
+  /* The diffuse factor is only needed if one of the terms that uses it
+     is not black */
+  if (!has_diffuse && !has_specular)
+    return;
+
+  snippet = g_strdup_printf ("  float diffuse_factor$ = "
+                             "max (0.0, dot (%s, normal));\n"
+                             "  if (diffuse_factor$ > 0.0)\n"
+                             "    {\n",
+                             light_vector);
+  mash_light_append_shader (light, main_source, snippet);
+  g_free (snippet);
+
+  if (has_diffuse)
+    mash_light_append_shader (light, main_source,
+                              "      lit_color$ += (diffuse_factor$\n"
+                              "                     * mash_material.diffuse.rgb\n"
+                              "                     * diffuse_light$);\n");
+
+  if (has_specular)
+    {
+      snippet = g_strdup_printf ("      vec3 half_vector$ = normalize (%s\n"
+                                 "        + vec3 (0.0, 0.0, 1.0));\n",
+                                 light_vector);
+      mash_light_append_shader (light, main_source, snippet);
+      g_free (snippet);
+
+      mash_light_append_shader (light, main_source,
+                                "      float spec_factor$ = "
+                                "max (0.0, dot (half_vector$, normal));\n"
+                                "      float spec_power$ = "
+                                "pow (spec_factor$, mash_material.shininess);\n"
+                                "      lit_color$ += (mash_material.specular.rgb\n"
+                                "                     * specular_light$\n"
+                                "                     * spec_power$);\n");
+    }
+
+  mash_light_append_shader (light, main_source, "    }\n");
+}
+
+gboolean
+_mash_light_get_folded_ambient (MashLight *light,
+                                float *ambient)
+{
+  MashLightPrivate *priv = light->priv;
+  const ClutterColor *color = priv->light_colors + MASH_LIGHT_COLOR_AMBIENT;
+  GType type = G_OBJECT_TYPE (light);
+
+  if (!priv->static_parameters)
+    return FALSE;
+
+  /* Only the exact built-in types are known to use the ambient color
+     in the usual way. Directional lights are never attenuated and
+     point lights are only attenuated if the attenuation isn't the
+     default. Spot lights only light the inside of their cone so they
+     can never be folded */
+  if (type == MASH_TYPE_POINT_LIGHT)
+    {
+      if (_mash_point_light_is_attenuated (MASH_POINT_LIGHT (light)))
+        return FALSE;
+    }
+  else if (type != MASH_TYPE_DIRECTIONAL_LIGHT)
+    return FALSE;
+
+  ambient[0] = color->red / 255.0f;
+  ambient[1] = color->green / 255.0f;
+  ambient[2] = color->blue / 255.0f;
+
+  return TRUE;
+}
+
+void
+_mash_light_get_color_block (MashLight *light,
+                             float *block)
+{
+  MashLightPrivate *priv = light->priv;
+  int i;
+
+  /* The colors are stored in the same order as the color indices
+     with one vec4 for each color */
+  for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
+    {
+      const ClutterColor *color = priv->light_colors + i;
+
+      block[i * 4 + 0] = color->red / 255.0f;
+      block[i * 4 + 1] = color->green / 255.0f;
+      block[i * 4 + 2] = color->blue / 255.0f;
+      block[i * 4 + 3] = 1.0f;
+    }
 }
 
 static void
@@ -747,10 +1516,32 @@ mash_light_real_generate_shader (MashLight *light,
 {
   MashLightPrivate *priv = light->priv;
 
-  /* If the shader is being regenerated then we know that the uniform
-     locations are dirty */
-  priv->uniform_locations_dirty = TRUE;
-  priv->dirty_uniforms = (1 << MASH_LIGHT_COLOR_COUNT) - 1;
+  /* If the shader is being regenerated then the program it goes in
+     is new even if it gets the same handle as the last one */
+  priv->own_program = COGL_INVALID_HANDLE;
+
+  if (priv->static_parameters)
+    {
+      float block[MASH_LIGHT_COLOR_BLOCK_SIZE * 4];
+      int i;
+
+      /* Bake the colors into the shader as constants */
+      _mash_light_get_color_block (light, block);
+
+      for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
+        {
+          char *declaration = g_strdup_printf ("const vec3 %s$ = ",
+                                               mash_light_color_names[i]);
+
+          mash_light_append_shader (light, uniform_source, declaration);
+          g_free (declaration);
+
+          _mash_append_glsl_vec3 (uniform_source, block + i * 4);
+          g_string_append (uniform_source, ";\n");
+        }
+
+      return;
+    }
 
   /* Add the uniform definitions for the colors of this light */
   mash_light_append_shader (light,
@@ -765,38 +1556,36 @@ mash_light_real_update_uniforms (MashLight *light,
                                  CoglHandle program)
 {
   MashLightPrivate *priv = light->priv;
+  MashLightProgramState *state;
   int i;
 
-  /* We need to recalculate the light's transformation matrix. It is
-     assumed the subclasses will chain-up first before calling
-     mash_light_get_transformation_matrix(), otherwise this won't work
-     correctly */
-  priv->modelview_matrix_dirty = TRUE;
+  /* Static colors are constants in the shader */
+  if (priv->static_parameters ||
+      !_mash_light_parameters_changed (light))
+    return;
 
-  if (priv->uniform_locations_dirty)
-    {
-      for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
-        priv->uniform_locations[i]
-          = mash_light_get_uniform_location (light, program,
-                                             mash_light_color_names[i]);
+  state = _mash_light_get_program_state (light);
 
-      priv->uniform_locations_dirty = FALSE;
-    }
+  /* The locations are remembered for each program so they are only
+     queried the first time */
+  if (!state->initialized)
+    for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
+      state->locations[MASH_LIGHT_UNIFORM_AMBIENT + i]
+        = mash_light_get_uniform_location (light, program,
+                                           mash_light_color_names[i]);
 
   for (i = 0; i < MASH_LIGHT_COLOR_COUNT; i++)
-    if (priv->dirty_uniforms & (1 << i))
-      {
-        const ClutterColor *color = priv->light_colors + i;
-        float vec[3];
+    {
+      const ClutterColor *color = priv->light_colors + i;
+      float vec[3];
 
-        vec[0] = color->red / 255.0f;
-        vec[1] = color->green / 255.0f;
-        vec[2] = color->blue / 255.0f;
+      vec[0] = color->red / 255.0f;
+      vec[1] = color->green / 255.0f;
+      vec[2] = color->blue / 255.0f;
 
-        cogl_program_set_uniform_float (program,
-                                        priv->uniform_locations[i],
-                                        3, 1, vec);
-      }
-
-  priv->dirty_uniforms = 0;
+      cogl_program_set_uniform_float (program,
+                                      state->locations
+                                      [MASH_LIGHT_UNIFORM_AMBIENT + i],
+                                      3, 1, vec);
+    }
 }
@@ -94,6 +94,10 @@ void mash_light_get_diffuse (MashLight *light, ClutterColor *diffuse);
 void mash_light_set_specular (MashLight *light, const ClutterColor *specular);
 void mash_light_get_specular (MashLight *light, ClutterColor *specular);
 
+void mash_light_set_static_parameters (MashLight *light,
+                                       gboolean static_parameters);
+gboolean mash_light_get_static_parameters (MashLight *light);
+
 void mash_light_generate_shader (MashLight *light,
                                  GString *uniform_source,
                                  GString *main_source);
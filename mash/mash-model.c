@@ -78,6 +78,8 @@
 
 #include "mash-model.h"
 #include "mash-data.h"
+#include "mash-light-private.h"
+#include "mash-trace.h"
 
 static void mash_model_dispose (GObject *object);
 
@@ -117,7 +119,13 @@ G_DEFINE_TYPE (MashModel, mash_model, CLUTTER_TYPE_ACTOR);
 struct _MashModelPrivate
 {
   MashData *data;
+  /* Handler for the "changed" signal on the data */
+  gulong data_changed_handler;
   MashLightSet *light_set;
+
+  /* The normal matrix used for this model the last time it was
+     painted with a light set */
+  MashNormalMatrixCache normal_matrix_cache;
   CoglHandle material, pick_material;
   /* Whether the model should be transformed to fill the allocation */
   gboolean fit_to_allocation;
@@ -146,6 +154,8 @@ mash_model_class_init (MashModelClass *klass)
   ClutterActorClass *actor_class = (ClutterActorClass *) klass;
   GParamSpec *pspec;
 
+  _mash_trace_init ();
+
   gobject_class->dispose = mash_model_dispose;
   gobject_class->get_property = mash_model_get_property;
   gobject_class->set_property = mash_model_set_property;
@@ -239,9 +249,14 @@ mash_model_new (void)
  * @filename: The name of a PLY file to load.
  * @error: Return location for a #GError or %NULL.
  *
- * This is a convenience function that creates a new #MashData
- * and immediately loads the data in @filename. If the load succeeds a
- * new #MashModel will be created for the data. The model has a
+ * This is a convenience function that gets a #MashData for
+ * @filename with mash_data_cache_lookup_or_load(). If the load
+ * succeeds a new #MashModel will be created for the data. If the same
+ * file is already loaded with the same @flags for another model then
+ * the data is shared with that model instead of loading the file
+ * again. To give the model its own copy of the data, load it into a
+ * #MashData created with mash_data_new() and set it with
+ * mash_model_set_data() instead. The model has a
  * default white material so that if vertices of the model have any
  * color attributes they will be used directly. The material does not
  * have textures by default so if you want the model to be textured
@@ -254,14 +269,16 @@ mash_model_new_from_file (MashDataFlags flags,
                           const gchar *filename,
                           GError **error)
 {
-  MashData *data = mash_data_new ();
-  ClutterActor *model = NULL;
+  MashData *data;
+  ClutterActor *model;
 
-  if (mash_data_load (data, flags, filename, error))
-    {
-      model = mash_model_new ();
-      mash_model_set_data (MASH_MODEL (model), data);
-    }
+  data = mash_data_cache_lookup_or_load (flags, filename, error);
+
+  if (data == NULL)
+    return NULL;
+
+  model = mash_model_new ();
+  mash_model_set_data (MASH_MODEL (model), data);
 
   g_object_unref (data);
 
@@ -372,11 +389,29 @@ mash_model_render_data (MashModel *self)
     cogl_pop_matrix ();
 }
 
+/* Adds the time since @start_time to the paint time in the render
+   stats and gives the light set the stats counted since @before */
+static void
+mash_model_end_paint_stats (MashModel *self,
+                            const MashRenderStats *before,
+                            gint64 start_time)
+{
+  MashModelPrivate *priv = self->priv;
+
+  _mash_render_stats.paint_time += ((g_get_monotonic_time () - start_time)
+                                    / (gdouble) G_USEC_PER_SEC);
+
+  if (priv->light_set)
+    _mash_light_set_count_draws (priv->light_set, before);
+}
+
 static void
 mash_model_paint (ClutterActor *actor)
 {
   MashModel *self = MASH_MODEL (actor);
   MashModelPrivate *priv;
+  MashRenderStats before;
+  gint64 start_time;
 
   g_return_if_fail (MASH_IS_MODEL (self));
 
@@ -386,16 +421,47 @@ mash_model_paint (ClutterActor *actor)
   if (priv->data == NULL || priv->material == COGL_INVALID_HANDLE)
     return;
 
+  MASH_TRACE_BEGIN ("mash_model_paint");
+
+  before = _mash_render_stats;
+  start_time = g_get_monotonic_time ();
+
   if (priv->light_set)
     {
-      CoglHandle program = mash_light_set_begin_paint (priv->light_set,
-                                                       priv->material);
+      ClutterVertex min_vertex, max_vertex;
+      CoglHandle program;
+
+      /* Give the light set the bounding box of the model so that it
+         can pick out the lights that affect it */
+      mash_data_get_extents (priv->data, &min_vertex, &max_vertex);
+
+      if (priv->fit_to_allocation)
+        {
+          min_vertex.x = min_vertex.x * priv->scale + priv->translate_x;
+          min_vertex.y = min_vertex.y * priv->scale + priv->translate_y;
+          min_vertex.z = min_vertex.z * priv->scale + priv->translate_z;
+          max_vertex.x = max_vertex.x * priv->scale + priv->translate_x;
+          max_vertex.y = max_vertex.y * priv->scale + priv->translate_y;
+          max_vertex.z = max_vertex.z * priv->scale + priv->translate_z;
+        }
+
+      _mash_light_set_set_paint_bounds (priv->light_set,
+                                        &min_vertex, &max_vertex);
+      _mash_light_set_set_normal_matrix_cache (priv->light_set,
+                                               &priv->normal_matrix_cache);
+
+      program = mash_light_set_begin_paint (priv->light_set,
+                                            priv->material);
       cogl_material_set_user_program (priv->material, program);
     }
 
   cogl_set_source (priv->material);
 
   mash_model_render_data (self);
+
+  mash_model_end_paint_stats (self, &before, start_time);
+
+  MASH_TRACE_END ();
 }
 
 static void
@@ -404,6 +470,8 @@ mash_model_pick (ClutterActor *actor,
 {
   MashModel *self = MASH_MODEL (actor);
   MashModelPrivate *priv;
+  MashRenderStats before;
+  gint64 start_time;
   CoglColor color;
 
   g_return_if_fail (MASH_IS_MODEL (self));
@@ -414,6 +482,11 @@ mash_model_pick (ClutterActor *actor,
   if (priv->data == NULL)
     return;
 
+  MASH_TRACE_BEGIN ("mash_model_pick");
+
+  before = _mash_render_stats;
+  start_time = g_get_monotonic_time ();
+
   if (priv->pick_material == COGL_INVALID_HANDLE)
     {
       GError *error = NULL;
@@ -436,7 +509,13 @@ mash_model_pick (ClutterActor *actor,
 
   cogl_set_source (priv->pick_material);
 
+  _mash_render_stats.n_pick_passes++;
+
   mash_model_render_data (self);
+
+  mash_model_end_paint_stats (self, &before, start_time);
+
+  MASH_TRACE_END ();
 }
 
 /**
@@ -480,10 +559,21 @@ mash_model_set_data (MashModel *self,
     g_object_ref (data);
 
   if (priv->data)
-    g_object_unref (priv->data);
+    {
+      g_signal_handler_disconnect (priv->data, priv->data_changed_handler);
+      g_object_unref (priv->data);
+    }
 
   priv->data = data;
 
+  /* The extents change when the data finishes loading in the
+     background */
+  if (data)
+    priv->data_changed_handler =
+      g_signal_connect_swapped (data, "changed",
+                                G_CALLBACK (clutter_actor_queue_relayout),
+                                self);
+
   clutter_actor_queue_relayout (CLUTTER_ACTOR (self));
 
   g_object_notify (G_OBJECT (self), "data");
@@ -22,20 +22,31 @@
 #endif
 
 #include <glib-object.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
 #include <cogl/cogl.h>
 #include <clutter/clutter.h>
 
 #include "mash-ply-loader.h"
+#include "mash-trace.h"
 #include "rply/rply.h"
 
 static void mash_ply_loader_finalize (GObject *object);
-static gboolean mash_ply_loader_load (MashDataLoader *data_loader,
-                                      MashDataFlags flags,
-                                      const gchar *filename,
-                                      GError **error);
+static gboolean mash_ply_loader_parse (MashDataLoader *data_loader,
+                                       MashDataFlags flags,
+                                       const gchar *filename,
+                                       GError **error);
+static gboolean mash_ply_loader_upload_part (MashDataLoader *data_loader,
+                                             gboolean *done,
+                                             GError **error);
 static void mash_ply_loader_get_data (MashDataLoader *data_loader,
                                       MashDataLoaderData *loader_data);
+static gboolean mash_ply_loader_upload_coarse (MashDataLoader *data_loader,
+                                               MashDataLoaderData *loader_data);
 
 G_DEFINE_TYPE (MashPlyLoader, mash_ply_loader, MASH_TYPE_DATA_LOADER);
 
@@ -72,6 +83,34 @@ mash_ply_loader_properties[] =
 
 typedef struct _MashPlyLoaderData MashPlyLoaderData;
 
+/* The number of triangles that are sorted and cut into windows at a
+   time when streaming. This is also the number of vertices and
+   triangles that are decoded before they are written out */
+#define MASH_PLY_LOADER_STREAM_BATCH 0x40000
+/* The maximum number of vertices in a part that can always use
+   16-bit indices */
+#define MASH_PLY_LOADER_MAX_SHORT_VERTICES 0x10000
+
+/* A part of the decoded data that is uploaded into its own buffers */
+typedef struct
+{
+  /* The vertices in the same layout as the vertex array */
+  GByteArray *vertices;
+  GArray *indices;
+  CoglIndicesType indices_type;
+  guint min_index, max_index;
+} MashPlyLoaderPart;
+
+/* A temporary file that decoded data is written to when streaming.
+   Once the file has been read it is mapped so that the data can be
+   used without holding it all in memory */
+typedef struct
+{
+  FILE *file;
+  gchar *filename;
+  GMappedFile *mapping;
+} MashPlyLoaderSpill;
+
 struct _MashPlyLoaderData
 {
   p_ply ply;
@@ -86,25 +125,81 @@ struct _MashPlyLoaderData
   guint first_vertex, last_vertex;
   GByteArray *vertices;
   GArray *faces;
+  /* The decoded vertices. This points into the vertex array or into
+     the mapped vertex file when streaming */
+  const guint8 *vertex_data;
+  guint n_vertices;
+  /* The number of bytes reserved for the arrays before reading */
+  gsize reserved_vertex_bytes;
+  gsize reserved_index_bytes;
   CoglIndicesType indices_type;
   MashDataFlags flags;
+  const gchar *display_name;
+
+  /* The number of vertices given in the header */
+  guint n_header_vertices;
+
+  /* The number of triangles in each batch if MASH_DATA_STREAM was
+     given or 0 otherwise. When streaming, the vertex and face arrays
+     only hold the data decoded since they were last written to the
+     temporary files and the face array is reused to hold each batch
+     while it is cut into windows */
+  guint stream_batch;
+  MashPlyLoaderSpill vertex_spill;
+  MashPlyLoaderSpill face_spill;
+  /* The number of indices written to the face file */
+  guint n_spilled_indices;
+  /* The first triangle of the next batch to cut into windows */
+  guint next_batch;
+  /* Map from a vertex number plus one to its index in the window
+     being cut plus one */
+  GHashTable *window_map;
+  /* The largest amount of memory used to sort a batch and copy it
+     into windows */
+  gsize max_window_bytes;
 
   /* Bounding cuboid of the data */
   ClutterVertex min_vertex, max_vertex;
 
   /* Range of indices used */
   guint min_index, max_index;
+
+  /* The parts that the data is split into after reading. Each element
+     is a MashPlyLoaderPart. Once the data is split the parts own the
+     vertex and index arrays */
+  GArray *parts;
+  /* The next part for mash_ply_loader_upload_part(). When streaming
+     the array only holds the windows of the current batch */
+  guint next_part;
+  gboolean upload_started;
+
+  /* The coarse version of the data. The arrays are NULL if there
+     isn't one */
+  MashPlyLoaderPart coarse;
+
+  MashDataLoadStats stats;
+  /* The time in the stats that the clock is currently being added to
+     and when the current stage started. While reading the file the
+     stage is only switched when a callback is run for a different
+     element so that the clock isn't read for every property */
+  gdouble *stage_time;
+  gint64 stage_start;
 };
 
 struct _MashPlyLoaderPrivate
 {
-  CoglHandle vertices_vbo;
-  CoglHandle indices;
-  guint min_index, max_index;
+  /* The decoded data between parsing and uploading */
+  MashPlyLoaderData *parsed;
+
+  /* The uploaded parts. Each element is a MashDataLoaderPart */
+  GArray *parts;
   guint n_triangles;
 
   /* Bounding cuboid of the data */
   ClutterVertex min_vertex, max_vertex;
+
+  MashDataLoadStats stats;
+  MashDataMemoryUsage memory;
 };
 
 static void
@@ -115,8 +210,10 @@ mash_ply_loader_class_init (MashPlyLoaderClass *klass)
 
   gobject_class->finalize = mash_ply_loader_finalize;
 
-  data_loader_class->load = mash_ply_loader_load;
+  data_loader_class->parse = mash_ply_loader_parse;
+  data_loader_class->upload_part = mash_ply_loader_upload_part;
   data_loader_class->get_data = mash_ply_loader_get_data;
+  data_loader_class->upload_coarse = mash_ply_loader_upload_coarse;
 
   g_type_class_add_private (klass, sizeof (MashPlyLoaderPrivate));
 }
@@ -131,17 +228,116 @@ static void
 mash_ply_loader_free_vbos (MashPlyLoader *self)
 {
   MashPlyLoaderPrivate *priv = self->priv;
+  int i;
+
+  if (priv->parts)
+    {
+      for (i = 0; i < priv->parts->len; i++)
+        {
+          MashDataLoaderPart *part =
+            &g_array_index (priv->parts, MashDataLoaderPart, i);
+
+          cogl_handle_unref (part->vertices_vbo);
+          cogl_handle_unref (part->indices);
+        }
+
+      g_array_free (priv->parts, TRUE);
+      priv->parts = NULL;
+    }
+}
+
+static void
+mash_ply_loader_free_part_arrays (MashPlyLoaderPart *part)
+{
+  if (part->vertices)
+    {
+      g_byte_array_free (part->vertices, TRUE);
+      part->vertices = NULL;
+    }
+
+  if (part->indices)
+    {
+      g_array_free (part->indices, TRUE);
+      part->indices = NULL;
+    }
+}
+
+static void
+mash_ply_loader_close_spill (MashPlyLoaderSpill *spill)
+{
+  if (spill->mapping)
+    {
+      g_mapped_file_unref (spill->mapping);
+      spill->mapping = NULL;
+    }
+
+  if (spill->file)
+    {
+      fclose (spill->file);
+      spill->file = NULL;
+    }
+
+  if (spill->filename)
+    {
+#ifdef G_OS_WIN32
+      /* An open file can't be removed on Windows so this is only done
+         once it is closed */
+      g_unlink (spill->filename);
+#endif
+      g_free (spill->filename);
+      spill->filename = NULL;
+    }
+}
+
+static void
+mash_ply_loader_free_arrays (MashPlyLoaderData *data)
+{
+  int i;
+
+  if (data->vertices)
+    {
+      g_byte_array_free (data->vertices, TRUE);
+      data->vertices = NULL;
+    }
+
+  if (data->faces)
+    {
+      g_array_free (data->faces, TRUE);
+      data->faces = NULL;
+    }
+
+  mash_ply_loader_free_part_arrays (&data->coarse);
+
+  if (data->window_map)
+    {
+      g_hash_table_destroy (data->window_map);
+      data->window_map = NULL;
+    }
 
-  if (priv->vertices_vbo)
+  mash_ply_loader_close_spill (&data->vertex_spill);
+  mash_ply_loader_close_spill (&data->face_spill);
+
+  if (data->parts)
     {
-      cogl_handle_unref (priv->vertices_vbo);
-      priv->vertices_vbo = NULL;
+      for (i = 0; i < data->parts->len; i++)
+        mash_ply_loader_free_part_arrays (&g_array_index (data->parts,
+                                                          MashPlyLoaderPart,
+                                                          i));
+      g_array_free (data->parts, TRUE);
+      data->parts = NULL;
     }
+}
+
+static void
+mash_ply_loader_free_parsed (MashPlyLoader *self)
+{
+  MashPlyLoaderPrivate *priv = self->priv;
 
-  if (priv->indices)
+  if (priv->parsed)
     {
-      cogl_handle_unref (priv->indices);
-      priv->indices = NULL;
+      mash_ply_loader_free_arrays (priv->parsed);
+      g_slice_free (MashPlyLoaderData, priv->parsed);
+      priv->parsed = NULL;
     }
 }
 
@@ -150,6 +346,7 @@ mash_ply_loader_finalize (GObject *object)
 {
   MashPlyLoader *self = (MashPlyLoader *) object;
 
+  mash_ply_loader_free_parsed (self);
   mash_ply_loader_free_vbos (self);
 
   G_OBJECT_CLASS (mash_ply_loader_parent_class)->finalize (object);
@@ -175,6 +372,161 @@ mash_ply_loader_check_unknown_error (MashPlyLoaderData *data)
                          "Unknown error loading PLY file");
 }
 
+/* Adds the time since the last call to the previous stage and starts
+   timing @stage_time instead. @stage_time can be NULL to stop
+   timing. @name is the name of the span for the stage in the trace */
+static void
+mash_ply_loader_begin_stage (MashPlyLoaderData *data,
+                             gdouble *stage_time,
+                             const char *name)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (data->stage_time)
+    {
+      *data->stage_time += ((now - data->stage_start)
+                            / (gdouble) G_USEC_PER_SEC);
+      MASH_TRACE_END ();
+    }
+
+  if (stage_time)
+    MASH_TRACE_BEGIN (name);
+
+  data->stage_time = stage_time;
+  data->stage_start = now;
+}
+
+/* Creates a temporary file for @spill */
+static gboolean
+mash_ply_loader_open_spill (MashPlyLoaderSpill *spill,
+                            GError **error)
+{
+  GError *file_error = NULL;
+  int fd;
+
+  if ((fd = g_file_open_tmp ("mash-XXXXXX",
+                             &spill->filename,
+                             &file_error)) == -1)
+    {
+      g_set_error (error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_UNKNOWN,
+                   "Error creating temporary file: %s",
+                   file_error->message);
+      g_error_free (file_error);
+      return FALSE;
+    }
+
+#ifndef G_OS_WIN32
+  /* The file stays usable until it is closed so it can be removed
+     straight away. That way it isn't left behind if the process
+     dies */
+  g_unlink (spill->filename);
+#endif
+
+  if ((spill->file = fdopen (fd, "w+b")) == NULL)
+    {
+      int errsv = errno;
+
+      g_set_error (error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_UNKNOWN,
+                   "Error opening temporary file: %s",
+                   g_strerror (errsv));
+      g_close (fd, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Appends @length bytes to the temporary file for @spill. Returns
+   FALSE and sets data->error if the write fails */
+static gboolean
+mash_ply_loader_write_spill (MashPlyLoaderData *data,
+                             MashPlyLoaderSpill *spill,
+                             gconstpointer bytes,
+                             gsize length)
+{
+  if (length > 0 && fwrite (bytes, 1, length, spill->file) != length)
+    {
+      int errsv = errno;
+
+      g_set_error (&data->error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_UNKNOWN,
+                   "Error writing temporary file for %s: %s",
+                   data->display_name,
+                   g_strerror (errsv));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Maps the temporary file for @spill once everything has been
+   written to it. Returns FALSE and sets data->error on failure */
+static gboolean
+mash_ply_loader_map_spill (MashPlyLoaderData *data,
+                           MashPlyLoaderSpill *spill)
+{
+  GError *map_error = NULL;
+
+  if (fflush (spill->file) != 0)
+    {
+      int errsv = errno;
+
+      g_set_error (&data->error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_UNKNOWN,
+                   "Error writing temporary file for %s: %s",
+                   data->display_name,
+                   g_strerror (errsv));
+      return FALSE;
+    }
+
+  if ((spill->mapping = g_mapped_file_new_from_fd (fileno (spill->file),
+                                                   FALSE,
+                                                   &map_error)) == NULL)
+    {
+      g_set_error (&data->error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_UNKNOWN,
+                   "Error mapping temporary file for %s: %s",
+                   data->display_name,
+                   map_error->message);
+      g_error_free (map_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Writes out what is left of the decoded data when streaming and maps
+   the temporary files so that the batches can be cut into windows
+   from them when uploading. Sets data->error on failure */
+static void
+mash_ply_loader_map_spills (MashPlyLoaderData *data)
+{
+  guint index_size = g_array_get_element_size (data->faces);
+
+  if (!mash_ply_loader_write_spill (data, &data->vertex_spill,
+                                    data->vertices->data,
+                                    data->vertices->len) ||
+      !mash_ply_loader_write_spill (data, &data->face_spill,
+                                    data->faces->data,
+                                    data->faces->len * index_size) ||
+      !mash_ply_loader_map_spill (data, &data->vertex_spill) ||
+      !mash_ply_loader_map_spill (data, &data->face_spill))
+    return;
+
+  /* The vertex array was only needed to collect the vertices before
+     writing them out. The face array is kept to hold each batch */
+  g_byte_array_free (data->vertices, TRUE);
+  data->vertices = NULL;
+  g_array_set_size (data->faces, 0);
+
+  data->vertex_data =
+    (const guint8 *) g_mapped_file_get_contents (data->vertex_spill.mapping);
+  data->n_spilled_indices =
+    g_mapped_file_get_length (data->face_spill.mapping) / index_size;
+}
+
 static int
 mash_ply_loader_vertex_read_cb (p_ply_argument argument)
 {
@@ -186,6 +538,10 @@ mash_ply_loader_vertex_read_cb (p_ply_argument argument)
   ply_get_argument_user_data (argument, (void **) &data, &prop_num);
   ply_get_argument_property (argument, NULL, &length, &index);
 
+  if (data->stage_time != &data->stats.vertex_time)
+    mash_ply_loader_begin_stage (data, &data->stats.vertex_time,
+                                 "vertex decode");
+
   if (length != 1 || index != 0)
     {
       g_set_error (&data->error, MASH_DATA_ERROR,
@@ -234,14 +590,48 @@ mash_ply_loader_vertex_read_cb (p_ply_argument argument)
 
       g_byte_array_append (data->vertices, data->current_vertex,
                            data->n_vertex_bytes);
+      data->n_vertices++;
       data->got_props = 0;
 
-      /* Update the bounding box for the data */
+      if (data->stream_batch
+          && data->vertices->len >= data->stream_batch * data->n_vertex_bytes)
+        {
+          if (!mash_ply_loader_write_spill (data, &data->vertex_spill,
+                                            data->vertices->data,
+                                            data->vertices->len))
+            return 0;
+
+          g_byte_array_set_size (data->vertices, 0);
+        }
+    }
+
+  return 1;
+}
+
+static const guint8 *
+mash_ply_loader_get_vertex (MashPlyLoaderData *data,
+                            guint vertex)
+{
+  return data->vertex_data + (gsize) vertex * data->n_vertex_bytes;
+}
+
+/* Updates the bounding box for the data. This is done in a separate
+   pass after the file is read so that it can be timed on its own */
+static void
+mash_ply_loader_calculate_extents (MashPlyLoaderData *data)
+{
+  const guint8 *vertex = data->vertex_data;
+  const guint8 *end = mash_ply_loader_get_vertex (data, data->n_vertices);
+
+  for (; vertex < end; vertex += data->n_vertex_bytes)
+    {
+      int i;
+
       for (i = 0; i < 3; i++)
         {
           gfloat *min = &data->min_vertex.x + i;
           gfloat *max = &data->max_vertex.x + i;
-          gfloat value = *(gfloat *) (data->current_vertex + data->prop_map[i]);
+          gfloat value = *(const gfloat *) (vertex + data->prop_map[i]);
 
           if (value < *min)
             *min = value;
@@ -249,100 +639,682 @@ mash_ply_loader_vertex_read_cb (p_ply_argument argument)
             *max = value;
         }
     }
-
-  return 1;
 }
 
 static void
-mash_ply_loader_add_face_index (MashPlyLoaderData *data,
-                                guint index)
+mash_ply_loader_append_index (GArray *indices,
+                              CoglIndicesType indices_type,
+                              guint index)
 {
-  if (index > data->max_index)
-    data->max_index = index;
-  if (index < data->min_index)
-    data->min_index = index;
-
-  switch (data->indices_type)
+  switch (indices_type)
     {
     case COGL_INDICES_TYPE_UNSIGNED_BYTE:
       {
         guint8 value = index;
-        g_array_append_val (data->faces, value);
+        g_array_append_val (indices, value);
       }
       break;
     case COGL_INDICES_TYPE_UNSIGNED_SHORT:
       {
         guint16 value = index;
-        g_array_append_val (data->faces, value);
+        g_array_append_val (indices, value);
       }
       break;
     case COGL_INDICES_TYPE_UNSIGNED_INT:
       {
         guint32 value = index;
-        g_array_append_val (data->faces, value);
+        g_array_append_val (indices, value);
       }
       break;
     }
 }
 
-static gboolean
-mash_ply_loader_get_indices_type (MashPlyLoaderData *data,
-                                  GError **error)
+static guint
+mash_ply_loader_get_index (GArray *indices,
+                           CoglIndicesType indices_type,
+                           guint i)
 {
-  p_ply_element elem = NULL;
+  switch (indices_type)
+    {
+    case COGL_INDICES_TYPE_UNSIGNED_BYTE:
+      return g_array_index (indices, guint8, i);
+    case COGL_INDICES_TYPE_UNSIGNED_SHORT:
+      return g_array_index (indices, guint16, i);
+    case COGL_INDICES_TYPE_UNSIGNED_INT:
+      return g_array_index (indices, guint32, i);
+    }
 
-  /* Look for the 'vertices' element */
-  while ((elem = ply_get_next_element (data->ply, elem)))
+  g_assert_not_reached ();
+
+  return 0;
+}
+
+static void
+mash_ply_loader_add_face_index (MashPlyLoaderData *data,
+                                guint index)
+{
+  if (index > data->max_index)
+    data->max_index = index;
+  if (index < data->min_index)
+    data->min_index = index;
+
+  mash_ply_loader_append_index (data->faces, data->indices_type, index);
+}
+
+static CoglIndicesType
+mash_ply_loader_get_indices_type_for_vertices (guint n_vertices,
+                                               guint *index_size)
+{
+  if (n_vertices <= 0x100)
     {
-      const char *name;
-      gint32 n_instances;
+      *index_size = sizeof (guint8);
+      return COGL_INDICES_TYPE_UNSIGNED_BYTE;
+    }
+  else if (n_vertices <= 0x10000)
+    {
+      *index_size = sizeof (guint16);
+      return COGL_INDICES_TYPE_UNSIGNED_SHORT;
+    }
+  else
+    {
+      *index_size = sizeof (guint32);
+      return COGL_INDICES_TYPE_UNSIGNED_INT;
+    }
+}
+
+static void
+mash_ply_loader_get_position (MashPlyLoaderData *data,
+                              const guint8 *vertex,
+                              float *position)
+{
+  int i;
+
+  for (i = 0; i < 3; i++)
+    memcpy (position + i, vertex + data->prop_map[i], sizeof (float));
+}
+
+/* Gets the values needed to map a position to a cell in a grid of
+   @grid_size cells along each axis of the bounding cuboid. The cell
+   along axis i is (position[i] - min[i]) * scale[i] */
+static void
+mash_ply_loader_get_grid (MashPlyLoaderData *data,
+                          guint grid_size,
+                          float *min,
+                          float *scale)
+{
+  int i;
+
+  min[0] = data->min_vertex.x;
+  min[1] = data->min_vertex.y;
+  min[2] = data->min_vertex.z;
+  scale[0] = data->max_vertex.x - data->min_vertex.x;
+  scale[1] = data->max_vertex.y - data->min_vertex.y;
+  scale[2] = data->max_vertex.z - data->min_vertex.z;
+  for (i = 0; i < 3; i++)
+    scale[i] = scale[i] > 0.0f ? grid_size / scale[i] : 0.0f;
+}
+
+/* Builds a coarse version of the data with roughly @target_triangles
+   triangles by clustering the vertices. The bounding cuboid is divided
+   into a grid and all of the vertices in a cell are merged into one
+   at their average position. The other properties are taken from the
+   first vertex in the cell. Triangles that end up with two corners in
+   the same cell are dropped */
+static void
+mash_ply_loader_build_coarse (MashPlyLoaderData *data,
+                              guint target_triangles)
+{
+  MashPlyLoaderPart *coarse = &data->coarse;
+  guint n_vertices = data->n_vertices;
+  float min[3], scale[3];
+  GHashTable *cells;
+  GArray *sums;
+  guint *vertex_map;
+  guint grid_size, index_size, n_coarse_vertices;
+  guint i, j;
 
-      if (ply_get_element_info (elem, &name, &n_instances))
+  if (target_triangles == 0 || data->faces->len / 3 <= target_triangles)
+    return;
+
+  /* A surface crossing a grid of n³ cells touches roughly n² of them
+     and there are about twice as many triangles as vertices. The size
+     is limited so that a cell number fits in 30 bits */
+  grid_size = CLAMP ((guint) sqrtf (target_triangles / 2.0f), 2, 1024);
+
+  mash_ply_loader_get_grid (data, grid_size, min, scale);
+
+  cells = g_hash_table_new (g_direct_hash, g_direct_equal);
+  sums = g_array_new (FALSE, FALSE, sizeof (float) * 4);
+  vertex_map = g_new (guint, n_vertices);
+
+  coarse->vertices = g_byte_array_new ();
+
+  for (i = 0; i < n_vertices; i++)
+    {
+      const guint8 *vertex = mash_ply_loader_get_vertex (data, i);
+      float position[3];
+      guint cell = 0;
+      gpointer value;
+
+      mash_ply_loader_get_position (data, vertex, position);
+
+      for (j = 0; j < 3; j++)
+        cell = (cell * grid_size
+                + MIN ((guint) ((position[j] - min[j]) * scale[j]),
+                       grid_size - 1));
+
+      /* The values are stored plus one so that they aren't NULL */
+      if ((value = g_hash_table_lookup (cells, GUINT_TO_POINTER (cell))))
+        {
+          float *sum;
+
+          vertex_map[i] = GPOINTER_TO_UINT (value) - 1;
+          sum = &g_array_index (sums, float, vertex_map[i] * 4);
+          for (j = 0; j < 3; j++)
+            sum[j] += position[j];
+          sum[3] += 1.0f;
+        }
+      else
         {
-          if (!strcmp (name, "vertex"))
+          float sum[4] = { position[0], position[1], position[2], 1.0f };
+
+          vertex_map[i] = sums->len;
+          g_hash_table_insert (cells,
+                               GUINT_TO_POINTER (cell),
+                               GUINT_TO_POINTER (sums->len + 1));
+          g_array_append_vals (sums, sum, 1);
+          g_byte_array_append (coarse->vertices, vertex,
+                               data->n_vertex_bytes);
+        }
+    }
+
+  n_coarse_vertices = sums->len;
+
+  for (i = 0; i < n_coarse_vertices; i++)
+    {
+      guint8 *vertex = coarse->vertices->data + i * data->n_vertex_bytes;
+      const float *sum = &g_array_index (sums, float, i * 4);
+
+      for (j = 0; j < 3; j++)
+        {
+          float value = sum[j] / sum[3];
+          memcpy (vertex + data->prop_map[j], &value, sizeof (float));
+        }
+    }
+
+  coarse->indices_type =
+    mash_ply_loader_get_indices_type_for_vertices (n_coarse_vertices,
+                                                   &index_size);
+  coarse->indices = g_array_new (FALSE, FALSE, index_size);
+  coarse->min_index = 0;
+  coarse->max_index = n_coarse_vertices - 1;
+
+  for (i = 0; i + 2 < data->faces->len; i += 3)
+    {
+      guint triangle[3];
+
+      for (j = 0; j < 3; j++)
+        triangle[j] =
+          vertex_map[mash_ply_loader_get_index (data->faces,
+                                                data->indices_type,
+                                                i + j)];
+
+      if (triangle[0] != triangle[1] &&
+          triangle[1] != triangle[2] &&
+          triangle[2] != triangle[0])
+        for (j = 0; j < 3; j++)
+          mash_ply_loader_append_index (coarse->indices,
+                                        coarse->indices_type,
+                                        triangle[j]);
+    }
+
+  data->stats.peak_temp_bytes += ((gsize) n_vertices * sizeof (guint)
+                                  + sums->len * sizeof (float) * 4
+                                  + coarse->vertices->len
+                                  + coarse->indices->len * index_size);
+
+  g_hash_table_destroy (cells);
+  g_array_free (sums, TRUE);
+  g_free (vertex_map);
+
+  /* There is no point showing the coarse version if it has nothing in
+     it or if it needs indices that may not be supported */
+  if (coarse->indices->len == 0 ||
+      coarse->indices_type == COGL_INDICES_TYPE_UNSIGNED_INT)
+    mash_ply_loader_free_part_arrays (coarse);
+}
+
+/* A triangle and the position of its centre along a Morton curve */
+typedef struct
+{
+  guint32 code;
+  guint32 triangle;
+} MashPlyLoaderSortedTriangle;
+
+/* Spreads the bottom 10 bits of @value out so that there are two zero
+   bits between each of them */
+static guint32
+mash_ply_loader_spread_bits (guint32 value)
+{
+  value &= 0x3ff;
+  value = (value | (value << 16)) & 0x030000ff;
+  value = (value | (value << 8)) & 0x0300f00f;
+  value = (value | (value << 4)) & 0x030c30c3;
+  value = (value | (value << 2)) & 0x09249249;
+
+  return value;
+}
+
+static int
+mash_ply_loader_compare_sorted_triangles (const void *a_ptr,
+                                          const void *b_ptr)
+{
+  const MashPlyLoaderSortedTriangle *a = a_ptr;
+  const MashPlyLoaderSortedTriangle *b = b_ptr;
+
+  if (a->code != b->code)
+    return a->code < b->code ? -1 : 1;
+
+  /* Keep the file order for triangles in the same cell */
+  return a->triangle < b->triangle ? -1 : a->triangle > b->triangle ? 1 : 0;
+}
+
+/* Returns the triangles sorted along a Morton curve through a
+   1024³ grid over the bounding cuboid. Consecutive triangles are then
+   close together so the parts cut from the sorted order are compact
+   and share few vertices */
+static MashPlyLoaderSortedTriangle *
+mash_ply_loader_sort_triangles (MashPlyLoaderData *data)
+{
+  guint n_triangles = data->faces->len / 3;
+  MashPlyLoaderSortedTriangle *sorted;
+  float min[3], scale[3];
+  guint i, j, k;
+
+  mash_ply_loader_get_grid (data, 1024, min, scale);
+
+  sorted = g_new (MashPlyLoaderSortedTriangle, n_triangles);
+
+  for (i = 0; i < n_triangles; i++)
+    {
+      float centre[3] = { 0.0f, 0.0f, 0.0f };
+      guint32 code = 0;
+
+      for (j = 0; j < 3; j++)
+        {
+          guint vertex = mash_ply_loader_get_index (data->faces,
+                                                    data->indices_type,
+                                                    i * 3 + j);
+          float position[3];
+
+          mash_ply_loader_get_position (data,
+                                        mash_ply_loader_get_vertex (data,
+                                                                    vertex),
+                                        position);
+          for (k = 0; k < 3; k++)
+            centre[k] += position[k] / 3.0f;
+        }
+
+      for (k = 0; k < 3; k++)
+        code |= (mash_ply_loader_spread_bits
+                 (MIN ((guint) ((centre[k] - min[k]) * scale[k]), 1023))
+                 << k);
+
+      sorted[i].code = code;
+      sorted[i].triangle = i;
+    }
+
+  qsort (sorted, n_triangles, sizeof (MashPlyLoaderSortedTriangle),
+         mash_ply_loader_compare_sorted_triangles);
+
+  return sorted;
+}
+
+/* Cuts the triangles in the face array into parts of at most
+   @max_part_vertices vertices and appends them to @parts. The
+   triangles are sorted spatially first so that each part covers a
+   compact region of the model. Each part gets a copy of the vertices
+   used by its triangles so a vertex shared between two parts is
+   stored twice. The vertices of the current part are normally found
+   with two arrays that have an entry for every vertex. If @vertex_map
+   is given it is used instead so that the temporary memory only
+   depends on the size of the face array. Returns the amount of
+   temporary memory used, including the parts */
+static gsize
+mash_ply_loader_cut_parts (MashPlyLoaderData *data,
+                           guint max_part_vertices,
+                           GHashTable *vertex_map,
+                           GArray *parts)
+{
+  MashPlyLoaderPart *part = NULL;
+  guint n_vertices = data->n_vertices;
+  CoglIndicesType indices_type;
+  guint index_size;
+  MashPlyLoaderSortedTriangle *sorted;
+  guint n_triangles = data->faces->len / 3;
+  guint *part_stamps = NULL, *part_indices = NULL;
+  guint first_part = parts->len;
+  guint part_number = 0;
+  guint n_part_vertices = 0;
+  gsize temp_bytes;
+  guint i, j;
+
+  indices_type =
+    mash_ply_loader_get_indices_type_for_vertices (max_part_vertices,
+                                                   &index_size);
+
+  sorted = mash_ply_loader_sort_triangles (data);
+  temp_bytes = (gsize) n_triangles * sizeof (MashPlyLoaderSortedTriangle);
+
+  if (vertex_map)
+    /* The values are stored plus one so that they aren't NULL */
+    temp_bytes += (gsize) max_part_vertices * sizeof (gpointer) * 2;
+  else
+    {
+      /* part_stamps records the number of the last part that each
+         vertex was added to and part_indices records its index in
+         that part so that the arrays don't need clearing for each
+         part */
+      part_stamps = g_new0 (guint, n_vertices);
+      part_indices = g_new (guint, n_vertices);
+      temp_bytes += (gsize) n_vertices * sizeof (guint) * 2;
+    }
+
+  for (i = 0; i < n_triangles; i++)
+    {
+      guint triangle[3];
+      guint n_new = 0;
+
+      for (j = 0; j < 3; j++)
+        {
+          triangle[j] = mash_ply_loader_get_index (data->faces,
+                                                   data->indices_type,
+                                                   sorted[i].triangle * 3
+                                                   + j);
+          if (vertex_map
+              ? !g_hash_table_lookup (vertex_map,
+                                      GUINT_TO_POINTER (triangle[j] + 1))
+              : part_stamps[triangle[j]] != part_number)
+            n_new++;
+        }
+
+      if (part == NULL || n_part_vertices + n_new > max_part_vertices)
+        {
+          MashPlyLoaderPart new_part;
+
+          new_part.vertices =
+            g_byte_array_sized_new (MIN (max_part_vertices, n_vertices)
+                                    * data->n_vertex_bytes);
+          new_part.indices = g_array_new (FALSE, FALSE, index_size);
+          new_part.indices_type = indices_type;
+          new_part.min_index = 0;
+          new_part.max_index = 0;
+          g_array_append_val (parts, new_part);
+
+          part = &g_array_index (parts, MashPlyLoaderPart, parts->len - 1);
+          part_number++;
+          n_part_vertices = 0;
+
+          if (vertex_map)
+            g_hash_table_remove_all (vertex_map);
+        }
+
+      for (j = 0; j < 3; j++)
+        {
+          guint vertex = triangle[j];
+          guint index;
+
+          if (vertex_map)
             {
-              if (n_instances <= 0x100)
-                {
-                  data->indices_type = COGL_INDICES_TYPE_UNSIGNED_BYTE;
-                  data->faces = g_array_new (FALSE, FALSE, sizeof (guint8));
-                }
-              else if (n_instances <= 0x10000)
-                {
-                  data->indices_type = COGL_INDICES_TYPE_UNSIGNED_SHORT;
-                  data->faces = g_array_new (FALSE, FALSE, sizeof (guint16));
-                }
-              else if (cogl_features_available
-                       (COGL_FEATURE_UNSIGNED_INT_INDICES))
+              gpointer value =
+                g_hash_table_lookup (vertex_map,
+                                     GUINT_TO_POINTER (vertex + 1));
+
+              if (value)
+                index = GPOINTER_TO_UINT (value) - 1;
+              else
                 {
-                  data->indices_type = COGL_INDICES_TYPE_UNSIGNED_INT;
-                  data->faces = g_array_new (FALSE, FALSE, sizeof (guint32));
+                  index = n_part_vertices++;
+                  g_hash_table_insert (vertex_map,
+                                       GUINT_TO_POINTER (vertex + 1),
+                                       GUINT_TO_POINTER (index + 1));
+                  g_byte_array_append (part->vertices,
+                                       mash_ply_loader_get_vertex (data,
+                                                                   vertex),
+                                       data->n_vertex_bytes);
                 }
-              else
+            }
+          else
+            {
+              if (part_stamps[vertex] != part_number)
                 {
-                  g_set_error (error, MASH_DATA_ERROR,
-                               MASH_DATA_ERROR_UNSUPPORTED,
-                               "The PLY file requires unsigned int indices "
-                               "but this is not supported by your GL driver");
-                  return FALSE;
+                  part_stamps[vertex] = part_number;
+                  part_indices[vertex] = n_part_vertices++;
+                  g_byte_array_append (part->vertices,
+                                       mash_ply_loader_get_vertex (data,
+                                                                   vertex),
+                                       data->n_vertex_bytes);
                 }
 
-              return TRUE;
+              index = part_indices[vertex];
             }
+
+          mash_ply_loader_append_index (part->indices, indices_type, index);
+        }
+
+      part->max_index = n_part_vertices - 1;
+    }
+
+  g_free (part_stamps);
+  g_free (part_indices);
+  g_free (sorted);
+
+  /* The original arrays are alive at the same time as the parts */
+  for (i = first_part; i < parts->len; i++)
+    {
+      part = &g_array_index (parts, MashPlyLoaderPart, i);
+      temp_bytes += (part->vertices->len
+                     + part->indices->len * index_size);
+    }
+
+  return temp_bytes;
+}
+
+/* Splits the data into parts of at most @max_part_vertices vertices
+   or moves the arrays into a single part if @max_part_vertices is 0 */
+static void
+mash_ply_loader_split (MashPlyLoaderData *data,
+                       guint max_part_vertices)
+{
+  data->parts = g_array_new (FALSE, TRUE, sizeof (MashPlyLoaderPart));
+
+  if (max_part_vertices == 0 || data->n_vertices <= max_part_vertices)
+    {
+      MashPlyLoaderPart whole;
+
+      whole.vertices = data->vertices;
+      whole.indices = data->faces;
+      whole.indices_type = data->indices_type;
+      whole.min_index = data->min_index;
+      whole.max_index = data->max_index;
+      g_array_append_val (data->parts, whole);
+
+      data->vertices = NULL;
+      data->faces = NULL;
+
+      return;
+    }
+
+  data->stats.peak_temp_bytes +=
+    mash_ply_loader_cut_parts (data, max_part_vertices, NULL, data->parts);
+
+  g_byte_array_free (data->vertices, TRUE);
+  data->vertices = NULL;
+  g_array_free (data->faces, TRUE);
+  data->faces = NULL;
+}
+
+/* Splits again any parts that need unsigned int indices into parts
+   of at most MASH_PLY_LOADER_MAX_SHORT_VERTICES vertices. This is
+   used when the driver doesn't support unsigned int indices */
+static void
+mash_ply_loader_split_int_parts (MashPlyLoaderData *data)
+{
+  GArray *parts = g_array_new (FALSE, TRUE, sizeof (MashPlyLoaderPart));
+  guint i;
+
+  for (i = 0; i < data->parts->len; i++)
+    {
+      MashPlyLoaderPart *part =
+        &g_array_index (data->parts, MashPlyLoaderPart, i);
+
+      if (part->indices_type == COGL_INDICES_TYPE_UNSIGNED_INT)
+        {
+          data->vertices = part->vertices;
+          data->vertex_data = part->vertices->data;
+          data->n_vertices = part->vertices->len / data->n_vertex_bytes;
+          data->faces = part->indices;
+          data->indices_type = part->indices_type;
+
+          data->stats.peak_temp_bytes +=
+            mash_ply_loader_cut_parts (data,
+                                       MASH_PLY_LOADER_MAX_SHORT_VERTICES,
+                                       NULL,
+                                       parts);
+
+          mash_ply_loader_free_part_arrays (part);
+          data->vertices = NULL;
+          data->faces = NULL;
         }
       else
+        g_array_append_val (parts, *part);
+    }
+
+  g_array_free (data->parts, TRUE);
+  data->parts = parts;
+}
+
+/* Returns whether there are batches left to cut into windows when
+   streaming */
+static gboolean
+mash_ply_loader_has_batch (MashPlyLoaderData *data)
+{
+  return data->stream_batch && data->next_batch < data->stats.n_triangles;
+}
+
+/* Copies the next batch of triangles from the mapped face file into
+   the face array and cuts it into windows of at most
+   MASH_PLY_LOADER_MAX_SHORT_VERTICES vertices in the same way as
+   mash_ply_loader_split(). Each window covers a compact region of the
+   batch and can use 16-bit indices. The windows replace the parts
+   that have already been uploaded */
+static void
+mash_ply_loader_cut_batch (MashPlyLoaderData *data)
+{
+  const guint8 *indices =
+    (const guint8 *) g_mapped_file_get_contents (data->face_spill.mapping);
+  guint index_size = g_array_get_element_size (data->faces);
+  guint n_triangles = MIN (data->stream_batch,
+                           data->stats.n_triangles - data->next_batch);
+  gsize window_bytes;
+
+  mash_ply_loader_begin_stage (data, &data->stats.split_time,
+                               "split batch");
+
+  g_array_set_size (data->parts, 0);
+  data->next_part = 0;
+
+  g_array_set_size (data->faces, 0);
+  g_array_append_vals (data->faces,
+                       indices + (gsize) data->next_batch * 3 * index_size,
+                       n_triangles * 3);
+  data->next_batch += n_triangles;
+
+  window_bytes =
+    mash_ply_loader_cut_parts (data,
+                               MASH_PLY_LOADER_MAX_SHORT_VERTICES,
+                               data->window_map,
+                               data->parts);
+  data->max_window_bytes = MAX (data->max_window_bytes, window_bytes);
+
+  mash_ply_loader_begin_stage (data, NULL, NULL);
+}
+
+static gboolean
+mash_ply_loader_get_indices_type (MashPlyLoaderData *data,
+                                  GError **error)
+{
+  p_ply_element elem = NULL;
+  gint32 n_vertices = -1, n_faces = 0;
+  guint index_size;
+  guint64 max_reserve;
+
+  /* Look for the 'vertex' and 'face' elements */
+  while ((elem = ply_get_next_element (data->ply, elem)))
+    {
+      const char *name;
+      gint32 n_instances;
+
+      if (!ply_get_element_info (elem, &name, &n_instances))
         {
           g_set_error (error, MASH_DATA_ERROR,
                        MASH_DATA_ERROR_UNKNOWN,
                        "Error getting element info");
           return FALSE;
         }
+
+      if (!strcmp (name, "vertex"))
+        n_vertices = n_instances;
+      else if (!strcmp (name, "face"))
+        n_faces = n_instances;
+    }
+
+  if (n_vertices < 0)
+    {
+      g_set_error (error, MASH_DATA_ERROR,
+                   MASH_DATA_ERROR_MISSING_PROPERTY,
+                   "PLY file is missing the vertex element");
+      return FALSE;
     }
 
-  g_set_error (error, MASH_DATA_ERROR,
-               MASH_DATA_ERROR_MISSING_PROPERTY,
-               "PLY file is missing the vertex element");
+  data->n_header_vertices = n_vertices;
 
-  return FALSE;
+  /* Whether the driver supports unsigned int indices is checked when
+     the data is uploaded because Cogl can't be used while parsing */
+  data->indices_type =
+    mash_ply_loader_get_indices_type_for_vertices (n_vertices, &index_size);
+
+  /* When streaming the arrays only need to hold one batch */
+  if (data->stream_batch)
+    {
+      n_vertices = MIN (n_vertices, data->stream_batch);
+      n_faces = MIN (n_faces, data->stream_batch);
+    }
+
+  /* Reserve the space for the data up front using the counts from
+     the header so that the arrays don't have to be repeatedly
+     reallocated while reading. Every face makes at least one
+     triangle so the index array only grows for faces with more than
+     three vertices. Each element takes at least a byte in the file so
+     the counts are clamped to the file size in case the header is
+     bogus */
+  max_reserve = data->stats.file_size;
+
+  data->reserved_vertex_bytes = (MIN ((guint64) n_vertices, max_reserve)
+                                 * data->n_vertex_bytes);
+  data->reserved_index_bytes = (MIN ((guint64) n_faces, max_reserve)
+                                * 3 * index_size);
+
+  data->vertices = g_byte_array_sized_new (data->reserved_vertex_bytes);
+  data->faces = g_array_sized_new (FALSE, FALSE, index_size,
+                                   data->reserved_index_bytes / index_size);
+
+  if (data->stream_batch
+      && (!mash_ply_loader_open_spill (&data->vertex_spill, error)
+          || !mash_ply_loader_open_spill (&data->face_spill, error)))
+    return FALSE;
+
+  return TRUE;
 }
 
 static int
@@ -355,11 +1327,18 @@ mash_ply_loader_face_read_cb (p_ply_argument argument)
   ply_get_argument_user_data (argument, (void **) &data, &prop_num);
   ply_get_argument_property (argument, NULL, &length, &index);
 
-  if (index == 0)
+  if (data->stage_time != &data->stats.face_time)
+    mash_ply_loader_begin_stage (data, &data->stats.face_time,
+                                 "face decode");
+
+  /* The callback is first called with the length of the list */
+  if (index == -1)
+    data->stats.n_faces++;
+  else if (index == 0)
     data->first_vertex = ply_get_argument_value (argument);
   else if (index == 1)
     data->last_vertex = ply_get_argument_value (argument);
-  else if (index != -1)
+  else
     {
       guint new_vertex = ply_get_argument_value (argument);
 
@@ -371,22 +1350,96 @@ mash_ply_loader_face_read_cb (p_ply_argument argument)
 
       /* Use the new vertex as one of the vertices next time around */
       data->last_vertex = new_vertex;
+
+      if (data->stream_batch
+          && data->faces->len >= data->stream_batch * 3)
+        {
+          if (!mash_ply_loader_write_spill
+              (data, &data->face_spill,
+               data->faces->data,
+               data->faces->len * g_array_get_element_size (data->faces)))
+            return 0;
+
+          g_array_set_size (data->faces, 0);
+        }
     }
 
   return 1;
 }
 
+static void
+mash_ply_loader_calculate_memory (MashPlyLoaderData *data,
+                                  gsize vertex_bytes,
+                                  gsize index_bytes,
+                                  MashDataMemoryUsage *memory)
+{
+  static const struct
+  {
+    gint props;
+    gint first_prop;
+    gint n_components;
+    gsize offset;
+  }
+  attributes[] =
+    {
+      { MASH_PLY_LOADER_VERTEX_PROPS, 0, 3,
+        G_STRUCT_OFFSET (MashDataMemoryUsage, position_bytes) },
+      { MASH_PLY_LOADER_NORMAL_PROPS, 3, 3,
+        G_STRUCT_OFFSET (MashDataMemoryUsage, normal_bytes) },
+      { MASH_PLY_LOADER_TEX_COORD_PROPS, 6, 2,
+        G_STRUCT_OFFSET (MashDataMemoryUsage, tex_coord_bytes) },
+      { MASH_PLY_LOADER_COLOR_PROPS, 8, 3,
+        G_STRUCT_OFFSET (MashDataMemoryUsage, color_bytes) }
+    };
+  /* Vertices shared between parts are counted once for each part */
+  gsize n_vertices = vertex_bytes / data->n_vertex_bytes;
+  gsize attribute_bytes = 0;
+  int i;
+
+  memset (memory, 0, sizeof (MashDataMemoryUsage));
+
+  /* The vertex buffer is uploaded with the same interleaved layout as
+     the vertex array so any bytes not used by an attribute are
+     counted as padding */
+  for (i = 0; i < G_N_ELEMENTS (attributes); i++)
+    if ((data->available_props & attributes[i].props) == attributes[i].props)
+      {
+        gsize bytes = (n_vertices
+                       * attributes[i].n_components
+                       * mash_ply_loader_properties[attributes[i].first_prop]
+                       .size);
+
+        G_STRUCT_MEMBER (gsize, memory, attributes[i].offset) = bytes;
+        attribute_bytes += bytes;
+      }
+
+  memory->vertex_bytes = vertex_bytes;
+  memory->padding_bytes = memory->vertex_bytes - attribute_bytes;
+  memory->index_bytes = index_bytes;
+
+  /* Without VBOs Cogl keeps the buffers in system memory */
+  if (cogl_features_available (COGL_FEATURE_VBOS))
+    memory->gpu_bytes = memory->vertex_bytes + memory->index_bytes;
+  else
+    memory->cpu_bytes = memory->vertex_bytes + memory->index_bytes;
+}
+
+/* Decodes the file into arrays in system memory. This doesn't use
+   Cogl so it can be called from any thread. If MASH_DATA_STREAM is
+   given the decoded data is written to temporary files instead and
+   the batches are cut into windows as they are uploaded */
 static gboolean
-mash_ply_loader_load (MashDataLoader *data_loader,
-                      MashDataFlags flags,
-                      const gchar *filename,
-                      GError **error)
+mash_ply_loader_parse (MashDataLoader *data_loader,
+                       MashDataFlags flags,
+                       const gchar *filename,
+                       GError **error)
 {
   MashPlyLoader *self = MASH_PLY_LOADER (data_loader);
   MashPlyLoaderPrivate *priv;
   MashPlyLoaderData data;
+  GStatBuf stat_buf;
   gchar *display_name;
-  gboolean ret;
+  gboolean ret = FALSE;
 
   priv = self->priv;
 
@@ -394,8 +1447,23 @@ mash_ply_loader_load (MashDataLoader *data_loader,
   data.n_vertex_bytes = 0;
   data.available_props = 0;
   data.got_props = 0;
-  data.vertices = g_byte_array_new ();
+  data.vertices = NULL;
   data.faces = NULL;
+  data.vertex_data = NULL;
+  data.n_vertices = 0;
+  data.parts = NULL;
+  memset (&data.coarse, 0, sizeof (data.coarse));
+  data.n_header_vertices = 0;
+  data.stream_batch = ((flags & MASH_DATA_STREAM)
+                       ? MASH_PLY_LOADER_STREAM_BATCH : 0);
+  memset (&data.vertex_spill, 0, sizeof (data.vertex_spill));
+  memset (&data.face_spill, 0, sizeof (data.face_spill));
+  data.n_spilled_indices = 0;
+  data.next_batch = 0;
+  data.window_map = (data.stream_batch
+                     ? g_hash_table_new (g_direct_hash, g_direct_equal)
+                     : NULL);
+  data.max_window_bytes = 0;
   data.min_vertex.x = G_MAXFLOAT;
   data.min_vertex.y = G_MAXFLOAT;
   data.min_vertex.z = G_MAXFLOAT;
@@ -405,8 +1473,17 @@ mash_ply_loader_load (MashDataLoader *data_loader,
   data.min_index = G_MAXUINT;
   data.max_index = 0;
   data.flags = flags;
+  memset (&data.stats, 0, sizeof (data.stats));
+  data.stage_time = NULL;
 
   display_name = g_filename_display_name (filename);
+  data.display_name = display_name;
+
+  mash_ply_loader_begin_stage (&data, &data.stats.open_time,
+                               "open");
+
+  if (g_stat (filename, &stat_buf) == 0)
+    data.stats.file_size = stat_buf.st_size;
 
   if ((data.ply = ply_open (filename,
                             mash_ply_loader_error_cb,
@@ -414,6 +1491,9 @@ mash_ply_loader_load (MashDataLoader *data_loader,
     mash_ply_loader_check_unknown_error (&data);
   else
     {
+      mash_ply_loader_begin_stage (&data, &data.stats.header_time,
+                                   "parse header");
+
       if (!ply_read_header (data.ply))
         mash_ply_loader_check_unknown_error (&data);
       else
@@ -448,124 +1528,346 @@ mash_ply_loader_load (MashDataLoader *data_loader,
                          "PLY file %s is missing face property "
                          "'vertex_indices'",
                          display_name);
-          else if (mash_ply_loader_get_indices_type (&data, &data.error)
-                   && !ply_read (data.ply))
-            mash_ply_loader_check_unknown_error (&data);
+          else if (mash_ply_loader_get_indices_type (&data, &data.error))
+            {
+              if (!ply_read (data.ply))
+                mash_ply_loader_check_unknown_error (&data);
+              else if (data.stream_batch)
+                mash_ply_loader_map_spills (&data);
+              else
+                data.vertex_data = data.vertices->data;
+            }
         }
 
       ply_close (data.ply);
     }
 
   if (data.error)
-    {
-      g_propagate_error (error, data.error);
-      ret = FALSE;
-    }
-  else if (data.faces->len < 3)
-    {
-      g_set_error (error, MASH_DATA_ERROR,
-                   MASH_DATA_ERROR_INVALID,
-                   "No faces found in %s",
-                   display_name);
-      ret = FALSE;
-    }
+    g_propagate_error (error, data.error);
   else
     {
+      guint n_indices = (data.stream_batch
+                         ? data.n_spilled_indices
+                         : data.faces->len);
+
+      mash_ply_loader_begin_stage (&data, &data.stats.validate_time,
+                                   "validate");
+
+      if (n_indices < 3)
+        g_set_error (error, MASH_DATA_ERROR,
+                     MASH_DATA_ERROR_INVALID,
+                     "No faces found in %s",
+                     display_name);
       /* Make sure all of the indices are valid */
-      if (data.max_index >= data.vertices->len / data.n_vertex_bytes)
-        {
-          g_set_error (error, MASH_DATA_ERROR,
-                       MASH_DATA_ERROR_INVALID,
-                       "Index out of range in %s",
-                       display_name);
-          ret = FALSE;
-        }
+      else if (data.max_index >= data.n_vertices)
+        g_set_error (error, MASH_DATA_ERROR,
+                     MASH_DATA_ERROR_INVALID,
+                     "Index out of range in %s",
+                     display_name);
       else
         {
-          /* Get rid of the old VBOs (if any) */
-          mash_ply_loader_free_vbos (self);
+          mash_ply_loader_begin_stage (&data, &data.stats.extents_time,
+                                       "calculate extents");
+
+          mash_ply_loader_calculate_extents (&data);
+
+          data.stats.n_vertices = data.n_vertices;
+          data.stats.n_triangles = n_indices / 3;
+          /* Both arrays are alive until they are split. When streaming
+             they only ever hold one batch and the mapped files aren't
+             counted */
+          data.stats.peak_temp_bytes
+            = (MAX (data.reserved_vertex_bytes,
+                    data.vertices ? data.vertices->len : 0)
+               + MAX (data.reserved_index_bytes,
+                      data.faces->len
+                      * g_array_get_element_size (data.faces)));
+
+          if (data.stream_batch)
+            /* The batches are cut into windows as they are uploaded.
+               There is no coarse version because that would need all
+               of the faces at once */
+            data.parts = g_array_new (FALSE, TRUE,
+                                      sizeof (MashPlyLoaderPart));
+          else
+            {
+              mash_ply_loader_begin_stage (&data, &data.stats.coarse_time,
+                                           "build coarse");
 
-          /* Create a new VBO for the vertices */
-          priv->vertices_vbo = cogl_vertex_buffer_new (data.vertices->len
-                                                       / data.n_vertex_bytes);
+              mash_ply_loader_build_coarse
+                (&data,
+                 mash_data_loader_get_coarse_triangles (data_loader));
 
-          /* Upload the data */
-          if ((data.available_props & MASH_PLY_LOADER_VERTEX_PROPS)
-              == MASH_PLY_LOADER_VERTEX_PROPS)
-            cogl_vertex_buffer_add (priv->vertices_vbo,
-                                    "gl_Vertex",
-                                    3, COGL_ATTRIBUTE_TYPE_FLOAT,
-                                    FALSE, data.n_vertex_bytes,
-                                    data.vertices->data
-                                    + data.prop_map[0]);
-
-          if ((data.available_props & MASH_PLY_LOADER_NORMAL_PROPS)
-              == MASH_PLY_LOADER_NORMAL_PROPS)
-            cogl_vertex_buffer_add (priv->vertices_vbo,
-                                    "gl_Normal",
-                                    3, COGL_ATTRIBUTE_TYPE_FLOAT,
-                                    FALSE, data.n_vertex_bytes,
-                                    data.vertices->data
-                                    + data.prop_map[3]);
-
-          if ((data.available_props & MASH_PLY_LOADER_TEX_COORD_PROPS)
-              == MASH_PLY_LOADER_TEX_COORD_PROPS)
-            cogl_vertex_buffer_add (priv->vertices_vbo,
-                                    "gl_MultiTexCoord0",
-                                    2, COGL_ATTRIBUTE_TYPE_FLOAT,
-                                    FALSE, data.n_vertex_bytes,
-                                    data.vertices->data
-                                    + data.prop_map[6]);
-
-          if ((data.available_props & MASH_PLY_LOADER_COLOR_PROPS)
-              == MASH_PLY_LOADER_COLOR_PROPS)
-            cogl_vertex_buffer_add (priv->vertices_vbo,
-                                    "gl_Color",
-                                    3, COGL_ATTRIBUTE_TYPE_UNSIGNED_BYTE,
-                                    FALSE, data.n_vertex_bytes,
-                                    data.vertices->data
-                                    + data.prop_map[8]);
-
-          cogl_vertex_buffer_submit (priv->vertices_vbo);
-
-          /* Create a VBO for the indices */
-          priv->indices
-            = cogl_vertex_buffer_indices_new (data.indices_type,
-                                              data.faces->data,
-                                              data.faces->len);
-
-          priv->min_index = data.min_index;
-          priv->max_index = data.max_index;
-          priv->n_triangles = data.faces->len / 3;
-
-          priv->min_vertex = data.min_vertex;
-          priv->max_vertex = data.max_vertex;
+              mash_ply_loader_begin_stage (&data, &data.stats.split_time,
+                                           "split");
+
+              mash_ply_loader_split
+                (&data,
+                 mash_data_loader_get_max_part_vertices (data_loader));
+            }
+
+          mash_ply_loader_begin_stage (&data, NULL, NULL);
+
+          /* Keep the parts for mash_ply_loader_upload_part() */
+          mash_ply_loader_free_parsed (self);
+          data.next_part = 0;
+          data.upload_started = FALSE;
+          priv->parsed = g_slice_dup (MashPlyLoaderData, &data);
+          data.parts = NULL;
+          data.faces = NULL;
+          data.window_map = NULL;
+          memset (&data.vertex_spill, 0, sizeof (data.vertex_spill));
+          memset (&data.face_spill, 0, sizeof (data.face_spill));
+          memset (&data.coarse, 0, sizeof (data.coarse));
 
           ret = TRUE;
         }
     }
 
+  /* End the last stage if the load failed part way through */
+  mash_ply_loader_begin_stage (&data, NULL, NULL);
+
   g_free (display_name);
-  g_byte_array_free (data.vertices, TRUE);
-  if (data.faces)
-    g_array_free (data.faces, TRUE);
+  mash_ply_loader_free_arrays (&data);
 
   return ret;
 }
 
+/* Creates the buffers for @part */
+static void
+mash_ply_loader_create_buffers (MashPlyLoaderData *data,
+                                const MashPlyLoaderPart *part,
+                                MashDataLoaderPart *loader_part)
+{
+  guint n_part_vertices = part->vertices->len / data->n_vertex_bytes;
+
+  /* Create a new VBO for the vertices */
+  loader_part->vertices_vbo = cogl_vertex_buffer_new (n_part_vertices);
+
+  /* Upload the data */
+  if ((data->available_props & MASH_PLY_LOADER_VERTEX_PROPS)
+      == MASH_PLY_LOADER_VERTEX_PROPS)
+    cogl_vertex_buffer_add (loader_part->vertices_vbo,
+                            "gl_Vertex",
+                            3, COGL_ATTRIBUTE_TYPE_FLOAT,
+                            FALSE, data->n_vertex_bytes,
+                            part->vertices->data + data->prop_map[0]);
+
+  if ((data->available_props & MASH_PLY_LOADER_NORMAL_PROPS)
+      == MASH_PLY_LOADER_NORMAL_PROPS)
+    cogl_vertex_buffer_add (loader_part->vertices_vbo,
+                            "gl_Normal",
+                            3, COGL_ATTRIBUTE_TYPE_FLOAT,
+                            FALSE, data->n_vertex_bytes,
+                            part->vertices->data + data->prop_map[3]);
+
+  if ((data->available_props & MASH_PLY_LOADER_TEX_COORD_PROPS)
+      == MASH_PLY_LOADER_TEX_COORD_PROPS)
+    cogl_vertex_buffer_add (loader_part->vertices_vbo,
+                            "gl_MultiTexCoord0",
+                            2, COGL_ATTRIBUTE_TYPE_FLOAT,
+                            FALSE, data->n_vertex_bytes,
+                            part->vertices->data + data->prop_map[6]);
+
+  if ((data->available_props & MASH_PLY_LOADER_COLOR_PROPS)
+      == MASH_PLY_LOADER_COLOR_PROPS)
+    cogl_vertex_buffer_add (loader_part->vertices_vbo,
+                            "gl_Color",
+                            3, COGL_ATTRIBUTE_TYPE_UNSIGNED_BYTE,
+                            FALSE, data->n_vertex_bytes,
+                            part->vertices->data + data->prop_map[8]);
+
+  cogl_vertex_buffer_submit (loader_part->vertices_vbo);
+
+  /* Create a VBO for the indices */
+  loader_part->indices
+    = cogl_vertex_buffer_indices_new (part->indices_type,
+                                      part->indices->data,
+                                      part->indices->len);
+
+  loader_part->min_index = part->min_index;
+  loader_part->max_index = part->max_index;
+  loader_part->n_triangles = part->indices->len / 3;
+}
+
+/* Creates the buffers for the next part of the data decoded by
+   mash_ply_loader_parse(). This must be called from the thread that
+   uses Cogl */
+static gboolean
+mash_ply_loader_upload_part (MashDataLoader *data_loader,
+                             gboolean *done,
+                             GError **error)
+{
+  MashPlyLoader *self = MASH_PLY_LOADER (data_loader);
+  MashPlyLoaderPrivate *priv = self->priv;
+  MashPlyLoaderData *data = priv->parsed;
+  MashPlyLoaderPart *part;
+  MashDataLoaderPart loader_part;
+  int i;
+
+  g_return_val_if_fail (data != NULL, FALSE);
+
+  if (!data->upload_started)
+    {
+      /* The data is only split when parsing if it was asked for so
+         it may still need splitting if the driver can't use unsigned
+         int indices. Cogl can't be queried while parsing so this has
+         to be done here */
+      for (i = 0; i < data->parts->len; i++)
+        if (g_array_index (data->parts, MashPlyLoaderPart, i).indices_type
+            == COGL_INDICES_TYPE_UNSIGNED_INT &&
+            !cogl_features_available (COGL_FEATURE_UNSIGNED_INT_INDICES))
+          {
+            mash_ply_loader_begin_stage (data, &data->stats.split_time,
+                                         "split");
+            mash_ply_loader_split_int_parts (data);
+            mash_ply_loader_begin_stage (data, NULL, NULL);
+            break;
+          }
+
+      /* Get rid of the old VBOs (if any) */
+      mash_ply_loader_free_vbos (self);
+
+      priv->parts = g_array_sized_new (FALSE, FALSE,
+                                       sizeof (MashDataLoaderPart),
+                                       data->parts->len);
+
+      data->stats.vertex_bytes = 0;
+      data->stats.index_bytes = 0;
+
+      data->upload_started = TRUE;
+    }
+
+  /* When streaming, the next batch is cut into windows once the
+     windows of the previous one have been uploaded */
+  if (data->next_part >= data->parts->len
+      && mash_ply_loader_has_batch (data))
+    mash_ply_loader_cut_batch (data);
+
+  if (data->next_part < data->parts->len)
+    {
+      mash_ply_loader_begin_stage (data, &data->stats.upload_time, "upload");
+
+      part = &g_array_index (data->parts, MashPlyLoaderPart,
+                             data->next_part++);
+
+      mash_ply_loader_create_buffers (data, part, &loader_part);
+
+      g_array_append_val (priv->parts, loader_part);
+
+      data->stats.vertex_bytes += part->vertices->len;
+      data->stats.index_bytes
+        += part->indices->len * g_array_get_element_size (part->indices);
+
+      /* The part is on the GPU now so its arrays can be freed
+         straight away instead of waiting for the rest of the parts */
+      mash_ply_loader_free_part_arrays (part);
+
+      mash_ply_loader_begin_stage (data, NULL, NULL);
+    }
+
+  if (data->next_part < data->parts->len
+      || mash_ply_loader_has_batch (data))
+    {
+      *done = FALSE;
+      return TRUE;
+    }
+
+  /* Only one batch and its windows are in memory at a time */
+  if (data->stream_batch)
+    data->stats.peak_temp_bytes = MAX (data->stats.peak_temp_bytes,
+                                       data->reserved_index_bytes
+                                       + data->max_window_bytes);
+
+  priv->n_triangles = data->stats.n_triangles;
+
+  priv->min_vertex = data->min_vertex;
+  priv->max_vertex = data->max_vertex;
+
+  mash_ply_loader_calculate_memory (data,
+                                    data->stats.vertex_bytes,
+                                    data->stats.index_bytes,
+                                    &priv->memory);
+
+  priv->stats = data->stats;
+
+  mash_ply_loader_free_parsed (self);
+
+  *done = TRUE;
+
+  return TRUE;
+}
+
 static void
 mash_ply_loader_get_data (MashDataLoader *data_loader, MashDataLoaderData *loader_data)
 {
   MashPlyLoader *self = MASH_PLY_LOADER (data_loader);
   MashPlyLoaderPrivate *priv = self->priv;
+  int i;
 
-  loader_data->vertices_vbo = cogl_handle_ref (priv->vertices_vbo);
-  loader_data->indices = cogl_handle_ref (priv->indices);
+  loader_data->n_parts = priv->parts->len;
+  loader_data->parts = g_new (MashDataLoaderPart, priv->parts->len);
+
+  for (i = 0; i < priv->parts->len; i++)
+    {
+      const MashDataLoaderPart *part =
+        &g_array_index (priv->parts, MashDataLoaderPart, i);
+
+      loader_data->parts[i] = *part;
+      cogl_handle_ref (part->vertices_vbo);
+      cogl_handle_ref (part->indices);
+    }
 
-  loader_data->min_index = priv->min_index;
-  loader_data->max_index = priv->max_index;
   loader_data->n_triangles = priv->n_triangles;
 
   loader_data->min_vertex = priv->min_vertex;
   loader_data->max_vertex = priv->max_vertex;
+
+  loader_data->stats = priv->stats;
+  loader_data->memory = priv->memory;
+}
+
+/* Creates the buffers for the coarse version of the data decoded by
+   mash_ply_loader_parse(). The full data can still be uploaded
+   afterwards */
+static gboolean
+mash_ply_loader_upload_coarse (MashDataLoader *data_loader,
+                               MashDataLoaderData *loader_data)
+{
+  MashPlyLoader *self = MASH_PLY_LOADER (data_loader);
+  MashPlyLoaderData *data = self->priv->parsed;
+  gsize index_bytes;
+
+  g_return_val_if_fail (data != NULL, FALSE);
+
+  if (data->coarse.vertices == NULL)
+    return FALSE;
+
+  mash_ply_loader_begin_stage (data, &data->stats.upload_time,
+                               "upload coarse");
+
+  memset (loader_data, 0, sizeof (MashDataLoaderData));
+
+  loader_data->n_parts = 1;
+  loader_data->parts = g_new (MashDataLoaderPart, 1);
+  mash_ply_loader_create_buffers (data, &data->coarse, loader_data->parts);
+
+  loader_data->n_triangles = loader_data->parts[0].n_triangles;
+  loader_data->min_vertex = data->min_vertex;
+  loader_data->max_vertex = data->max_vertex;
+  loader_data->stats = data->stats;
+
+  index_bytes = (data->coarse.indices->len
+                 * g_array_get_element_size (data->coarse.indices));
+  mash_ply_loader_calculate_memory (data,
+                                    data->coarse.vertices->len,
+                                    index_bytes,
+                                    &loader_data->memory);
+
+  /* The coarse version is only uploaded once */
+  mash_ply_loader_free_part_arrays (&data->coarse);
+
+  mash_ply_loader_begin_stage (data, NULL, NULL);
+
+  return TRUE;
 }
@@ -46,6 +46,7 @@
 
 #include "mash-light.h"
 #include "mash-point-light.h"
+#include "mash-light-private.h"
 
 static void mash_point_light_get_property (GObject *object,
                                            guint prop_id,
@@ -79,17 +80,6 @@ struct _MashPointLightPrivate
      can upload them as one vector and use a dot product in the
      shader */
   float attenuation[MASH_POINT_LIGHT_ATTENUATION_COUNT];
-
-  int attenuation_uniform_location;
-  int light_eye_coord_uniform_location;
-
-  /* TRUE if the attenuation factors have been modified since
-     update_uniforms was last called */
-  gboolean attenuation_dirty;
-
-  /* TRUE if the shader has changed since we last called
-     cogl_program_get_uniform_location for the uniforms */
-  gboolean uniform_locations_dirty;
 };
 
 enum
@@ -138,6 +128,62 @@ mash_point_light_shader[] =
   "  cogl_color_out.xyz += lit_color$;\n"
   ;
 
+/* This is used instead of the snippet above when the light set is
+   using uniform arrays. Every point light in the set is evaluated by
+   the same loop. See _mash_point_light_get_block() for the layout of
+   the array */
+static const char
+mash_point_light_array_uniforms[] =
+  "uniform int mash_n_point_lights;\n"
+  "uniform vec4 mash_point_lights[mash_max_point_lights * 5];\n"
+  ;
+
+static const char
+mash_point_light_array_shader[] =
+  "  for (int i = 0; i < mash_max_point_lights; i++)\n"
+  "    {\n"
+  "      if (i >= mash_n_point_lights)\n"
+  "        break;\n"
+  "      int base = i * 5;\n"
+  /* Vector from the vertex to the light */
+  "      vec3 light_vec = mash_point_lights[base + 3].xyz - eye_coord;\n"
+  /* Distance from the vertex to the light */
+  "      float d = length (light_vec);\n"
+  /* Normalize the light vector */
+  "      light_vec /= d;\n"
+  /* Add the ambient light term */
+  "      vec3 lit_color = (mash_material.ambient.rgb\n"
+  "                        * mash_point_lights[base].rgb);\n"
+  /* Calculate the diffuse factor based on the angle between the
+     vertex normal and the angle between the light and the vertex */
+  "      float diffuse_factor = max (0.0, dot (light_vec, normal));\n"
+  /* Skip the specular and diffuse terms if the vertex is not facing
+     the light */
+  "      if (diffuse_factor > 0.0)\n"
+  "        {\n"
+  /* Add the diffuse term */
+  "          lit_color += (diffuse_factor * mash_material.diffuse.rgb\n"
+  "                        * mash_point_lights[base + 1].rgb);\n"
+  /* Add the specular term using the half vector as in the snippet
+     for a single light */
+  "          vec3 half_vector = normalize (light_vec\n"
+  "                                        + vec3 (0.0, 0.0, 1.0));\n"
+  "          float spec_factor = max (0.0, dot (half_vector, normal));\n"
+  "          float spec_power = pow (spec_factor,\n"
+  "                                  mash_material.shininess);\n"
+  "          lit_color += (mash_material.specular.rgb\n"
+  "                        * mash_point_lights[base + 2].rgb\n"
+  "                        * spec_power);\n"
+  "        }\n"
+  /* Attenuate the lit color based on the distance to the light and
+     the attenuation formula properties */
+  "      lit_color /= dot (mash_point_lights[base + 4].xyz,\n"
+  "                        vec3 (1.0, d, d * d));\n"
+  /* Add it to the total computed color value */
+  "      cogl_color_out.xyz += lit_color;\n"
+  "    }\n"
+  ;
+
 static void
 mash_point_light_class_init (MashPointLightClass *klass)
 {
@@ -210,10 +256,6 @@ mash_point_light_init (MashPointLight *self)
   priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_CONSTANT] = 1.0f;
   priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_LINEAR] = 0.0f;
   priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_QUADRATIC] = 0.0f;
-
-  priv->attenuation_dirty = TRUE;
-
-  priv->uniform_locations_dirty = TRUE;
 }
 
 static void
@@ -327,7 +369,6 @@ mash_point_light_set_constant_attenuation (MashPointLight *light,
   if (attenuation != priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_CONSTANT])
     {
       priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_CONSTANT] = attenuation;
-      priv->attenuation_dirty = TRUE;
       g_object_notify (G_OBJECT (light), "constant-attenuation");
     }
 }
@@ -369,7 +410,6 @@ mash_point_light_set_linear_attenuation (MashPointLight *light,
   if (attenuation != priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_LINEAR])
     {
       priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_LINEAR] = attenuation;
-      priv->attenuation_dirty = TRUE;
       g_object_notify (G_OBJECT (light), "linear-attenuation");
     }
 }
@@ -411,7 +451,6 @@ mash_point_light_set_quadratic_attenuation (MashPointLight *light,
   if (attenuation != priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_QUADRATIC])
     {
       priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_QUADRATIC] = attenuation;
-      priv->attenuation_dirty = TRUE;
       g_object_notify (G_OBJECT (light), "quadratic-attenuation");
     }
 }
@@ -441,10 +480,37 @@ mash_point_light_generate_shader (MashLight *light,
   MASH_LIGHT_CLASS (mash_point_light_parent_class)
     ->generate_shader (light, uniform_source, main_source);
 
-  /* If the shader is being generated then the uniform locations also
-     need updating */
-  priv->uniform_locations_dirty = TRUE;
-  priv->attenuation_dirty = TRUE;
+  if (mash_light_get_static_parameters (light))
+    {
+      float ambient[3];
+
+      /* Bake the attenuation into the shader and leave out any terms
+         that can't contribute */
+      mash_light_append_shader (light, uniform_source,
+                                "const vec3 attenuation$ = ");
+      _mash_append_glsl_vec3 (uniform_source, priv->attenuation);
+      mash_light_append_shader (light, uniform_source,
+                                ";\n"
+                                "uniform vec3 light_eye_coord$;\n");
+
+      mash_light_append_shader (light, main_source,
+                                "  vec3 light_vec$ = light_eye_coord$"
+                                " - eye_coord;\n"
+                                "  float d$ = length (light_vec$);\n"
+                                "  light_vec$ /= d$;\n");
+      _mash_light_append_static_terms (light, main_source, "light_vec$",
+                                       !_mash_light_get_folded_ambient
+                                       (light, ambient));
+      if (_mash_point_light_is_attenuated (plight))
+        mash_light_append_shader (light, main_source,
+                                  "  lit_color$ /= dot (attenuation$,\n"
+                                  "                     vec3 (1.0, d$,"
+                                  " d$ * d$));\n");
+      mash_light_append_shader (light, main_source,
+                                "  cogl_color_out.xyz += lit_color$;\n");
+
+      return;
+    }
 
   mash_light_append_shader (light, uniform_source,
                             "uniform vec3 attenuation$;\n"
@@ -459,49 +525,92 @@ mash_point_light_update_uniforms (MashLight *light,
 {
   MashPointLight *plight = MASH_POINT_LIGHT (light);
   MashPointLightPrivate *priv = plight->priv;
+  MashLightProgramState *state = _mash_light_get_program_state (light);
   gfloat light_eye_coord[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
   CoglMatrix matrix;
 
   MASH_LIGHT_CLASS (mash_point_light_parent_class)
     ->update_uniforms (light, program);
 
-  if (priv->uniform_locations_dirty)
+  if (!state->initialized)
     {
-      priv->attenuation_uniform_location
+      state->locations[MASH_LIGHT_UNIFORM_ATTENUATION]
         = mash_light_get_uniform_location (light, program, "attenuation");
-      priv->light_eye_coord_uniform_location
+      state->locations[MASH_LIGHT_UNIFORM_LIGHT_EYE_COORD]
         = mash_light_get_uniform_location (light, program, "light_eye_coord");
-      priv->uniform_locations_dirty = FALSE;
     }
 
-  if (priv->attenuation_dirty)
+  /* Static attenuation is a constant in the shader */
+  if (_mash_light_parameters_changed (light) &&
+      !mash_light_get_static_parameters (light))
+    cogl_program_set_uniform_float (program,
+                                    state->locations
+                                    [MASH_LIGHT_UNIFORM_ATTENUATION],
+                                    3, 1,
+                                    priv->attenuation);
+
+  /* MashLight tracks changes to the transformation of the light and
+     all of its ancestors so we only need to update the light eye
+     coordinates when that has changed */
+  if (_mash_light_transform_changed (light))
     {
+      mash_light_get_modelview_matrix (light,
+                                       &matrix);
+
+      cogl_matrix_transform_point (&matrix,
+                                   light_eye_coord + 0,
+                                   light_eye_coord + 1,
+                                   light_eye_coord + 2,
+                                   light_eye_coord + 3);
+      light_eye_coord[0] /= light_eye_coord[3];
+      light_eye_coord[1] /= light_eye_coord[3];
+      light_eye_coord[2] /= light_eye_coord[3];
+
       cogl_program_set_uniform_float (program,
-                                      priv->attenuation_uniform_location,
+                                      state->locations
+                                      [MASH_LIGHT_UNIFORM_LIGHT_EYE_COORD],
                                       3, 1,
-                                      priv->attenuation);
-      priv->attenuation_dirty = FALSE;
+                                      light_eye_coord);
     }
+}
+
+gboolean
+_mash_point_light_is_attenuated (MashPointLight *light)
+{
+  MashPointLightPrivate *priv = light->priv;
+
+  return (priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_CONSTANT] != 1.0f ||
+          priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_LINEAR] != 0.0f ||
+          priv->attenuation[MASH_POINT_LIGHT_ATTENUATION_QUADRATIC] != 0.0f);
+}
+
+void
+_mash_point_light_generate_array_shader (int capacity,
+                                         GString *uniform_source,
+                                         GString *main_source)
+{
+  g_string_append_printf (uniform_source,
+                          "const int mash_max_point_lights = %i;\n",
+                          capacity);
+  g_string_append (uniform_source, mash_point_light_array_uniforms);
+  g_string_append (main_source, mash_point_light_array_shader);
+}
+
+void
+_mash_point_light_get_block (MashPointLight *light,
+                             float *block)
+{
+  MashPointLightPrivate *priv = light->priv;
+  float *position = block + MASH_LIGHT_COLOR_BLOCK_SIZE * 4;
+  float *attenuation = position + 4;
+  int i;
+
+  _mash_light_get_color_block (MASH_LIGHT (light), block);
+
+  /* The xyz of the position is filled in by the light set */
+  position[3] = 1.0f;
 
-  /* I can't think of a good way to recognise when the position of the
-     actor may have changed so this just always updates the light eye
-     coordinates. Any transformations in the parent hierarchy could
-     cause the position to change without affecting the allocation */
-
-  mash_light_get_modelview_matrix (light,
-                                   &matrix);
-
-  cogl_matrix_transform_point (&matrix,
-                               light_eye_coord + 0,
-                               light_eye_coord + 1,
-                               light_eye_coord + 2,
-                               light_eye_coord + 3);
-  light_eye_coord[0] /= light_eye_coord[3];
-  light_eye_coord[1] /= light_eye_coord[3];
-  light_eye_coord[2] /= light_eye_coord[3];
-
-  cogl_program_set_uniform_float (program,
-                                  priv->light_eye_coord_uniform_location,
-                                  3, 1,
-                                  light_eye_coord);
+  for (i = 0; i < MASH_POINT_LIGHT_ATTENUATION_COUNT; i++)
+    attenuation[i] = priv->attenuation[i];
+  attenuation[3] = 0.0f;
 }
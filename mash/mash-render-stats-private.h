@@ -0,0 +1,49 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_RENDER_STATS_PRIVATE_H__
+#define __MASH_RENDER_STATS_PRIVATE_H__
+
+#include "mash-render-stats.h"
+
+G_BEGIN_DECLS
+
+/* The counters since the library was loaded. These are only updated
+   from the thread that paints so they can be incremented directly.
+   mash_render_stats_reset() doesn't clear them so that the MASH_DEBUG
+   summary keeps working when the application resets the counters */
+extern MashRenderStats _mash_render_stats;
+
+/* Counts a draw by mash_data_render(). This also starts the once a
+   second summary if MASH_DEBUG contains "stats" */
+void _mash_render_stats_count_draw (guint n_triangles,
+                                    guint n_vertices);
+
+/* Stores the difference between each counter in @a and @b in
+   @result */
+void _mash_render_stats_subtract (MashRenderStats *result,
+                                  const MashRenderStats *a,
+                                  const MashRenderStats *b);
+
+G_END_DECLS
+
+#endif /* __MASH_RENDER_STATS_PRIVATE_H__ */
@@ -0,0 +1,157 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:mash-render-stats
+ * @short_description: Counters for the rendering work done by Mash
+ *
+ * Mash keeps counters of the draws, triangles, program compiles and
+ * other work that it causes while painting. These can be used to
+ * estimate the cost of a scene or to catch regressions. The counters
+ * accumulate until mash_render_stats_reset() is called so an
+ * application that wants them per frame can reset them at the start
+ * of each frame.
+ *
+ * If the MASH_DEBUG environment variable contains "stats" then a
+ * summary of the counters is also logged once a second while
+ * anything is being drawn.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "mash-render-stats-private.h"
+#include "mash-debug.h"
+
+MashRenderStats _mash_render_stats;
+
+/* The values of _mash_render_stats when mash_render_stats_reset()
+   was last called */
+static MashRenderStats mash_render_stats_reset_point;
+
+/* The values of _mash_render_stats when the last debug summary was
+   logged */
+static MashRenderStats mash_render_stats_summary_point;
+static guint mash_render_stats_summary_source = 0;
+
+void
+_mash_render_stats_subtract (MashRenderStats *result,
+                             const MashRenderStats *a,
+                             const MashRenderStats *b)
+{
+  result->n_draws = a->n_draws - b->n_draws;
+  result->n_triangles = a->n_triangles - b->n_triangles;
+  result->n_vertices = a->n_vertices - b->n_vertices;
+  result->n_program_compiles = a->n_program_compiles - b->n_program_compiles;
+  result->n_uniform_uploads = a->n_uniform_uploads - b->n_uniform_uploads;
+  result->n_matrix_inversions = (a->n_matrix_inversions
+                                 - b->n_matrix_inversions);
+  result->n_pick_passes = a->n_pick_passes - b->n_pick_passes;
+  result->n_lights_dropped = a->n_lights_dropped - b->n_lights_dropped;
+  result->paint_time = a->paint_time - b->paint_time;
+  result->begin_paint_time = a->begin_paint_time - b->begin_paint_time;
+}
+
+static gboolean
+mash_render_stats_summary_cb (gpointer user_data)
+{
+  MashRenderStats stats;
+
+  _mash_render_stats_subtract (&stats,
+                               &_mash_render_stats,
+                               &mash_render_stats_summary_point);
+  mash_render_stats_summary_point = _mash_render_stats;
+
+  /* Stop the summary while nothing is being drawn. The next draw
+     starts it again */
+  if (stats.n_draws == 0)
+    {
+      mash_render_stats_summary_source = 0;
+      return FALSE;
+    }
+
+  g_message ("Mash render stats for the last second: "
+             "%u draws, %u triangles, %u vertices, "
+             "%u program compiles, %u uniform uploads, "
+             "%u matrix inversions, %u pick passes, %u dropped lights, "
+             "%.3fms painting models, %.3fms in begin_paint",
+             stats.n_draws,
+             stats.n_triangles,
+             stats.n_vertices,
+             stats.n_program_compiles,
+             stats.n_uniform_uploads,
+             stats.n_matrix_inversions,
+             stats.n_pick_passes,
+             stats.n_lights_dropped,
+             stats.paint_time * 1000.0,
+             stats.begin_paint_time * 1000.0);
+
+  return TRUE;
+}
+
+void
+_mash_render_stats_count_draw (guint n_triangles,
+                               guint n_vertices)
+{
+  if (mash_render_stats_summary_source == 0 && MASH_DEBUG_ENABLED (STATS))
+    {
+      /* Don't include anything from before the summary started */
+      mash_render_stats_summary_point = _mash_render_stats;
+
+      mash_render_stats_summary_source
+        = g_timeout_add_seconds (1, mash_render_stats_summary_cb, NULL);
+    }
+
+  _mash_render_stats.n_draws++;
+  _mash_render_stats.n_triangles += n_triangles;
+  _mash_render_stats.n_vertices += n_vertices;
+}
+
+/**
+ * mash_render_stats_get:
+ * @stats: (out): A location to return the counters
+ *
+ * Retrieves the counters for all of the rendering done by Mash since
+ * mash_render_stats_reset() was last called.
+ */
+void
+mash_render_stats_get (MashRenderStats *stats)
+{
+  g_return_if_fail (stats != NULL);
+
+  _mash_render_stats_subtract (stats,
+                               &_mash_render_stats,
+                               &mash_render_stats_reset_point);
+}
+
+/**
+ * mash_render_stats_reset:
+ *
+ * Resets the counters returned by mash_render_stats_get() to
+ * zero. This is typically called at the start of each frame. The
+ * counters for each light set are reset separately with
+ * mash_light_set_reset_stats().
+ */
+void
+mash_render_stats_reset (void)
+{
+  mash_render_stats_reset_point = _mash_render_stats;
+}
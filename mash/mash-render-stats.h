@@ -0,0 +1,85 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(__MASH_H_INSIDE__) && !defined(MASH_COMPILATION)
+#error "Only <mash/mash.h> can be included directly."
+#endif
+
+#ifndef __MASH_RENDER_STATS_H__
+#define __MASH_RENDER_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MashRenderStats MashRenderStats;
+
+/**
+ * MashRenderStats:
+ * @n_draws: The number of draws issued by mash_data_render()
+ * @n_triangles: The number of triangles submitted in those draws
+ * @n_vertices: The number of vertices in the ranges of the vertex
+ *   buffers used by those draws
+ * @n_program_compiles: The number of lighting programs generated
+ * @n_uniform_uploads: The number of uniform values uploaded by
+ *   light sets
+ * @n_matrix_inversions: The number of modelview matrices that had
+ *   to be inverted to calculate a normal matrix. Matrices that only
+ *   rotate and scale uniformly are used directly and aren't counted.
+ *   Normal matrices that are still valid in the cache aren't
+ *   recalculated at all.
+ * @n_pick_passes: The number of times a #MashModel was painted for
+ *   picking. These draws are also included in @n_draws.
+ * @n_lights_dropped: The number of times a light that affects an
+ *   actor was left out because the arrays of a light set in
+ *   %MASH_LIGHT_SET_MODE_CLUSTERED mode were full. The lights
+ *   estimated to contribute the least are dropped first.
+ * @paint_time: The number of seconds spent in the paint and pick
+ *   methods of #MashModel. This includes the time spent in
+ *   mash_light_set_begin_paint() and issuing the draws but not the
+ *   time the GPU takes to execute them.
+ * @begin_paint_time: The number of seconds spent in
+ *   mash_light_set_begin_paint()
+ *
+ * Counters for the rendering work done by Mash. The counters for the
+ * whole library can be retrieved with mash_render_stats_get() and the
+ * counters for the models painted with a single light set with
+ * mash_light_set_get_render_stats().
+ */
+struct _MashRenderStats
+{
+  guint n_draws;
+  guint n_triangles;
+  guint n_vertices;
+  guint n_program_compiles;
+  guint n_uniform_uploads;
+  guint n_matrix_inversions;
+  guint n_pick_passes;
+  guint n_lights_dropped;
+
+  gdouble paint_time;
+  gdouble begin_paint_time;
+};
+
+void mash_render_stats_get (MashRenderStats *stats);
+
+void mash_render_stats_reset (void);
+
+G_END_DECLS
+
+#endif /* __MASH_RENDER_STATS_H__ */
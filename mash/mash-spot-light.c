@@ -45,6 +45,7 @@
 
 #include "mash-light.h"
 #include "mash-spot-light.h"
+#include "mash-light-private.h"
 
 static void mash_spot_light_get_property (GObject *object,
                                           guint prop_id,
@@ -69,20 +70,8 @@ G_DEFINE_TYPE (MashSpotLight, mash_spot_light, MASH_TYPE_POINT_LIGHT);
 
 struct _MashSpotLightPrivate
 {
-  int light_direction_uniform_location;
-  int spot_cos_cutoff_uniform_location;
-  int spot_exponent_uniform_location;
-
   float spot_cutoff;
   float spot_exponent;
-
-  /* TRUE if the spot parameters have been modified since
-     update_uniforms was last called */
-  gboolean spot_params_dirty;
-
-  /* TRUE if the shader has changed since we last called
-     cogl_program_get_uniform_location for the uniforms */
-  gboolean uniform_locations_dirty;
 };
 
 enum
@@ -135,8 +124,9 @@ mash_spot_light_shader[] =
   "                         * specular_light$ * spec_power$);\n"
   "        }\n"
   /* Attenuate the lit color based on the distance to the light and
-     the attenuation formula properties */
-  "      float att = dot (attenuation$, vec3 (1.0, d$, d$ * d$));\n"
+     the attenuation formula properties. The intensity is divided by
+     the formula in the same way as for a point light */
+  "      float att = 1.0 / dot (attenuation$, vec3 (1.0, d$, d$ * d$));\n"
   /* Also attenuate based on the angle to the light and the spot exponent */
   "      att *= pow (spot_cos$, spot_exponent$);\n"
   /* Add it to the total computed color value */
@@ -144,6 +134,72 @@ mash_spot_light_shader[] =
   "    }\n"
   ;
 
+/* This is used instead of the snippet above when the light set is
+   using uniform arrays. See _mash_spot_light_get_block() for the
+   layout of the array */
+static const char
+mash_spot_light_array_uniforms[] =
+  "uniform int mash_n_spot_lights;\n"
+  "uniform vec4 mash_spot_lights[mash_max_spot_lights * 6];\n"
+  ;
+
+static const char
+mash_spot_light_array_shader[] =
+  "  for (int i = 0; i < mash_max_spot_lights; i++)\n"
+  "    {\n"
+  "      if (i >= mash_n_spot_lights)\n"
+  "        break;\n"
+  "      int base = i * 6;\n"
+  /* Vector from the vertex to the light */
+  "      vec3 light_vec = mash_spot_lights[base + 3].xyz - eye_coord;\n"
+  /* Distance from the vertex to the light */
+  "      float d = length (light_vec);\n"
+  /* Normalize the light vector */
+  "      light_vec /= d;\n"
+  /* Check if the point on the surface is inside the cone of
+     illumination. The cosine of the cut off angle is stored in the w
+     component of the position */
+  "      float spot_cos = dot (light_vec * -1.0,\n"
+  "                            mash_spot_lights[base + 5].xyz);\n"
+  "      if (spot_cos > mash_spot_lights[base + 3].w)\n"
+  "        {\n"
+  /* Add the ambient light term */
+  "          vec3 lit_color = (mash_material.ambient.rgb\n"
+  "                            * mash_spot_lights[base].rgb);\n"
+  /* Calculate the diffuse factor based on the angle between the
+     vertex normal and the angle between the light and the vertex */
+  "          float diffuse_factor = max (0.0, dot (light_vec, normal));\n"
+  /* Skip the specular and diffuse terms if the vertex is not facing
+     the light */
+  "          if (diffuse_factor > 0.0)\n"
+  "            {\n"
+  /* Add the diffuse term */
+  "              lit_color += (diffuse_factor * mash_material.diffuse.rgb\n"
+  "                            * mash_spot_lights[base + 1].rgb);\n"
+  /* Add the specular term using the half vector as in the snippet
+     for a single light */
+  "              vec3 half_vector = normalize (light_vec\n"
+  "                                            + vec3 (0.0, 0.0, 1.0));\n"
+  "              float spec_factor = max (0.0, dot (half_vector, normal));\n"
+  "              float spec_power = pow (spec_factor,\n"
+  "                                      mash_material.shininess);\n"
+  "              lit_color += (mash_material.specular.rgb\n"
+  "                            * mash_spot_lights[base + 2].rgb\n"
+  "                            * spec_power);\n"
+  "            }\n"
+  /* Attenuate the lit color based on the distance to the light and
+     the attenuation formula properties */
+  "          lit_color /= dot (mash_spot_lights[base + 4].xyz,\n"
+  "                            vec3 (1.0, d, d * d));\n"
+  /* Also attenuate based on the angle to the light and the spot
+     exponent which is stored in the w component of the direction */
+  "          lit_color *= pow (spot_cos, mash_spot_lights[base + 5].w);\n"
+  /* Add it to the total computed color value */
+  "          cogl_color_out.xyz += lit_color;\n"
+  "        }\n"
+  "    }\n"
+  ;
+
 static void
 mash_spot_light_class_init (MashSpotLightClass *klass)
 {
@@ -202,9 +258,6 @@ mash_spot_light_init (MashSpotLight *self)
      OpenGL which uses 180°. However 180° results in a point light
      which doesn't make sense here */
   priv->spot_cutoff = 45.0f;
-
-  priv->spot_params_dirty = TRUE;
-  priv->uniform_locations_dirty = TRUE;
 }
 
 static void
@@ -304,7 +357,6 @@ mash_spot_light_set_spot_cutoff (MashSpotLight *light,
   if (cutoff != priv->spot_cutoff)
     {
       priv->spot_cutoff = cutoff;
-      priv->spot_params_dirty = TRUE;
       g_object_notify (G_OBJECT (light), "spot-cutoff");
     }
 }
@@ -346,7 +398,6 @@ mash_spot_light_set_spot_exponent (MashSpotLight *light,
   if (exponent != priv->spot_exponent)
     {
       priv->spot_exponent = exponent;
-      priv->spot_params_dirty = TRUE;
       g_object_notify (G_OBJECT (light), "spot-exponent");
     }
 }
@@ -384,10 +435,48 @@ mash_spot_light_generate_shader (MashLight *light,
 
   g_string_set_size (main_source, old_len);
 
-  /* If the shader is being generated then the uniform locations also
-     need updating */
-  priv->uniform_locations_dirty = TRUE;
-  priv->spot_params_dirty = TRUE;
+  if (mash_light_get_static_parameters (light))
+    {
+      /* Bake the spot parameters into the shader and leave out any
+         terms that can't contribute */
+      mash_light_append_shader (light, uniform_source,
+                                "const float spot_cos_cutoff$ = ");
+      _mash_append_glsl_float (uniform_source,
+                               cosf (priv->spot_cutoff * G_PI / 180.0));
+      mash_light_append_shader (light, uniform_source,
+                                ";\n"
+                                "const float spot_exponent$ = ");
+      _mash_append_glsl_float (uniform_source, priv->spot_exponent);
+      mash_light_append_shader (light, uniform_source,
+                                ";\n"
+                                "uniform vec3 spot_direction$;\n");
+
+      mash_light_append_shader (light, main_source,
+                                "  vec3 light_vec$ = light_eye_coord$"
+                                " - eye_coord;\n"
+                                "  float d$ = length (light_vec$);\n"
+                                "  light_vec$ /= d$;\n"
+                                "  float spot_cos$ = dot (light_vec$ * -1.0,"
+                                " spot_direction$);\n"
+                                "  if (spot_cos$ > spot_cos_cutoff$)\n"
+                                "  {\n");
+      _mash_light_append_static_terms (light, main_source, "light_vec$",
+                                       TRUE);
+      if (_mash_point_light_is_attenuated (MASH_POINT_LIGHT (light)))
+        mash_light_append_shader (light, main_source,
+                                  "  lit_color$ /= dot (attenuation$,\n"
+                                  "                     vec3 (1.0, d$,"
+                                  " d$ * d$));\n");
+      if (priv->spot_exponent != 0.0f)
+        mash_light_append_shader (light, main_source,
+                                  "  lit_color$ *= pow (spot_cos$,"
+                                  " spot_exponent$);\n");
+      mash_light_append_shader (light, main_source,
+                                "  cogl_color_out.xyz += lit_color$;\n"
+                                "  }\n");
+
+      return;
+    }
 
   mash_light_append_shader (light, uniform_source,
                             "uniform float spot_cos_cutoff$;\n"
@@ -406,40 +495,71 @@ mash_spot_light_update_uniforms (MashLight *light,
   /* The light is assumed to always be pointing directly down. This
      can be modified by rotating the actor */
   static const float light_direction[4] = { 0.0f, 1.0f, 0.0f, 0.0f };
+  MashLightProgramState *state = _mash_light_get_program_state (light);
 
   MASH_LIGHT_CLASS (mash_spot_light_parent_class)
     ->update_uniforms (light, program);
 
-  if (priv->uniform_locations_dirty)
+  if (!state->initialized)
     {
-      priv->spot_cos_cutoff_uniform_location
+      state->locations[MASH_LIGHT_UNIFORM_SPOT_COS_CUTOFF]
         = mash_light_get_uniform_location (light, program, "spot_cos_cutoff");
-      priv->spot_exponent_uniform_location
+      state->locations[MASH_LIGHT_UNIFORM_SPOT_EXPONENT]
         = mash_light_get_uniform_location (light, program, "spot_exponent");
-      priv->light_direction_uniform_location
+      state->locations[MASH_LIGHT_UNIFORM_SPOT_DIRECTION]
         = mash_light_get_uniform_location (light, program, "spot_direction");
-      priv->uniform_locations_dirty = FALSE;
     }
 
-  if (priv->spot_params_dirty)
+  /* Static spot parameters are constants in the shader */
+  if (_mash_light_parameters_changed (light) &&
+      !mash_light_get_static_parameters (light))
     {
       cogl_program_set_uniform_1f (program,
-                                   priv->spot_cos_cutoff_uniform_location,
+                                   state->locations
+                                   [MASH_LIGHT_UNIFORM_SPOT_COS_CUTOFF],
                                    cosf (priv->spot_cutoff * G_PI / 180.0));
       cogl_program_set_uniform_1f (program,
-                                   priv->spot_exponent_uniform_location,
+                                   state->locations
+                                   [MASH_LIGHT_UNIFORM_SPOT_EXPONENT],
                                    priv->spot_exponent);
-      priv->spot_params_dirty = FALSE;
     }
 
-  /* I can't think of a good way to recognise when the transformation
-     of the actor may have changed so this just always updates the
-     light direction. Any transformations in the parent hierarchy
-     could cause the transformation to change without affecting the
-     allocation */
+  /* The direction only changes with the transformation of the
+     light */
+  if (_mash_light_transform_changed (light))
+    mash_light_set_direction_uniform (light,
+                                      program,
+                                      state->locations
+                                      [MASH_LIGHT_UNIFORM_SPOT_DIRECTION],
+                                      light_direction);
+}
+
+void
+_mash_spot_light_generate_array_shader (int capacity,
+                                        GString *uniform_source,
+                                        GString *main_source)
+{
+  g_string_append_printf (uniform_source,
+                          "const int mash_max_spot_lights = %i;\n",
+                          capacity);
+  g_string_append (uniform_source, mash_spot_light_array_uniforms);
+  g_string_append (main_source, mash_spot_light_array_shader);
+}
+
+void
+_mash_spot_light_get_block (MashSpotLight *light,
+                            float *block)
+{
+  MashSpotLightPrivate *priv = light->priv;
+  float *position = block + MASH_LIGHT_COLOR_BLOCK_SIZE * 4;
+  float *direction = block + MASH_POINT_LIGHT_BLOCK_SIZE * 4;
+
+  /* The start of the block is the same as for a point light */
+  _mash_point_light_get_block (MASH_POINT_LIGHT (light), block);
+
+  position[3] = cosf (priv->spot_cutoff * G_PI / 180.0);
 
-  mash_light_set_direction_uniform (light,
-                                    program,
-                                    priv->light_direction_uniform_location,
-                                    light_direction);
+  /* The xyz of the direction is filled in by the light set. The light
+     points along the positive y axis */
+  direction[3] = priv->spot_exponent;
 }
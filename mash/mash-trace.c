@@ -0,0 +1,189 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "mash-trace.h"
+
+#ifdef MASH_ENABLE_TRACING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+typedef struct _MashTraceEvent MashTraceEvent;
+typedef struct _MashTraceBuffer MashTraceBuffer;
+
+struct _MashTraceEvent
+{
+  /* NULL for end events */
+  const char *name;
+  gint64 time;
+  char phase;
+};
+
+struct _MashTraceBuffer
+{
+  /* The lock is only contended while the trace is being written */
+  GMutex mutex;
+  int thread_id;
+  GArray *events;
+};
+
+gboolean _mash_trace_enabled = FALSE;
+
+static char *mash_trace_filename = NULL;
+
+/* Every buffer that has been created. The buffers are never freed
+   because the events of threads that have finished still need to be
+   written */
+static GMutex mash_trace_buffers_mutex;
+static GSList *mash_trace_buffers = NULL;
+static int mash_trace_next_thread_id = 1;
+
+static GPrivate mash_trace_buffer_key;
+
+static MashTraceBuffer *
+mash_trace_get_buffer (void)
+{
+  MashTraceBuffer *buffer = g_private_get (&mash_trace_buffer_key);
+
+  if (buffer == NULL)
+    {
+      buffer = g_new (MashTraceBuffer, 1);
+      g_mutex_init (&buffer->mutex);
+      buffer->events = g_array_new (FALSE, FALSE, sizeof (MashTraceEvent));
+
+      g_mutex_lock (&mash_trace_buffers_mutex);
+      buffer->thread_id = mash_trace_next_thread_id++;
+      mash_trace_buffers = g_slist_prepend (mash_trace_buffers, buffer);
+      g_mutex_unlock (&mash_trace_buffers_mutex);
+
+      g_private_set (&mash_trace_buffer_key, buffer);
+    }
+
+  return buffer;
+}
+
+void
+_mash_trace_event (const char *name,
+                   char phase)
+{
+  MashTraceBuffer *buffer = mash_trace_get_buffer ();
+  MashTraceEvent event;
+
+  event.name = name;
+  event.time = g_get_monotonic_time ();
+  event.phase = phase;
+
+  g_mutex_lock (&buffer->mutex);
+  g_array_append_val (buffer->events, event);
+  g_mutex_unlock (&buffer->mutex);
+}
+
+static void
+mash_trace_write (void)
+{
+  gboolean first = TRUE;
+  int pid = 0;
+  FILE *file;
+  GSList *l;
+
+  if ((file = g_fopen (mash_trace_filename, "w")) == NULL)
+    {
+      g_warning ("Failed to open trace file %s", mash_trace_filename);
+      return;
+    }
+
+#ifdef G_OS_UNIX
+  pid = getpid ();
+#endif
+
+  fputs ("{\"traceEvents\":[", file);
+
+  g_mutex_lock (&mash_trace_buffers_mutex);
+
+  for (l = mash_trace_buffers; l; l = l->next)
+    {
+      MashTraceBuffer *buffer = l->data;
+      guint i;
+
+      g_mutex_lock (&buffer->mutex);
+
+      for (i = 0; i < buffer->events->len; i++)
+        {
+          const MashTraceEvent *event =
+            &g_array_index (buffer->events, MashTraceEvent, i);
+
+          fputs (first ? "\n{" : ",\n{", file);
+          first = FALSE;
+
+          /* The names are all string literals in Mash so they don't
+             need escaping */
+          if (event->name)
+            fprintf (file, "\"name\":\"%s\",", event->name);
+
+          fprintf (file,
+                   "\"cat\":\"mash\",\"ph\":\"%c\","
+                   "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d}",
+                   event->phase,
+                   event->time,
+                   pid,
+                   buffer->thread_id);
+        }
+
+      g_mutex_unlock (&buffer->mutex);
+    }
+
+  g_mutex_unlock (&mash_trace_buffers_mutex);
+
+  fputs ("\n]}\n", file);
+
+  if (fclose (file) != 0)
+    g_warning ("Error writing trace file %s", mash_trace_filename);
+}
+
+void
+_mash_trace_init (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *filename = g_getenv ("MASH_TRACE");
+
+      if (filename && *filename)
+        {
+          mash_trace_filename = g_strdup (filename);
+          atexit (mash_trace_write);
+          _mash_trace_enabled = TRUE;
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+#endif /* MASH_ENABLE_TRACING */
@@ -0,0 +1,78 @@
+/*
+ * Mash - A library for displaying PLY models in a Clutter scene
+ * Copyright (C) 2010  Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MASH_COMPILATION)
+#error "This is a private header that can't be used outside of Mash."
+#endif
+
+#ifndef __MASH_TRACE_H__
+#define __MASH_TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* If Mash is configured with --enable-tracing and the MASH_TRACE
+   environment variable is set to a file name then a trace of the
+   spans marked with MASH_TRACE_BEGIN() and MASH_TRACE_END() is written
+   to the file in the Chrome trace event format when the process
+   exits. The file can be loaded into chrome://tracing or Perfetto.
+
+   Each thread records its events into its own buffer so the spans
+   can be emitted from any thread. Every MASH_TRACE_BEGIN() must be
+   matched by a MASH_TRACE_END() on the same thread. The name must be
+   a string literal because only the pointer is stored.
+
+   When tracing isn't compiled in the macros expand to nothing. When
+   it is compiled in but MASH_TRACE isn't set they cost a single
+   branch. _mash_trace_init() reads the environment variable and is
+   called from the class_init functions of the types that emit
+   events */
+
+#ifdef MASH_ENABLE_TRACING
+
+extern gboolean _mash_trace_enabled;
+
+void _mash_trace_init (void);
+
+void _mash_trace_event (const char *name,
+                        char phase);
+
+#define MASH_TRACE_BEGIN(name)                          \
+  G_STMT_START {                                        \
+    if (G_UNLIKELY (_mash_trace_enabled))               \
+      _mash_trace_event ((name), 'B');                  \
+  } G_STMT_END
+
+#define MASH_TRACE_END()                                \
+  G_STMT_START {                                        \
+    if (G_UNLIKELY (_mash_trace_enabled))               \
+      _mash_trace_event (NULL, 'E');                    \
+  } G_STMT_END
+
+#else /* MASH_ENABLE_TRACING */
+
+#define _mash_trace_init() G_STMT_START { } G_STMT_END
+#define MASH_TRACE_BEGIN(name) G_STMT_START { } G_STMT_END
+#define MASH_TRACE_END() G_STMT_START { } G_STMT_END
+
+#endif /* MASH_ENABLE_TRACING */
+
+G_END_DECLS
+
+#endif /* __MASH_TRACE_H__ */
@@ -23,11 +23,13 @@
 
 #include "mash-model.h"
 #include "mash-data.h"
+#include "mash-batch-loader.h"
 #include "mash-light.h"
 #include "mash-point-light.h"
 #include "mash-spot-light.h"
 #include "mash-directional-light.h"
 #include "mash-light-set.h"
+#include "mash-render-stats.h"
 #include "mash-enum-types.h"
 
 #undef __MASH_H_INSIDE__